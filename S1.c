@@ -2,23 +2,33 @@
  * S1.c
  *
  * Main server that listens for connections from w25clients and forks a child
- * for each client. Handles commands to upload, download, remove, and list files.
+ * for each client (or, with --mode epoll, serves them all from an epoll event
+ * loop and a pool of worker threads). Handles commands to upload, download,
+ * remove, and list files.
  * Also coordinates with S2, S3, S4 to store .pdf, .txt, and .zip files,
  * keeping .c files locally in ~/S1.
  *
  * Build example (on Linux/Unix):
- *     gcc S1.c -o S1
+ *     gcc S1.c -o S1 -lpthread -lz
  * Usage:
- *     ./S1
+ *     ./S1 [--mode fork|epoll] [--workers N] [--max-clients N] [--list-timeout MS]
+ *          [--cache-mb MB] [--routes FILE] [--repair-interval S]
+ *          [--sync group|each|none] [--io blocking|uring] [--metrics-port N]
+ *          [--tar-cache-mb MB] [--client-rate MB] [--client-burst MB]
+ *          [--client-transfers N] [--backend-slots N] [--slot-wait-ms MS]
+ *          [--log-level error|warn|info|debug]
  *
  * Assumptions / Requirements:
  *  - The directories ~/S1, ~/S2, ~/S3, and ~/S4 already exist (not auto-created).
- *  - All servers (S1, S2, S3, S4) run on localhost with hardcoded ports.
+ *  - All servers (S1, S2, S3, S4) run on localhost with hardcoded ports,
+ *    unless a routing file (--routes) says where the storage servers are and
+ *    which file types each of them stores.
  *  - S1 listens for w25clients on port 9001.
  *  - S2, S3, and S4 run on ports 9002, 9003, 9004 respectively.
  *
  *****************************************************************************/
 
+ #define _GNU_SOURCE    // for splice(2) and F_SETPIPE_SZ
  #include <stdio.h>
  #include <stdlib.h>
  #include <string.h>
@@ -28,11 +38,33 @@
  #include <sys/types.h>
  #include <sys/socket.h>
  #include <netinet/in.h>
+ #include <netinet/tcp.h>
  #include <arpa/inet.h>
  #include <pthread.h>
  #include <sys/stat.h>
  #include <signal.h>
  #include <dirent.h>
+ #include <fnmatch.h>
+ #include <sys/sendfile.h>
+ #include <time.h>
+ #include <getopt.h>
+ #include <sys/epoll.h>
+ #include <stdint.h>
+ #include <stdarg.h>
+ #include <stddef.h>
+ #include <limits.h>
+ #include <endian.h>
+ #include <ftw.h>
+ #include <poll.h>
+ #include <sys/mman.h>
+ #include <sys/syscall.h>
+ #include <sys/uio.h>
+ #include <linux/io_uring.h>
+ #include <sys/prctl.h>
+ #include <zlib.h>
+ #if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+ #include <arm_acle.h>
+ #endif
  
  // ----------------------- CONFIGURATION CONSTANTS ----------------------------
  
@@ -51,37 +83,571 @@
  // Buffer sizes
  #define MAX_CMD_LEN 1024   // Maximum length of a command string from client
  #define BUF_SIZE 4096      // Buffer size for file transfers
+ #define READER_BUF_SIZE 8192  // Per-connection read-ahead for protocol lines
+ #define TAR_CHUNK_SIZE (64 * 1024)  // downltar output is written in chunks of this size
+ 
+ // Event-driven (epoll) mode
+ #define DEFAULT_MAX_CLIENTS 4096  // Accepting pauses while this many clients are connected
+ #define CLIENT_IO_TIMEOUT 60      // Seconds a worker waits on a stalled client mid-command
+ #define MAX_EVENTS 256            // epoll_wait batch size
+ 
+ // Connection pool to the storage servers
+ #define POOL_SLOTS 4        // Idle connections kept per storage server (per worker)
+ #define POOL_IDLE_SECS 60   // Idle connections older than this are closed, not reused
+ 
+ // dispfnames
+ #define DEFAULT_LIST_TIMEOUT_MS 2000  // Per-server deadline for LIST replies (--list-timeout)
+ #define FIND_MAX_EXTS 8               // ext= predicates in one listing filter
+ #define FIND_MAX_DEPTH 64             // Directory levels searched under ~/S1
+ 
+ // Hot-file cache for downlf relays (--cache-mb)
+ #define CACHE_BLOCK_SIZE 4096         // Cache arena allocation unit
+ #define CACHE_MAX_FILE (1024 * 1024)  // Larger files are never cached
+ #define CACHE_KEY_LEN 256             // Longer paths are never cached
+ 
+ // Multipart uploads (uploadp/uploadc)
+ #define MAX_UPLOAD_ID 32   // Hex digits in a client-chosen upload id
+ 
+ // Batch commands (uploadm/downlm/removem)
+ #define MAX_BATCH_MANIFEST (4 * 1024 * 1024)  // Largest downlm/removem path list
+ #define BATCH_WINDOW 64                       // Commands in flight per storage server
+ 
+ // On-the-wire compression (clients that sent "HELLO 2 deflate")
+ #define COMPRESS_MIN_SIZE 4096      // Smaller files are sent as they are
+ #define ZCHUNK_SIZE (64 * 1024)     // Deflated output is sent in chunks of up to this size
+ #define DEFAULT_COMPRESS_LEVEL 6    // zlib level of .txt and .c unless the routing file says otherwise
+ 
+ // Archive cache for downltar of the local .c files (--tar-cache-mb)
+ #define DEFAULT_TAR_CACHE_MB 256
+ #define TAR_CACHE_DIR ".tar-cache"     // under ~/S1; holds <level>.tar per deflate level
+ #define TAR_CACHE_LEVELS 10            // plain, and zlib levels 1-9
+ 
+ // Admission control (--client-rate, --client-transfers, --backend-slots)
+ #define ADMIT_CLIENTS 256             // Client addresses with a token bucket
+ #define ADMIT_TRANSFERS 512           // Transfers running or waiting at once, all clients
+ #define ADMIT_BURST_SECS 4            // Default bucket size, in seconds of --client-rate
+ #define ADMIT_MIN_COST (16 * 1024)    // Tokens a transfer takes, however small
+ #define DRR_QUANTUM (256 * 1024)      // Credit a waiting transfer gets per round
+ #define DEFAULT_SLOT_WAIT_MS 5000     // Longest wait for a backend slot (--slot-wait-ms)
+ 
+ // ----------------------- STORAGE SERVER TABLE -------------------------------
+ 
+ // Storage servers S1 forwards to, and which of them store each file type.
+ // Unless --routes names a routing file, S2, S3 and S4 above hold the .pdf,
+ // .txt and .zip files. A routing file lists the servers and then, for each
+ // file type, the servers sharing it with their weights:
+ //
+ //   backend S2  127.0.0.1 50005        # backend <name> <address> <port>
+ //   backend S3  127.0.0.1 50006
+ //   backend S3b 10.0.0.7  50006
+ //   route .pdf S2                      # route <type> <server>[:<weight>]...
+ //   route .txt S3:3 S3b:1
+ //   replicas 2                         # copies of every routed file
+ //   compress .txt 6                    # compress <type> <level>
+ //
+ // .c files always stay in ~S1. Backends are referred to by their index in
+ // backendTable, which also indexes the connection pool.
+ //
+ // The servers of a type share it through a consistent-hash ring: each server
+ // has RING_VNODES points on the ring per unit of weight, placed by hashing
+ // its name, and a file belongs to the server owning the first point at or
+ // after the hash of its path. Adding or removing a server therefore only
+ // moves the files next to that server's points; the rebalancer moves them.
+ // With "replicas R", a file is kept on the first R distinct servers of its
+ // ring order (fewer if the type has fewer servers).
+ //
+ // "compress" sets the zlib level (1-9, 0 = never) a type is deflated at on
+ // the wire (see DEFLATE STREAMS). .txt and .c files are compressed at level
+ // 6 by default; other types, already compressed ones like .zip and most
+ // .pdf files, are not compressed unless a compress line says so.
+ #define MAX_BACKENDS 16        // Storage servers in the routing table
+ #define MAX_ROUTES 16          // File types stored on storage servers
+ #define MAX_EXT_LEN 16         // Longest routed extension, with its dot
+ #define ROUTE_HASH_SLOTS 64    // Extension hash table size (power of two)
+ #define RING_VNODES 64         // Ring points per unit of weight
+ #define MAX_WEIGHT 100
+ #define BACKEND_DOWN_SECS 5    // A server that refused a connection is tried last this long
+ #define BACKEND_LOCAL MAX_BACKENDS  // "Backend" of .c files, kept in ~S1
+ 
+ struct backend_info {
+     char name[32];
+     char addr[64];
+     int port;
+     char exts[64];     // File types stored there, for messages
+ };
+ 
+ struct ring_point {
+     uint64_t hash;
+     int backend;
+ };
+ 
+ struct route {
+     char ext[MAX_EXT_LEN];
+     int count;                  // Servers sharing the type
+     int backend[MAX_BACKENDS];
+     int weight[MAX_BACKENDS];
+     struct ring_point *ring;    // Sorted by hash
+     size_t ringSize;
+ };
+ 
+ static struct backend_info backendTable[MAX_BACKENDS];
+ static int numBackends;
+ static struct route routeTable[MAX_ROUTES];
+ static int numRoutes;
+ static int routeSlots[ROUTE_HASH_SLOTS];   // routeTable index + 1, 0 = free
+ static int replicaCount = 1;
+ 
+ struct compress_rule {
+     char ext[MAX_EXT_LEN];
+     int level;
+ };
+ 
+ static struct compress_rule compressRules[MAX_ROUTES + 1] = {
+     {".txt", DEFAULT_COMPRESS_LEVEL},
+     {".c", DEFAULT_COMPRESS_LEVEL},
+ };
+ static int numCompressRules = 2;
+ 
+ // ----------------------- RUNTIME OPTIONS ------------------------------------
+ 
+ // How S1 serves clients: one forked child per client, or an epoll event loop
+ // feeding a fixed pool of worker threads.
+ enum { MODE_FORK, MODE_EPOLL };
+ 
+ // How uploads stored on S1's disk are flushed before they replace the old
+ // file (see DURABLE WRITES).
+ enum { SYNC_NONE, SYNC_EACH, SYNC_GROUP };
+ 
+ // What moves local .c files between disk and socket (see I/O ENGINE).
+ enum { IO_BLOCKING, IO_URING };
+ 
+ // How much is logged (--log-level, see LOGGING).
+ enum { LOG_LEVEL_ERROR, LOG_LEVEL_WARN, LOG_LEVEL_INFO, LOG_LEVEL_DEBUG };
+ 
+ struct s1_options {
+     int mode;        // MODE_FORK (default) or MODE_EPOLL
+     int workers;     // Worker threads in epoll mode (0 = one per core)
+     int maxClients;  // Connected clients before accepting pauses (epoll mode)
+     int listTimeoutMs;  // How long dispfnames waits for each storage server
+     long cacheMb;       // Hot-file cache size in MB (0 = off)
+     const char *routes; // Routing file (NULL = built-in S2/S3/S4 table)
+     int repairSecs;     // Pause between rebalance/repair passes (0 = once at startup)
+     int sync;           // SYNC_GROUP (default), SYNC_EACH or SYNC_NONE
+     int io;             // IO_BLOCKING (default) or IO_URING
+     int metricsPort;    // Prometheus endpoint port (0 = off)
+     int logLevel;       // Most verbose level logged (see LOGGING)
+     long tarCacheMb;    // Archive cache size in MB (0 = off)
+     long clientRateMb;  // Per-address transfer rate in MB/s (0 = unlimited)
+     long clientBurstMb; // Per-address token bucket size in MB (0 = ADMIT_BURST_SECS of the rate)
+     int clientTransfers;  // Transfers one address may run at once (0 = unlimited)
+     int backendSlots;   // Relayed transfers running at once (0 = unlimited)
+     int slotWaitMs;     // How long a transfer waits for a backend slot
+ };
+ 
+ static struct s1_options options = { MODE_FORK, 0, DEFAULT_MAX_CLIENTS, DEFAULT_LIST_TIMEOUT_MS, 0, NULL, 0,
+                                      SYNC_GROUP, IO_BLOCKING, 0, LOG_LEVEL_INFO, DEFAULT_TAR_CACHE_MB,
+                                      0, 0, 0, 0, DEFAULT_SLOT_WAIT_MS };
  
  // ----------------------- LOGGING MACRO & UTILITY ----------------------------
  
- // Simple logging macro that prints to stderr
- #define LOG(msg, ...) fprintf(stderr, "S1: " msg "\n", ##__VA_ARGS__)
+ // Logging macros, by level (see LOGGING); every line gets an "S1:" prefix
+ void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+ #define LOG_ERROR(msg, ...) log_write(LOG_LEVEL_ERROR, "S1: " msg "\n", ##__VA_ARGS__)
+ #define LOG_WARN(msg, ...) log_write(LOG_LEVEL_WARN, "S1: " msg "\n", ##__VA_ARGS__)
+ #define LOG(msg, ...) log_write(LOG_LEVEL_INFO, "S1: " msg "\n", ##__VA_ARGS__)
+ #define LOG_DEBUG(msg, ...) log_write(LOG_LEVEL_DEBUG, "S1: " msg "\n", ##__VA_ARGS__)
+ 
+ // ----------------------- BUFFERED CONNECTION READER -------------------------
+ 
+ // Read-ahead buffer for one connection. Command and response lines are pulled
+ // out of it without a syscall per byte; whatever follows a line (the start of
+ // a file body, or the next pipelined command) stays here until it is consumed
+ // through the reader, so every read of that connection must go through it.
+ struct line_reader {
+     int fd;
+     size_t start;   // First unconsumed byte in buf
+     size_t end;     // One past the last buffered byte
+     char buf[READER_BUF_SIZE];
+ };
+ 
+ // ----------------------- CLIENT SESSIONS & PROTOCOL V2 ----------------------
+ 
+ // Clients speak the original newline-terminated text protocol until they send
+ // "HELLO 2". If S1 answers "HELLO 2", every later request and response on that
+ // connection is a binary frame: a 16-byte header (big-endian)
+ //
+ //   u8  opcode       request: V2_OP_*; response: V2_OP_OK or V2_OP_ERROR
+ //   u8  flags        V2_FLAG_*; 0 in requests except V2_FLAG_DEFLATE, V2_FLAG_CRC
+ //   u16 argLen       length of the text arguments following the header
+ //   u32 reqId        chosen by the client, echoed in the response
+ //   u64 payloadLen   bytes of payload following the arguments
+ //
+ // Arguments are those of the matching text command (the upload size is the
+ // payload length); upload bodies and download/tar/listing data are payloads,
+ // and status or error messages travel as the response's arguments. Requests
+ // can be pipelined; responses come back in request order. An archive whose
+ // size is not known up front is answered with V2_FLAG_CHUNKED and a zero
+ // payload length, followed by the chunked stream described under TAR ARCHIVE
+ // WRITER. V2_FLAG_DATA marks a data response whose arguments carry extra
+ // information (a listing cursor, a ranged download's total size), so it is
+ // not taken for a status message when its payload is empty.
+ //
+ // "HELLO 2 deflate" also asks for compression. S1 then answers
+ // "HELLO 2 deflate <type>:<level>..." with the types it compresses, and
+ // V2_FLAG_DEFLATE on a chunked response means the chunks carry one zlib
+ // stream. On an uploadf request the flag says the payload is deflated; the
+ // arguments then end with the size of the file once inflated.
+ //
+ // "crc32c" in the HELLO (after "deflate" if both are wanted) asks for
+ // checksums, and S1's answer then ends with " crc32c". V2_FLAG_CRC on a
+ // whole-file downlf response means the payload, or the chunked stream, is
+ // followed by the file's CRC-32C as 4 big-endian bytes; on an uploadf request
+ // it says the upload body is followed by the same (see CHECKSUMS).
+ #define V2_HEADER_LEN 16
+ #define V2_FLAG_CHUNKED 0x01
+ #define V2_FLAG_DATA 0x02
+ #define V2_FLAG_DEFLATE 0x04
+ #define V2_FLAG_CRC 0x08
+ 
+ enum {
+     V2_OP_UPLOADF = 1,
+     V2_OP_DOWNLF,
+     V2_OP_REMOVEF,
+     V2_OP_DOWNLTAR,
+     V2_OP_DISPFNAMES,
+     V2_OP_CACHESTATS,
+     V2_OP_UPLOADP,
+     V2_OP_UPLOADC,
+     V2_OP_UPLOADM,
+     V2_OP_DOWNLM,
+     V2_OP_REMOVEM,
+     V2_OP_UPLOADH,
+     V2_OP_STATS,
+     V2_OP_OK = 0x80,
+     V2_OP_ERROR = 0x81
+ };
+ 
+ // One client connection as seen by the command handlers
+ struct client_session {
+     struct line_reader in;
+     int proto;        // 1 = text lines, 2 = binary frames
+     int deflate;      // Client accepts deflated data ("HELLO 2 deflate")
+     int crc;          // Client wants checksum trailers ("crc32c" in its HELLO)
+     int uploadCrc;    // The upload being served ends with a checksum trailer
+     uint32_t reqId;   // Request being answered (protocol 2)
+     uint32_t peer;    // Client's IPv4 address, network order (0 if not IPv4)
+     long lastTransfer;  // Bytes the last transfer moved (see ADMISSION CONTROL)
+     int corked;       // A data response is being sent (see reply_cork())
+ };
  
  // ----------------------- FUNCTION DECLARATIONS ------------------------------
  
  // Main function that handles each connected client in a child process
  void prcclient(int clientSock);
  
+ // Parses and executes a single command line received from a client
+ void process_command(struct client_session *client, char *cmdBuf);
+ 
+ // Parses command-line options into `options`; exits on invalid usage.
+ void parse_options(int argc, char *argv[]);
+ 
+ // Serves clients with an epoll event loop and worker threads (never returns).
+ void run_event_loop(int listenSock);
+ 
  // Utility to ensure the specified directory path exists (creates subdirs if needed).
  // Return 0 on success, -1 on error.
  int ensure_directory_exists(const char *path);
+ // Opens directory `path`, creating it and its parents if need be (see DIRECTORY CACHE).
+ int dir_open(const char *path);
+ // Forgets the removed directory `path` and everything below it.
+ void dir_cache_forget(const char *path);
  
  // Safe "send all" function to handle partial sends.
  int send_all(int sock, const void *buffer, size_t length);
  
  // Safe "receive all" function to read exactly `length` bytes.
- int recv_all(int sock, void *buffer, size_t length);
+ int recv_all(struct line_reader *r, void *buffer, size_t length);
+ 
+ // Reads and discards `length` bytes so the socket stays in sync after an error.
+ void drain_socket(struct line_reader *r, long length);
+ 
+ // Opens a TCP connection to one of the storage servers. Returns the fd or -1.
+ int connect_to_server(const char *addr, int port);
+ 
+ // Starts a non-blocking connect; *inProgress is set while it has not completed.
+ int connect_to_server_async(const char *addr, int port, int *inProgress);
+ 
+ // Moves `length` bytes from one socket to another without touching disk.
+ int relay_bytes(struct line_reader *from, int toSock, long length);
+ 
+ // Sends `length` bytes of an open file starting at `offset` (sendfile when possible).
+ int send_file_fd(int sock, int fd, off_t offset, long length, uint32_t *crc);
+ 
+ // ---- Buffered connection reader ----
+ void reader_init(struct line_reader *r, int fd);
+ // Bytes already read from the socket but not yet consumed.
+ size_t reader_buffered(const struct line_reader *r);
+ // Returns 1 if a complete line is already buffered.
+ int reader_has_line(const struct line_reader *r);
+ // One recv() into the free end of the buffer; returns like recv().
+ ssize_t reader_fill(struct line_reader *r);
+ // Moves buffered bytes of the current line into `line`; 1 once the line is complete.
+ int reader_scan_line(struct line_reader *r, char *line, size_t size, size_t *len);
+ // Reads one line (without '\n'); returns its length or -1 on EOF/error.
+ int reader_getline(struct line_reader *r, char *line, size_t size);
+ // Reads up to `len` bytes, buffered bytes first; returns like recv().
+ ssize_t reader_read(struct line_reader *r, void *buffer, size_t len);
+ 
+ // ---- Client sessions ----
+ void session_init(struct client_session *c, int fd);
+ // Returns 1 if a complete request is already buffered.
+ int session_has_command(const struct client_session *c);
+ // Moves the next buffered request into `cmdBuf` as a text command line.
+ int session_scan_command(struct client_session *c, char *cmdBuf, size_t size, size_t *len);
+ // Blocking read of the next request; returns its length or -1.
+ int session_next_command(struct client_session *c, char *cmdBuf, size_t size);
+ // Sends a status or error message ("SUCCESS: ...\n", "ERROR: ...\n").
+ int reply_line(struct client_session *c, const char *msg);
+ // Announces `size` bytes of data, which the caller sends next.
+ int reply_size(struct client_session *c, long size);
+ // Announces a chunked data stream, which the caller sends next.
+ int reply_chunked(struct client_session *c);
+ // reply_chunked() (or, if `deflated`, reply_deflated()) carrying the token an
+ // incremental downltar continues from.
+ int reply_chunked_token(struct client_session *c, int deflated, const char *token);
+ // The same for a deflated stream (clients that asked for compression).
+ int reply_deflated(struct client_session *c, int withCrc);
+ // reply_size() for a whole file that is followed by its checksum trailer.
+ int reply_size_crc(struct client_session *c, long size);
+ // reply_size() for a listing page, with the cursor of the next page (or NULL).
+ int reply_size_cursor(struct client_session *c, long size, const char *cursor);
+ // reply_size() for a byte range of a file that has `total` bytes.
+ int reply_range(struct client_session *c, long length, long total);
+ 
+ // ---- Checksums ----
+ // Picks the CRC-32C implementation; called once at startup.
+ void crc32c_init(void);
+ // CRC-32C of `len` more bytes, continuing from `crc` (0 to start).
+ uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+ // Reads a storage server's "CRC32C <hex>" trailer line (0 or -1).
+ int read_backend_trailer(struct line_reader *r, uint32_t *crc);
+ // Sends the trailer of a STORE body announced with "crc32c", and uncorks.
+ int send_backend_trailer(int sock, uint32_t crc);
+ // Corks (1) or uncorks (0) a socket around a body and its trailer.
+ void tcp_cork(int sock, int on);
+ // Sends / reads a protocol 2 client's 4-byte checksum trailer.
+ int send_client_trailer(struct client_session *c, uint32_t crc);
+ int recv_client_trailer(struct client_session *c, uint32_t *crc);
+ 
+ // ---- Durable writes ----
+ // Creates and opens ~/S1 and maps the shared group commit state; called once at startup.
+ void durable_init(void);
+ // Waits for a flush of ~/S1 that started after the call (0 or -1).
+ int group_sync(void);
+ // Temporary file in directory `dirFd` for an upload to `name`, preallocated to `fileSize`.
+ FILE *durable_open(int dirFd, const char *name, long fileSize, char *tmpName, size_t size);
+ // Flushes `tmpName` as --sync asks and renames it over `name` in `dirFd` (0 or -1).
+ int durable_rename(int dirFd, int fd, const char *tmpName, const char *name);
+ 
+ // ---- Logging and metrics ----
+ // Starts the logger thread, logging up to `level`.
+ void log_init(int level);
+ // Level named by --log-level ("error" ... "debug"), or -1.
+ int log_level_parse(const char *name);
+ // Maps the metrics shared by every process and worker.
+ int metrics_init(void);
+ // Starts timing the command `cmdLine` read from connection `fd`.
+ void metrics_begin(int fd, const char *cmdLine);
+ // Counts bytes read from / written to `fd`, if it is the current command's connection.
+ void metrics_io(int fd, long in, long out);
+ // Marks the current command as answered with an ERROR.
+ void metrics_failed(void);
+ // Records the current command begun by metrics_begin().
+ void metrics_end(void);
+ // The metrics in the Prometheus text format (malloc'd, NULL if out of memory).
+ char *metrics_text(size_t *len);
+ // Serves "GET /metrics" on `port` from a thread of its own (0 or -1).
+ int metrics_http_start(int port);
+ 
+ // ---- I/O engine ----
+ struct uring;
+ // The calling thread's io_uring with --io uring (set up on first use), else NULL.
+ struct uring *uring_get(void);
+ // send_file_fd() through ring `r`, with reads of the file kept in flight (0 or -1).
+ int uring_send_file(struct uring *r, int sock, int fd, off_t offset, long length, uint32_t *crc);
+ 
+ // ---- Routing table ----
+ // Loads the built-in S2/S3/S4 routes, or those of a routing file (0 or -1).
+ void routes_default(void);
+ int routes_load(const char *path);
+ // Route of a file type (".pdf"), or NULL if it is not stored on any server.
+ const struct route *route_find(const char *ext);
+ // Sorts each route's servers onto its hash ring; 0 or -1 if out of memory.
+ int routes_build_rings(void);
+ // A path's servers in ring order (the first is its home); returns how many.
+ int route_nodes(const char *path, int *nodes, int max);
+ // Storage server of a path relative to ~S1, BACKEND_LOCAL for .c, or -1.
+ int route_backend(const char *path);
+ // Comma-separated list of the supported file types.
+ void route_types(char *buf, size_t size);
+ // zlib level a file type is compressed at on the wire (0 = not compressed).
+ int compress_level(const char *ext);
+ 
+ // ---- Storage server connection pool ----
+ // Returns a connection to `backend`, reusing a healthy pooled one when possible.
+ int backend_acquire(int backend, int *reused);
+ // Returns a connection that finished its command cleanly to the pool.
+ void backend_release(int backend, int sfd);
+ // Sends a one-line command and reads the first response line into `line`.
+ int backend_command(int backend, const char *cmd, struct line_reader *reply,
+                     char *line, size_t lineLen);
+ 
+ // ---- Replica selection ----
+ // Maps the per-server load counters shared by every process and worker.
+ int backend_load_init(void);
+ // Records whether a new connection to `backend` could be opened.
+ void backend_note_connect(int backend, int ok);
+ // Counts a download relayed from `backend` (+1 when it starts, -1 when it ends).
+ void backend_busy(int backend, int delta);
+ // Feeds the time `backend` took to answer into its moving average.
+ void backend_latency(int backend, long us);
+ // route_nodes() with the file's replicas ordered least busy first.
+ int replica_order(const char *path, int *nodes, int max);
+ // STORE command sending a file on to the replicas in `chain`; -1 if too long.
+ // A `zLen` of 0 or more makes it STOREZ, for a body that is deflated to zLen bytes;
+ // `withCrc` announces the checksum trailer after the body.
+ int store_header(char *buf, size_t size, const char *path, long fileSize, long zLen,
+                  int withCrc, const int *chain, int count);
+ // Copies reported by a STORE acknowledgement (0 for an error).
+ int store_copies(const char *ack);
+ // Copies `path` from server `from` to `to` and on down `chain`; copies stored or -1.
+ int backend_copy(int from, int to, const char *path, const int *chain, int count);
+ 
+ // Moves and re-replicates files to match the ring, in a background process.
+ void rebalance_start(void);
+ 
+ // ---- Hot file cache ----
+ // Maps the shared cache; a budget of 0 leaves it off.
+ int cache_init(long budget);
+ // Returns 1 if a download of `size` bytes should go through the cache.
+ int cache_admits(long size);
+ // Invalidation generation to pass to cache_put() for a fill starting now.
+ uint64_t cache_generation(void);
+ // Returns a malloc'd copy of a cached file and its checksum, or NULL on a miss.
+ char *cache_get(const char *key, long *size, uint32_t *crc);
+ // Stores a relayed file unless it was invalidated since `generation`.
+ void cache_put(const char *key, const char *data, long size, uint32_t crc, uint64_t generation);
+ // Drops a file that was uploaded or removed through S1.
+ void cache_invalidate(const char *key);
+ // Formats the hit/miss counters as a status line.
+ void cache_stats(char *buf, size_t size);
+ 
+ // ---- Tar archives ----
+ // Streams a tar of the files under `baseDir` ending in `ext` (deflated at
+ // `level` if above 0), leaving out files unchanged since `since` (ns, 0 = none)
+ // and copying the output to `copy` if not NULL; returns the file count or -1.
+ struct stream_copy;
+ long tar_write_tree(int fd, int chunked, const char *baseDir, const char *ext, int level,
+                     uint64_t since, struct stream_copy *copy);
+ // Copies a storage server's chunked tar stream, with or without its framing.
+ int copy_chunks(struct line_reader *from, int outFd, int framed);
+ // The same for one of several archives joined into one (written through `z`
+ // if it is not NULL), keeping only the files `shard` owns if that is not NULL;
+ // tar_end() finishes it.
+ struct zout;
+ struct tar_shard {
+     int backend;      // Server the archive comes from
+     const char *up;   // up[b] is nonzero if server b's archive is part of the download
+ };
+ int copy_chunks_joined(struct line_reader *from, int outFd, int framed, struct zout *z,
+                        const struct tar_shard *shard);
+ int tar_end(int fd, int framed, struct zout *z);
+ // Unlinked temp file for archives that must be sized before they are sent.
+ int spool_create(void);
+ // Sends a spooled archive with its size and closes it.
+ int spool_send(struct client_session *client, int fd, const char *fileType);
+ 
+ // ---- Archive cache ----
+ // Maps the shared cache state; a budget of 0 leaves it off.
+ int tar_cache_init(long budget);
+ // Called after every change to the local .c files; cached archives go stale.
+ void tar_note_change(void);
+ // Opens the cached archive at `level` if it is still current (-1 if not).
+ int tar_cache_open(const char *baseDir, int level, long *len);
+ // Temp file a new archive is copied into while it streams out (-1 if the cache is off).
+ int tar_cache_create(const char *baseDir, char *tmpPath, size_t size);
+ // Installs the copy as the archive at `level`, unless the files changed after `gen`.
+ void tar_cache_put(const char *baseDir, const char *tmpPath, int level, uint64_t gen, long len);
+ uint64_t tar_cache_generation(void);
+ 
+ // ---- Admission control ----
+ // Maps the shared limiter state; nothing to do if every limit is off.
+ int admit_init(void);
+ // Admits a transfer of `path` (NULL for a batch) that will move `size` bytes
+ // (-1 if not known), waiting for a backend slot if it needs one. Otherwise
+ // answers "ERROR: BUSY retry-after ..." and returns -1.
+ int admit_transfer(struct client_session *client, const char *path, long size);
+ // Ends the calling thread's admitted transfer, if any, charging what it moved.
+ void admit_release(struct client_session *client);
  
  // ---- Command-specific handlers ----
- int handle_upload(int clientSock, const char *filename, const char *destPath, long fileSize);
- int handle_download(int clientSock, const char *filePath);
- int handle_remove(int clientSock, const char *filePath);
- int handle_downltar(int clientSock, const char *fileType);
- int handle_dispfnames(int clientSock, const char *dirPath);
+ // Returns 1 if `id` can name a multipart upload (uploadp/uploadc).
+ int valid_upload_id(const char *id);
+ // A `zLen` of 0 or more means the body is that many bytes of deflated data.
+ int handle_upload(struct client_session *client, const char *filename, const char *destPath,
+                   long fileSize, long zLen);
+ int handle_upload_part(struct client_session *client, const char *uploadId, const char *filename,
+                        const char *destPath, long total, long offset, long length);
+ int handle_upload_commit(const char *uploadId, const char *filename, const char *destPath,
+                          long total, int discard);
+ // Stores a file by linking it to identical contents a storage server already has.
+ int handle_upload_link(const char *filename, const char *destPath, long fileSize, const char *hash);
+ int handle_batch_upload(struct client_session *client, long bodyLen);
+ int handle_batch_download(struct client_session *client, long manifestLen);
+ int handle_batch_remove(struct client_session *client, long manifestLen);
+ int handle_download(struct client_session *client, const char *filePath, long offset, long length);
+ int handle_remove(const char *filePath);
+ // `since` is the token of an earlier chunked answer, for only what changed after it.
+ int handle_downltar(struct client_session *client, const char *fileType, int chunked,
+                     const char *since);
+ int handle_dispfnames(struct client_session *client, const char *dirPath, long limit,
+                       const char *cursor, const char *filter);
  
  // ----------------------- MAIN FUNCTION (S1 SERVER) --------------------------
  
- int main() {
+ int main(int argc, char *argv[]) {
+     parse_options(argc, argv);
+     log_init(options.logLevel);
+     crc32c_init();
+     durable_init();
+     if (options.routes == NULL) {
+         routes_default();
+     } else if (routes_load(options.routes) != 0) {
+         exit(EXIT_FAILURE);
+     }
+     if (routes_build_rings() != 0) {
+         fprintf(stderr, "Error: out of memory building the routing table\n");
+         exit(EXIT_FAILURE);
+     }
+ 
+     // Shared state is mapped before any child or worker exists so all of them see it
+     if (backend_load_init() != 0 || metrics_init() != 0) {
+         exit(EXIT_FAILURE);
+     }
+     if (options.metricsPort > 0 && metrics_http_start(options.metricsPort) != 0) {
+         fprintf(stderr, "Error: cannot serve metrics on port %d: %s\n", options.metricsPort, strerror(errno));
+         exit(EXIT_FAILURE);
+     }
+     if (cache_init(options.cacheMb * 1024 * 1024) != 0) {
+         LOG("Continuing without the hot-file cache");
+     }
+     if (tar_cache_init(options.tarCacheMb * 1024 * 1024) != 0) {
+         LOG("Continuing without the archive cache");
+     }
+     if (admit_init() != 0) {
+         exit(EXIT_FAILURE);
+     }
+ 
      // Attempt to get HOME environment variable (for building ~/S1, etc.)
      char *homeDir = getenv("HOME");
      if (!homeDir) {
@@ -93,6 +659,15 @@
      // Alternatively, you could do signal(SIGCHLD, SIG_IGN);
      signal(SIGCHLD, SIG_IGN);
  
+     // A storage server closing mid-transfer must not kill the child handling
+     // the client; send()/splice() report EPIPE instead.
+     signal(SIGPIPE, SIG_IGN);
+ 
+     // A routing file may have moved files to other servers
+     if (options.routes) {
+         rebalance_start();
+     }
+ 
      // Create a listening socket
      int listenSock = socket(AF_INET, SOCK_STREAM, 0);
      if (listenSock < 0) {
@@ -126,6 +701,10 @@
  
      LOG("Server is listening on port %d", S1_PORT);
  
+     if (options.mode == MODE_EPOLL) {
+         run_event_loop(listenSock);
+     }
+ 
      // Accept loop: fork a child for each new client
      while (1) {
          struct sockaddr_in clientAddr;
@@ -143,7 +722,7 @@
          // Log that a new client is connecting 
          char clientIP[INET_ADDRSTRLEN];
          inet_ntop(AF_INET, &clientAddr.sin_addr, clientIP, sizeof(clientIP));
-         LOG("Accepted connection from %s:%d", clientIP, ntohs(clientAddr.sin_port));
+         LOG_DEBUG("Accepted connection from %s:%d", clientIP, ntohs(clientAddr.sin_port));
  
          // Fork a child process to handle this client
          pid_t pid = fork();
@@ -157,7 +736,7 @@
              close(listenSock);  // Child doesn't need the main listening socket
              prcclient(clientSock);
              close(clientSock);
-             LOG("Client handled. Child exiting...");
+             LOG_DEBUG("Client handled. Child exiting...");
              exit(0);
          } else {
              // Parent process
@@ -172,54 +751,170 @@
  
  // ----------------------- UTILITY FUNCTION DEFINITIONS -----------------------
  
+ /**
+  * @brief Parses S1's command-line options.
+  *
+  *     --mode fork|epoll   Concurrency model (default: fork)
+  *     --workers N         Worker threads for epoll mode (default: one per core)
+  *     --max-clients N     Connected clients before epoll mode stops accepting
+  *     --list-timeout MS   How long dispfnames waits for a storage server's listing
+  *     --cache-mb MB       Memory for caching small files relayed by downlf (default: off)
+  *     --routes FILE       Storage servers and file types (default: S2/S3/S4 on localhost)
+  *     --repair-interval S Repeat the rebalance and replica repair pass every S seconds
+  *     --sync group|each|none  How local uploads reach the disk (default: group)
+  *     --io blocking|uring     I/O engine for local .c files (default: blocking)
+  *     --metrics-port N    Serve the metrics for Prometheus on port N (default: off)
+  *     --tar-cache-mb MB   Disk for the last downltar archives of .c files (default: 256, 0 = off)
+  *     --client-rate MB    Bytes per second one client address may transfer, in MB (default: unlimited)
+  *     --client-burst MB   How far a client may go above that rate at once (default: 4 s worth)
+  *     --client-transfers N  Transfers one client address may run at once (default: unlimited)
+  *     --backend-slots N   Transfers relayed to the storage servers at once (default: unlimited)
+  *     --slot-wait-ms MS   How long a transfer waits for a backend slot (default: 5000)
+  *     --log-level L       error, warn, info (default) or debug
+  */
+ void parse_options(int argc, char *argv[]) {
+     static const struct option longOpts[] = {
+         { "mode",        required_argument, NULL, 'm' },
+         { "workers",     required_argument, NULL, 'w' },
+         { "max-clients", required_argument, NULL, 'c' },
+         { "list-timeout", required_argument, NULL, 'l' },
+         { "cache-mb",    required_argument, NULL, 'C' },
+         { "routes",      required_argument, NULL, 'r' },
+         { "repair-interval", required_argument, NULL, 'R' },
+         { "sync",        required_argument, NULL, 's' },
+         { "io",          required_argument, NULL, 'i' },
+         { "metrics-port", required_argument, NULL, 'M' },
+         { "log-level",   required_argument, NULL, 'L' },
+         { "tar-cache-mb", required_argument, NULL, 'T' },
+         { "client-rate", required_argument, NULL, 'b' },
+         { "client-burst", required_argument, NULL, 'B' },
+         { "client-transfers", required_argument, NULL, 'x' },
+         { "backend-slots", required_argument, NULL, 'S' },
+         { "slot-wait-ms", required_argument, NULL, 'W' },
+         { "help",        no_argument,       NULL, 'h' },
+         { NULL, 0, NULL, 0 }
+     };
+     int opt;
+     while ((opt = getopt_long(argc, argv, "m:w:c:l:C:r:R:s:i:M:L:T:b:B:x:S:W:h", longOpts, NULL)) != -1) {
+         switch (opt) {
+         case 'm':
+             if (strcmp(optarg, "fork") == 0) {
+                 options.mode = MODE_FORK;
+             } else if (strcmp(optarg, "epoll") == 0) {
+                 options.mode = MODE_EPOLL;
+             } else {
+                 fprintf(stderr, "Error: unknown mode '%s' (use fork or epoll)\n", optarg);
+                 exit(EXIT_FAILURE);
+             }
+             break;
+         case 'w':
+             options.workers = atoi(optarg);
+             break;
+         case 'c':
+             options.maxClients = atoi(optarg);
+             break;
+         case 'l':
+             options.listTimeoutMs = atoi(optarg);
+             break;
+         case 'C':
+             options.cacheMb = atol(optarg);
+             break;
+         case 'r':
+             options.routes = optarg;
+             break;
+         case 'R':
+             options.repairSecs = atoi(optarg);
+             break;
+         case 's':
+             if (strcmp(optarg, "group") == 0) {
+                 options.sync = SYNC_GROUP;
+             } else if (strcmp(optarg, "each") == 0) {
+                 options.sync = SYNC_EACH;
+             } else if (strcmp(optarg, "none") == 0) {
+                 options.sync = SYNC_NONE;
+             } else {
+                 fprintf(stderr, "Error: unknown sync mode '%s' (use group, each or none)\n", optarg);
+                 exit(EXIT_FAILURE);
+             }
+             break;
+         case 'i':
+             if (strcmp(optarg, "blocking") == 0) {
+                 options.io = IO_BLOCKING;
+             } else if (strcmp(optarg, "uring") == 0) {
+                 options.io = IO_URING;
+             } else {
+                 fprintf(stderr, "Error: unknown I/O engine '%s' (use blocking or uring)\n", optarg);
+                 exit(EXIT_FAILURE);
+             }
+             break;
+         case 'M':
+             options.metricsPort = atoi(optarg);
+             break;
+         case 'T':
+             options.tarCacheMb = atol(optarg);
+             break;
+         case 'b':
+             options.clientRateMb = atol(optarg);
+             break;
+         case 'B':
+             options.clientBurstMb = atol(optarg);
+             break;
+         case 'x':
+             options.clientTransfers = atoi(optarg);
+             break;
+         case 'S':
+             options.backendSlots = atoi(optarg);
+             break;
+         case 'W':
+             options.slotWaitMs = atoi(optarg);
+             break;
+         case 'L':
+             options.logLevel = log_level_parse(optarg);
+             if (options.logLevel < 0) {
+                 fprintf(stderr, "Error: unknown log level '%s' (use error, warn, info or debug)\n", optarg);
+                 exit(EXIT_FAILURE);
+             }
+             break;
+         default:
+             fprintf(stderr, "Usage: %s [--mode fork|epoll] [--workers N] [--max-clients N] [--list-timeout MS] [--cache-mb MB] [--routes FILE] [--repair-interval S] [--sync group|each|none] [--io blocking|uring] [--metrics-port N] [--tar-cache-mb MB] [--client-rate MB] [--client-burst MB] [--client-transfers N] [--backend-slots N] [--slot-wait-ms MS] [--log-level L]\n", argv[0]);
+             exit(opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE);
+         }
+     }
+     if (options.workers <= 0) {
+         long cores = sysconf(_SC_NPROCESSORS_ONLN);
+         options.workers = cores > 0 ? (int)cores : 1;
+     }
+     if (options.maxClients <= 0) {
+         options.maxClients = DEFAULT_MAX_CLIENTS;
+     }
+     if (options.listTimeoutMs <= 0) {
+         options.listTimeoutMs = DEFAULT_LIST_TIMEOUT_MS;
+     }
+     if (options.cacheMb < 0) {
+         options.cacheMb = 0;
+     }
+     if (options.tarCacheMb < 0) {
+         options.tarCacheMb = 0;
+     }
+     if (options.repairSecs < 0) {
+         options.repairSecs = 0;
+     }
+     if (options.slotWaitMs <= 0) {
+         options.slotWaitMs = DEFAULT_SLOT_WAIT_MS;
+     }
+ }
+ 
  /**
   * @brief Creates the directory path recursively if it doesn't exist.
   * @param path Full path to ensure
   * @return 0 on success, -1 on error
   */
  int ensure_directory_exists(const char *path) {
-     struct stat st;
-     // If path already exists
-     if (stat(path, &st) == 0) {
-         if (S_ISDIR(st.st_mode)) {
-             return 0; // Already a directory
-         } else {
-             // Exists but not a directory
-             return -1;
-         }
-     }
-     // We'll build it piece by piece
-     char tmp[512];
-     snprintf(tmp, sizeof(tmp), "%s", path);
-     size_t len = strlen(tmp);
-     if (len == 0) return -1;
-     if (tmp[len - 1] == '/') {
-         tmp[len - 1] = '\0';
-     }
-     // Create parent directories first
-     for (char *p = tmp + 1; *p; p++) {
-         if (*p == '/') {
-             *p = '\0';
-             if (stat(tmp, &st) != 0) {
-                 if (mkdir(tmp, 0755) < 0) {
-                     perror("mkdir");
-                     return -1;
-                 }
-             } else if (!S_ISDIR(st.st_mode)) {
-                 return -1;
-             }
-             *p = '/';
-         }
-     }
-     // Create final directory
-     if (stat(tmp, &st) != 0) {
-         if (mkdir(tmp, 0755) < 0) {
-             perror("mkdir");
-             return -1;
-         }
-     } else if (!S_ISDIR(st.st_mode)) {
+     int fd = dir_open(path);
+     if (fd < 0) {
          return -1;
      }
+     close(fd);
      return 0;
  }
  
@@ -231,6 +926,7 @@
   * @return 0 on success, -1 on error
   */
  int send_all(int sock, const void *buffer, size_t length) {
+     metrics_io(sock, 0, (long)length);
      size_t totalSent = 0;
      const char *buf = (const char*) buffer;
      while (totalSent < length) {
@@ -244,17 +940,17 @@
  }
  
  /**
-  * @brief Reads exactly `length` bytes from a socket, handling partial reads.
-  * @param sock The socket file descriptor
+  * @brief Reads exactly `length` bytes from a connection, handling partial reads.
+  * @param r The connection's reader (buffered bytes are used first)
   * @param buffer Buffer to store data
   * @param length Number of bytes to read
   * @return 0 on success, -1 on error or if connection is closed prematurely
   */
- int recv_all(int sock, void *buffer, size_t length) {
+ int recv_all(struct line_reader *r, void *buffer, size_t length) {
      size_t totalRecv = 0;
      char *buf = (char*) buffer;
      while (totalRecv < length) {
-         ssize_t n = recv(sock, buf + totalRecv, length - totalRecv, 0);
+         ssize_t n = reader_read(r, buf + totalRecv, length - totalRecv);
          if (n <= 0) {
              return -1; // error or connection closed
          }
@@ -263,394 +959,6560 @@
      return 0;
  }
  
- // ----------------------- CHILD PROCESS CLIENT HANDLER -----------------------
- 
  /**
-  * @brief Handles all commands from a single client. Runs in the child process.
-  * @param clientSock The connected socket to the client
+  * @brief Reads and throws away `length` bytes from a socket. Used when a
+  *        command fails after the client has already started sending a body.
+  * @param r The connection's reader
+  * @param length Number of bytes still expected on the socket
   */
- void prcclient(int clientSock) {
-     char cmdBuf[MAX_CMD_LEN];
- 
-     while (1) {
-         // Read a command line from the client. We'll parse it character by character until newline.
-         int idx = 0;
-         char c;
-         while (1) {
-             ssize_t n = recv(clientSock, &c, 1, 0);
-             if (n <= 0) {
-                 // Connection closed or error
-                 return;
-             }
-             if (c == '\n') {
-                 // End of command
-                 break;
-             }
-             // Build up the command string
-             if (idx < (MAX_CMD_LEN - 1)) {
-                 cmdBuf[idx++] = c;
-             }
-         }
-         cmdBuf[idx] = '\0';
- 
-         // If the command line is empty, ignore it
-         if (idx == 0) {
-             continue;
-         }
- 
-         LOG("Received command: %s", cmdBuf);
- 
-         // Tokenize the command
-         char *command = strtok(cmdBuf, " ");
-         if (!command) {
-             continue;
-         }
- 
-         // Handle each possible command
-         if (strcmp(command, "uploadf") == 0) {
-             // Format: uploadf <filename> <dest_path> <filesize>
-             char *filename = strtok(NULL, " ");
-             char *destPath = strtok(NULL, " ");
-             char *sizeStr  = strtok(NULL, " ");
-             if (!filename || !destPath || !sizeStr) {
-                 const char *errMsg = "ERROR: Invalid uploadf command format\n";
-                 send_all(clientSock, errMsg, strlen(errMsg));
-                 continue;
-             }
-             long fileSize = atol(sizeStr);
-             if (fileSize < 0) {
-                 const char *errMsg = "ERROR: Invalid file size\n";
-                 send_all(clientSock, errMsg, strlen(errMsg));
-                 continue;
-             }
-             // Handle the upload
-             int res = handle_upload(clientSock, filename, destPath, fileSize);
-             if (res == 0) {
-                 const char *msg = "SUCCESS: File uploaded\n";
-                 send_all(clientSock, msg, strlen(msg));
-             } else {
-                 const char *msg = "ERROR: File upload failed\n";
-                 send_all(clientSock, msg, strlen(msg));
-             }
- 
-         } else if (strcmp(command, "downlf") == 0) {
-             // Format: downlf <file_path>
-             char *filePath = strtok(NULL, "");
-             if (!filePath) {
-                 const char *errMsg = "ERROR: Invalid downlf command format\n";
-                 send_all(clientSock, errMsg, strlen(errMsg));
-                 continue;
-             }
-             // Trim leading spaces from filePath
-             while (*filePath == ' ') filePath++;
-             if (strlen(filePath) == 0) {
-                 const char *errMsg = "ERROR: Invalid file path\n";
-                 send_all(clientSock, errMsg, strlen(errMsg));
-                 continue;
-             }
-             // Let the handler send the file or error
-             handle_download(clientSock, filePath);
- 
-         } else if (strcmp(command, "removef") == 0) {
-             // Format: removef <file_path>
-             char *filePath = strtok(NULL, "");
-             if (!filePath) {
-                 const char *errMsg = "ERROR: Invalid removef command format\n";
-                 send_all(clientSock, errMsg, strlen(errMsg));
-                 continue;
-             }
-             // Trim leading spaces
-             while (*filePath == ' ') filePath++;
-             if (strlen(filePath) == 0) {
-                 const char *errMsg = "ERROR: Invalid file path\n";
-                 send_all(clientSock, errMsg, strlen(errMsg));
-                 continue;
-             }
-             int res = handle_remove(clientSock, filePath);
-             if (res == 0) {
-                 const char *msg = "SUCCESS: File removed\n";
-                 send_all(clientSock, msg, strlen(msg));
-             } else {
-                 const char *msg = "ERROR: File not found or cannot remove\n";
-                 send_all(clientSock, msg, strlen(msg));
-             }
- 
-         } else if (strcmp(command, "downltar") == 0) {
-             // Format: downltar <filetype>
-             char *fileType = strtok(NULL, " ");
-             if (!fileType) {
-                 const char *errMsg = "ERROR: Invalid downltar command format\n";
-                 send_all(clientSock, errMsg, strlen(errMsg));
-                 continue;
-             }
-             handle_downltar(clientSock, fileType);
- 
-         } else if (strcmp(command, "dispfnames") == 0) {
-             // Format: dispfnames <directory_path>
-             char *dirPath = strtok(NULL, "");
-             if (!dirPath) {
-                 const char *errMsg = "ERROR: Invalid dispfnames command format\n";
-                 send_all(clientSock, errMsg, strlen(errMsg));
-                 continue;
-             }
-             while (*dirPath == ' ') dirPath++;
-             if (strlen(dirPath) == 0) {
-                 const char *errMsg = "ERROR: Invalid directory path\n";
-                 send_all(clientSock, errMsg, strlen(errMsg));
-                 continue;
-             }
-             handle_dispfnames(clientSock, dirPath);
- 
-         } else {
-             // Unknown command
-             const char *errMsg = "ERROR: Unknown command\n";
-             send_all(clientSock, errMsg, strlen(errMsg));
-         }
+ void drain_socket(struct line_reader *r, long length) {
+     char buffer[BUF_SIZE];
+     long remaining = length;
+     while (remaining > 0) {
+         ssize_t n = reader_read(r, buffer, (remaining < BUF_SIZE ? remaining : BUF_SIZE));
+         if (n <= 0) break;
+         remaining -= n;
      }
  }
  
- // ----------------------- COMMAND HANDLER DEFINITIONS ------------------------
- 
  /**
-  * @brief Handles 'uploadf' command: receives file bytes from client and
-  *        stores them in ~/S1 if .c, else forwards them to S2 (pdf), S3 (txt), or S4 (zip).
+  * @brief Connects to a storage server (S2/S3/S4).
+  * @param addr Dotted IPv4 address of the server
+  * @param port TCP port of the server
+  * @return Connected socket on success, -1 on error
   */
- int handle_upload(int clientSock, const char *filename, const char *destPath, long fileSize) {
-     // Identify file extension
-     const char *ext = strrchr(filename, '.');
-     if (!ext) {
-         // No extension found
-         LOG("Upload error: file has no extension");
-         // Drain incoming data from socket to keep it in sync
-         char buffer[BUF_SIZE];
-         long remaining = fileSize;
-         while (remaining > 0) {
-             ssize_t r = recv(clientSock, buffer, (remaining < BUF_SIZE ? remaining : BUF_SIZE), 0);
-             if (r <= 0) break;
-             remaining -= r;
-         }
+ int connect_to_server(const char *addr, int port) {
+     int sfd = socket(AF_INET, SOCK_STREAM, 0);
+     if (sfd < 0) {
          return -1;
      }
- 
-     // Build S1 base path: ~/S1
-     char *homeDir = getenv("HOME");
-     if (!homeDir) return -1;
-     char basePath[512];
-     snprintf(basePath, sizeof(basePath), "%s/S1", homeDir);
- 
-     // Replace "~S1" with basePath
-     char destCopy[512];
-     strncpy(destCopy, destPath, sizeof(destCopy) - 1);
-     destCopy[sizeof(destCopy) - 1] = '\0';
-     // Remove trailing slash if present
-     size_t destLen = strlen(destCopy);
-     if (destLen > 0 && destCopy[destLen - 1] == '/') {
-         destCopy[destLen - 1] = '\0';
+     struct sockaddr_in serv;
+     memset(&serv, 0, sizeof(serv));
+     serv.sin_family = AF_INET;
+     serv.sin_port = htons(port);
+     if (inet_pton(AF_INET, addr, &serv.sin_addr) <= 0) {
+         LOG_WARN("Invalid address for server %s", addr);
+         close(sfd);
+         return -1;
      }
-     const char *subPath = destCopy;
-     if (strncmp(destCopy, "~S1", 3) == 0) {
-         subPath = destCopy + 3;
-         if (*subPath == '/') subPath++;
+     if (connect(sfd, (struct sockaddr*)&serv, sizeof(serv)) < 0) {
+         close(sfd);
+         return -1;
      }
+     return sfd;
+ }
  
-     // Build full directory path inside ~/S1
-     char fullDir[512];
-     if (*subPath) {
-         snprintf(fullDir, sizeof(fullDir), "%s/%s", basePath, subPath);
-     } else {
-         snprintf(fullDir, sizeof(fullDir), "%s", basePath);
+ /**
+  * @brief Like connect_to_server(), but does not wait for the connection to be
+  *        established. The socket is non-blocking; once it is writable,
+  *        SO_ERROR tells whether the connect succeeded.
+  * @param inProgress Set to 1 if the connect is still pending, 0 if it is done
+  * @return The socket, or -1 on immediate failure
+  */
+ int connect_to_server_async(const char *addr, int port, int *inProgress) {
+     int sfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+     if (sfd < 0) {
+         return -1;
+     }
+     struct sockaddr_in serv;
+     memset(&serv, 0, sizeof(serv));
+     serv.sin_family = AF_INET;
+     serv.sin_port = htons(port);
+     if (inet_pton(AF_INET, addr, &serv.sin_addr) <= 0) {
+         LOG_WARN("Invalid address for server %s", addr);
+         close(sfd);
+         return -1;
+     }
+     *inProgress = 0;
+     if (connect(sfd, (struct sockaddr*)&serv, sizeof(serv)) < 0) {
+         if (errno != EINPROGRESS) {
+             close(sfd);
+             return -1;
+         }
+         *inProgress = 1;
      }
+     return sfd;
+ }
  
-     // Make sure the directory exists (but the instructions say user may have already created them).
-     if (ensure_directory_exists(fullDir) != 0) {
-         LOG("Directory creation failed for %s", fullDir);
-         // Drain data from socket
-         char buffer[BUF_SIZE];
-         long remaining = fileSize;
-         while (remaining > 0) {
-             ssize_t r = recv(clientSock, buffer, (remaining < BUF_SIZE ? remaining : BUF_SIZE), 0);
-             if (r <= 0) break;
-             remaining -= r;
+ /**
+  * @brief Forwards exactly `length` bytes from one socket to another.
+  *
+  * The bytes are moved with splice(2) through a pipe, so they never enter user
+  * space or touch S1's disk. If the kernel refuses to splice these descriptors,
+  * a plain recv/send loop through a BUF_SIZE buffer is used instead. Any part
+  * of the payload the reader already buffered is sent first.
+  *
+  * @param from Reader of the socket the payload is read from
+  * @param toSock Socket the payload is written to
+  * @param length Number of bytes to forward
+  * @return 0 on success,
+  *         -1 if `from` failed or closed early (stream is out of sync),
+  *         -2 if `toSock` failed; the rest of the payload has been drained
+  *            from `from` so it stays in sync.
+  */
+ int relay_bytes(struct line_reader *from, int toSock, long length) {
+     int fromSock = from->fd;
+     long remaining = length;
+     int pipefd[2];
+ 
+     // Bytes that arrived together with the header line
+     size_t buffered = reader_buffered(from);
+     if (buffered > 0 && remaining > 0) {
+         size_t take = buffered < (size_t)remaining ? buffered : (size_t)remaining;
+         int sent = send_all(toSock, from->buf + from->start, take);
+         from->start += take;
+         remaining -= take;
+         if (sent != 0) {
+             drain_socket(from, remaining);
+             return -2;
          }
-         return -1;
      }
  
-     // Open local file
-     char fullPath[1024];
-     snprintf(fullPath, sizeof(fullPath), "%s/%s", fullDir, filename);
-     FILE *fp = fopen(fullPath, "wb");
-     if (!fp) {
-         LOG("Failed to open %s for writing: %s", fullPath, strerror(errno));
-         // Drain incoming data
-         char buffer[BUF_SIZE];
-         long remaining = fileSize;
+     if (remaining > 0 && pipe2(pipefd, O_CLOEXEC) == 0) {
+         // A bigger pipe means fewer splice round trips; failure is harmless.
+         fcntl(pipefd[1], F_SETPIPE_SZ, 1 << 20);
+         int spliced = 0;
          while (remaining > 0) {
-             ssize_t r = recv(clientSock, buffer, (remaining < BUF_SIZE ? remaining : BUF_SIZE), 0);
-             if (r <= 0) break;
-             remaining -= r;
+             ssize_t in = splice(fromSock, NULL, pipefd[1], NULL,
+                                 (size_t)(remaining < (1 << 20) ? remaining : (1 << 20)),
+                                 SPLICE_F_MOVE | SPLICE_F_MORE);
+             if (in < 0 && errno == EINTR) continue;
+             if (in < 0 && !spliced && (errno == EINVAL || errno == ENOSYS)) {
+                 break;  // Not supported here; use the copy loop below
+             }
+             if (in <= 0) {
+                 close(pipefd[0]);
+                 close(pipefd[1]);
+                 return -1;
+             }
+             spliced = 1;
+             remaining -= in;
+             metrics_io(fromSock, in, 0);
+             // Push everything that is sitting in the pipe to the destination
+             while (in > 0) {
+                 ssize_t out = splice(pipefd[0], NULL, toSock, NULL, (size_t)in,
+                                      SPLICE_F_MOVE | (remaining > 0 ? SPLICE_F_MORE : 0));
+                 if (out < 0 && errno == EINTR) continue;
+                 if (out <= 0) {
+                     close(pipefd[0]);
+                     close(pipefd[1]);
+                     drain_socket(from, remaining);
+                     return -2;
+                 }
+                 metrics_io(toSock, 0, out);
+                 in -= out;
+             }
          }
-         return -1;
+         close(pipefd[0]);
+         close(pipefd[1]);
      }
  
-     // Receive file data from client
-     long remaining = fileSize;
-     char buf[BUF_SIZE];
+     // Fallback: copy through user space
+     char buffer[BUF_SIZE];
      while (remaining > 0) {
-         ssize_t r = recv(clientSock, buf, (remaining < BUF_SIZE ? remaining : BUF_SIZE), 0);
+         ssize_t r = recv(fromSock, buffer, (remaining < BUF_SIZE ? remaining : BUF_SIZE), 0);
          if (r <= 0) {
-             fclose(fp);
-             LOG("Connection lost while receiving file");
              return -1;
          }
-         fwrite(buf, 1, r, fp);
+         metrics_io(fromSock, r, 0);
          remaining -= r;
+         if (send_all(toSock, buffer, r) != 0) {
+             drain_socket(from, remaining);
+             return -2;
+         }
+     }
+     return 0;
+ }
+ 
+ /**
+  * @brief Sends part of an open file to a socket. Uses sendfile(2) so the data
+  *        goes from the page cache to the socket without a user-space copy, and
+  *        falls back to a pread/send loop when sendfile is not supported.
+  * @param sock The socket file descriptor
+  * @param fd File to read from (its file offset is not used or changed)
+  * @param offset Position in the file of the first byte to send
+  * @param length Number of bytes to send
+  * @param crc If not NULL, the pread/send loop is used throughout (with
+  *        --io uring, uring_send_file()) and *crc is updated with the bytes sent
+  * @return 0 on success, -1 on error or if the file is shorter than expected
+  */
+ int send_file_fd(int sock, int fd, off_t offset, long length, uint32_t *crc) {
+     struct uring *ring = crc ? uring_get() : NULL;
+     if (ring) {
+         int rc = uring_send_file(ring, sock, fd, offset, length, crc);
+         if (rc == 0) {
+             metrics_io(sock, 0, length);
+         }
+         return rc;
+     }
+     long remaining = length;
+     while (!crc && remaining > 0) {
+         size_t chunk = remaining < (1L << 30) ? (size_t)remaining : (1UL << 30);
+         ssize_t n = sendfile(sock, fd, &offset, chunk);
+         if (n < 0 && errno == EINTR) continue;
+         if (n < 0 && remaining == length && (errno == EINVAL || errno == ENOSYS)) {
+             break;  // Not supported here; use the copy loop below
+         }
+         if (n <= 0) {
+             return -1;
+         }
+         metrics_io(sock, 0, n);
+         remaining -= n;
+     }
+     char buffer[BUF_SIZE];
+     while (remaining > 0) {
+         ssize_t r = pread(fd, buffer, (remaining < BUF_SIZE ? remaining : BUF_SIZE), offset);
+         if (r <= 0) {
+             return -1;
+         }
+         if (crc) {
+             *crc = crc32c(*crc, buffer, (size_t)r);
+         }
+         if (send_all(sock, buffer, r) != 0) {
+             return -1;
+         }
+         offset += r;
+         remaining -= r;
+     }
+     return 0;
+ }
+ 
+ // ----------------------- BUFFERED CONNECTION READER -------------------------
+ 
+ /**
+  * @brief Attaches an empty reader to a connected socket.
+  */
+ void reader_init(struct line_reader *r, int fd) {
+     r->fd = fd;
+     r->start = 0;
+     r->end = 0;
+ }
+ 
+ size_t reader_buffered(const struct line_reader *r) {
+     return r->end - r->start;
+ }
+ 
+ int reader_has_line(const struct line_reader *r) {
+     return memchr(r->buf + r->start, '\n', r->end - r->start) != NULL;
+ }
+ 
+ /**
+  * @brief Reads as much as fits into the free end of the buffer with a single
+  *        recv(). Consumed bytes at the front are reclaimed first.
+  * @return Bytes added, 0 if the peer closed the connection, -1 on error
+  *         (including EAGAIN on a non-blocking socket)
+  */
+ ssize_t reader_fill(struct line_reader *r) {
+     if (r->start == r->end) {
+         r->start = r->end = 0;
+     } else if (r->start > 0) {
+         memmove(r->buf, r->buf + r->start, r->end - r->start);
+         r->end -= r->start;
+         r->start = 0;
+     }
+     ssize_t n;
+     do {
+         n = recv(r->fd, r->buf + r->end, sizeof(r->buf) - r->end, 0);
+     } while (n < 0 && errno == EINTR);
+     if (n > 0) {
+         metrics_io(r->fd, n, 0);
+         r->end += n;
+     }
+     return n;
+ }
+ 
+ /**
+  * @brief Moves the buffered part of the current line into `line` without any
+  *        I/O. Can be called repeatedly (with the same `len`) as more data
+  *        arrives. Lines longer than `size` - 1 are truncated, the excess is
+  *        discarded.
+  * @param line Destination, always NUL-terminated
+  * @param size Size of `line`
+  * @param len In/out: bytes of the line collected so far
+  * @return 1 if the newline was reached (and consumed), 0 if more input is needed
+  */
+ int reader_scan_line(struct line_reader *r, char *line, size_t size, size_t *len) {
+     char *p = r->buf + r->start;
+     size_t avail = r->end - r->start;
+     char *nl = memchr(p, '\n', avail);
+     size_t lineBytes = nl ? (size_t)(nl - p) : avail;
+     size_t room = size - 1 - *len;
+     size_t copy = lineBytes < room ? lineBytes : room;
+     memcpy(line + *len, p, copy);
+     *len += copy;
+     line[*len] = '\0';
+     r->start += nl ? lineBytes + 1 : lineBytes;
+     return nl != NULL;
+ }
+ 
+ /**
+  * @brief Blocking read of one newline-terminated line.
+  * @return Length of the line (newline stripped), or -1 if the connection was
+  *         closed or failed before a full line arrived
+  */
+ int reader_getline(struct line_reader *r, char *line, size_t size) {
+     size_t len = 0;
+     while (!reader_scan_line(r, line, size, &len)) {
+         if (reader_fill(r) <= 0) {
+             return -1;
+         }
+     }
+     return (int)len;
+ }
+ 
+ /**
+  * @brief Reads payload bytes. Buffered bytes are returned first; once the
+  *        buffer is empty the read goes straight to the socket, so large bodies
+  *        are not copied through the buffer.
+  * @return Bytes read, 0 on EOF, -1 on error
+  */
+ ssize_t reader_read(struct line_reader *r, void *buffer, size_t len) {
+     size_t avail = r->end - r->start;
+     if (avail > 0) {
+         size_t n = avail < len ? avail : len;
+         memcpy(buffer, r->buf + r->start, n);
+         r->start += n;
+         return (ssize_t)n;
+     }
+     ssize_t n;
+     do {
+         n = recv(r->fd, buffer, len, 0);
+     } while (n < 0 && errno == EINTR);
+     if (n > 0) {
+         metrics_io(r->fd, n, 0);
+     }
+     return n;
+ }
+ 
+ // ----------------------- CLIENT SESSIONS & PROTOCOL V2 ----------------------
+ 
+ // Request opcodes and the text commands they stand for
+ static const char *const v2CommandNames[] = {
+     [V2_OP_UPLOADF]    = "uploadf",
+     [V2_OP_DOWNLF]     = "downlf",
+     [V2_OP_REMOVEF]    = "removef",
+     [V2_OP_DOWNLTAR]   = "downltar",
+     [V2_OP_DISPFNAMES] = "dispfnames",
+     [V2_OP_CACHESTATS] = "cachestats",
+     [V2_OP_UPLOADP]    = "uploadp",
+     [V2_OP_UPLOADC]    = "uploadc",
+     [V2_OP_UPLOADM]    = "uploadm",
+     [V2_OP_DOWNLM]     = "downlm",
+     [V2_OP_REMOVEM]    = "removem",
+     [V2_OP_UPLOADH]    = "uploadh",
+     [V2_OP_STATS]      = "stats",
+ };
+ 
+ void session_init(struct client_session *c, int fd) {
+     reader_init(&c->in, fd);
+     c->proto = 1;
+     c->deflate = 0;
+     c->crc = 0;
+     c->uploadCrc = 0;
+     c->reqId = 0;
+     c->peer = 0;
+     c->lastTransfer = 0;
+     c->corked = 0;
+     struct sockaddr_in addr;
+     socklen_t addrLen = sizeof(addr);
+     if (getpeername(fd, (struct sockaddr *)&addr, &addrLen) == 0 && addr.sin_family == AF_INET) {
+         c->peer = addr.sin_addr.s_addr;
+     }
+ }
+ 
+ // Returns the argument length of a complete buffered frame, or -1.
+ static int v2_frame_buffered(const struct line_reader *r) {
+     if (reader_buffered(r) < V2_HEADER_LEN) {
+         return -1;
+     }
+     const unsigned char *h = (const unsigned char *)r->buf + r->start;
+     int argLen = (h[2] << 8) | h[3];
+     return reader_buffered(r) >= (size_t)(V2_HEADER_LEN + argLen) ? argLen : -1;
+ }
+ 
+ int session_has_command(const struct client_session *c) {
+     if (c->proto == 2) {
+         return v2_frame_buffered(&c->in) >= 0;
+     }
+     return reader_has_line(&c->in);
+ }
+ 
+ /**
+  * @brief Takes the next request out of the session's buffer without doing
+  *        any I/O. Text requests may arrive in pieces, so `len` carries the
+  *        partial line between calls. A binary frame is only consumed once
+  *        its header and arguments are complete; it is turned into the
+  *        equivalent text command line so process_command serves both
+  *        protocols. An upload's payload stays in the reader for the handler.
+  * @return 1 if `cmdBuf` holds a request, 0 if more input is needed,
+  *         -1 on a malformed frame (the connection cannot be resynchronised)
+  */
+ int session_scan_command(struct client_session *c, char *cmdBuf, size_t size, size_t *len) {
+     if (c->proto != 2) {
+         return reader_scan_line(&c->in, cmdBuf, size, len);
+     }
+     // Frames never exceed the reader's buffer, so they can always be completed
+     if (reader_buffered(&c->in) >= 4) {
+         const unsigned char *h = (const unsigned char *)c->in.buf + c->in.start;
+         if (((h[2] << 8) | h[3]) >= MAX_CMD_LEN - 32) {
+             return -1;
+         }
+     }
+     int argLen = v2_frame_buffered(&c->in);
+     if (argLen < 0) {
+         return 0;
+     }
+     const unsigned char *h = (const unsigned char *)c->in.buf + c->in.start;
+     int opcode = h[0];
+     int flags = h[1];
+     uint32_t reqId;
+     uint64_t payloadLen;
+     memcpy(&reqId, h + 4, sizeof(reqId));
+     memcpy(&payloadLen, h + 8, sizeof(payloadLen));
+     c->reqId = ntohl(reqId);
+     payloadLen = be64toh(payloadLen);
+     const char *args = c->in.buf + c->in.start + V2_HEADER_LEN;
+     c->in.start += V2_HEADER_LEN + argLen;
+     c->uploadCrc = opcode == V2_OP_UPLOADF && (flags & V2_FLAG_CRC);
+ 
+     const char *name = (opcode < (int)(sizeof(v2CommandNames) / sizeof(v2CommandNames[0])))
+                        ? v2CommandNames[opcode] : NULL;
+     if (opcode == V2_OP_UPLOADF || opcode == V2_OP_UPLOADP || opcode == V2_OP_UPLOADM ||
+         opcode == V2_OP_DOWNLM || opcode == V2_OP_REMOVEM) {
+         // Single uploads need "<filename> <dest_path>" (after the part's
+         // position for uploadp), or the body could not be skipped; batch
+         // commands carry everything in the payload
+         int batch = opcode != V2_OP_UPLOADF && opcode != V2_OP_UPLOADP;
+         if (payloadLen > (uint64_t)LONG_MAX || (!batch && !memchr(args, ' ', argLen))) {
+             return -1;
+         }
+         if (opcode == V2_OP_UPLOADF && (flags & V2_FLAG_DEFLATE)) {
+             // Deflated upload: the arguments end with the inflated size
+             name = "uploadz";
+         }
+         snprintf(cmdBuf, size, "%s %.*s %llu", name, argLen, args,
+                  (unsigned long long)payloadLen);
+     } else if (payloadLen != 0) {
+         return -1;  // Only uploads and batches carry a request payload
+     } else if (name) {
+         snprintf(cmdBuf, size, "%s %.*s", name, argLen, args);
+     } else {
+         snprintf(cmdBuf, size, "opcode%d", opcode);  // Answered as an unknown command
+     }
+     *len = strlen(cmdBuf);
+     return 1;
+ }
+ 
+ /**
+  * @brief Blocking read of the next non-empty request.
+  * @return Length of the command line in `cmdBuf`, or -1 if the client closed
+  *         the connection or sent a malformed frame
+  */
+ int session_next_command(struct client_session *c, char *cmdBuf, size_t size) {
+     while (1) {
+         size_t len = 0;
+         int rc;
+         while ((rc = session_scan_command(c, cmdBuf, size, &len)) == 0) {
+             if (reader_fill(&c->in) <= 0) {
+                 return -1;
+             }
+         }
+         if (rc < 0) {
+             return -1;
+         }
+         if (len > 0) {
+             return (int)len;
+         }
+     }
+ }
+ 
+ static int v2_send_header(struct client_session *c, int opcode, int flags, const char *args,
+                           size_t argLen, uint64_t payloadLen) {
+     // Header and arguments go out in one send: as two small writes the
+     // second would wait for the client's delayed ACK (Nagle)
+     unsigned char h[V2_HEADER_LEN + MAX_CMD_LEN];
+     uint32_t reqId = htonl(c->reqId);
+     uint64_t len64 = htobe64(payloadLen);
+     h[0] = (unsigned char)opcode;
+     h[1] = (unsigned char)flags;
+     h[2] = (unsigned char)(argLen >> 8);
+     h[3] = (unsigned char)argLen;
+     memcpy(h + 4, &reqId, sizeof(reqId));
+     memcpy(h + 8, &len64, sizeof(len64));
+     unsigned char *frame = argLen <= MAX_CMD_LEN ? h : malloc(V2_HEADER_LEN + argLen);
+     if (!frame) {
+         return -1;
+     }
+     if (frame != h) {
+         memcpy(frame, h, V2_HEADER_LEN);
+     }
+     if (argLen > 0) {
+         memcpy(frame + V2_HEADER_LEN, args, argLen);
+     }
+     int rc = send_all(c->in.fd, frame, V2_HEADER_LEN + argLen);
+     if (frame != h) {
+         free(frame);
+     }
+     return rc;
+ }
+ 
+ /**
+  * @brief Corks the client socket for a data response, so the header and a
+  *        small body share a segment instead of the body waiting behind
+  *        Nagle for the client's delayed ACK. process_command() takes the
+  *        cork out when the command is over.
+  */
+ static void reply_cork(struct client_session *c) {
+     if (!c->corked) {
+         tcp_cork(c->in.fd, 1);
+         c->corked = 1;
+     }
+ }
+ 
+ /**
+  * @brief Sends a status or error message. In text mode the message goes out
+  *        as-is; in protocol 2 it becomes the arguments of an OK frame, or of an
+  *        ERROR frame if it starts with "ERROR".
+  */
+ int reply_line(struct client_session *c, const char *msg) {
+     if (strncmp(msg, "ERROR", 5) == 0) {
+         metrics_failed();
+     }
+     if (c->proto != 2) {
+         return send_all(c->in.fd, msg, strlen(msg));
+     }
+     size_t len = strlen(msg);
+     if (len > 0 && msg[len - 1] == '\n') {
+         len--;
+     }
+     int opcode = strncmp(msg, "ERROR", 5) == 0 ? V2_OP_ERROR : V2_OP_OK;
+     return v2_send_header(c, opcode, 0, msg, len, 0);
+ }
+ 
+ /**
+  * @brief Starts a data response of `size` bytes ("<size>\n" in text mode, an
+  *        OK frame with that payload length in protocol 2). The caller then
+  *        sends exactly `size` bytes on the socket, e.g. with sendfile/splice.
+  */
+ int reply_size(struct client_session *c, long size) {
+     reply_cork(c);
+     if (c->proto != 2) {
+         char sizeStr[64];
+         snprintf(sizeStr, sizeof(sizeStr), "%ld\n", size);
+         return send_all(c->in.fd, sizeStr, strlen(sizeStr));
+     }
+     return v2_send_header(c, V2_OP_OK, 0, NULL, 0, (uint64_t)size);
+ }
+ 
+ /**
+  * @brief Like reply_size(), for one page of a listing: the cursor of the
+  *        next page follows the size ("<size> <cursor>\n") or travels as the
+  *        frame's arguments. No cursor means this is the last page.
+  */
+ int reply_size_cursor(struct client_session *c, long size, const char *cursor) {
+     if (!cursor) {
+         return reply_size(c, size);
+     }
+     reply_cork(c);
+     if (c->proto != 2) {
+         // One send for the whole line, for the same reason as v2_send_header()
+         char line[64 + 2 * MAX_CMD_LEN];
+         int n = snprintf(line, sizeof(line), "%ld %s\n", size, cursor);
+         if (n < 0 || (size_t)n >= sizeof(line)) {
+             return -1;
+         }
+         return send_all(c->in.fd, line, (size_t)n);
+     }
+     return v2_send_header(c, V2_OP_OK, V2_FLAG_DATA, cursor, strlen(cursor), (uint64_t)size);
+ }
+ 
+ /**
+  * @brief Like reply_size(), for part of a file: `length` bytes follow, and
+  *        the whole file has `total` ("<length> <total>\n" in text mode).
+  */
+ int reply_range(struct client_session *c, long length, long total) {
+     char totalStr[32];
+     snprintf(totalStr, sizeof(totalStr), "%ld", total);
+     return reply_size_cursor(c, length, totalStr);
+ }
+ 
+ /**
+  * @brief Starts a chunked data response ("chunked\n" in text mode, an OK
+  *        frame with V2_FLAG_CHUNKED in protocol 2). The caller then sends the
+  *        chunks and the "0\n" terminator.
+  */
+ int reply_chunked(struct client_session *c) {
+     reply_cork(c);
+     if (c->proto != 2) {
+         return send_all(c->in.fd, "chunked\n", 8);
+     }
+     return v2_send_header(c, V2_OP_OK, V2_FLAG_CHUNKED, NULL, 0, 0);
+ }
+ 
+ /**
+  * @brief Like reply_chunked() (reply_deflated() if `deflated`), for a
+  *        downltar that asked for changes: the token to continue from next
+  *        time follows ("chunked <token>\n") or travels as the frame's arguments.
+  */
+ int reply_chunked_token(struct client_session *c, int deflated, const char *token) {
+     reply_cork(c);
+     if (c->proto != 2) {
+         if (send_all(c->in.fd, "chunked ", 8) != 0 || send_all(c->in.fd, token, strlen(token)) != 0) {
+             return -1;
+         }
+         return send_all(c->in.fd, "\n", 1);
+     }
+     int flags = V2_FLAG_CHUNKED | V2_FLAG_DATA | (deflated ? V2_FLAG_DEFLATE : 0);
+     return v2_send_header(c, V2_OP_OK, flags, token, strlen(token), 0);
+ }
+ 
+ /**
+  * @brief Like reply_chunked(), for chunks that carry a zlib stream (see
+  *        DEFLATE STREAMS). Only used for clients that asked for it.
+  * @param withCrc The stream is followed by the checksum trailer
+  */
+ int reply_deflated(struct client_session *c, int withCrc) {
+     reply_cork(c);
+     return v2_send_header(c, V2_OP_OK, V2_FLAG_CHUNKED | V2_FLAG_DEFLATE | (withCrc ? V2_FLAG_CRC : 0),
+                           NULL, 0, 0);
+ }
+ 
+ /**
+  * @brief Like reply_size(), for a whole file whose checksum trailer
+  *        (send_client_trailer()) follows the payload. Only used for clients
+  *        that asked for checksums.
+  */
+ int reply_size_crc(struct client_session *c, long size) {
+     reply_cork(c);
+     return v2_send_header(c, V2_OP_OK, V2_FLAG_CRC, NULL, 0, (uint64_t)size);
+ }
+ 
+ // ----------------------- ROUTING TABLE --------------------------------------
+ 
+ // FNV-1a, used both to find an extension's route in routeSlots (linear
+ // probing) and to spread the paths of a type over its servers.
+ static uint64_t route_hash(const char *s) {
+     uint64_t h = 1469598103934665603ULL;
+     for (; *s; s++) {
+         h = (h ^ (unsigned char)*s) * 1099511628211ULL;
+     }
+     return h;
+ }
+ 
+ /**
+  * @brief Looks up the route of a file type.
+  * @param ext Extension with its dot (".pdf")
+  * @return The route, or NULL if the type is not stored on any server
+  */
+ const struct route *route_find(const char *ext) {
+     for (size_t i = route_hash(ext) & (ROUTE_HASH_SLOTS - 1);; i = (i + 1) & (ROUTE_HASH_SLOTS - 1)) {
+         int slot = routeSlots[i];
+         if (slot == 0) {
+             return NULL;
+         }
+         if (strcmp(routeTable[slot - 1].ext, ext) == 0) {
+             return &routeTable[slot - 1];
+         }
+     }
+ }
+ 
+ static int backend_find(const char *name) {
+     for (int b = 0; b < numBackends; b++) {
+         if (strcmp(backendTable[b].name, name) == 0) {
+             return b;
+         }
+     }
+     return -1;
+ }
+ 
+ /**
+  * @brief Adds a storage server to backendTable.
+  * @return NULL, or why the server could not be added
+  */
+ static const char *backend_add(const char *name, const char *addr, int port) {
+     struct in_addr in;
+     if (numBackends == MAX_BACKENDS) {
+         return "too many backends";
+     }
+     if (strlen(name) >= sizeof(backendTable[0].name) || backend_find(name) >= 0) {
+         return "backend name too long or already used";
+     }
+     if (inet_pton(AF_INET, addr, &in) != 1 || port <= 0 || port > 65535) {
+         return "invalid address or port";
+     }
+     struct backend_info *b = &backendTable[numBackends++];
+     snprintf(b->name, sizeof(b->name), "%s", name);
+     snprintf(b->addr, sizeof(b->addr), "%s", addr);
+     b->port = port;
+     b->exts[0] = '\0';
+     return NULL;
+ }
+ 
+ /**
+  * @brief Adds a server to the route of a file type, creating the route if
+  *        this is its first server.
+  * @return NULL, or why the server could not be added
+  */
+ static const char *route_add(const char *ext, int backend, int weight) {
+     struct route *r = (struct route *)route_find(ext);
+     if (!r) {
+         if (ext[0] != '.' || strlen(ext) >= MAX_EXT_LEN || strchr(ext, '/') || strcmp(ext, ".c") == 0) {
+             return "invalid file type (.c files always stay on S1)";
+         }
+         if (numRoutes == MAX_ROUTES) {
+             return "too many file types";
+         }
+         r = &routeTable[numRoutes++];
+         memset(r, 0, sizeof(*r));
+         snprintf(r->ext, sizeof(r->ext), "%s", ext);
+         size_t i = route_hash(ext) & (ROUTE_HASH_SLOTS - 1);
+         while (routeSlots[i] != 0) {
+             i = (i + 1) & (ROUTE_HASH_SLOTS - 1);
+         }
+         routeSlots[i] = numRoutes;
+     }
+     for (int i = 0; i < r->count; i++) {
+         if (r->backend[i] == backend) {
+             return "backend listed twice";
+         }
+     }
+     r->backend[r->count] = backend;
+     r->weight[r->count] = weight;
+     r->count++;
+ 
+     char *exts = backendTable[backend].exts;
+     size_t used = strlen(exts);
+     snprintf(exts + used, sizeof(backendTable[backend].exts) - used, "%s%s", used ? " " : "", ext);
+     return NULL;
+ }
+ 
+ /**
+  * @brief Sets the wire compression level of a file type ("compress" line).
+  * @return NULL, or why the level could not be set
+  */
+ static const char *compress_set(const char *ext, int level) {
+     if (ext[0] != '.' || strlen(ext) >= MAX_EXT_LEN || strchr(ext, '/')) {
+         return "invalid file type";
+     }
+     if (level < 0 || level > 9) {
+         return "level must be between 0 and 9";
+     }
+     int i = 0;
+     while (i < numCompressRules && strcmp(compressRules[i].ext, ext) != 0) {
+         i++;
+     }
+     if (i == numCompressRules) {
+         if (numCompressRules == MAX_ROUTES + 1) {
+             return "too many file types";
+         }
+         snprintf(compressRules[i].ext, sizeof(compressRules[i].ext), "%s", ext);
+         numCompressRules++;
+     }
+     compressRules[i].level = level;
+     return NULL;
+ }
+ 
+ int compress_level(const char *ext) {
+     for (int i = 0; ext && i < numCompressRules; i++) {
+         if (strcmp(compressRules[i].ext, ext) == 0) {
+             return compressRules[i].level;
+         }
+     }
+     return 0;
+ }
+ 
+ /**
+  * @brief Fills the routing table with S2 (.pdf), S3 (.txt) and S4 (.zip).
+  */
+ void routes_default(void) {
+     backend_add("S2", S2_ADDR, S2_PORT);
+     backend_add("S3", S3_ADDR, S3_PORT);
+     backend_add("S4", S4_ADDR, S4_PORT);
+     route_add(".pdf", 0, 1);
+     route_add(".txt", 1, 1);
+     route_add(".zip", 2, 1);
+ }
+ 
+ /**
+  * @brief Fills the routing table from a routing file (format above). Blank
+  *        lines and '#' comments are ignored.
+  * @return 0, or -1 after reporting the first bad line on stderr
+  */
+ int routes_load(const char *path) {
+     FILE *fp = fopen(path, "r");
+     if (!fp) {
+         fprintf(stderr, "Error: cannot open routing file %s: %s\n", path, strerror(errno));
+         return -1;
+     }
+     char line[1024];
+     int lineNo = 0;
+     const char *error = NULL;
+     while (!error && fgets(line, sizeof(line), fp)) {
+         lineNo++;
+         char *comment = strchr(line, '#');
+         if (comment) *comment = '\0';
+         char *saveptr;
+         char *word = strtok_r(line, " \t\r\n", &saveptr);
+         if (!word) {
+             continue;
+         }
+         if (strcmp(word, "backend") == 0) {
+             char *name = strtok_r(NULL, " \t\r\n", &saveptr);
+             char *addr = strtok_r(NULL, " \t\r\n", &saveptr);
+             char *port = strtok_r(NULL, " \t\r\n", &saveptr);
+             if (!port || strtok_r(NULL, " \t\r\n", &saveptr)) {
+                 error = "expected: backend <name> <address> <port>";
+             } else {
+                 error = backend_add(name, addr, atoi(port));
+             }
+         } else if (strcmp(word, "route") == 0) {
+             char *ext = strtok_r(NULL, " \t\r\n", &saveptr);
+             char *entry = ext ? strtok_r(NULL, " \t\r\n", &saveptr) : NULL;
+             if (!entry) {
+                 error = "expected: route <type> <backend>[:<weight>]...";
+             }
+             for (; entry && !error; entry = strtok_r(NULL, " \t\r\n", &saveptr)) {
+                 int weight = 1;
+                 char *colon = strchr(entry, ':');
+                 if (colon) {
+                     *colon = '\0';
+                     weight = atoi(colon + 1);
+                 }
+                 int backend = backend_find(entry);
+                 if (backend < 0) {
+                     error = "unknown backend (declare it first)";
+                 } else if (weight <= 0 || weight > MAX_WEIGHT) {
+                     error = "weight must be between 1 and 100";
+                 } else {
+                     error = route_add(ext, backend, weight);
+                 }
+             }
+         } else if (strcmp(word, "replicas") == 0) {
+             char *count = strtok_r(NULL, " \t\r\n", &saveptr);
+             replicaCount = count ? atoi(count) : 0;
+             if (replicaCount <= 0 || replicaCount > MAX_BACKENDS || strtok_r(NULL, " \t\r\n", &saveptr)) {
+                 error = "expected: replicas <count> (1 to 16)";
+             }
+         } else if (strcmp(word, "compress") == 0) {
+             char *ext = strtok_r(NULL, " \t\r\n", &saveptr);
+             char *level = ext ? strtok_r(NULL, " \t\r\n", &saveptr) : NULL;
+             if (!level || strtok_r(NULL, " \t\r\n", &saveptr)) {
+                 error = "expected: compress <type> <level>";
+             } else {
+                 error = compress_set(ext, atoi(level));
+             }
+         } else {
+             error = "expected a backend, route, replicas or compress line";
+         }
+     }
+     fclose(fp);
+     if (error) {
+         fprintf(stderr, "Error: %s:%d: %s\n", path, lineNo, error);
+         return -1;
+     }
+     if (numRoutes == 0) {
+         fprintf(stderr, "Error: %s does not route any file type\n", path);
+         return -1;
+     }
+     return 0;
+ }
+ 
+ // Final mix of MurmurHash3: FNV-1a alone leaves names that differ only at
+ // the end (S3#1, S3#2) close together on the ring.
+ static uint64_t ring_hash(const char *s) {
+     uint64_t h = route_hash(s);
+     h ^= h >> 33;
+     h *= 0xff51afd7ed558ccdULL;
+     h ^= h >> 33;
+     h *= 0xc4ceb9fe1a85ec53ULL;
+     h ^= h >> 33;
+     return h;
+ }
+ 
+ static int ring_point_cmp(const void *a, const void *b) {
+     uint64_t x = ((const struct ring_point *)a)->hash, y = ((const struct ring_point *)b)->hash;
+     return x < y ? -1 : x > y;
+ }
+ 
+ /**
+  * @brief Builds the hash ring of every route once the table is loaded.
+  * @return 0, or -1 if out of memory
+  */
+ int routes_build_rings(void) {
+     for (int i = 0; i < numRoutes; i++) {
+         struct route *r = &routeTable[i];
+         size_t points = 0;
+         for (int k = 0; k < r->count; k++) {
+             points += (size_t)r->weight[k] * RING_VNODES;
+         }
+         r->ring = malloc(points * sizeof(*r->ring));
+         if (!r->ring) {
+             return -1;
+         }
+         r->ringSize = 0;
+         for (int k = 0; k < r->count; k++) {
+             for (int v = 0; v < r->weight[k] * RING_VNODES; v++) {
+                 char key[48];
+                 snprintf(key, sizeof(key), "%s#%d", backendTable[r->backend[k]].name, v);
+                 r->ring[r->ringSize].hash = ring_hash(key);
+                 r->ring[r->ringSize].backend = r->backend[k];
+                 r->ringSize++;
+             }
+         }
+         qsort(r->ring, r->ringSize, sizeof(*r->ring), ring_point_cmp);
+     }
+     return 0;
+ }
+ 
+ /**
+  * @brief The servers of a file's type in ring order from the file's point:
+  *        the first is where the file belongs, the others follow clockwise.
+  * @param path File path relative to ~S1
+  * @param nodes Receives at most `max` distinct backend indexes
+  * @return How many were stored; for a .c file one, BACKEND_LOCAL; 0 if the
+  *         type is not stored anywhere
+  */
+ int route_nodes(const char *path, int *nodes, int max) {
+     const char *name = strrchr(path, '/');
+     const char *ext = strrchr(name ? name + 1 : path, '.');
+     if (!ext || max <= 0) {
+         return 0;
+     }
+     if (strcmp(ext, ".c") == 0) {
+         nodes[0] = BACKEND_LOCAL;
+         return 1;
+     }
+     const struct route *r = route_find(ext);
+     if (!r) {
+         return 0;
+     }
+     uint64_t h = ring_hash(path);
+     size_t lo = 0, hi = r->ringSize;
+     while (lo < hi) {
+         size_t mid = lo + (hi - lo) / 2;
+         if (r->ring[mid].hash < h) {
+             lo = mid + 1;
+         } else {
+             hi = mid;
+         }
+     }
+     int n = 0;
+     for (size_t k = 0; k < r->ringSize && n < max && n < r->count; k++) {
+         int backend = r->ring[(lo + k) % r->ringSize].backend;
+         int seen = 0;
+         for (int i = 0; i < n; i++) {
+             seen |= nodes[i] == backend;
+         }
+         if (!seen) {
+             nodes[n++] = backend;
+         }
+     }
+     return n;
+ }
+ 
+ /**
+  * @brief Where a file is stored: the first of route_nodes().
+  * @return Index into backendTable, BACKEND_LOCAL for .c files, or -1 if the
+  *         type is not stored anywhere
+  */
+ int route_backend(const char *path) {
+     int backend;
+     return route_nodes(path, &backend, 1) == 1 ? backend : -1;
+ }
+ 
+ /**
+  * @brief Lists the supported file types (".c, .pdf, .txt, .zip") for error
+  *        messages.
+  */
+ void route_types(char *buf, size_t size) {
+     size_t used = (size_t)snprintf(buf, size, ".c");
+     for (int i = 0; i < numRoutes && used < size; i++) {
+         used += (size_t)snprintf(buf + used, size - used, ", %s", routeTable[i].ext);
+     }
+ }
+ 
+ // ----------------------- STORAGE SERVER CONNECTION POOL ---------------------
+ 
+ // Idle connections to each storage server. The pool is per thread, so each
+ // worker owns its connections and no locking is needed. The storage servers
+ // already loop over commands on one connection, so a connection can be
+ // reused for any number of commands as long as every response is consumed.
+ struct pooled_conn {
+     int fd;
+     time_t lastUsed;
+ };
+ static __thread struct pooled_conn connPool[MAX_BACKENDS][POOL_SLOTS];
+ static __thread int connPoolCount[MAX_BACKENDS];
+ 
+ /**
+  * @brief Checks that an idle pooled connection can still be used: the peer has
+  *        not closed it (e.g. the storage server restarted) and no stray bytes
+  *        are waiting on it.
+  * @return 1 if the connection is usable, 0 otherwise
+  */
+ static int pooled_conn_healthy(int sfd) {
+     char c;
+     ssize_t n = recv(sfd, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+     if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+         return 1;  // Nothing to read and not closed: idle and alive
+     }
+     return 0;      // EOF, error, or unexpected data
+ }
+ 
+ /**
+  * @brief Takes an idle connection to `backend` out of the pool, closing any
+  *        dead or stale ones found on the way.
+  * @return The socket, or -1 if no usable pooled connection is left
+  */
+ static int pool_take(int backend) {
+     time_t now = time(NULL);
+     while (connPoolCount[backend] > 0) {
+         struct pooled_conn pc = connPool[backend][--connPoolCount[backend]];
+         if (now - pc.lastUsed <= POOL_IDLE_SECS && pooled_conn_healthy(pc.fd)) {
+             return pc.fd;
+         }
+         close(pc.fd);
+     }
+     return -1;
+ }
+ 
+ /**
+  * @brief Gets a connection to a storage server. Pooled connections are
+  *        health-checked before reuse; dead or stale ones are closed and a new
+  *        connection is opened transparently.
+  * @param backend Index into backendTable
+  * @param reused Set to 1 if a pooled connection was returned (may be NULL)
+  * @return Connected socket, or -1 if the server is unreachable
+  */
+ int backend_acquire(int backend, int *reused) {
+     int sfd = pool_take(backend);
+     if (sfd >= 0) {
+         if (reused) *reused = 1;
+         return sfd;
+     }
+     if (reused) *reused = 0;
+     sfd = connect_to_server(backendTable[backend].addr, backendTable[backend].port);
+     backend_note_connect(backend, sfd >= 0);
+     if (sfd < 0) {
+         LOG_WARN("Could not connect to %s (%s:%d)", backendTable[backend].name,
+             backendTable[backend].addr, backendTable[backend].port);
+     }
+     return sfd;
+ }
+ 
+ /**
+  * @brief Puts a connection back into the pool. Only call this when the last
+  *        response was read completely; otherwise just close() the socket.
+  */
+ void backend_release(int backend, int sfd) {
+     if (connPoolCount[backend] < POOL_SLOTS) {
+         connPool[backend][connPoolCount[backend]].fd = sfd;
+         connPool[backend][connPoolCount[backend]].lastUsed = time(NULL);
+         connPoolCount[backend]++;
+     } else {
+         close(sfd);
+     }
+ }
+ 
+ /**
+  * @brief Sends a single-line command (GET/DEL/LIST/TAR) to a storage server
+  *        and reads the first line of its reply. If a pooled connection dies
+  *        before answering, the command is retried once on a fresh connection.
+  * @param backend Index into backendTable
+  * @param cmd Newline-terminated command
+  * @param reply Attached to the returned socket; the rest of the response
+  *        (e.g. the file body) must be read through it
+  * @param line Receives the response line without its newline
+  * @param lineLen Size of `line`
+  * @return The socket (still owned by the caller, who must release or close
+  *         it), -1 if the server is unreachable, -2 if it did not answer
+  */
+ int backend_command(int backend, const char *cmd, struct line_reader *reply,
+                     char *line, size_t lineLen) {
+     for (int attempt = 0; attempt < 2; attempt++) {
+         int reused = 0;
+         int sfd = backend_acquire(backend, &reused);
+         if (sfd < 0) {
+             return -1;
+         }
+         reader_init(reply, sfd);
+         if (send_all(sfd, cmd, strlen(cmd)) == 0 &&
+             reader_getline(reply, line, lineLen) >= 0) {
+             return sfd;
+         }
+         close(sfd);
+         if (!reused) {
+             break;  // A brand-new connection failed; retrying will not help
+         }
+         LOG_WARN("Pooled connection to %s went away; reconnecting", backendTable[backend].name);
+     }
+     line[0] = '\0';
+     return -2;
+ }
+ 
+ // ----------------------- REPLICA SELECTION ----------------------------------
+ 
+ // Downloads go to the replica that looks least busy. For each server S1
+ // counts the downloads being relayed from it and keeps a moving average of
+ // how long it takes to answer a GET; a server that refused a connection is
+ // tried last for BACKEND_DOWN_SECS. The counters are in a MAP_SHARED mapping
+ // so forked children and epoll workers share them. They are updated with
+ // atomic builtins and no lock: the average can lose an update under a race,
+ // which does not matter for picking a replica.
+ struct backend_load {
+     int inflight;       // Downloads being relayed
+     int latencyUs;      // Moving average of the time to the first reply line
+     time_t downUntil;   // Last connection failure + BACKEND_DOWN_SECS
+ };
+ 
+ static struct backend_load *backendLoad;
+ 
+ /**
+  * @brief Maps the load counters; done before any child or worker exists.
+  * @return 0, or -1 if the mapping failed
+  */
+ int backend_load_init(void) {
+     void *mem = mmap(NULL, sizeof(struct backend_load) * MAX_BACKENDS, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+     if (mem == MAP_FAILED) {
+         perror("mmap (backend load)");
+         return -1;
+     }
+     backendLoad = mem;
+     return 0;
+ }
+ 
+ // Records whether a new connection to `backend` could be opened.
+ void backend_note_connect(int backend, int ok) {
+     time_t until = ok ? 0 : time(NULL) + BACKEND_DOWN_SECS;
+     __atomic_store_n(&backendLoad[backend].downUntil, until, __ATOMIC_RELAXED);
+ }
+ 
+ void backend_busy(int backend, int delta) {
+     __atomic_add_fetch(&backendLoad[backend].inflight, delta, __ATOMIC_RELAXED);
+ }
+ 
+ void backend_latency(int backend, long us) {
+     int avg = __atomic_load_n(&backendLoad[backend].latencyUs, __ATOMIC_RELAXED);
+     avg = avg == 0 ? (int)us : (int)((7L * avg + us) / 8);
+     __atomic_store_n(&backendLoad[backend].latencyUs, avg, __ATOMIC_RELAXED);
+ }
+ 
+ // Returns 1 if replica `a` should be asked before `b`.
+ static int replica_before(int a, int b, time_t now) {
+     const struct backend_load *x = &backendLoad[a], *y = &backendLoad[b];
+     int downA = __atomic_load_n(&x->downUntil, __ATOMIC_RELAXED) > now;
+     int downB = __atomic_load_n(&y->downUntil, __ATOMIC_RELAXED) > now;
+     if (downA != downB) {
+         return downB;
+     }
+     int busyA = __atomic_load_n(&x->inflight, __ATOMIC_RELAXED);
+     int busyB = __atomic_load_n(&y->inflight, __ATOMIC_RELAXED);
+     if (busyA != busyB) {
+         return busyA < busyB;
+     }
+     return __atomic_load_n(&x->latencyUs, __ATOMIC_RELAXED) <
+            __atomic_load_n(&y->latencyUs, __ATOMIC_RELAXED);
+ }
+ 
+ /**
+  * @brief Like route_nodes(), but with the file's replicas (the first
+  *        replicaCount servers) sorted so the least busy healthy one comes
+  *        first. The servers after them follow in ring order, for files the
+  *        rebalancer has not moved yet.
+  */
+ int replica_order(const char *path, int *nodes, int max) {
+     int n = route_nodes(path, nodes, max);
+     int replicas = n < replicaCount ? n : replicaCount;
+     if (n <= 0 || nodes[0] == BACKEND_LOCAL) {
+         return n;
+     }
+     time_t now = time(NULL);
+     for (int i = 1; i < replicas; i++) {
+         int b = nodes[i], j = i;
+         for (; j > 0 && replica_before(b, nodes[j - 1], now); j--) {
+             nodes[j] = nodes[j - 1];
+         }
+         nodes[j] = b;
+     }
+     return n;
+ }
+ 
+ /**
+  * @brief Formats the STORE command for the first reachable replica of a
+  *        file: "STORE <path> <size>", followed by the addresses of the
+  *        replicas after it, which the storage server forwards the file to.
+  * @param zLen Length of a deflated body ("STOREZ <path> <size> <zlen>"),
+  *        or -1 if the file is sent as it is
+  * @param withCrc The body is followed by its checksum trailer ("crc32c")
+  * @param chain The replicas after the one the command is sent to
+  * @return Length of the command, or -1 if it does not fit
+  */
+ int store_header(char *buf, size_t size, const char *path, long fileSize, long zLen,
+                  int withCrc, const int *chain, int count) {
+     int n = zLen >= 0 ? snprintf(buf, size, "STOREZ %s %ld %ld", path, fileSize, zLen)
+                       : snprintf(buf, size, "STORE %s %ld", path, fileSize);
+     if (withCrc && n > 0 && (size_t)n < size) {
+         n += snprintf(buf + n, size - n, " crc32c");
+     }
+     for (int i = 0; i < count && n > 0 && (size_t)n < size; i++) {
+         n += snprintf(buf + n, size - n, " %s:%d", backendTable[chain[i]].addr, backendTable[chain[i]].port);
+     }
+     if (n > 0 && (size_t)n + 1 < size) {
+         buf[n++] = '\n';
+         buf[n] = '\0';
+         return n;
+     }
+     return -1;
+ }
+ 
+ // Number of copies a STORE acknowledgement reports ("SUCCESS [<copies>]").
+ int store_copies(const char *ack) {
+     if (strncmp(ack, "SUCCESS", 7) != 0) {
+         return 0;
+     }
+     return ack[7] == ' ' ? atoi(ack + 8) : 1;
+ }
+ 
+ // ----------------------- REBALANCER -----------------------------------------
+ 
+ // When S1 starts with a routing file, a background process makes sure every
+ // file is on the servers its ring maps it to. Each storage server is asked
+ // for all of its paths (KEYS). A file missing from one of its replicas is
+ // copied there (GET, then STORE); a copy on a server that is not one of its
+ // replicas any more is deleted once every replica has the file. The ring
+ // only reassigns the files next to the points of servers that were added or
+ // removed, so after a change only that share of the files moves. The same
+ // pass repairs replicas: with --repair-interval it is repeated, so a server
+ // that lost its files or missed uploads while down gets them back. To
+ // retire a server, drop it from every "route" line but keep its "backend"
+ // line until the rebalancer has emptied it.
+ 
+ /**
+  * @brief Copies one file from server `from` to server `to`, which passes it
+  *        on to the `count` servers in `chain` as an upload would.
+  * @return The number of copies stored, or -1 on failure
+  */
+ int backend_copy(int from, int to, const char *path, const int *chain, int count) {
+     char cmd[1600], line[128];
+     struct line_reader src, dst;
+     snprintf(cmd, sizeof(cmd), "GET %s\n", path);
+     int sfd = backend_command(from, cmd, &src, line, sizeof(line));
+     if (sfd < 0) {
+         return -1;
+     }
+     if (strncmp(line, "ERROR", 5) == 0) {
+         backend_release(from, sfd);   // Removed meanwhile
+         return -1;
+     }
+     long size = atol(line);
+     int tfd = backend_acquire(to, NULL);
+     // The cork keeps a small file and its trailer in the header's segment
+     // instead of leaving them behind Nagle until the delayed ACK
+     int n = store_header(cmd, sizeof(cmd), path, size, -1, 1, chain, count);
+     int rc = -2;
+     if (tfd >= 0) {
+         tcp_cork(tfd, 1);
+     }
+     if (tfd >= 0 && n > 0 && send(tfd, cmd, (size_t)n, MSG_MORE) == n) {
+         rc = relay_bytes(&src, tfd, size);
+     } else {
+         drain_socket(&src, size);
+     }
+     // The copy is checked against the checksum the source sends after the body
+     uint32_t crc;
+     if (rc != -1 && read_backend_trailer(&src, &crc) != 0) {
+         rc = -1;
+     }
+     if (rc == 0 && send_backend_trailer(tfd, crc) != 0) {
+         rc = -2;
+     }
+     if (rc == -1) {
+         close(sfd);
+     } else {
+         backend_release(from, sfd);
+     }
+     if (rc == 0) {
+         reader_init(&dst, tfd);
+         rc = reader_getline(&dst, line, sizeof(line)) >= 0 ? 0 : -1;
+     }
+     if (rc != 0) {
+         if (tfd >= 0) close(tfd);
+         return -1;
+     }
+     backend_release(to, tfd);
+     int copies = store_copies(line);
+     return copies > 0 ? copies : -1;
+ }
+ 
+ /**
+  * @brief Copies one file from server `from` to server `to`, unless `to` has
+  *        it already.
+  * @return 1 if it was copied, 0 if it was there, -1 on failure
+  */
+ static int rebalance_copy(int from, int to, const char *path) {
+     char cmd[1100], line[128];
+     struct line_reader dst;
+     snprintf(cmd, sizeof(cmd), "GETR 0 0 %s\n", path);
+     int tfd = backend_command(to, cmd, &dst, line, sizeof(line));
+     if (tfd < 0) {
+         return -1;
+     }
+     backend_release(to, tfd);   // A zero-length range has no body
+     if (strncmp(line, "ERROR", 5) != 0) {
+         return 0;
+     }
+     return backend_copy(from, to, path, NULL, 0) > 0 ? 1 : -1;
+ }
+ 
+ // Deletes a misplaced copy. Returns 0 on success.
+ static int rebalance_delete(int backend, const char *path) {
+     char cmd[1100], line[128];
+     struct line_reader reply;
+     snprintf(cmd, sizeof(cmd), "DEL %s\n", path);
+     int sfd = backend_command(backend, cmd, &reply, line, sizeof(line));
+     if (sfd < 0) {
+         return -1;
+     }
+     backend_release(backend, sfd);
+     return strncmp(line, "SUCCESS", 7) == 0 ? 0 : -1;
+ }
+ 
+ // One pass over the files of every storage server (the rebalancer process).
+ static void rebalance_run(void) {
+     long copied = 0, removed = 0, failed = 0;
+     for (int b = 0; b < numBackends; b++) {
+         char line[128];
+         struct line_reader reply;
+         int sfd = backend_command(b, "KEYS\n", &reply, line, sizeof(line));
+         long size = sfd >= 0 ? atol(line) : 0;
+         char *keys = size > 0 ? malloc((size_t)size + 1) : NULL;
+         if (sfd < 0 || (size > 0 && (!keys || recv_all(&reply, keys, (size_t)size) != 0))) {
+             LOG_WARN("Rebalance: could not list the files of %s", backendTable[b].name);
+             if (sfd >= 0) close(sfd);
+             free(keys);
+             continue;
+         }
+         backend_release(b, sfd);
+         if (!keys) {
+             continue;   // No files, or an error line
+         }
+         keys[size] = '\0';
+         char *saveptr;
+         for (char *path = strtok_r(keys, "\n", &saveptr); path; path = strtok_r(NULL, "\n", &saveptr)) {
+             int nodes[MAX_BACKENDS];
+             int n = route_nodes(path, nodes, replicaCount);
+             if (n <= 0 || nodes[0] == BACKEND_LOCAL || strchr(path, ' ')) {
+                 continue;
+             }
+             int placed = 0, ok = 1;
+             for (int i = 0; i < n; i++) {
+                 int rc = nodes[i] == b ? 0 : rebalance_copy(b, nodes[i], path);
+                 placed |= nodes[i] == b;
+                 copied += rc > 0;
+                 if (rc < 0) {
+                     LOG_WARN("Rebalance: could not copy %s from %s to %s", path, backendTable[b].name,
+                         backendTable[nodes[i]].name);
+                     ok = 0;
+                 }
+             }
+             if (!placed && ok) {
+                 ok = rebalance_delete(b, path) == 0;
+                 removed += ok;
+             }
+             failed += !ok;
+         }
+         free(keys);
+     }
+     LOG("Rebalance finished: %ld copies made, %ld misplaced files removed, %ld files to retry",
+         copied, removed, failed);
+ }
+ 
+ /**
+  * @brief Runs the rebalancer in a child process, so it neither delays startup
+  *        nor shares connections with the client handlers. It runs once, or
+  *        every --repair-interval seconds until S1 exits.
+  */
+ void rebalance_start(void) {
+     pid_t pid = fork();
+     if (pid == 0) {
+         prctl(PR_SET_PDEATHSIG, SIGTERM);
+         for (;;) {
+             rebalance_run();
+             if (options.repairSecs <= 0) {
+                 break;
+             }
+             sleep((unsigned)options.repairSecs);
+         }
+         _exit(EXIT_SUCCESS);
+     }
+     if (pid < 0) {
+         LOG_WARN("Could not start the rebalancer: %s", strerror(errno));
+     }
+ }
+ 
+ // ----------------------- HOT FILE CACHE -------------------------------------
+ 
+ // Optional LRU cache of small files relayed by downlf (--cache-mb), keyed by
+ // their path under ~S1. It lives in one MAP_SHARED anonymous mapping made
+ // before S1 starts serving, so forked children and epoll workers all see the
+ // same cache. The mapping holds a header, a hash table of entries, and a data
+ // arena cut into CACHE_BLOCK_SIZE blocks; a file's blocks are chained through
+ // blockNext (a free list reuses the same links). A process-shared, robust
+ // mutex guards everything: if a child dies holding it, the next locker throws
+ // the cache away and carries on.
+ //
+ // Entries are filled when a download is relayed and dropped by uploadf and
+ // removef. Each drop bumps `generation`; a fill that started before a drop is
+ // not inserted, so a download racing an upload cannot cache the old bytes.
+ struct cache_entry {
+     char key[CACHE_KEY_LEN];   // Path relative to ~S1
+     long size;
+     uint32_t crc;              // CRC-32C of the contents
+     int32_t firstBlock;        // -1 for an empty file
+     int32_t hashNext;          // Bucket chain, or free-entry list
+     int32_t lruPrev, lruNext;  // Most recently used at lruHead
+ };
+ 
+ struct cache_header {
+     pthread_mutex_t lock;
+     uint64_t generation;
+     uint64_t hits, misses, fills, evictions, invalidations;
+     long bytes;                // Sum of cached file sizes
+     int32_t numBlocks, freeBlock, freeBlocks;
+     int32_t numEntries, freeEntry, usedEntries;
+     int32_t numBuckets;        // Power of two
+     int32_t lruHead, lruTail;
+ };
+ 
+ static struct cache_header *cache;   // NULL when the cache is off
+ static int32_t *cacheBuckets;
+ static int32_t *cacheBlockNext;
+ static struct cache_entry *cacheEntries;
+ static char *cacheData;
+ static long cacheMaxFile;            // Larger files are always relayed directly
+ 
+ static uint32_t cache_hash(const char *key) {
+     uint32_t h = 2166136261u;   // FNV-1a
+     while (*key) {
+         h = (h ^ (unsigned char)*key++) * 16777619u;
+     }
+     return h;
+ }
+ 
+ // Empties the cache (also used to recover after a holder of the lock died).
+ static void cache_reset_locked(void) {
+     for (int32_t i = 0; i < cache->numBuckets; i++) {
+         cacheBuckets[i] = -1;
+     }
+     for (int32_t i = 0; i < cache->numBlocks; i++) {
+         cacheBlockNext[i] = i + 1 < cache->numBlocks ? i + 1 : -1;
+     }
+     for (int32_t i = 0; i < cache->numEntries; i++) {
+         cacheEntries[i].key[0] = '\0';
+         cacheEntries[i].hashNext = i + 1 < cache->numEntries ? i + 1 : -1;
+     }
+     cache->freeBlock = 0;
+     cache->freeBlocks = cache->numBlocks;
+     cache->freeEntry = 0;
+     cache->usedEntries = 0;
+     cache->bytes = 0;
+     cache->lruHead = cache->lruTail = -1;
+     cache->generation++;
+ }
+ 
+ static void cache_lock(void) {
+     if (pthread_mutex_lock(&cache->lock) == EOWNERDEAD) {
+         LOG_WARN("Cache lock holder died; clearing the cache");
+         cache_reset_locked();
+         pthread_mutex_consistent(&cache->lock);
+     }
+ }
+ 
+ static void cache_unlock(void) {
+     pthread_mutex_unlock(&cache->lock);
+ }
+ 
+ /**
+  * @brief Maps and initializes the cache. A budget of 0 leaves it off.
+  * @param budget Bytes of file data the cache may hold
+  * @return 0 on success (or when disabled), -1 if the mapping failed
+  */
+ int cache_init(long budget) {
+     int32_t numBlocks = (int32_t)(budget / CACHE_BLOCK_SIZE);
+     if (numBlocks <= 0) {
+         return 0;
+     }
+     int32_t numEntries = numBlocks / 2 > 16 ? numBlocks / 2 : 16;
+     int32_t numBuckets = 16;
+     while (numBuckets < numEntries) {
+         numBuckets *= 2;
+     }
+     size_t total = sizeof(struct cache_header) + sizeof(int32_t) * ((size_t)numBuckets + numBlocks) +
+                    sizeof(struct cache_entry) * (size_t)numEntries +
+                    (size_t)numBlocks * CACHE_BLOCK_SIZE;
+     void *mem = mmap(NULL, total, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+     if (mem == MAP_FAILED) {
+         perror("mmap (cache)");
+         return -1;
+     }
+     cache = mem;
+     cacheBuckets = (int32_t *)(cache + 1);
+     cacheBlockNext = cacheBuckets + numBuckets;
+     cacheEntries = (struct cache_entry *)(cacheBlockNext + numBlocks);
+     cacheData = (char *)(cacheEntries + numEntries);
+     cache->numBlocks = numBlocks;
+     cache->numEntries = numEntries;
+     cache->numBuckets = numBuckets;
+     cache_reset_locked();
+ 
+     pthread_mutexattr_t attr;
+     pthread_mutexattr_init(&attr);
+     pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+     pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+     pthread_mutex_init(&cache->lock, &attr);
+     pthread_mutexattr_destroy(&attr);
+ 
+     // One file may take at most a quarter of the cache
+     cacheMaxFile = budget / 4 < CACHE_MAX_FILE ? budget / 4 : CACHE_MAX_FILE;
+     LOG("Hot-file cache: %ld KB, files up to %ld KB", budget / 1024, cacheMaxFile / 1024);
+     return 0;
+ }
+ 
+ // Returns the entry for `key`, or -1. Caller holds the lock.
+ static int32_t cache_find(const char *key) {
+     int32_t e = cacheBuckets[cache_hash(key) & (cache->numBuckets - 1)];
+     while (e >= 0 && strcmp(cacheEntries[e].key, key) != 0) {
+         e = cacheEntries[e].hashNext;
+     }
+     return e;
+ }
+ 
+ static void cache_lru_unlink(int32_t e) {
+     struct cache_entry *ce = &cacheEntries[e];
+     if (ce->lruPrev >= 0) cacheEntries[ce->lruPrev].lruNext = ce->lruNext;
+     else cache->lruHead = ce->lruNext;
+     if (ce->lruNext >= 0) cacheEntries[ce->lruNext].lruPrev = ce->lruPrev;
+     else cache->lruTail = ce->lruPrev;
+ }
+ 
+ static void cache_lru_push(int32_t e) {
+     cacheEntries[e].lruPrev = -1;
+     cacheEntries[e].lruNext = cache->lruHead;
+     if (cache->lruHead >= 0) cacheEntries[cache->lruHead].lruPrev = e;
+     cache->lruHead = e;
+     if (cache->lruTail < 0) cache->lruTail = e;
+ }
+ 
+ // Removes an entry and frees its blocks. Caller holds the lock.
+ static void cache_remove_entry(int32_t e) {
+     struct cache_entry *ce = &cacheEntries[e];
+     int32_t *pp = &cacheBuckets[cache_hash(ce->key) & (cache->numBuckets - 1)];
+     while (*pp != e) {
+         pp = &cacheEntries[*pp].hashNext;
+     }
+     *pp = ce->hashNext;
+     cache_lru_unlink(e);
+     int32_t b = ce->firstBlock;
+     while (b >= 0) {
+         int32_t next = cacheBlockNext[b];
+         cacheBlockNext[b] = cache->freeBlock;
+         cache->freeBlock = b;
+         cache->freeBlocks++;
+         b = next;
+     }
+     cache->bytes -= ce->size;
+     ce->key[0] = '\0';
+     ce->hashNext = cache->freeEntry;
+     cache->freeEntry = e;
+     cache->usedEntries--;
+ }
+ 
+ /**
+  * @brief Returns 1 if a file of `size` bytes would be cached on download.
+  */
+ int cache_admits(long size) {
+     return cache != NULL && size <= cacheMaxFile;
+ }
+ 
+ /**
+  * @brief Current invalidation generation; pass it to cache_put() for a fill
+  *        that starts now.
+  */
+ uint64_t cache_generation(void) {
+     if (!cache) {
+         return 0;
+     }
+     cache_lock();
+     uint64_t generation = cache->generation;
+     cache_unlock();
+     return generation;
+ }
+ 
+ /**
+  * @brief Looks up a cached file and copies it out, so the caller can send it
+  *        without holding the lock.
+  * @param size Receives the file size on a hit
+  * @param crc Receives its checksum
+  * @return A malloc'd copy of the contents (caller frees), or NULL on a miss
+  */
+ char *cache_get(const char *key, long *size, uint32_t *crc) {
+     if (!cache) {
+         return NULL;
+     }
+     cache_lock();
+     int32_t e = cache_find(key);
+     char *copy = NULL;
+     if (e >= 0 && (copy = malloc(cacheEntries[e].size > 0 ? cacheEntries[e].size : 1)) != NULL) {
+         long off = 0;
+         for (int32_t b = cacheEntries[e].firstBlock; b >= 0; b = cacheBlockNext[b]) {
+             long n = cacheEntries[e].size - off < CACHE_BLOCK_SIZE ? cacheEntries[e].size - off
+                                                                    : CACHE_BLOCK_SIZE;
+             memcpy(copy + off, cacheData + (size_t)b * CACHE_BLOCK_SIZE, (size_t)n);
+             off += n;
+         }
+         *size = cacheEntries[e].size;
+         *crc = cacheEntries[e].crc;
+         cache_lru_unlink(e);
+         cache_lru_push(e);
+         cache->hits++;
+     } else {
+         cache->misses++;
+     }
+     cache_unlock();
+     return copy;
+ }
+ 
+ /**
+  * @brief Caches a file that was just relayed, evicting the least recently
+  *        used files to make room. Skipped if the file was invalidated since
+  *        `generation` was taken. `crc` has been checked against the contents.
+  */
+ void cache_put(const char *key, const char *data, long size, uint32_t crc, uint64_t generation) {
+     if (!cache_admits(size) || strlen(key) >= CACHE_KEY_LEN) {
+         return;
+     }
+     int32_t need = (int32_t)((size + CACHE_BLOCK_SIZE - 1) / CACHE_BLOCK_SIZE);
+     cache_lock();
+     if (cache->generation != generation) {
+         cache_unlock();
+         return;
+     }
+     int32_t e = cache_find(key);
+     if (e >= 0) {
+         cache_remove_entry(e);
+     }
+     while ((cache->freeBlocks < need || cache->freeEntry < 0) && cache->lruTail >= 0) {
+         cache_remove_entry(cache->lruTail);
+         cache->evictions++;
+     }
+     if (cache->freeBlocks < need || cache->freeEntry < 0) {
+         cache_unlock();
+         return;
+     }
+     e = cache->freeEntry;
+     struct cache_entry *ce = &cacheEntries[e];
+     cache->freeEntry = ce->hashNext;
+     cache->usedEntries++;
+     snprintf(ce->key, sizeof(ce->key), "%s", key);
+     ce->size = size;
+     ce->crc = crc;
+     ce->firstBlock = -1;
+     int32_t *link = &ce->firstBlock;
+     for (long off = 0; off < size; off += CACHE_BLOCK_SIZE) {
+         int32_t b = cache->freeBlock;
+         cache->freeBlock = cacheBlockNext[b];
+         cache->freeBlocks--;
+         long n = size - off < CACHE_BLOCK_SIZE ? size - off : CACHE_BLOCK_SIZE;
+         memcpy(cacheData + (size_t)b * CACHE_BLOCK_SIZE, data + off, (size_t)n);
+         *link = b;
+         link = &cacheBlockNext[b];
+     }
+     *link = -1;
+     int32_t bucket = (int32_t)(cache_hash(key) & (cache->numBuckets - 1));
+     ce->hashNext = cacheBuckets[bucket];
+     cacheBuckets[bucket] = e;
+     cache_lru_push(e);
+     cache->bytes += size;
+     cache->fills++;
+     cache_unlock();
+ }
+ 
+ /**
+  * @brief Drops `key` from the cache (after an upload or removal through S1)
+  *        and fences off fills that were already in flight.
+  */
+ void cache_invalidate(const char *key) {
+     if (!cache) {
+         return;
+     }
+     cache_lock();
+     cache->generation++;
+     int32_t e = cache_find(key);
+     if (e >= 0) {
+         cache_remove_entry(e);
+         cache->invalidations++;
+     }
+     cache_unlock();
+ }
+ 
+ /**
+  * @brief Formats the cache counters as a one-line status message.
+  */
+ void cache_stats(char *buf, size_t size) {
+     if (!cache) {
+         snprintf(buf, size, "SUCCESS: cache disabled (start S1 with --cache-mb)\n");
+         return;
+     }
+     cache_lock();
+     uint64_t lookups = cache->hits + cache->misses;
+     snprintf(buf, size, "SUCCESS: cache hits=%llu misses=%llu hit_rate=%.1f%% fills=%llu "
+              "evictions=%llu invalidations=%llu files=%d bytes=%ld capacity=%ld\n",
+              (unsigned long long)cache->hits, (unsigned long long)cache->misses,
+              lookups ? 100.0 * (double)cache->hits / (double)lookups : 0.0,
+              (unsigned long long)cache->fills, (unsigned long long)cache->evictions,
+              (unsigned long long)cache->invalidations, cache->usedEntries, cache->bytes,
+              (long)cache->numBlocks * CACHE_BLOCK_SIZE);
+     cache_unlock();
+ }
+ 
+ // ----------------------- PARALLEL STORAGE SERVER LISTING -------------------
+ 
+ // dispfnames asks every storage server for its part of a directory listing.
+ // The LIST requests go out at the same time on non-blocking sockets and the
+ // replies are collected with poll(), so a listing costs one round trip to the
+ // slowest server instead of the sum of all of them, and a server that does
+ // not answer within the deadline is left out instead of stalling the client.
+ 
+ enum { LIST_CONNECTING, LIST_SENDING, LIST_READING_SIZE, LIST_READING_BODY,
+        LIST_DONE, LIST_FAILED };
+ 
+ // One storage server's LIST request
+ struct list_fetch {
+     int sfd;
+     int reused;        // sfd came from the pool; retried once on a fresh connection
+     int state;         // LIST_*
+     size_t sent;       // Bytes of the command sent so far
+     char line[128];    // Reply's size line
+     size_t lineLen;
+     long size;         // Listing length announced by the server
+     long got;          // Listing bytes received so far
+     char *buf;         // The listing, NUL-terminated, once state is LIST_DONE
+     struct line_reader reply;
+ };
+ 
+ struct list_fanout {
+     char cmd[MAX_CMD_LEN + 64];           // "LIST <path>\n", the same for every server
+     struct timespec started;              // The deadline counts from here
+     struct list_fetch fetch[MAX_BACKENDS];
+ };
+ 
+ static void list_fetch_fail(struct list_fetch *f) {
+     if (f->sfd >= 0) {
+         close(f->sfd);  // Reply not fully read: the connection is out of sync
+         f->sfd = -1;
+     }
+     free(f->buf);
+     f->buf = NULL;
+     f->state = LIST_FAILED;
+ }
+ 
+ /**
+  * @brief Starts (or restarts) one server's request: takes a pooled connection
+  *        if `allowPooled` is set and one is available, otherwise begins a
+  *        non-blocking connect.
+  */
+ static void list_fetch_start(struct list_fetch *f, int backend, int allowPooled) {
+     f->sent = 0;
+     f->lineLen = 0;
+     f->size = 0;
+     f->got = 0;
+     f->buf = NULL;
+     f->reused = 0;
+     f->sfd = allowPooled ? pool_take(backend) : -1;
+     if (f->sfd >= 0) {
+         f->reused = 1;
+         f->state = LIST_SENDING;
+     } else {
+         int inProgress = 0;
+         f->sfd = connect_to_server_async(backendTable[backend].addr, backendTable[backend].port,
+                                          &inProgress);
+         if (f->sfd < 0) {
+             LOG_WARN("Could not connect to %s (%s:%d)", backendTable[backend].name,
+                 backendTable[backend].addr, backendTable[backend].port);
+             f->state = LIST_FAILED;
+             return;
+         }
+         f->state = inProgress ? LIST_CONNECTING : LIST_SENDING;
+     }
+     fcntl(f->sfd, F_SETFL, fcntl(f->sfd, F_GETFL) | O_NONBLOCK);
+     reader_init(&f->reply, f->sfd);
+ }
+ 
+ /**
+  * @brief Advances one request as far as the socket allows without blocking.
+  *        A finished request hands its connection back to the pool.
+  */
+ static void list_fetch_step(struct list_fanout *lf, int backend) {
+     struct list_fetch *f = &lf->fetch[backend];
+     if (f->state == LIST_CONNECTING) {
+         int err = 0;
+         socklen_t errLen = sizeof(err);
+         if (getsockopt(f->sfd, SOL_SOCKET, SO_ERROR, &err, &errLen) != 0 || err != 0) {
+             LOG_WARN("Could not connect to %s: %s", backendTable[backend].name, strerror(err));
+             list_fetch_fail(f);
+             return;
+         }
+         f->state = LIST_SENDING;
+     }
+     if (f->state == LIST_SENDING) {
+         size_t cmdLen = strlen(lf->cmd);
+         ssize_t n = send(f->sfd, lf->cmd + f->sent, cmdLen - f->sent, MSG_NOSIGNAL);
+         if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)) {
+             return;
+         }
+         if (n <= 0) {
+             // A pooled connection may have been closed by the server meanwhile
+             if (f->reused) {
+                 close(f->sfd);
+                 list_fetch_start(f, backend, 0);
+             } else {
+                 list_fetch_fail(f);
+             }
+             return;
+         }
+         f->sent += (size_t)n;
+         if (f->sent == cmdLen) {
+             f->state = LIST_READING_SIZE;
+         }
+         return;
+     }
+     while (f->state == LIST_READING_SIZE || f->state == LIST_READING_BODY) {
+         if (f->state == LIST_READING_SIZE &&
+             reader_scan_line(&f->reply, f->line, sizeof(f->line), &f->lineLen)) {
+             f->size = atol(f->line);
+             if (f->size <= 0) {
+                 f->state = LIST_DONE;   // Empty or missing directory
+                 break;
+             }
+             f->buf = malloc((size_t)f->size + 1);
+             if (!f->buf) {
+                 list_fetch_fail(f);
+                 return;
+             }
+             f->state = LIST_READING_BODY;
+         }
+         ssize_t n;
+         if (f->state == LIST_READING_BODY) {
+             n = reader_read(&f->reply, f->buf + f->got, (size_t)(f->size - f->got));
+             if (n > 0) {
+                 f->got += n;
+                 if (f->got == f->size) {
+                     f->buf[f->size] = '\0';
+                     f->state = LIST_DONE;
+                 }
+                 continue;
+             }
+         } else {
+             n = reader_fill(&f->reply);
+             if (n > 0) {
+                 continue;
+             }
+         }
+         if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+             return;
+         }
+         if (f->reused && f->state == LIST_READING_SIZE && f->lineLen == 0) {
+             // Pooled connection died before answering: retry once, as backend_command does
+             LOG_WARN("Pooled connection to %s went away; reconnecting", backendTable[backend].name);
+             close(f->sfd);
+             list_fetch_start(f, backend, 0);
+             return;
+         }
+         list_fetch_fail(f);
+         return;
+     }
+     if (f->state == LIST_DONE) {
+         fcntl(f->sfd, F_SETFL, fcntl(f->sfd, F_GETFL) & ~O_NONBLOCK);
+         backend_release(backend, f->sfd);
+         f->sfd = -1;
+     }
+ }
+ 
+ /**
+  * @brief Sends the same LIST/LISTP/FIND command to every storage server
+  *        without waiting for any reply. The caller can do other work (such as
+  *        reading the local directory) before collecting the replies with
+  *        list_fanout_finish().
+  * @param skip Servers not to ask (bit b for backend b); they end LIST_DONE
+  *             with an empty listing
+  */
+ void list_fanout_start(struct list_fanout *lf, const char *cmd, unsigned skip) {
+     snprintf(lf->cmd, sizeof(lf->cmd), "%s", cmd);
+     clock_gettime(CLOCK_MONOTONIC, &lf->started);
+     for (int b = 0; b < numBackends; b++) {
+         if (skip & (1u << b)) {
+             lf->fetch[b].sfd = -1;
+             lf->fetch[b].buf = NULL;
+             lf->fetch[b].state = LIST_DONE;
+             continue;
+         }
+         list_fetch_start(&lf->fetch[b], b, 1);
+         if (lf->fetch[b].state == LIST_SENDING) {
+             list_fetch_step(lf, b);   // The command normally fits in one send
+         }
+     }
+ }
+ 
+ /**
+  * @brief Waits for the replies of list_fanout_start(). Each server has until
+  *        `timeoutMs` after the start; one that fails or runs out of time ends
+  *        in LIST_FAILED and its connection is closed. On return every fetch is
+  *        LIST_DONE (`buf` holds its listing, NULL if empty) or LIST_FAILED.
+  */
+ void list_fanout_finish(struct list_fanout *lf, int timeoutMs) {
+     while (1) {
+         struct pollfd pfd[MAX_BACKENDS];
+         int which[MAX_BACKENDS];
+         int n = 0;
+         for (int b = 0; b < numBackends; b++) {
+             struct list_fetch *f = &lf->fetch[b];
+             if (f->state == LIST_DONE || f->state == LIST_FAILED) {
+                 continue;
+             }
+             pfd[n].fd = f->sfd;
+             pfd[n].events = (f->state == LIST_CONNECTING || f->state == LIST_SENDING) ? POLLOUT : POLLIN;
+             pfd[n].revents = 0;
+             which[n++] = b;
+         }
+         if (n == 0) {
+             return;
+         }
+         struct timespec now;
+         clock_gettime(CLOCK_MONOTONIC, &now);
+         long elapsedMs = (now.tv_sec - lf->started.tv_sec) * 1000 +
+                          (now.tv_nsec - lf->started.tv_nsec) / 1000000;
+         int rc = elapsedMs < timeoutMs ? poll(pfd, n, (int)(timeoutMs - elapsedMs)) : 0;
+         if (rc < 0 && errno == EINTR) {
+             continue;
+         }
+         if (rc <= 0) {
+             for (int i = 0; i < n; i++) {
+                 LOG_WARN("%s did not answer LIST within %d ms", backendTable[which[i]].name, timeoutMs);
+                 list_fetch_fail(&lf->fetch[which[i]]);
+             }
+             return;
+         }
+         for (int i = 0; i < n; i++) {
+             if (pfd[i].revents) {
+                 list_fetch_step(lf, which[i]);
+             }
+         }
+     }
+ }
+ 
+ /**
+  * @brief Whether the replies of `lf` still cover every file of `route`. Each
+  *        file is on `replicas` of the route's servers (see route_nodes()),
+  *        so as long as fewer of them failed, every file had a copy on a
+  *        server that answered.
+  */
+ static int list_route_covered(const struct list_fanout *lf, const struct route *route) {
+     int replicas = replicaCount < route->count ? replicaCount : route->count;
+     int failed = 0;
+     for (int i = 0; i < route->count; i++) {
+         failed += lf->fetch[route->backend[i]].state == LIST_FAILED;
+     }
+     return failed < replicas;
+ }
+ 
+ // ----------------------- DIRECTORY LISTINGS ---------------------------------
+ 
+ // A listing is kept in one growable block: names back to back, each
+ // NUL-terminated, plus the offset of every name. Adding a name is amortized
+ // O(length), so directories of any size are listed without truncation or
+ // repeated strcat. The storage servers send their names already sorted; S1
+ // sorts only its local .c names and k-way merges the four lists.
+ //
+ // Paged listings ("dispfnames -n <limit> [-c <cursor>] <dir>") return the
+ // first <limit> names greater than the cursor, which is the last name of the
+ // previous page, hex-encoded. Each source is asked for <limit> + 1 names, so
+ // the merge can tell whether another page follows; if one does, its cursor
+ // comes with the response ("<size> <cursor>\n", or the frame's arguments).
+ //
+ // Filtered listings ("dispfnames -f <filter> <dir>") are searches: the
+ // filter (see find_filter_parse) goes to every storage server in a FIND
+ // command, which answers from its index with only the matching files, and
+ // the same predicates are applied to the local .c files. Each line is then
+ // "<path>\t<size>\t<mtime>", and lines are ordered and paged by the path
+ // before the tab, which plain names compare the same way as with strcmp.
+ // Servers that store none of the ext= types asked for are not asked at all.
+ 
+ struct name_list {
+     char *data;        // Names, each NUL-terminated
+     size_t len, cap;
+     size_t *offsets;   // Start of each name in data
+     size_t count, offCap;
+ };
+ 
+ void name_list_init(struct name_list *l) {
+     memset(l, 0, sizeof(*l));
+ }
+ 
+ void name_list_free(struct name_list *l) {
+     free(l->data);
+     free(l->offsets);
+     name_list_init(l);
+ }
+ 
+ static const char *name_list_get(const struct name_list *l, size_t i) {
+     return l->data + l->offsets[i];
+ }
+ 
+ /**
+  * @brief Appends `len` bytes of `name`, growing the block geometrically.
+  * @return 0 on success, -1 if out of memory
+  */
+ int name_list_add(struct name_list *l, const char *name, size_t len) {
+     if (l->len + len + 1 > l->cap) {
+         size_t cap = l->cap ? l->cap * 2 : 4096;
+         while (cap < l->len + len + 1) cap *= 2;
+         char *p = realloc(l->data, cap);
+         if (!p) return -1;
+         l->data = p;
+         l->cap = cap;
+     }
+     if (l->count == l->offCap) {
+         size_t cap = l->offCap ? l->offCap * 2 : 256;
+         size_t *p = realloc(l->offsets, cap * sizeof(*p));
+         if (!p) return -1;
+         l->offsets = p;
+         l->offCap = cap;
+     }
+     memcpy(l->data + l->len, name, len);
+     l->data[l->len + len] = '\0';
+     l->offsets[l->count++] = l->len;
+     l->len += len + 1;
+     return 0;
+ }
+ 
+ /**
+  * @brief Orders listing lines by name: the whole line for a plain listing,
+  *        the path before the first tab for a filtered one.
+  */
+ static int listing_cmp(const char *a, const char *b) {
+     size_t al = strcspn(a, "\t"), bl = strcspn(b, "\t");
+     int c = memcmp(a, b, al < bl ? al : bl);
+     return c ? c : (al > bl) - (al < bl);
+ }
+ 
+ static int name_offset_cmp(const void *a, const void *b, void *data) {
+     return listing_cmp((const char *)data + *(const size_t *)a, (const char *)data + *(const size_t *)b);
+ }
+ 
+ void name_list_sort(struct name_list *l) {
+     if (l->count > 1) {
+         qsort_r(l->offsets, l->count, sizeof(size_t), name_offset_cmp, l->data);
+     }
+ }
+ 
+ /**
+  * @brief Adds every line of a storage server's newline-separated listing.
+  */
+ int name_list_parse(struct name_list *l, const char *buf) {
+     while (*buf) {
+         const char *nl = strchr(buf, '\n');
+         size_t len = nl ? (size_t)(nl - buf) : strlen(buf);
+         if (len > 0 && name_list_add(l, buf, len) != 0) {
+             return -1;
+         }
+         buf += nl ? len + 1 : len;
+     }
+     return 0;
+ }
+ 
+ /**
+  * @brief Lowercase hex encoding of a name, used as the paging cursor so it
+  *        can travel as one token whatever characters the name contains.
+  */
+ void hex_encode(const char *in, char *out, size_t size) {
+     static const char digits[] = "0123456789abcdef";
+     size_t o = 0;
+     for (; *in && o + 2 < size; in++) {
+         out[o++] = digits[(unsigned char)*in >> 4];
+         out[o++] = digits[(unsigned char)*in & 0xf];
+     }
+     out[o] = '\0';
+ }
+ 
+ /**
+  * @brief Decodes hex_encode() output.
+  * @return 0 on success, -1 if `in` is not valid hex or does not fit
+  */
+ int hex_decode(const char *in, char *out, size_t size) {
+     size_t n = strlen(in);
+     if (n % 2 != 0 || n / 2 >= size) {
+         return -1;
+     }
+     for (size_t i = 0; i < n; i += 2) {
+         int hi, lo;
+         if (sscanf(in + i, "%1x%1x", &hi, &lo) != 2) {
+             return -1;
+         }
+         out[i / 2] = (char)(hi << 4 | lo);
+     }
+     out[n / 2] = '\0';
+     return 0;
+ }
+ 
+ struct find_filter {
+     int recursive;
+     char glob[NAME_MAX + 1];        // "" = any name
+     char exts[FIND_MAX_EXTS][16];
+     int extCount;                   // 0 = any extension
+     long long minSize, maxSize;     // -1 = no bound
+     long long minMtime, maxMtime;
+ };
+ 
+ /**
+  * @brief Parses "<min>-<max>", either end optional (-1).
+  * @return 0 on success, -1 if malformed
+  */
+ static int find_range_parse(const char *s, long long *lo, long long *hi) {
+     const char *dash = strchr(s, '-');
+     char *end;
+     *lo = *hi = -1;
+     if (!dash) return -1;
+     if (dash > s) {
+         *lo = strtoll(s, &end, 10);
+         if (end != dash || *lo < 0) return -1;
+     }
+     if (dash[1]) {
+         *hi = strtoll(dash + 1, &end, 10);
+         if (*end || *hi < 0) return -1;
+     }
+     return 0;
+ }
+ 
+ /**
+  * @brief Parses a listing filter: "-" or comma-separated predicates, all of
+  *        which must hold. "r" searches the whole subtree, "name=<hex>" matches
+  *        the file name against a hex-encoded fnmatch() pattern, "ext=<.ext>"
+  *        (repeatable) requires one of the extensions, and "size=<min>-<max>"
+  *        and "mtime=<from>-<to>" (bytes, epoch seconds) are inclusive ranges
+  *        with either end optional. The storage servers parse it the same way.
+  * @return 0 on success, -1 if malformed
+  */
+ int find_filter_parse(const char *spec, struct find_filter *f) {
+     memset(f, 0, sizeof(*f));
+     f->minSize = f->maxSize = f->minMtime = f->maxMtime = -1;
+     char buf[MAX_CMD_LEN];
+     if (strcmp(spec, "-") == 0) return 0;
+     if (strlen(spec) >= sizeof(buf)) return -1;
+     strcpy(buf, spec);
+     char *save;
+     for (char *p = strtok_r(buf, ",", &save); p; p = strtok_r(NULL, ",", &save)) {
+         char *value = strchr(p, '=');
+         if (value) *value++ = '\0';
+         int rc = -1;
+         if (strcmp(p, "r") == 0 && !value) {
+             f->recursive = 1;
+             rc = 0;
+         } else if (!value) {
+             rc = -1;
+         } else if (strcmp(p, "name") == 0) {
+             rc = hex_decode(value, f->glob, sizeof(f->glob));
+         } else if (strcmp(p, "ext") == 0) {
+             if (f->extCount < FIND_MAX_EXTS && value[0] == '.' && strlen(value) < sizeof(f->exts[0])) {
+                 strcpy(f->exts[f->extCount++], value);
+                 rc = 0;
+             }
+         } else if (strcmp(p, "size") == 0) {
+             rc = find_range_parse(value, &f->minSize, &f->maxSize);
+         } else if (strcmp(p, "mtime") == 0) {
+             rc = find_range_parse(value, &f->minMtime, &f->maxMtime);
+         }
+         if (rc != 0) return -1;
+     }
+     return 0;
+ }
+ 
+ /**
+  * @brief Whether a file named `name` (last component only) passes every
+  *        predicate of `f`.
+  */
+ int find_filter_match(const struct find_filter *f, const char *name, long long size, long long mtime) {
+     if (f->glob[0] && fnmatch(f->glob, name, 0) != 0) return 0;
+     if (f->extCount > 0) {
+         const char *ext = strrchr(name, '.');
+         int i = 0;
+         while (i < f->extCount && !(ext && strcmp(ext, f->exts[i]) == 0)) i++;
+         if (i == f->extCount) return 0;
+     }
+     if ((f->minSize >= 0 && size < f->minSize) || (f->maxSize >= 0 && size > f->maxSize)) return 0;
+     if ((f->minMtime >= 0 && mtime < f->minMtime) || (f->maxMtime >= 0 && mtime > f->maxMtime)) return 0;
+     return 1;
+ }
+ 
+ /**
+  * @brief Whether a place storing the space-separated file types `exts` can
+  *        hold any file `f` accepts, judging by its ext= predicates alone.
+  */
+ int find_filter_wants(const struct find_filter *f, const char *exts) {
+     if (f->extCount == 0) {
+         return 1;
+     }
+     for (int i = 0; i < f->extCount; i++) {
+         size_t n = strlen(f->exts[i]);
+         for (const char *p = strstr(exts, f->exts[i]); p; p = strstr(p + 1, f->exts[i])) {
+             if ((p == exts || p[-1] == ' ') && (p[n] == '\0' || p[n] == ' ')) {
+                 return 1;
+             }
+         }
+     }
+     return 0;
+ }
+ 
+ /**
+  * @brief Collects the regular .c files of `dir` that sort after `after`
+  *        (all of them if it is empty), sorted.
+  */
+ int list_local_c(const char *dir, const char *after, struct name_list *out) {
+     DIR *dp = opendir(dir);
+     if (!dp) {
+         return 0;  // Directory might not exist locally; nothing to list
+     }
+     struct dirent *entry;
+     int rc = 0;
+     while (rc == 0 && (entry = readdir(dp)) != NULL) {
+         const char *ext = strrchr(entry->d_name, '.');
+         if (entry->d_type == DT_REG && ext && strcmp(ext, ".c") == 0 &&
+             strcmp(entry->d_name, after) > 0) {
+             rc = name_list_add(out, entry->d_name, strlen(entry->d_name));
+         }
+     }
+     closedir(dp);
+     name_list_sort(out);
+     return rc;
+ }
+ 
+ static int find_local_walk(const char *dir, const char *sub, const struct find_filter *f,
+                            const char *after, struct name_list *out, int depth) {
+     DIR *dp = opendir(dir);
+     if (!dp) {
+         return 0;  // Directory might not exist locally; nothing to list
+     }
+     struct dirent *entry;
+     int rc = 0;
+     while (rc == 0 && (entry = readdir(dp)) != NULL) {
+         struct stat st;
+         if (entry->d_name[0] == '.' ||   // ., .., and S1's own files such as .tar-cache
+             fstatat(dirfd(dp), entry->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+             continue;
+         }
+         char rel[1024];
+         int n = snprintf(rel, sizeof(rel), "%s%s%s", sub, sub[0] ? "/" : "", entry->d_name);
+         if (n <= 0 || (size_t)n >= sizeof(rel) - 48) {
+             continue;
+         }
+         const char *ext = strrchr(entry->d_name, '.');
+         if (S_ISDIR(st.st_mode) && f->recursive && depth < FIND_MAX_DEPTH) {
+             char path[2048];
+             snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+             rc = find_local_walk(path, rel, f, after, out, depth + 1);
+         } else if (S_ISREG(st.st_mode) && ext && strcmp(ext, ".c") == 0 &&
+                    find_filter_match(f, entry->d_name, (long long)st.st_size, (long long)st.st_mtime) &&
+                    strcmp(rel, after) > 0) {
+             n += snprintf(rel + n, sizeof(rel) - (size_t)n, "\t%lld\t%lld",
+                           (long long)st.st_size, (long long)st.st_mtime);
+             rc = name_list_add(out, rel, (size_t)n);
+         }
+     }
+     closedir(dp);
+     return rc;
+ }
+ 
+ /**
+  * @brief Collects the .c files of `dir` (with f->recursive, of its whole
+  *        subtree) that match `f` and sort after `after`, as sorted
+  *        "<path>\t<size>\t<mtime>" lines with the path relative to `dir`.
+  */
+ int find_local_c(const char *dir, const struct find_filter *f, const char *after, struct name_list *out) {
+     int rc = find_local_walk(dir, "", f, after, out, 0);
+     name_list_sort(out);
+     return rc;
+ }
+ 
+ // Growable output buffer for a listing response
+ struct text_buf {
+     char *data;
+     size_t len, cap;
+ };
+ 
+ static int text_append(struct text_buf *t, const char *s, size_t len) {
+     if (t->len + len > t->cap) {
+         size_t cap = t->cap ? t->cap * 2 : 4096;
+         while (cap < t->len + len) cap *= 2;
+         char *p = realloc(t->data, cap);
+         if (!p) return -1;
+         t->data = p;
+         t->cap = cap;
+     }
+     memcpy(t->data + t->len, s, len);
+     t->len += len;
+     return 0;
+ }
+ 
+ /**
+  * @brief Merges sorted lists into `out` as newline-terminated names, at most
+  *        `limit` of them (0 = no limit). Since there are only a handful of
+  *        lists, the smallest head is found with a linear scan. A name that
+  *        is in several lists is written once.
+  * @param last Receives the last name written (for the next page's cursor)
+  * @return 1 if names were left over because of `limit`, 0 if none were,
+  *         -1 if out of memory
+  */
+ int merge_listings(const struct name_list *lists, int k, size_t limit,
+                    struct text_buf *out, const char **last) {
+     size_t pos[1 + MAX_BACKENDS] = { 0 };
+     size_t emitted = 0;
+     *last = NULL;
+     while (1) {
+         int best = -1;
+         for (int i = 0; i < k; i++) {
+             if (pos[i] < lists[i].count &&
+                 (best < 0 || listing_cmp(name_list_get(&lists[i], pos[i]),
+                                          name_list_get(&lists[best], pos[best])) < 0)) {
+                 best = i;
+             }
+         }
+         if (best < 0) {
+             return 0;
+         }
+         const char *name = name_list_get(&lists[best], pos[best]);
+         if (*last && listing_cmp(name, *last) == 0) {
+             pos[best]++;   // Also on another server (e.g. a file being moved)
+             continue;
+         }
+         if (limit > 0 && emitted == limit) {
+             return 1;
+         }
+         pos[best]++;
+         if (text_append(out, name, strlen(name)) != 0 || text_append(out, "\n", 1) != 0) {
+             return -1;
+         }
+         *last = name;
+         emitted++;
+     }
+ }
+ 
+ // ----------------------- CHILD PROCESS CLIENT HANDLER -----------------------
+ 
+ /**
+  * @brief Handles all commands from a single client. Runs in the child process.
+  * @param clientSock The connected socket to the client
+  */
+ void prcclient(int clientSock) {
+     char cmdBuf[MAX_CMD_LEN];
+     struct client_session client;
+     session_init(&client, clientSock);
+ 
+     while (1) {
+         // Read the next request (overlong lines are truncated, empty ones skipped)
+         if (session_next_command(&client, cmdBuf, sizeof(cmdBuf)) < 0) {
+             // Connection closed or error
+             return;
+         }
+ 
+         process_command(&client, cmdBuf);
+     }
+ }
+ 
+ /**
+  * @brief Parses one command line from a client and runs the matching handler.
+  *        Shared by the fork model (prcclient) and the epoll workers. The
+  *        command is recorded in the metrics once it is over.
+  * @param client The client's session (socket, reader and protocol)
+  * @param cmdBuf The NUL-terminated command line (modified by tokenizing)
+  */
+ static void run_command(struct client_session *client, char *cmdBuf);
+ 
+ void process_command(struct client_session *client, char *cmdBuf) {
+     metrics_begin(client->in.fd, cmdBuf);
+     run_command(client, cmdBuf);
+     if (client->corked) {
+         tcp_cork(client->in.fd, 0);
+         client->corked = 0;
+     }
+     admit_release(client);
+     metrics_end();
+ }
+ 
+ static void run_command(struct client_session *client, char *cmdBuf) {
+     LOG_DEBUG("Received command: %s", cmdBuf);
+ 
+     // Tokenize the command
+     char *saveptr;
+     char *command = strtok_r(cmdBuf, " ", &saveptr);
+     if (!command) {
+         return;
+     }
+ 
+     // Handle each possible command
+     if (strcmp(command, "uploadf") == 0 || strcmp(command, "uploadz") == 0) {
+         // Format: uploadf <filename> <dest_path> <filesize>
+         //         uploadz <filename> <dest_path> <filesize> <deflated_size>
+         char *filename = strtok_r(NULL, " ", &saveptr);
+         char *destPath = strtok_r(NULL, " ", &saveptr);
+         char *sizeStr  = strtok_r(NULL, " ", &saveptr);
+         char *zlenStr = command[6] == 'z' ? strtok_r(NULL, " ", &saveptr) : NULL;
+         if (!filename || !destPath || !sizeStr || (command[6] == 'z' && !zlenStr)) {
+             const char *errMsg = "ERROR: Invalid uploadf command format\n";
+             reply_line(client, errMsg);
+             return;
+         }
+         long fileSize = atol(sizeStr);
+         long zLen = zlenStr ? atol(zlenStr) : -1;
+         if (fileSize < 0 || (zlenStr && zLen < 0)) {
+             const char *errMsg = "ERROR: Invalid file size\n";
+             reply_line(client, errMsg);
+             return;
+         }
+         if (admit_transfer(client, filename, zLen >= 0 ? zLen : fileSize) != 0) {
+             drain_socket(&client->in, (zLen >= 0 ? zLen : fileSize) + (client->uploadCrc ? 4 : 0));
+             client->uploadCrc = 0;
+             return;
+         }
+         // Handle the upload
+         int res = handle_upload(client, filename, destPath, fileSize, zLen);
+         if (res == 0) {
+             const char *msg = "SUCCESS: File uploaded\n";
+             reply_line(client, msg);
+         } else if (res == -2) {
+             reply_line(client, "ERROR: Checksum mismatch\n");
+         } else {
+             const char *msg = "ERROR: File upload failed\n";
+             reply_line(client, msg);
+         }
+ 
+     } else if (strcmp(command, "uploadp") == 0) {
+         // Format: uploadp <upload_id> <offset> <total_size> <filename> <dest_path> <part_size>
+         char *uploadId  = strtok_r(NULL, " ", &saveptr);
+         char *offsetStr = strtok_r(NULL, " ", &saveptr);
+         char *totalStr  = strtok_r(NULL, " ", &saveptr);
+         char *filename  = strtok_r(NULL, " ", &saveptr);
+         char *destPath  = strtok_r(NULL, " ", &saveptr);
+         char *sizeStr   = strtok_r(NULL, " ", &saveptr);
+         if (!sizeStr || atol(sizeStr) < 0) {
+             const char *errMsg = "ERROR: Invalid uploadp command format\n";
+             reply_line(client, errMsg);
+             return;
+         }
+         long offset = atol(offsetStr), total = atol(totalStr), length = atol(sizeStr);
+         if (!valid_upload_id(uploadId) || offset < 0 || total < 0 || offset > total - length) {
+             drain_socket(&client->in, length);
+             const char *errMsg = "ERROR: Invalid part\n";
+             reply_line(client, errMsg);
+             return;
+         }
+         if (admit_transfer(client, filename, length) != 0) {
+             drain_socket(&client->in, length);
+             return;
+         }
+         int res = handle_upload_part(client, uploadId, filename, destPath, total, offset, length);
+         if (res == 0) {
+             const char *msg = "SUCCESS: Part stored\n";
+             reply_line(client, msg);
+         } else {
+             const char *msg = "ERROR: Part upload failed\n";
+             reply_line(client, msg);
+         }
+ 
+     } else if (strcmp(command, "uploadc") == 0) {
+         // Format: uploadc <upload_id> <total_size> <filename> <dest_path>
+         //         uploadc -a <upload_id> <filename> <dest_path>   (abort)
+         char *uploadId = strtok_r(NULL, " ", &saveptr);
+         int discard = uploadId != NULL && strcmp(uploadId, "-a") == 0;
+         if (discard) {
+             uploadId = strtok_r(NULL, " ", &saveptr);
+         }
+         const char *totalStr = discard ? "0" : strtok_r(NULL, " ", &saveptr);
+         char *filename = totalStr ? strtok_r(NULL, " ", &saveptr) : NULL;
+         char *destPath = filename ? strtok_r(NULL, " ", &saveptr) : NULL;
+         if (!destPath || !valid_upload_id(uploadId) || atol(totalStr) < 0) {
+             const char *errMsg = "ERROR: Invalid uploadc command format\n";
+             reply_line(client, errMsg);
+             return;
+         }
+         int res = handle_upload_commit(uploadId, filename, destPath, atol(totalStr), discard);
+         if (res == 0) {
+             const char *msg = discard ? "SUCCESS: Upload aborted\n" : "SUCCESS: File uploaded\n";
+             reply_line(client, msg);
+         } else if (res == -2) {
+             const char *msg = "ERROR: Incomplete upload\n";
+             reply_line(client, msg);
+         } else {
+             const char *msg = "ERROR: File upload failed\n";
+             reply_line(client, msg);
+         }
+ 
+     } else if (strcmp(command, "uploadh") == 0) {
+         // Format: uploadh <filename> <dest_path> <filesize> <xxh64>   (no body)
+         char *filename = strtok_r(NULL, " ", &saveptr);
+         char *destPath = strtok_r(NULL, " ", &saveptr);
+         char *sizeStr  = strtok_r(NULL, " ", &saveptr);
+         char *hash     = strtok_r(NULL, " ", &saveptr);
+         if (!hash || atol(sizeStr) < 0 || strlen(hash) != 16 ||
+             strspn(hash, "0123456789abcdefABCDEF") != 16) {
+             const char *errMsg = "ERROR: Invalid uploadh command format\n";
+             reply_line(client, errMsg);
+             return;
+         }
+         int res = handle_upload_link(filename, destPath, atol(sizeStr), hash);
+         if (res == 0) {
+             const char *msg = "SUCCESS: File uploaded\n";
+             reply_line(client, msg);
+         } else if (res == -2) {
+             const char *msg = "ERROR: Unknown content\n";
+             reply_line(client, msg);
+         } else {
+             const char *msg = "ERROR: File upload failed\n";
+             reply_line(client, msg);
+         }
+
+     } else if (strcmp(command, "uploadm") == 0 || strcmp(command, "downlm") == 0 ||
+                strcmp(command, "removem") == 0) {
+         // Format: uploadm <body_size>   (entries: "<filename> <dest_path> <size>\n<bytes>")
+         //         downlm <manifest_size>, removem <manifest_size>   (one path per line)
+         char *sizeStr = strtok_r(NULL, " ", &saveptr);
+         long bodyLen = sizeStr ? atol(sizeStr) : -1;
+         if (bodyLen < 0) {
+             const char *errMsg = "ERROR: Invalid batch command format\n";
+             reply_line(client, errMsg);
+             return;
+         }
+         if (command[0] != 'r' && admit_transfer(client, NULL, command[0] == 'u' ? bodyLen : -1) != 0) {
+             drain_socket(&client->in, bodyLen);
+             return;
+         }
+         if (command[0] == 'u') {
+             handle_batch_upload(client, bodyLen);
+         } else if (command[0] == 'd') {
+             handle_batch_download(client, bodyLen);
+         } else {
+             handle_batch_remove(client, bodyLen);
+         }
+ 
+     } else if (strcmp(command, "downlf") == 0) {
+         // Format: downlf [-o <offset>] [-l <length>] <file_path>
+         char *filePath = strtok_r(NULL, "", &saveptr);
+         if (!filePath) {
+             const char *errMsg = "ERROR: Invalid downlf command format\n";
+             reply_line(client, errMsg);
+             return;
+         }
+         // A range is requested with -o and/or -l; without them the whole
+         // file is sent with the plain size reply
+         long offset = -1, length = -1;
+         while (1) {
+             while (*filePath == ' ') filePath++;
+             if (filePath[0] != '-' || (filePath[1] != 'o' && filePath[1] != 'l') || filePath[2] != ' ') {
+                 break;
+             }
+             char opt = filePath[1];
+             char *value = strtok_r(filePath + 3, " ", &saveptr);
+             char *rest = strtok_r(NULL, "", &saveptr);
+             if (!value || !rest || atol(value) < 0) {
+                 const char *errMsg = "ERROR: Invalid downlf command format\n";
+                 reply_line(client, errMsg);
+                 return;
+             }
+             if (opt == 'o') {
+                 offset = atol(value);
+             } else {
+                 length = atol(value);
+                 if (offset < 0) offset = 0;
+             }
+             filePath = rest;
+         }
+         if (strlen(filePath) == 0) {
+             const char *errMsg = "ERROR: Invalid file path\n";
+             reply_line(client, errMsg);
+             return;
+         }
+         if (admit_transfer(client, filePath, length) != 0) {
+             return;
+         }
+         // Let the handler send the file or error
+         handle_download(client, filePath, offset, length);
+ 
+     } else if (strcmp(command, "removef") == 0) {
+         // Format: removef <file_path>
+         char *filePath = strtok_r(NULL, "", &saveptr);
+         if (!filePath) {
+             const char *errMsg = "ERROR: Invalid removef command format\n";
+             reply_line(client, errMsg);
+             return;
+         }
+         // Trim leading spaces
+         while (*filePath == ' ') filePath++;
+         if (strlen(filePath) == 0) {
+             const char *errMsg = "ERROR: Invalid file path\n";
+             reply_line(client, errMsg);
+             return;
+         }
+         int res = handle_remove(filePath);
+         if (res == 0) {
+             const char *msg = "SUCCESS: File removed\n";
+             reply_line(client, msg);
+         } else {
+             const char *msg = "ERROR: File not found or cannot remove\n";
+             reply_line(client, msg);
+         }
+ 
+     } else if (strcmp(command, "downltar") == 0) {
+         // Format: downltar <filetype> [chunked [since <token>]]
+         char *fileType = strtok_r(NULL, " ", &saveptr);
+         char *mode = fileType ? strtok_r(NULL, " ", &saveptr) : NULL;
+         char *sinceKey = mode ? strtok_r(NULL, " ", &saveptr) : NULL;
+         char *since = sinceKey ? strtok_r(NULL, " ", &saveptr) : NULL;
+         int chunked = mode != NULL && strcmp(mode, "chunked") == 0;
+         if (!fileType || (sinceKey && (!chunked || strcmp(sinceKey, "since") != 0 || !since))) {
+             const char *errMsg = "ERROR: Invalid downltar command format\n";
+             reply_line(client, errMsg);
+             return;
+         }
+         if (admit_transfer(client, fileType, -1) != 0) {
+             return;
+         }
+         handle_downltar(client, fileType, chunked, since);
+ 
+     } else if (strcmp(command, "dispfnames") == 0) {
+         // Format: dispfnames [-n <page_size>] [-c <cursor>] [-f <filter>] <directory_path>
+         char *dirPath = strtok_r(NULL, "", &saveptr);
+         if (!dirPath) {
+             const char *errMsg = "ERROR: Invalid dispfnames command format\n";
+             reply_line(client, errMsg);
+             return;
+         }
+         long limit = 0;
+         const char *cursor = NULL;
+         const char *filter = NULL;
+         while (1) {
+             while (*dirPath == ' ') dirPath++;
+             if (dirPath[0] != '-' || !dirPath[1] || !strchr("ncf", dirPath[1]) || dirPath[2] != ' ') {
+                 break;
+             }
+             char opt = dirPath[1];
+             char *value = strtok_r(dirPath + 3, " ", &saveptr);
+             char *rest = strtok_r(NULL, "", &saveptr);
+             if (!value || !rest) {
+                 const char *errMsg = "ERROR: Invalid dispfnames command format\n";
+                 reply_line(client, errMsg);
+                 return;
+             }
+             if (opt == 'n') {
+                 limit = atol(value);
+             } else if (opt == 'c') {
+                 cursor = value;
+             } else {
+                 filter = value;
+             }
+             dirPath = rest;
+         }
+         if (strlen(dirPath) == 0 || limit < 0) {
+             const char *errMsg = "ERROR: Invalid directory path\n";
+             reply_line(client, errMsg);
+             return;
+         }
+         handle_dispfnames(client, dirPath, limit, cursor, filter);
+ 
+     } else if (strcmp(command, "cachestats") == 0) {
+         // Format: cachestats
+         char stats[256];
+         cache_stats(stats, sizeof(stats));
+         reply_line(client, stats);
+ 
+     } else if (strcmp(command, "stats") == 0) {
+         // Format: stats; answered with the metrics in the Prometheus text format
+         size_t len = 0;
+         char *text = metrics_text(&len);
+         if (reply_size(client, (long)len) == 0 && len > 0) {
+             send_all(client->in.fd, text, len);
+         }
+         free(text);
+ 
+     } else if (strcmp(command, "HELLO") == 0 && client->proto == 1) {
+         // Format: HELLO <version> [deflate] [crc32c]; "HELLO 2" switches to
+         // binary framing, "deflate" also turns on compression (see DEFLATE
+         // STREAMS) and "crc32c" checksum trailers (see CHECKSUMS)
+         char *version = strtok_r(NULL, " ", &saveptr);
+         int wantDeflate = 0, wantCrc = 0;
+         for (char *feature; (feature = strtok_r(NULL, " ", &saveptr)) != NULL;) {
+             wantDeflate |= strcmp(feature, "deflate") == 0;
+             wantCrc |= strcmp(feature, "crc32c") == 0;
+         }
+         if (version && atoi(version) >= 2) {
+             char hello[512] = "HELLO 2";
+             if (wantDeflate) {
+                 // Tell the client which types it should send deflated
+                 size_t used = strlen(hello);
+                 used += (size_t)snprintf(hello + used, sizeof(hello) - used, " deflate");
+                 for (int i = 0; i < numCompressRules && used < sizeof(hello); i++) {
+                     if (compressRules[i].level > 0) {
+                         used += (size_t)snprintf(hello + used, sizeof(hello) - used, " %s:%d",
+                                                  compressRules[i].ext, compressRules[i].level);
+                     }
+                 }
+                 client->deflate = 1;
+             }
+             if (wantCrc && strlen(hello) + 8 < sizeof(hello)) {
+                 strcat(hello, " crc32c");
+                 client->crc = 1;
+             }
+             if (strlen(hello) + 1 < sizeof(hello)) {
+                 strcat(hello, "\n");
+             }
+             reply_line(client, hello);
+             client->proto = 2;
+         } else {
+             reply_line(client, "HELLO 1\n");
+         }
+ 
+     } else {
+         // Unknown command
+         const char *errMsg = "ERROR: Unknown command\n";
+         reply_line(client, errMsg);
+     }
+ }
+ 
+ // ----------------------- EVENT-DRIVEN MODE (EPOLL) --------------------------
+ 
+ // Per-connection state for epoll mode. A connection is in exactly one of
+ // these states, and only the thread that owns that state touches it:
+ //
+ //   CONN_READING  armed in epoll (EPOLLONESHOT); the event loop collects the
+ //                 next request with non-blocking reads into conn->session
+ //   CONN_QUEUED   a complete line is waiting in the work queue
+ //   CONN_RUNNING  a worker is executing the command; the socket is switched
+ //                 to blocking mode (with a timeout) while the handler streams
+ //                 the file body, then the connection is re-armed
+ enum { CONN_READING, CONN_QUEUED, CONN_RUNNING };
+ 
+ struct client_conn {
+     int fd;
+     int state;
+     struct client_session session;  // Read-ahead and protocol state
+     char cmdBuf[MAX_CMD_LEN];
+     size_t cmdLen;
+     struct client_conn *next;   // Work queue link
+ };
+ 
+ // Work queue shared by the event loop (producer) and the workers (consumers).
+ // Every queued entry is a distinct connection, so its length is bounded by
+ // options.maxClients.
+ static struct client_conn *workHead = NULL;
+ static struct client_conn *workTail = NULL;
+ static pthread_mutex_t workLock = PTHREAD_MUTEX_INITIALIZER;
+ static pthread_cond_t workReady = PTHREAD_COND_INITIALIZER;
+ static int epollFd = -1;
+ 
+ static void work_push(struct client_conn *conn) {
+     pthread_mutex_lock(&workLock);
+     conn->state = CONN_QUEUED;
+     conn->next = NULL;
+     if (workTail) {
+         workTail->next = conn;
+     } else {
+         workHead = conn;
+     }
+     workTail = conn;
+     pthread_cond_signal(&workReady);
+     pthread_mutex_unlock(&workLock);
+ }
+ 
+ static struct client_conn *work_pop(void) {
+     pthread_mutex_lock(&workLock);
+     while (!workHead) {
+         pthread_cond_wait(&workReady, &workLock);
+     }
+     struct client_conn *conn = workHead;
+     workHead = conn->next;
+     if (!workHead) {
+         workTail = NULL;
+     }
+     conn->state = CONN_RUNNING;
+     pthread_mutex_unlock(&workLock);
+     return conn;
+ }
+ 
+ static int set_nonblocking(int fd, int enable) {
+     int flags = fcntl(fd, F_GETFL, 0);
+     if (flags < 0) return -1;
+     flags = enable ? (flags | O_NONBLOCK) : (flags & ~O_NONBLOCK);
+     return fcntl(fd, F_SETFL, flags);
+ }
+ 
+ // Hands a connection back to the event loop to wait for its next command.
+ static void conn_rearm(struct client_conn *conn) {
+     struct epoll_event ev;
+     ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+     ev.data.ptr = conn;
+     conn->state = CONN_READING;
+     if (epoll_ctl(epollFd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
+         LOG_WARN("epoll_ctl(MOD) failed: %s", strerror(errno));
+     }
+ }
+ 
+ /**
+  * @brief Worker thread: runs queued commands one at a time. Each worker has its
+  *        own thread-local pool of storage server connections, which is reused
+  *        across all clients the worker serves. Commands a client pipelined
+  *        behind the current one may already be buffered, where epoll
+  *        cannot see them, so they are run before the connection is re-armed.
+  */
+ static void *worker_main(void *arg) {
+     (void)arg;
+     struct timeval tv = { CLIENT_IO_TIMEOUT, 0 };
+     while (1) {
+         struct client_conn *conn = work_pop();
+         set_nonblocking(conn->fd, 0);
+         setsockopt(conn->fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+         setsockopt(conn->fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+         process_command(&conn->session, conn->cmdBuf);
+         conn->cmdLen = 0;
+         while (session_has_command(&conn->session)) {
+             if (session_scan_command(&conn->session, conn->cmdBuf, sizeof(conn->cmdBuf),
+                                      &conn->cmdLen) < 0) {
+                 shutdown(conn->fd, SHUT_RDWR);  // The event loop then closes it
+                 break;
+             }
+             if (conn->cmdLen > 0) {
+                 process_command(&conn->session, conn->cmdBuf);
+             }
+             conn->cmdLen = 0;
+         }
+         set_nonblocking(conn->fd, 1);
+         conn_rearm(conn);
+     }
+     return NULL;
+ }
+ 
+ /**
+  * @brief Reads whatever is available of the next request without blocking.
+  *        Bytes after it (e.g. the start of an upload body) stay buffered in
+  *        the session for the handler.
+  * @return 1 if a complete request is in conn->cmdBuf, 0 if more input is
+  *         needed, -1 if the client closed the connection, sent a malformed
+  *         frame, or an error occurred
+  */
+ static int conn_read_command(struct client_conn *conn) {
+     while (1) {
+         int rc = session_scan_command(&conn->session, conn->cmdBuf, sizeof(conn->cmdBuf),
+                                       &conn->cmdLen);
+         if (rc < 0) return -1;
+         if (rc > 0) {
+             if (conn->cmdLen == 0) {
+                 continue;  // Empty line: ignore it, as prcclient does
+             }
+             return 1;
+         }
+         ssize_t n = reader_fill(&conn->session.in);
+         if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+         if (n <= 0) return -1;
+     }
+ }
+ 
+ static void conn_close(struct client_conn *conn) {
+     epoll_ctl(epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+     close(conn->fd);
+     free(conn);
+ }
+ 
+ /**
+  * @brief Event-driven alternative to the fork-per-client accept loop. One
+  *        thread waits in epoll_wait for new connections and for idle clients
+  *        to send their next command; complete commands are queued for a fixed
+  *        set of worker threads. When options.maxClients clients are
+  *        connected, the listening socket is taken out of epoll so the kernel
+  *        backlog (and ultimately the clients) feel the back-pressure.
+  * @param listenSock The bound, listening socket
+  */
+ void run_event_loop(int listenSock) {
+     epollFd = epoll_create1(EPOLL_CLOEXEC);
+     if (epollFd < 0) {
+         perror("epoll_create1");
+         exit(EXIT_FAILURE);
+     }
+     set_nonblocking(listenSock, 1);
+     struct epoll_event ev;
+     ev.events = EPOLLIN;
+     ev.data.ptr = NULL;  // NULL marks the listening socket
+     if (epoll_ctl(epollFd, EPOLL_CTL_ADD, listenSock, &ev) < 0) {
+         perror("epoll_ctl");
+         exit(EXIT_FAILURE);
+     }
+ 
+     for (int i = 0; i < options.workers; i++) {
+         pthread_t tid;
+         if (pthread_create(&tid, NULL, worker_main, NULL) != 0) {
+             perror("pthread_create");
+             exit(EXIT_FAILURE);
+         }
+         pthread_detach(tid);
+     }
+     LOG("Event loop started with %d worker threads (max %d clients)",
+         options.workers, options.maxClients);
+ 
+     int connected = 0;
+     int accepting = 1;
+     struct epoll_event events[MAX_EVENTS];
+     while (1) {
+         int n = epoll_wait(epollFd, events, MAX_EVENTS, -1);
+         if (n < 0) {
+             if (errno == EINTR) continue;
+             perror("epoll_wait");
+             exit(EXIT_FAILURE);
+         }
+         for (int i = 0; i < n; i++) {
+             struct client_conn *conn = events[i].data.ptr;
+ 
+             if (conn == NULL) {
+                 // New clients: accept until the backlog is empty or we are full
+                 while (connected < options.maxClients) {
+                     struct sockaddr_in clientAddr;
+                     socklen_t clientLen = sizeof(clientAddr);
+                     int clientSock = accept4(listenSock, (struct sockaddr*)&clientAddr,
+                                              &clientLen, SOCK_NONBLOCK | SOCK_CLOEXEC);
+                     if (clientSock < 0) {
+                         if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                             perror("accept");
+                         }
+                         break;
+                     }
+                     struct client_conn *nc = calloc(1, sizeof(*nc));
+                     if (!nc) {
+                         close(clientSock);
+                         continue;
+                     }
+                     nc->fd = clientSock;
+                     nc->state = CONN_READING;
+                     session_init(&nc->session, clientSock);
+                     struct epoll_event cev;
+                     cev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+                     cev.data.ptr = nc;
+                     if (epoll_ctl(epollFd, EPOLL_CTL_ADD, clientSock, &cev) < 0) {
+                         close(clientSock);
+                         free(nc);
+                         continue;
+                     }
+                     connected++;
+                     char clientIP[INET_ADDRSTRLEN];
+                     inet_ntop(AF_INET, &clientAddr.sin_addr, clientIP, sizeof(clientIP));
+                     LOG_DEBUG("Accepted connection from %s:%d", clientIP, ntohs(clientAddr.sin_port));
+                 }
+                 if (connected >= options.maxClients && accepting) {
+                     epoll_ctl(epollFd, EPOLL_CTL_DEL, listenSock, NULL);
+                     accepting = 0;
+                     LOG_WARN("Client limit reached (%d); pausing accept", options.maxClients);
+                 }
+                 continue;
+             }
+ 
+             // An idle client has input (or hung up)
+             int rc = conn_read_command(conn);
+             if (rc == 1) {
+                 work_push(conn);
+             } else if (rc == 0) {
+                 conn_rearm(conn);  // Partial line; wait for the rest
+             } else {
+                 conn_close(conn);
+                 connected--;
+                 if (!accepting && connected < options.maxClients) {
+                     ev.events = EPOLLIN;
+                     ev.data.ptr = NULL;
+                     epoll_ctl(epollFd, EPOLL_CTL_ADD, listenSock, &ev);
+                     accepting = 1;
+                 }
+             }
+         }
+     }
+ }
+ 
+ // ----------------------- CHECKSUMS ------------------------------------------
+ 
+ // Whole files carry a CRC-32C (Castagnoli) on every hop, computed in the loop
+ // that moves the bytes. The storage servers follow a GET answer with
+ // "CRC32C <8 hex digits>\n" (from their index, so it costs no re-read) and
+ // check the same trailer after a STORE body announced with "crc32c". Clients
+ // that sent "HELLO 2 ... crc32c" get V2_FLAG_CRC downloads, whose payload or
+ // chunked stream is followed by the file's CRC-32C as 4 big-endian bytes, and
+ // may send uploads the same way. Spliced bodies are not looked at here: the
+ // two ends compare the checksum, S1 only carries it. Files that pass through
+ // S1's memory (the hot-file cache, .c uploads) are checked on the way.
+ // SSE4.2 (x86-64) or ARMv8 CRC instructions are used when the CPU has them.
+ 
+ static uint32_t crc32cTable[256];
+ static uint32_t (*crc32c_update)(uint32_t crc, const unsigned char *p, size_t len);
+ 
+ static uint32_t crc32c_table(uint32_t crc, const unsigned char *p, size_t len) {
+     while (len--) {
+         crc = crc32cTable[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+     }
+     return crc;
+ }
+ 
+ #if defined(__x86_64__)
+ __attribute__((target("sse4.2")))
+ static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+     uint64_t c = crc;
+     for (; len >= 8; p += 8, len -= 8) {
+         uint64_t v;
+         memcpy(&v, p, sizeof(v));
+         c = __builtin_ia32_crc32di(c, v);
+     }
+     crc = (uint32_t)c;
+     while (len--) {
+         crc = __builtin_ia32_crc32qi(crc, *p++);
+     }
+     return crc;
+ }
+ #define CRC32C_HW_AVAILABLE() __builtin_cpu_supports("sse4.2")
+ #elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+ static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+     for (; len >= 8; p += 8, len -= 8) {
+         uint64_t v;
+         memcpy(&v, p, sizeof(v));
+         crc = __crc32cd(crc, v);
+     }
+     while (len--) {
+         crc = __crc32cb(crc, *p++);
+     }
+     return crc;
+ }
+ #define CRC32C_HW_AVAILABLE() 1
+ #endif
+ 
+ /**
+  * @brief Fills the lookup table and picks the CRC instructions if the CPU
+  *        has them. Called once at startup, before any transfer.
+  */
+ void crc32c_init(void) {
+     for (uint32_t i = 0; i < 256; i++) {
+         uint32_t c = i;
+         for (int k = 0; k < 8; k++) {
+             c = (c >> 1) ^ (0x82F63B78u & (0u - (c & 1)));
+         }
+         crc32cTable[i] = c;
+     }
+     crc32c_update = crc32c_table;
+ #ifdef CRC32C_HW_AVAILABLE
+     if (CRC32C_HW_AVAILABLE()) {
+         crc32c_update = crc32c_hw;
+     }
+ #endif
+ }
+ 
+ // CRC-32C of `len` more bytes; start with 0 and feed the data in pieces.
+ uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+     return ~crc32c_update(~crc, buf, len);
+ }
+ 
+ /**
+  * @brief Reads a storage server's trailer line ("CRC32C <8 hex digits>").
+  * @return 0 and the checksum in *crc, or -1 if the line is missing or
+  *         malformed (the connection is then out of sync)
+  */
+ int read_backend_trailer(struct line_reader *r, uint32_t *crc) {
+     char line[64], *end;
+     if (reader_getline(r, line, sizeof(line)) != 15 || strncmp(line, "CRC32C ", 7) != 0) {
+         return -1;
+     }
+     *crc = (uint32_t)strtoul(line + 7, &end, 16);
+     return *end == '\0' ? 0 : -1;
+ }
+ 
+ // Sends the trailer that follows a STORE body announced with "crc32c".
+ int send_backend_trailer(int sock, uint32_t crc) {
+     char line[32];
+     int n = snprintf(line, sizeof(line), "CRC32C %08x\n", crc);
+     int rc = send_all(sock, line, (size_t)n);
+     tcp_cork(sock, 0);
+     return rc;
+ }
+ 
+ /**
+  * @brief Holds back partial segments while a body and its trailer are sent,
+  *        so the short trailer does not wait behind Nagle for the peer's
+  *        delayed ACK. The trailer functions take the cork out again (for a
+  *        client reply, see reply_cork()).
+  */
+ void tcp_cork(int sock, int on) {
+     setsockopt(sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+ }
+ 
+ // Sends a client's checksum trailer (4 bytes, big-endian) after a V2_FLAG_CRC payload.
+ int send_client_trailer(struct client_session *c, uint32_t crc) {
+     uint32_t be = htonl(crc);
+     int rc = send_all(c->in.fd, &be, sizeof(be));
+     tcp_cork(c->in.fd, 0);
+     c->corked = 0;
+     return rc;
+ }
+ 
+ // Reads the checksum trailer that follows a client's V2_FLAG_CRC upload.
+ int recv_client_trailer(struct client_session *c, uint32_t *crc) {
+     uint32_t be;
+     if (recv_all(&c->in, &be, sizeof(be)) != 0) {
+         return -1;
+     }
+     *crc = ntohl(be);
+     return 0;
+ }
+ 
+ // ----------------------- DURABLE WRITES -------------------------------------
+ 
+ // Local .c uploads are written to a hidden temporary file next to their
+ // target, "<dir>/.<name>.<pid>.<thread>.tmp", preallocated to the declared
+ // size, and renamed over it only once the whole file has arrived and checked
+ // out; a committed multipart upload is flushed the same way before its part
+ // file is renamed. Readers and a crash see the old file or the complete new
+ // one. --sync decides how the data reaches the disk before the rename:
+ // "group" (default) shares one syncfs() of ~/S1 between all uploads that
+ // finished writing before it started, "each" does fdatasync() per file plus
+ // fsync() of the directory, "none" only renames. The group state is in
+ // shared memory, so the forked children of fork mode batch their flushes
+ // with each other just as the worker threads of epoll mode do.
+ 
+ struct sync_header {
+     pthread_mutex_t lock;
+     pthread_cond_t done;     // Broadcast after every flush
+     pid_t running;           // Process doing the flush in progress, or 0
+     unsigned long count;     // Flushes completed so far
+     unsigned long failedAt;  // Number of the last flush that failed
+ };
+ 
+ static int syncRootFd = -1;              // ~/S1, for syncfs()
+ static struct sync_header *syncState;
+ 
+ static int sync_lock_result(int rc) {
+     if (rc == EOWNERDEAD) {
+         pthread_mutex_consistent(&syncState->lock);
+     }
+     return rc;
+ }
+ 
+ /**
+  * @brief Returns once a syncfs() of ~/S1 that started after the call has
+  *        finished. Whoever finds no flush running does it for all waiting
+  *        uploads; those that arrive during a flush wait for the next one. A
+  *        flush whose process died is taken over after a second.
+  * @return 0, or -1 if that flush failed
+  */
+ int group_sync(void) {
+     sync_lock_result(pthread_mutex_lock(&syncState->lock));
+     unsigned long need = syncState->count + (syncState->running ? 2 : 1);
+     while (syncState->count < need) {
+         if (syncState->running) {
+             struct timespec deadline;
+             clock_gettime(CLOCK_MONOTONIC, &deadline);
+             deadline.tv_sec++;
+             int rc = sync_lock_result(pthread_cond_timedwait(&syncState->done, &syncState->lock, &deadline));
+             if (rc == ETIMEDOUT && syncState->running && kill(syncState->running, 0) != 0 && errno == ESRCH) {
+                 LOG_WARN("Process %d died flushing ~/S1; taking the flush over", (int)syncState->running);
+                 syncState->running = 0;
+             }
+             continue;
+         }
+         syncState->running = getpid();
+         pthread_mutex_unlock(&syncState->lock);
+         int rc = syncfs(syncRootFd);
+         sync_lock_result(pthread_mutex_lock(&syncState->lock));
+         syncState->running = 0;
+         syncState->count++;
+         if (rc != 0) {
+             syncState->failedAt = syncState->count;
+         }
+         pthread_cond_broadcast(&syncState->done);
+     }
+     int rc = syncState->failedAt >= need ? -1 : 0;
+     pthread_mutex_unlock(&syncState->lock);
+     return rc;
+ }
+ 
+ /**
+  * @brief Creates the temporary file an upload of `fileSize` bytes to `name`
+  *        in the directory open as `dirFd` is written to, and puts its name
+  *        in `tmpName`.
+  * @return The stream, or NULL with errno set (ENOSPC if the space cannot be
+  *         reserved)
+  */
+ FILE *durable_open(int dirFd, const char *name, long fileSize, char *tmpName, size_t size) {
+     int n = snprintf(tmpName, size, ".%s.%d.%lx.tmp", name, (int)getpid(), (unsigned long)pthread_self());
+     if (n < 0 || (size_t)n >= size) {
+         errno = ENAMETOOLONG;
+         return NULL;
+     }
+     int fd = openat(dirFd, tmpName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+     if (fd < 0) {
+         return NULL;
+     }
+     // Reserving the blocks up front lets a full disk fail the upload before
+     // the body is read and keeps the file in one piece. fallocate() rather
+     // than posix_fallocate(), which writes zeros where it is not supported.
+     FILE *fp = NULL;
+     if (fileSize <= 0 || fallocate(fd, 0, 0, fileSize) == 0 || errno != ENOSPC) {
+         fp = fdopen(fd, "wb");
+     }
+     if (!fp) {
+         int saved = errno;
+         close(fd);
+         unlinkat(dirFd, tmpName, 0);
+         errno = saved;
+     }
+     return fp;
+ }
+ 
+ /**
+  * @brief Flushes the complete file `tmpName` (open as `fd`) as --sync asks
+  *        and renames it over `name`, both in the directory open as `dirFd`.
+  * @return 0 on success, -1 with the target untouched otherwise (the caller
+  *         removes `tmpName`)
+  */
+ int durable_rename(int dirFd, int fd, const char *tmpName, const char *name) {
+     int rc = 0;
+     if (options.sync == SYNC_EACH) {
+         rc = fdatasync(fd);
+     } else if (options.sync == SYNC_GROUP) {
+         rc = group_sync();
+     }
+     if (rc != 0 || renameat(dirFd, tmpName, dirFd, name) != 0) {
+         return -1;
+     }
+     // The new name is durable once its directory has been flushed too
+     rc = options.sync == SYNC_EACH ? fsync(dirFd) : options.sync == SYNC_GROUP ? group_sync() : 0;
+     if (rc != 0) {
+         LOG_WARN("Cannot flush the directory of %s: %s", name, strerror(errno));
+     }
+     return 0;
+ }
+ 
+ /**
+  * @brief Creates ~/S1 if it is missing, opens it and maps the shared state
+  *        for group commits; if either fails, every file is flushed on its
+  *        own and --sync reads "each" from then on.
+  */
+ void durable_init(void) {
+     char *homeDir = getenv("HOME");
+     if (options.sync != SYNC_GROUP) {
+         return;
+     }
+     char basePath[512];
+     snprintf(basePath, sizeof(basePath), "%s/S1", homeDir ? homeDir : "");
+     if (mkdir(basePath, 0755) == 0) {
+         LOG("Created %s", basePath);
+     }
+     syncRootFd = open(basePath, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+     if (syncRootFd < 0) {
+         LOG_WARN("Cannot open %s (%s); --sync group falls back to each", basePath, strerror(errno));
+         options.sync = SYNC_EACH;
+         return;
+     }
+     void *mem = mmap(NULL, sizeof(struct sync_header), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+     if (mem == MAP_FAILED) {
+         LOG_WARN("Cannot map the group commit state (%s); --sync group falls back to each", strerror(errno));
+         close(syncRootFd);
+         syncRootFd = -1;
+         options.sync = SYNC_EACH;
+         return;
+     }
+     syncState = mem;
+     pthread_mutexattr_t attr;
+     pthread_mutexattr_init(&attr);
+     pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+     pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+     pthread_mutex_init(&syncState->lock, &attr);
+     pthread_mutexattr_destroy(&attr);
+     pthread_condattr_t cattr;
+     pthread_condattr_init(&cattr);
+     pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+     pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+     pthread_cond_init(&syncState->done, &cattr);
+     pthread_condattr_destroy(&cattr);
+ }
+ 
+ // ----------------------- DIRECTORY CACHE ------------------------------------
+ 
+ // Directories under ~/S1 known to exist, so that an upload into an existing
+ // tree costs one open() of its directory instead of a stat()/mkdir() per path
+ // component. A directory not seen before is walked once from "/" with
+ // mkdirat() and openat(); the upload then creates, renames and flushes its
+ // file relative to the directory fd. Direct-mapped by path: a collision just
+ // replaces the older entry. The cache belongs to the process (in fork mode,
+ // to one client's child). handle_remove forgets the directories it removes;
+ // one removed behind our back is forgotten when its open() fails.
+ 
+ #define DIR_CACHE_SLOTS 1024
+ 
+ static char *dirCache[DIR_CACHE_SLOTS];
+ static pthread_mutex_t dirCacheLock = PTHREAD_MUTEX_INITIALIZER;
+ 
+ static int dir_cache_has(const char *path) {
+     pthread_mutex_lock(&dirCacheLock);
+     const char *slot = dirCache[route_hash(path) % DIR_CACHE_SLOTS];
+     int known = slot && strcmp(slot, path) == 0;
+     pthread_mutex_unlock(&dirCacheLock);
+     return known;
+ }
+ 
+ static void dir_cache_add(const char *path) {
+     char *copy = strdup(path);
+     if (!copy) {
+         return;
+     }
+     pthread_mutex_lock(&dirCacheLock);
+     char **slot = &dirCache[route_hash(path) % DIR_CACHE_SLOTS];
+     free(*slot);
+     *slot = copy;
+     pthread_mutex_unlock(&dirCacheLock);
+ }
+ 
+ /**
+  * @brief Forgets directory `path` and every directory below it.
+  */
+ void dir_cache_forget(const char *path) {
+     size_t len = strlen(path);
+     pthread_mutex_lock(&dirCacheLock);
+     for (size_t i = 0; i < DIR_CACHE_SLOTS; i++) {
+         const char *slot = dirCache[i];
+         if (slot && strncmp(slot, path, len) == 0 && (slot[len] == '\0' || slot[len] == '/')) {
+             free(dirCache[i]);
+             dirCache[i] = NULL;
+         }
+     }
+     pthread_mutex_unlock(&dirCacheLock);
+ }
+ 
+ /**
+  * @brief Opens the directory `path` (absolute), creating it and its parents
+  *        if need be.
+  * @return The directory fd, or -1 with errno set
+  */
+ int dir_open(const char *path) {
+     if (dir_cache_has(path)) {
+         int fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+         if (fd >= 0) {
+             return fd;
+         }
+         dir_cache_forget(path);
+     }
+     int fd = open("/", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+     for (const char *p = path + strspn(path, "/"); fd >= 0 && *p; p += strspn(p, "/")) {
+         char component[NAME_MAX + 1];
+         size_t len = strcspn(p, "/");
+         if (len >= sizeof(component)) {
+             close(fd);
+             errno = ENAMETOOLONG;
+             return -1;
+         }
+         memcpy(component, p, len);
+         component[len] = '\0';
+         p += len;
+         int next = -1;
+         if (mkdirat(fd, component, 0755) == 0 || errno == EEXIST) {
+             next = openat(fd, component, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+         }
+         int saved = errno;
+         close(fd);
+         errno = saved;
+         fd = next;
+     }
+     if (fd >= 0) {
+         dir_cache_add(path);
+     }
+     return fd;
+ }
+ 
+ // ----------------------- LOGGING --------------------------------------------
+ 
+ // LOG() and its siblings format the line in the calling thread and queue it;
+ // a logger thread started by log_init() writes whatever has queued to stderr
+ // in one go, so an epoll worker never waits on the terminal or a pipe. Lines
+ // above --log-level are dropped before they are formatted; per-request lines
+ // are LOG_DEBUG, which keeps them off the hot path at the default level
+ // (info). Past LOG_RATE_LIMIT lines in a second, or with the queue full,
+ // lines are dropped and counted, and the next batch says how many were lost.
+ // A forked child has no logger thread and writes its lines at once.
+ #define LOG_QUEUE_SIZE (64 * 1024)   // bytes of lines waiting for the logger
+ #define LOG_RATE_LIMIT 1000          // lines per second
+ 
+ static int logLevel = LOG_LEVEL_INFO;
+ static char logQueue[LOG_QUEUE_SIZE];
+ static size_t logUsed;
+ static unsigned long logDropped;
+ static time_t logSecond;             // second that logInSecond counts
+ static unsigned logInSecond;
+ static int logThreadStarted;
+ static pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER;
+ static pthread_mutex_t logWriteLock = PTHREAD_MUTEX_INITIALIZER;   // held while a batch is written
+ static pthread_cond_t logReady = PTHREAD_COND_INITIALIZER;
+ 
+ // Writes out the queued lines (and the count of dropped ones).
+ static void log_flush(void) {
+     static char batch[LOG_QUEUE_SIZE];
+     pthread_mutex_lock(&logWriteLock);
+     pthread_mutex_lock(&logLock);
+     size_t len = logUsed;
+     unsigned long dropped = logDropped;
+     memcpy(batch, logQueue, len);
+     logUsed = 0;
+     logDropped = 0;
+     pthread_mutex_unlock(&logLock);
+     fwrite(batch, 1, len, stderr);
+     if (dropped > 0) {
+         fprintf(stderr, "S1: %lu log lines dropped\n", dropped);
+     }
+     fflush(stderr);
+     pthread_mutex_unlock(&logWriteLock);
+ }
+ 
+ void log_write(int level, const char *fmt, ...) {
+     if (level > logLevel) {
+         return;
+     }
+     char line[1024];
+     va_list ap;
+     va_start(ap, fmt);
+     int n = vsnprintf(line, sizeof(line), fmt, ap);
+     va_end(ap);
+     if (n < 0) {
+         return;
+     }
+     if ((size_t)n >= sizeof(line)) {
+         n = (int)sizeof(line) - 1;
+         line[n - 1] = '\n';
+     }
+     time_t now = time(NULL);
+     pthread_mutex_lock(&logLock);
+     if (now != logSecond) {
+         logSecond = now;
+         logInSecond = 0;
+     }
+     if (logInSecond >= LOG_RATE_LIMIT || logUsed + (size_t)n > sizeof(logQueue)) {
+         logDropped++;
+     } else {
+         logInSecond++;
+         memcpy(logQueue + logUsed, line, (size_t)n);
+         logUsed += (size_t)n;
+         pthread_cond_signal(&logReady);
+     }
+     pthread_mutex_unlock(&logLock);
+     if (!logThreadStarted) {
+         log_flush();
+     }
+ }
+ 
+ static void *log_main(void *arg) {
+     (void)arg;
+     while (1) {
+         pthread_mutex_lock(&logLock);
+         while (logUsed == 0) {
+             pthread_cond_wait(&logReady, &logLock);
+         }
+         pthread_mutex_unlock(&logLock);
+         log_flush();
+     }
+     return NULL;
+ }
+ 
+ // fork() happens with both log locks held, so the child never inherits them
+ // taken by the logger thread. The child leaves the queued lines to the parent.
+ static void log_before_fork(void) {
+     pthread_mutex_lock(&logWriteLock);
+     pthread_mutex_lock(&logLock);
+ }
+ 
+ static void log_after_fork_parent(void) {
+     pthread_mutex_unlock(&logLock);
+     pthread_mutex_unlock(&logWriteLock);
+ }
+ 
+ static void log_after_fork_child(void) {
+     logUsed = 0;
+     logDropped = 0;
+     logThreadStarted = 0;
+     pthread_mutex_unlock(&logLock);
+     pthread_mutex_unlock(&logWriteLock);
+ }
+ 
+ /**
+  * @brief Sets --log-level and starts the logger thread; what is queued at
+  *        exit is still written.
+  */
+ void log_init(int level) {
+     logLevel = level;
+     pthread_t tid;
+     if (pthread_create(&tid, NULL, log_main, NULL) == 0) {
+         pthread_detach(tid);
+         pthread_atfork(log_before_fork, log_after_fork_parent, log_after_fork_child);
+         logThreadStarted = 1;
+         atexit(log_flush);
+     }
+ }
+ 
+ int log_level_parse(const char *name) {
+     static const char *const names[] = { "error", "warn", "info", "debug" };
+     for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+         if (strcmp(name, names[i]) == 0) {
+             return i;
+         }
+     }
+     return -1;
+ }
+ 
+ // ----------------------- METRICS --------------------------------------------
+ 
+ // Every client command is counted under its name (uploadf includes uploadz),
+ // together with its ERROR replies, the bytes it read from and wrote to the
+ // client's connection, and its latency in a log-linear histogram: 8 buckets
+ // per power of two of microseconds, so a percentile read from it is within
+ // 12.5%. Like the replica load counters, the metrics are in a MAP_SHARED
+ // mapping so forked children and epoll workers add to the same totals, with
+ // relaxed atomic adds and no lock. The stats command and --metrics-port
+ // (HTTP "GET /metrics") export them in the Prometheus text format: the
+ // histogram summed into power-of-two buckets, and p50, p90, p99 and p99.9
+ // beside it.
+ #define LAT_SUB_BITS 3
+ #define LAT_MAX_BITS 36                                     // 2^36 us, about 19 hours
+ #define LAT_BUCKETS ((LAT_MAX_BITS - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+ #define LAT_EXPORT_BITS 27                                  // histogram "le" up to 2^26 us
+ 
+ static const char *const metricOps[] = { "uploadf", "downlf", "removef", "downltar", "dispfnames",
+                                          "uploadp", "uploadc", "uploadm", "downlm", "removem",
+                                          "uploadh", "cachestats", "stats", "other" };
+ #define METRIC_OPS ((int)(sizeof(metricOps) / sizeof(metricOps[0])))
+ 
+ struct op_metrics {
+     unsigned long count;
+     unsigned long errors;
+     unsigned long bytesIn;
+     unsigned long bytesOut;
+     unsigned long latencySumUs;
+     unsigned long latency[LAT_BUCKETS];
+ };
+ 
+ static struct op_metrics *metrics;
+ 
+ // The command the calling thread is running
+ struct request_metrics {
+     int op;              // index in metricOps, -1 between commands
+     int fd;              // the client's connection; only I/O on it is counted
+     int failed;
+     long bytesIn;
+     long bytesOut;
+     struct timespec start;
+ };
+ static __thread struct request_metrics req = { .op = -1, .fd = -1 };
+ 
+ /**
+  * @brief Maps the metrics; done before any child or worker exists.
+  * @return 0, or -1 if the mapping failed
+  */
+ int metrics_init(void) {
+     void *mem = mmap(NULL, sizeof(struct op_metrics) * METRIC_OPS, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+     if (mem == MAP_FAILED) {
+         perror("mmap (metrics)");
+         return -1;
+     }
+     metrics = mem;
+     return 0;
+ }
+ 
+ static int lat_bucket(unsigned long us) {
+     if (us < (1UL << LAT_SUB_BITS)) {
+         return (int)us;
+     }
+     int msb = 63 - __builtin_clzl(us);
+     if (msb >= LAT_MAX_BITS) {
+         return LAT_BUCKETS - 1;
+     }
+     return ((msb - LAT_SUB_BITS + 1) << LAT_SUB_BITS) +
+            (int)((us >> (msb - LAT_SUB_BITS)) & ((1UL << LAT_SUB_BITS) - 1));
+ }
+ 
+ // Smallest latency above bucket `i`, in microseconds.
+ static unsigned long lat_bucket_end(int i) {
+     if (i < (1 << LAT_SUB_BITS)) {
+         return (unsigned long)i + 1;
+     }
+     int shift = (i >> LAT_SUB_BITS) - 1;
+     unsigned long sub = (unsigned long)(i & ((1 << LAT_SUB_BITS) - 1));
+     return (((1UL << LAT_SUB_BITS) + sub + 1) << shift);
+ }
+ 
+ void metrics_begin(int fd, const char *cmdLine) {
+     size_t len = strcspn(cmdLine, " ");
+     req.op = METRIC_OPS - 1;
+     for (int i = 0; i < METRIC_OPS - 1; i++) {
+         if (strlen(metricOps[i]) == len && strncmp(cmdLine, metricOps[i], len) == 0) {
+             req.op = i;
+             break;
+         }
+     }
+     if (len == 7 && strncmp(cmdLine, "uploadz", 7) == 0) {
+         req.op = 0;
+     }
+     req.fd = fd;
+     req.failed = 0;
+     req.bytesIn = 0;
+     req.bytesOut = 0;
+     clock_gettime(CLOCK_MONOTONIC, &req.start);
+ }
+ 
+ void metrics_io(int fd, long in, long out) {
+     if (fd == req.fd) {
+         req.bytesIn += in;
+         req.bytesOut += out;
+     }
+ }
+ 
+ void metrics_failed(void) {
+     req.failed = 1;
+ }
+ 
+ void metrics_end(void) {
+     if (req.op < 0 || !metrics) {
+         return;
+     }
+     struct timespec now;
+     clock_gettime(CLOCK_MONOTONIC, &now);
+     long us = (now.tv_sec - req.start.tv_sec) * 1000000L + (now.tv_nsec - req.start.tv_nsec) / 1000;
+     struct op_metrics *m = &metrics[req.op];
+     __atomic_add_fetch(&m->count, 1, __ATOMIC_RELAXED);
+     __atomic_add_fetch(&m->errors, (unsigned long)req.failed, __ATOMIC_RELAXED);
+     __atomic_add_fetch(&m->bytesIn, (unsigned long)req.bytesIn, __ATOMIC_RELAXED);
+     __atomic_add_fetch(&m->bytesOut, (unsigned long)req.bytesOut, __ATOMIC_RELAXED);
+     __atomic_add_fetch(&m->latencySumUs, (unsigned long)(us > 0 ? us : 0), __ATOMIC_RELAXED);
+     __atomic_add_fetch(&m->latency[lat_bucket(us > 0 ? (unsigned long)us : 0)], 1, __ATOMIC_RELAXED);
+     req.op = -1;
+     req.fd = -1;
+ }
+ 
+ // text_append() (see DIRECTORY LISTINGS) of a formatted line
+ static void text_add(struct text_buf *t, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+ 
+ static void text_add(struct text_buf *t, const char *fmt, ...) {
+     char line[512];
+     va_list ap;
+     va_start(ap, fmt);
+     int n = vsnprintf(line, sizeof(line), fmt, ap);
+     va_end(ap);
+     if (n > 0) {
+         text_append(t, line, n < (int)sizeof(line) ? (size_t)n : sizeof(line) - 1);
+     }
+ }
+ 
+ /**
+  * @brief Formats the metrics in the Prometheus text format. Commands that
+  *        never ran are left out.
+  * @param len Set to the length of the text
+  * @return The text in a malloc()ed buffer, or NULL if out of memory
+  */
+ char *metrics_text(size_t *len) {
+     struct text_buf t = { NULL, 0, 0 };
+     struct op_metrics m[METRIC_OPS];
+     memset(m, 0, sizeof(m));
+     for (int op = 0; metrics && op < METRIC_OPS; op++) {
+         unsigned long *from = (unsigned long *)&metrics[op], *to = (unsigned long *)&m[op];
+         for (size_t i = 0; i < sizeof(m[op]) / sizeof(unsigned long); i++) {
+             to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+         }
+     }
+     static const struct { const char *name, *help; size_t field; } counters[] = {
+         { "requests_total", "Commands served.", offsetof(struct op_metrics, count) },
+         { "request_errors_total", "Commands answered with an ERROR.",
+           offsetof(struct op_metrics, errors) },
+         { "received_bytes_total", "Bytes read from the client by commands.",
+           offsetof(struct op_metrics, bytesIn) },
+         { "sent_bytes_total", "Bytes written to the client by commands.",
+           offsetof(struct op_metrics, bytesOut) },
+     };
+     for (size_t c = 0; c < sizeof(counters) / sizeof(counters[0]); c++) {
+         text_add(&t, "# HELP w25_%s %s\n# TYPE w25_%s counter\n", counters[c].name, counters[c].help,
+                  counters[c].name);
+         for (int op = 0; op < METRIC_OPS; op++) {
+             if (m[op].count > 0) {
+                 text_add(&t, "w25_%s{op=\"%s\"} %lu\n", counters[c].name, metricOps[op],
+                          *(unsigned long *)((char *)&m[op] + counters[c].field));
+             }
+         }
+     }
+     text_add(&t, "# HELP w25_request_duration_seconds Command latency.\n"
+                  "# TYPE w25_request_duration_seconds histogram\n");
+     for (int op = 0; op < METRIC_OPS; op++) {
+         if (m[op].count == 0) {
+             continue;
+         }
+         unsigned long below = 0;
+         int i = 0;
+         for (int bit = 0; bit < LAT_EXPORT_BITS; bit++) {
+             for (; i < LAT_BUCKETS && lat_bucket_end(i) <= (1UL << bit); i++) {
+                 below += m[op].latency[i];
+             }
+             text_add(&t, "w25_request_duration_seconds_bucket{op=\"%s\",le=\"%g\"} %lu\n",
+                      metricOps[op], (double)(1UL << bit) / 1e6, below);
+         }
+         text_add(&t, "w25_request_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} %lu\n"
+                      "w25_request_duration_seconds_sum{op=\"%s\"} %g\n"
+                      "w25_request_duration_seconds_count{op=\"%s\"} %lu\n",
+                  metricOps[op], m[op].count, metricOps[op], (double)m[op].latencySumUs / 1e6,
+                  metricOps[op], m[op].count);
+     }
+     static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+     text_add(&t, "# HELP w25_request_duration_quantile_seconds Command latency percentiles.\n"
+                  "# TYPE w25_request_duration_quantile_seconds gauge\n");
+     for (int op = 0; op < METRIC_OPS; op++) {
+         unsigned long seen = 0;
+         int i = 0;
+         for (size_t q = 0; m[op].count > 0 && q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+             unsigned long rank = (unsigned long)(quantiles[q] * (double)m[op].count);
+             for (; i < LAT_BUCKETS - 1 && seen + m[op].latency[i] <= rank; i++) {
+                 seen += m[op].latency[i];
+             }
+             text_add(&t, "w25_request_duration_quantile_seconds{op=\"%s\",quantile=\"%g\"} %g\n",
+                      metricOps[op], quantiles[q], (double)lat_bucket_end(i) / 1e6);
+         }
+     }
+     *len = t.len;
+     return t.data;
+ }
+ 
+ // The Prometheus endpoint (--metrics-port): a thread of the main process
+ // answers "GET /metrics" over HTTP/1.0, one connection at a time, with
+ // metrics_text(); anything else gets a 404.
+ static void *metrics_http_main(void *arg) {
+     int listenSock = (int)(intptr_t)arg;
+     while (1) {
+         int sock = accept(listenSock, NULL, NULL);
+         if (sock < 0) {
+             continue;
+         }
+         struct timeval tv = { 2, 0 };
+         setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+         setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+         char request[1024];
+         size_t used = 0;
+         while (used < sizeof(request) - 1) {
+             ssize_t n = recv(sock, request + used, sizeof(request) - 1 - used, 0);
+             if (n <= 0) {
+                 break;
+             }
+             used += (size_t)n;
+             request[used] = '\0';
+             if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+                 break;
+             }
+         }
+         request[used] = '\0';
+         size_t len = 0;
+         char *body = strncmp(request, "GET /metrics", 12) == 0 ? metrics_text(&len) : NULL;
+         char head[160];
+         int n = body ? snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\n"
+                                 "Content-Type: text/plain; version=0.0.4\r\n"
+                                 "Content-Length: %zu\r\n\r\n", len)
+                      : snprintf(head, sizeof(head), "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+         if (send_all(sock, head, (size_t)n) == 0 && body) {
+             send_all(sock, body, len);
+         }
+         free(body);
+         close(sock);
+     }
+     return NULL;
+ }
+ 
+ /**
+  * @brief Starts the Prometheus endpoint on `port`.
+  * @return 0, or -1 if it cannot listen there
+  */
+ int metrics_http_start(int port) {
+     int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+     int one = 1;
+     struct sockaddr_in addr;
+     memset(&addr, 0, sizeof(addr));
+     addr.sin_family = AF_INET;
+     addr.sin_addr.s_addr = htonl(INADDR_ANY);
+     addr.sin_port = htons((uint16_t)port);
+     pthread_t tid;
+     if (sock < 0 || setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+         bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sock, 16) != 0 ||
+         pthread_create(&tid, NULL, metrics_http_main, (void *)(intptr_t)sock) != 0) {
+         if (sock >= 0) {
+             close(sock);
+         }
+         return -1;
+     }
+     pthread_detach(tid);
+     return 0;
+ }
+ 
+ // ----------------------- I/O ENGINE -----------------------------------------
+ 
+ // With --io uring, local .c files go through an io_uring of the serving
+ // thread instead of blocking pread()/send()/fwrite() calls: a download keeps
+ // URING_DEPTH reads of the file in flight ahead of the socket, and an upload
+ // hands each filled buffer to the kernel as a write and goes on receiving
+ // (write-behind), waiting only when every buffer is busy and once before the
+ // file is committed. The buffers are registered with the ring when it is set
+ // up (READ_FIXED/WRITE_FIXED). The ring is driven by raw system calls, without
+ // liburing. The blocking engine stays the default, and is what a thread falls
+ // back to when the kernel refuses io_uring (too old, or forbidden by seccomp).
+ 
+ #define URING_DEPTH 8                 // buffers, and so operations, per ring
+ #define URING_BUF_SIZE (64 * 1024)
+ #define URING_TIMEOUT_TAG ~0ULL       // user_data of a send's link timeout
+ 
+ enum { SLOT_FREE, SLOT_READING, SLOT_READ, SLOT_SENDING, SLOT_WRITING };
+ 
+ struct uring_slot {
+     int state;
+     off_t offset;     // file offset of the buffer's first byte
+     size_t len;       // bytes the operation is for
+     size_t done;      // bytes of them completed so far
+ };
+ 
+ struct uring {
+     int fd;
+     unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+     unsigned *cqHead, *cqTail, *cqMask;
+     struct io_uring_sqe *sqes;
+     struct io_uring_cqe *cqes;
+     unsigned toSubmit;        // queued since the last io_uring_enter()
+     unsigned inFlight;        // submitted, completion not reaped yet
+     char *bufs;               // URING_DEPTH registered buffers
+     struct uring_slot slots[URING_DEPTH];
+ };
+ 
+ static __thread struct uring *threadRing;
+ static __thread int threadRingFailed;
+ 
+ static struct uring *uring_setup(void) {
+     struct io_uring_params p;
+     memset(&p, 0, sizeof(p));
+     int fd = (int)syscall(__NR_io_uring_setup, 2 * URING_DEPTH, &p);
+     if (fd < 0) {
+         return NULL;
+     }
+     struct uring *r = calloc(1, sizeof(*r));
+     size_t sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+     size_t cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+     if (p.features & IORING_FEAT_SINGLE_MMAP) {
+         sqSize = cqSize = sqSize > cqSize ? sqSize : cqSize;
+     }
+     char *sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                     IORING_OFF_SQ_RING);
+     char *cq = (p.features & IORING_FEAT_SINGLE_MMAP) ? sq
+                : mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                       IORING_OFF_CQ_RING);
+     void *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+     void *bufs = mmap(NULL, (size_t)URING_DEPTH * URING_BUF_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+     struct iovec iov[URING_DEPTH];
+     for (int i = 0; bufs != MAP_FAILED && i < URING_DEPTH; i++) {
+         iov[i].iov_base = (char *)bufs + (size_t)i * URING_BUF_SIZE;
+         iov[i].iov_len = URING_BUF_SIZE;
+     }
+     if (!r || sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED || bufs == MAP_FAILED ||
+         syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov, URING_DEPTH) != 0) {
+         // The mappings die with the ring fd; a thread only gets here once
+         close(fd);
+         free(r);
+         return NULL;
+     }
+     r->fd = fd;
+     r->sqHead = (unsigned *)(sq + p.sq_off.head);
+     r->sqTail = (unsigned *)(sq + p.sq_off.tail);
+     r->sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+     r->sqArray = (unsigned *)(sq + p.sq_off.array);
+     r->cqHead = (unsigned *)(cq + p.cq_off.head);
+     r->cqTail = (unsigned *)(cq + p.cq_off.tail);
+     r->cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+     r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+     r->sqes = sqes;
+     r->bufs = bufs;
+     return r;
+ }
+ 
+ /**
+  * @brief The calling thread's ring, set up on first use.
+  * @return The ring, or NULL with the blocking engine
+  */
+ struct uring *uring_get(void) {
+     if (options.io != IO_URING || threadRingFailed) {
+         return NULL;
+     }
+     if (!threadRing) {
+         threadRing = uring_setup();
+         if (!threadRing) {
+             LOG_WARN("io_uring unavailable (%s); this thread uses blocking I/O", strerror(errno));
+             threadRingFailed = 1;
+         }
+     }
+     return threadRing;
+ }
+ 
+ // Queues `op` on buffer `tag` (URING_TIMEOUT_TAG: no buffer); submitted by the next uring_wait().
+ static struct io_uring_sqe *uring_sqe(struct uring *r, int op, int fd, unsigned long long tag) {
+     unsigned tail = *r->sqTail;
+     unsigned idx = tail & *r->sqMask;
+     struct io_uring_sqe *sqe = &r->sqes[idx];
+     memset(sqe, 0, sizeof(*sqe));
+     sqe->opcode = (unsigned char)op;
+     sqe->fd = fd;
+     sqe->user_data = tag;
+     if (tag != URING_TIMEOUT_TAG) {
+         sqe->addr = (unsigned long)(r->bufs + tag * URING_BUF_SIZE + r->slots[tag].done);
+         sqe->len = (unsigned)(r->slots[tag].len - r->slots[tag].done);
+         sqe->off = (unsigned long long)(r->slots[tag].offset + r->slots[tag].done);
+         sqe->buf_index = (unsigned short)tag;
+     }
+     r->sqArray[idx] = idx;
+     __atomic_store_n(r->sqTail, tail + 1, __ATOMIC_RELEASE);
+     r->toSubmit++;
+     r->inFlight++;
+     return sqe;
+ }
+ 
+ // Submits what is queued and takes the next completion. Returns 0, or -1 if the ring failed.
+ static int uring_wait(struct uring *r, struct io_uring_cqe *cqe) {
+     for (;;) {
+         unsigned head = *r->cqHead;
+         if (head != __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE)) {
+             *cqe = r->cqes[head & *r->cqMask];
+             __atomic_store_n(r->cqHead, head + 1, __ATOMIC_RELEASE);
+             r->inFlight--;
+             return 0;
+         }
+         int n = (int)syscall(__NR_io_uring_enter, r->fd, r->toSubmit, 1, IORING_ENTER_GETEVENTS,
+                              NULL, 0);
+         if (n < 0 && errno != EINTR) {
+             threadRingFailed = 1;   // later transfers of this thread use blocking I/O
+             return -1;
+         }
+         if (n > 0) {
+             r->toSubmit -= (unsigned)n;
+         }
+     }
+ }
+ 
+ // Waits for every operation still in flight (after an error, cancelling them first).
+ static void uring_drain(struct uring *r, int cancel) {
+     if (cancel && r->inFlight > 0) {
+         struct io_uring_sqe *sqe = uring_sqe(r, IORING_OP_ASYNC_CANCEL, -1, URING_TIMEOUT_TAG);
+         sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+     }
+     struct io_uring_cqe cqe;
+     while (r->inFlight > 0 && uring_wait(r, &cqe) == 0) {
+     }
+     for (int i = 0; i < URING_DEPTH; i++) {
+         r->slots[i].state = SLOT_FREE;
+     }
+ }
+ 
+ static void uring_read(struct uring *r, int slot, int fd) {
+     r->slots[slot].state = SLOT_READING;
+     uring_sqe(r, IORING_OP_READ_FIXED, fd, (unsigned long long)slot);
+ }
+ 
+ // A send that may wait on the peer gets the socket's SO_SNDTIMEO as a link timeout.
+ static void uring_send(struct uring *r, int slot, int sock, const struct __kernel_timespec *timeout) {
+     r->slots[slot].state = SLOT_SENDING;
+     struct io_uring_sqe *sqe = uring_sqe(r, IORING_OP_SEND, sock, (unsigned long long)slot);
+     sqe->off = 0;
+     sqe->buf_index = 0;
+     sqe->msg_flags = MSG_NOSIGNAL;
+     if (timeout) {
+         sqe->flags |= IOSQE_IO_LINK;
+         sqe = uring_sqe(r, IORING_OP_LINK_TIMEOUT, -1, URING_TIMEOUT_TAG);
+         sqe->addr = (unsigned long)timeout;
+         sqe->len = 1;
+     }
+ }
+ 
+ /**
+  * @brief send_file_fd() for the io_uring engine. The file is read in
+  *        URING_BUF_SIZE chunks, chunk k into buffer k % URING_DEPTH, up to
+  *        URING_DEPTH chunks ahead; the socket gets one send at a time, in
+  *        order (several sends on one stream could complete out of order).
+  * @return 0 on success, -1 on error
+  */
+ int uring_send_file(struct uring *r, int sock, int fd, off_t offset, long length, uint32_t *crc) {
+     struct timeval tv = { 0, 0 };
+     socklen_t tvLen = sizeof(tv);
+     getsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, &tvLen);
+     struct __kernel_timespec timeout = { tv.tv_sec, tv.tv_usec * 1000 };
+     const struct __kernel_timespec *sendTimeout = (tv.tv_sec || tv.tv_usec) ? &timeout : NULL;
+ 
+     long chunks = (length + URING_BUF_SIZE - 1) / URING_BUF_SIZE;
+     long nextRead = 0, nextSend = 0;
+     int sending = 0, rc = 0;
+     for (; nextRead < chunks && nextRead < URING_DEPTH; nextRead++) {
+         struct uring_slot *s = &r->slots[nextRead];
+         s->offset = offset + nextRead * URING_BUF_SIZE;
+         s->len = (size_t)(length - nextRead * URING_BUF_SIZE < URING_BUF_SIZE
+                           ? length - nextRead * URING_BUF_SIZE : URING_BUF_SIZE);
+         s->done = 0;
+         uring_read(r, (int)nextRead, fd);
+     }
+     while (rc == 0 && nextSend < chunks) {
+         int next = (int)(nextSend % URING_DEPTH);
+         if (!sending && r->slots[next].state == SLOT_READ) {
+             if (crc) {
+                 *crc = crc32c(*crc, r->bufs + (size_t)next * URING_BUF_SIZE, r->slots[next].len);
+             }
+             r->slots[next].done = 0;
+             uring_send(r, next, sock, sendTimeout);
+             sending = 1;
+         }
+         struct io_uring_cqe cqe;
+         if (uring_wait(r, &cqe) != 0) {
+             rc = -1;
+             break;
+         }
+         if (cqe.user_data == URING_TIMEOUT_TAG) {
+             continue;   // the send it guarded reports the outcome
+         }
+         int slot = (int)cqe.user_data;
+         struct uring_slot *s = &r->slots[slot];
+         if (cqe.res <= 0) {
+             errno = cqe.res == -ECANCELED ? ETIMEDOUT : cqe.res < 0 ? -cqe.res : EIO;
+             rc = -1;   // error, or file shorter than expected
+         } else if ((s->done += (size_t)cqe.res) < s->len) {
+             if (s->state == SLOT_READING) {
+                 uring_read(r, slot, fd);
+             } else {
+                 uring_send(r, slot, sock, sendTimeout);
+             }
+         } else if (s->state == SLOT_READING) {
+             s->state = SLOT_READ;
+         } else {
+             sending = 0;
+             nextSend++;
+             s->state = SLOT_FREE;
+             if (nextRead < chunks) {
+                 s->offset = offset + nextRead * URING_BUF_SIZE;
+                 s->len = (size_t)(length - nextRead * URING_BUF_SIZE < URING_BUF_SIZE
+                                   ? length - nextRead * URING_BUF_SIZE : URING_BUF_SIZE);
+                 s->done = 0;
+                 uring_read(r, slot, fd);
+                 nextRead++;
+             }
+         }
+     }
+     uring_drain(r, rc != 0);
+     return rc;
+ }
+ 
+ // Where a local upload goes. With the blocking engine it is the stdio stream;
+ // with io_uring the bytes are gathered in the ring's buffers and each full
+ // buffer becomes a WRITE_FIXED at its file offset, several of them in flight
+ // at once. writer_finish() must be called before the file is flushed, renamed
+ // or closed, whatever happened to the body.
+ struct file_writer {
+     FILE *fp;
+     struct uring *ring;   // NULL: fwrite() to fp
+     off_t offset;         // file offset of the next byte
+     int slot;             // buffer being filled, -1 if none
+     int failed;
+ };
+ 
+ void writer_init(struct file_writer *w, FILE *fp) {
+     w->fp = fp;
+     w->ring = uring_get();
+     w->offset = 0;
+     w->slot = -1;
+     w->failed = 0;
+ }
+ 
+ // Reaps one completion of the writer's ring, resubmitting the rest of a short write.
+ static void writer_reap(struct file_writer *w) {
+     struct io_uring_cqe cqe;
+     if (uring_wait(w->ring, &cqe) != 0) {
+         w->failed = 1;
+         w->ring->inFlight = 0;   // nothing more will be reaped from it
+         return;
+     }
+     struct uring_slot *s = &w->ring->slots[cqe.user_data];
+     if (cqe.res <= 0) {
+         errno = cqe.res < 0 ? -cqe.res : ENOSPC;
+         w->failed = 1;
+         s->state = SLOT_FREE;
+     } else if ((s->done += (size_t)cqe.res) < s->len) {
+         uring_sqe(w->ring, IORING_OP_WRITE_FIXED, fileno(w->fp), cqe.user_data);
+     } else {
+         s->state = SLOT_FREE;
+     }
+ }
+ 
+ static void writer_submit(struct file_writer *w) {
+     struct uring_slot *s = &w->ring->slots[w->slot];
+     s->state = SLOT_WRITING;
+     s->done = 0;
+     uring_sqe(w->ring, IORING_OP_WRITE_FIXED, fileno(w->fp), (unsigned long long)w->slot);
+     w->slot = -1;
+ }
+ 
+ // Appends `len` bytes to the file. Returns 0, or -1 once a write has failed.
+ int writer_write(struct file_writer *w, const void *data, size_t len) {
+     if (!w->ring) {
+         return fwrite(data, 1, len, w->fp) == len ? 0 : -1;
+     }
+     const char *p = data;
+     while (!w->failed && len > 0) {
+         if (w->slot < 0) {
+             for (int i = 0; i < URING_DEPTH && w->slot < 0; i++) {
+                 if (w->ring->slots[i].state == SLOT_FREE) {
+                     w->slot = i;
+                 }
+             }
+             if (w->slot < 0) {
+                 writer_reap(w);   // every buffer is being written
+                 continue;
+             }
+             w->ring->slots[w->slot].offset = w->offset;
+             w->ring->slots[w->slot].len = 0;
+         }
+         struct uring_slot *s = &w->ring->slots[w->slot];
+         size_t n = URING_BUF_SIZE - s->len < len ? URING_BUF_SIZE - s->len : len;
+         memcpy(w->ring->bufs + (size_t)w->slot * URING_BUF_SIZE + s->len, p, n);
+         s->len += n;
+         w->offset += (off_t)n;
+         p += n;
+         len -= n;
+         if (s->len == URING_BUF_SIZE) {
+             writer_submit(w);
+         }
+     }
+     return w->failed ? -1 : 0;
+ }
+ 
+ // Writes out what is still buffered and waits for every write. Returns 0, or -1 if one failed.
+ int writer_finish(struct file_writer *w) {
+     if (!w->ring) {
+         return 0;
+     }
+     if (w->slot >= 0 && !w->failed) {
+         writer_submit(w);
+     }
+     while (w->ring->inFlight > 0) {
+         writer_reap(w);
+     }
+     uring_drain(w->ring, 0);
+     return w->failed ? -1 : 0;
+ }
+ 
+ // ----------------------- DEFLATE STREAMS ------------------------------------
+ 
+ // A client that sent "HELLO 2 deflate" gets whole-file downloads and chunked
+ // archives of the types with a compression level deflated: one zlib stream
+ // carried in the chunked framing of TAR ARCHIVE WRITER, since its size is not
+ // known until it has been produced, announced with V2_FLAG_DEFLATE. Files
+ // under COMPRESS_MIN_SIZE and byte ranges go out as they are. Uploads may come
+ // deflated the same way (uploadz): .c files are inflated here, other types go
+ // on to the storage server still deflated (STOREZ), which stores them plain.
+ // Routed downloads are deflated by the storage server (GETZ, TARZ) so the
+ // bytes cross both links compressed; while the hot-file cache is on, S1
+ // fetches them plain so they can be cached, and deflates them itself.
+ 
+ static int write_all(int fd, const char *buf, size_t len) {
+     metrics_io(fd, 0, (long)len);
+     while (len > 0) {
+         ssize_t n = write(fd, buf, len);
+         if (n < 0 && errno == EINTR) continue;
+         if (n <= 0) return -1;
+         buf += n;
+         len -= (size_t)n;
+     }
+     return 0;
+ }
+ 
+ // A copy of a chunked answer taken as it goes out, for the archive cache
+ // (see ARCHIVE CACHE). A copy that fails or outgrows `limit` is given up.
+ struct stream_copy {
+     int fd;
+     int ok;                // Every byte so far made it into the copy
+     long len, limit;
+ };
+ 
+ // write_all() to `fd`, and to `copy` as well if there is one.
+ static int write_copied(int fd, struct stream_copy *copy, const char *buf, size_t len) {
+     if (copy && copy->ok) {
+         if (copy->len + (long)len > copy->limit || write_all(copy->fd, buf, len) != 0) {
+             copy->ok = 0;
+         } else {
+             copy->len += (long)len;
+         }
+     }
+     return write_all(fd, buf, len);
+ }
+ 
+ struct zout {
+     int fd;
+     struct stream_copy *copy;  // Also write the stream here; NULL for none
+     int failed;            // A write failed; the rest of the stream is dropped
+     z_stream zs;
+     unsigned char out[ZCHUNK_SIZE];
+ };
+ 
+ /**
+  * @brief Starts a deflated stream to `fd` at `level` (1-9).
+  * @return 0 on success, -1 if zlib could not be set up
+  */
+ int zout_init(struct zout *z, int fd, int level) {
+     memset(&z->zs, 0, sizeof(z->zs));
+     z->fd = fd;
+     z->copy = NULL;
+     z->failed = 0;
+     return deflateInit(&z->zs, level) == Z_OK ? 0 : -1;
+ }
+ 
+ // Feeds `len` bytes to the compressor and sends whatever output it produces.
+ static int zout_run(struct zout *z, const void *data, size_t len, int flush) {
+     z->zs.next_in = (Bytef *)data;
+     z->zs.avail_in = (uInt)len;
+     do {
+         z->zs.next_out = z->out;
+         z->zs.avail_out = sizeof(z->out);
+         if (deflate(&z->zs, flush) == Z_STREAM_ERROR) {
+             z->failed = 1;
+             break;
+         }
+         size_t n = sizeof(z->out) - z->zs.avail_out;
+         if (n > 0 && !z->failed) {
+             char hdr[32];
+             int h = snprintf(hdr, sizeof(hdr), "%zx\n", n);
+             if (write_copied(z->fd, z->copy, hdr, (size_t)h) != 0 ||
+                 write_copied(z->fd, z->copy, (char *)z->out, n) != 0) {
+                 z->failed = 1;
+             }
+         }
+     } while (z->zs.avail_out == 0);
+     return z->failed ? -1 : 0;
+ }
+ 
+ int zout_write(struct zout *z, const void *data, size_t len) {
+     return len > 0 ? zout_run(z, data, len, Z_NO_FLUSH) : (z->failed ? -1 : 0);
+ }
+ 
+ /**
+  * @brief Ends the stream with the "0" terminator and frees the compressor
+  *        (also when the stream has already failed).
+  */
+ int zout_finish(struct zout *z) {
+     int rc = zout_run(z, NULL, 0, Z_FINISH);
+     deflateEnd(&z->zs);
+     return rc == 0 ? write_copied(z->fd, z->copy, "0\n", 2) : -1;
+ }
+ 
+ /**
+  * @brief Sends a whole file to the client as a deflated response, read from
+  *        `fd`, or from `data` (`size` bytes) if that is not NULL.
+  * @param trailer Follow the stream with the checksum of the plain bytes,
+  *        computed as they are compressed
+  * @return 0 on success, -1 if the client went away or the file could not be
+  *         read (the stream then ends without its terminator)
+  */
+ int send_deflated(struct client_session *client, int fd, const char *data, long size, int level,
+                   int trailer) {
+     struct zout *z = malloc(sizeof(*z));
+     if (!z || zout_init(z, client->in.fd, level) != 0) {
+         free(z);
+         reply_line(client, "ERROR: Internal error\n");
+         return -1;
+     }
+     uint32_t crc = 0;
+     int rc = reply_deflated(client, trailer);
+     if (rc == 0 && data) {
+         crc = trailer ? crc32c(0, data, (size_t)size) : 0;
+         rc = zout_write(z, data, (size_t)size);
+     }
+     char buf[ZCHUNK_SIZE];
+     ssize_t n;
+     while (rc == 0 && !data && (n = read(fd, buf, sizeof(buf))) != 0) {
+         if (n < 0 && errno == EINTR) {
+             continue;
+         }
+         if (n > 0 && trailer) {
+             crc = crc32c(crc, buf, (size_t)n);
+         }
+         rc = n < 0 ? -1 : zout_write(z, buf, (size_t)n);
+     }
+     if (rc == 0) {
+         rc = zout_finish(z);
+     } else {
+         deflateEnd(&z->zs);
+     }
+     if (rc == 0 && trailer) {
+         rc = send_client_trailer(client, crc);
+     }
+     free(z);
+     return rc;
+ }
+ 
+ /**
+  * @brief Receives an upload body of `zLen` deflated bytes and writes the
+  *        inflated file, which must come to exactly `fileSize` bytes.
+  * @param crc Updated with the inflated bytes
+  * @return 0 on success, -1 if the connection was lost, -2 if the body was
+  *         not a zlib stream of that size, -3 if the file could not be
+  *         written (in both cases it has still been read to its end)
+  */
+ int inflate_to_file(struct line_reader *from, struct file_writer *w, long zLen, long fileSize, uint32_t *crc) {
+     z_stream zs;
+     memset(&zs, 0, sizeof(zs));
+     int zret = inflateInit(&zs);
+     char *out = malloc(ZCHUNK_SIZE);
+     int bad = zret != Z_OK || !out;
+     int writeFailed = 0;
+     long stored = 0;
+     long remaining = zLen;
+     char buf[BUF_SIZE];
+     while (remaining > 0) {
+         ssize_t r = reader_read(from, buf, (remaining < BUF_SIZE ? remaining : BUF_SIZE));
+         if (r <= 0) {
+             break;
+         }
+         remaining -= r;
+         zs.next_in = (Bytef *)buf;
+         zs.avail_in = (uInt)r;
+         while (!bad) {
+             zs.next_out = (Bytef *)out;
+             zs.avail_out = ZCHUNK_SIZE;
+             zret = inflate(&zs, Z_NO_FLUSH);
+             if (zret != Z_OK && zret != Z_STREAM_END && zret != Z_BUF_ERROR) {
+                 bad = 1;
+                 break;
+             }
+             size_t n = ZCHUNK_SIZE - zs.avail_out;
+             if (stored + (long)n > fileSize) {
+                 bad = 1;
+                 break;
+             }
+             if (!writeFailed && writer_write(w, out, n) != 0) {
+                 writeFailed = 1;
+             }
+             *crc = crc32c(*crc, out, n);
+             stored += (long)n;
+             if (zs.avail_out != 0) {
+                 break;
+             }
+         }
+     }
+     inflateEnd(&zs);
+     free(out);
+     if (remaining != 0) {
+         return -1;
+     }
+     if (bad || zret != Z_STREAM_END || stored != fileSize) {
+         return -2;
+     }
+     return writeFailed ? -3 : 0;
+ }
+ 
+ // ----------------------- TAR ARCHIVE WRITER ---------------------------------
+ 
+ // downltar archives are produced in-process: the tree is walked with nftw()
+ // and ustar headers plus file bodies are written straight to the output as
+ // they are read, so nothing waits for the whole archive and no temp copy or
+ // external tar process is involved. On a socket the output is chunked:
+ //
+ //   <hex length>\n<that many bytes>   repeated, then   0\n
+ //
+ // which lets the receiver frame the stream without knowing its total size.
+ 
+ struct tar_writer {
+     int fd;            // Socket or file the archive goes to
+     int chunked;       // Wrap the output in chunks (see above)
+     int failed;        // A write failed; the walk stops and the output is unusable
+     struct zout *z;    // Deflate the output (see DEFLATE STREAMS); NULL for plain
+     struct stream_copy *copy;  // Copy of the chunked output (see ARCHIVE CACHE); NULL for none
+     size_t baseLen;    // Length of the tree root, stripped from member names
+     const char *ext;   // Only regular files ending in this extension are archived
+     uint64_t since;    // Only files whose status changed at or after this time (ns); 0 for all
+     long files;
+     size_t len;        // Bytes waiting in buf
+     char buf[TAR_CHUNK_SIZE];
+ };
+ 
+ // nftw() has no user argument; each thread runs at most one walk at a time.
+ static __thread struct tar_writer *tarActive;
+ 
+ static int tar_flush(struct tar_writer *w) {
+     if (w->failed) return -1;
+     if (w->len == 0) return 0;
+     if (w->z) {
+         if (zout_write(w->z, w->buf, w->len) != 0) {
+             w->failed = 1;
+             return -1;
+         }
+         w->len = 0;
+         return 0;
+     }
+     if (w->chunked) {
+         char hdr[32];
+         int n = snprintf(hdr, sizeof(hdr), "%zx\n", w->len);
+         if (write_copied(w->fd, w->copy, hdr, (size_t)n) != 0) {
+             w->failed = 1;
+             return -1;
+         }
+     }
+     if (write_copied(w->fd, w->chunked ? w->copy : NULL, w->buf, w->len) != 0) {
+         w->failed = 1;
+         return -1;
+     }
+     w->len = 0;
+     return 0;
+ }
+ 
+ // Appends `len` zero bytes (record padding).
+ static int tar_zero(struct tar_writer *w, size_t len) {
+     while (len > 0) {
+         if (w->len == sizeof(w->buf) && tar_flush(w) != 0) return -1;
+         size_t n = sizeof(w->buf) - w->len;
+         if (n > len) n = len;
+         memset(w->buf + w->len, 0, n);
+         w->len += n;
+         len -= n;
+     }
+     return 0;
+ }
+ 
+ // Writes a numeric header field: zero-padded octal, or base-256 when the
+ // value does not fit (GNU extension, needed for files of 8 GiB and more).
+ static void tar_number(char *field, size_t width, unsigned long long value) {
+     if (value < (1ULL << (3 * (width - 1)))) {
+         snprintf(field, width, "%0*llo", (int)width - 1, value);
+         return;
+     }
+     memset(field, 0, width);
+     field[0] = (char)0x80;
+     for (size_t i = width - 1; i > 0 && value; i--, value >>= 8) {
+         field[i] = (char)(value & 0xff);
+     }
+ }
+ 
+ /**
+  * @brief Fills in a ustar header block. Names longer than 100 bytes are split
+  *        into the prefix field at a '/'.
+  * @return 0 on success, -1 if the name cannot be represented
+  */
+ static int tar_header(char *block, const char *name, const struct stat *st, long long size) {
+     memset(block, 0, 512);
+     size_t nameLen = strlen(name);
+     if (nameLen <= 100) {
+         memcpy(block, name, nameLen);
+     } else {
+         const char *split = NULL;
+         for (const char *p = name; (p = strchr(p, '/')) != NULL; p++) {
+             if ((size_t)(p - name) <= 155 && nameLen - (size_t)(p - name) - 1 <= 100) {
+                 split = p;
+                 break;
+             }
+         }
+         if (!split || split == name) {
+             return -1;
+         }
+         memcpy(block + 345, name, (size_t)(split - name));
+         memcpy(block, split + 1, nameLen - (size_t)(split - name) - 1);
+     }
+     tar_number(block + 100, 8, st->st_mode & 07777);
+     tar_number(block + 108, 8, st->st_uid);
+     tar_number(block + 116, 8, st->st_gid);
+     tar_number(block + 124, 12, (unsigned long long)size);
+     tar_number(block + 136, 12, st->st_mtime > 0 ? (unsigned long long)st->st_mtime : 0);
+     block[156] = '0';                  // Regular file
+     memcpy(block + 257, "ustar", 6);   // Magic, NUL-terminated
+     memcpy(block + 263, "00", 2);      // Version
+     memset(block + 148, ' ', 8);       // Checksum is computed with spaces here
+     unsigned int sum = 0;
+     for (int i = 0; i < 512; i++) {
+         sum += (unsigned char)block[i];
+     }
+     snprintf(block + 148, 8, "%06o", sum);
+     block[155] = ' ';
+     return 0;
+ }
+ 
+ /**
+  * @brief Adds one file: header, then the body read straight into the output
+  *        buffer. If the file shrinks while being read it is padded with zeros,
+  *        as GNU tar does, so the archive stays well-formed.
+  */
+ static int tar_add_file(struct tar_writer *w, const char *path, const char *name) {
+     int fd = open(path, O_RDONLY | O_CLOEXEC);
+     struct stat st;
+     if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+         LOG_WARN("tar: skipping %s: %s", path, strerror(errno));
+         if (fd >= 0) close(fd);
+         return 0;
+     }
+     if (w->len + 512 > sizeof(w->buf) && tar_flush(w) != 0) {
+         close(fd);
+         return -1;
+     }
+     if (tar_header(w->buf + w->len, name, &st, (long long)st.st_size) != 0) {
+         LOG_WARN("tar: skipping %s: name too long", path);
+         close(fd);
+         return 0;
+     }
+     w->len += 512;
+ 
+     long long remaining = (long long)st.st_size;
+     while (remaining > 0) {
+         if (w->len == sizeof(w->buf) && tar_flush(w) != 0) {
+             close(fd);
+             return -1;
+         }
+         size_t room = sizeof(w->buf) - w->len;
+         ssize_t n = read(fd, w->buf + w->len, (long long)room < remaining ? room : (size_t)remaining);
+         if (n < 0 && errno == EINTR) continue;
+         if (n <= 0) {
+             LOG_WARN("tar: %s shrank; padding with zeros", path);
+             break;
+         }
+         w->len += (size_t)n;
+         remaining -= n;
+     }
+     close(fd);
+     w->files++;
+     return tar_zero(w, (size_t)remaining + (size_t)((512 - st.st_size % 512) % 512));
+ }
+ 
+ static int tar_visit(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+     (void)ftw;
+     struct tar_writer *w = tarActive;
+     if (type != FTW_F || !S_ISREG(st->st_mode)) {
+         return 0;
+     }
+     size_t len = strlen(path), extLen = strlen(w->ext);
+     if (len < extLen || strcmp(path + len - extLen, w->ext) != 0) {
+         return 0;
+     }
+     if (w->since && (uint64_t)st->st_ctim.tv_sec * 1000000000u + (uint64_t)st->st_ctim.tv_nsec < w->since) {
+         return 0;
+     }
+     const char *name = path + w->baseLen;
+     while (*name == '/') name++;
+     return tar_add_file(w, path, name) != 0 ? 1 : 0;
+ }
+ 
+ /**
+  * @brief Writes a ustar archive of every regular file under `baseDir` whose
+  *        name ends in `ext`. Member names are relative to `baseDir`.
+  * @param fd Socket or file to write to
+  * @param chunked Nonzero to use the chunked framing (ends with "0\n")
+  * @param level Deflate the chunked output at this zlib level; 0 for plain
+  * @param since Leave out files whose status last changed before this time
+  *        (ns since the epoch); 0 for every file
+  * @param copy Also write the chunked output here (see ARCHIVE CACHE), or NULL
+  * @return Number of files archived, or -1 if writing failed
+  */
+ long tar_write_tree(int fd, int chunked, const char *baseDir, const char *ext, int level,
+                     uint64_t since, struct stream_copy *copy) {
+     struct tar_writer *w = malloc(sizeof(*w));
+     if (!w) {
+         return -1;
+     }
+     w->z = NULL;
+     if (level > 0) {
+         w->z = malloc(sizeof(*w->z));
+         if (!w->z || zout_init(w->z, fd, level) != 0) {
+             free(w->z);
+             free(w);
+             return -1;
+         }
+         w->z->copy = copy;
+     }
+     w->fd = fd;
+     w->chunked = chunked;
+     w->failed = 0;
+     w->copy = copy;
+     w->baseLen = strlen(baseDir);
+     w->ext = ext;
+     w->since = since;
+     w->files = 0;
+     w->len = 0;
+     tarActive = w;
+     nftw(baseDir, tar_visit, 16, FTW_PHYS);
+     tarActive = NULL;
+ 
+     // End of archive: two zero blocks
+     int rc = tar_zero(w, 1024);
+     if (rc == 0) rc = tar_flush(w);
+     if (w->z) {
+         if (rc == 0) {
+             rc = zout_finish(w->z);
+         } else {
+             deflateEnd(&w->z->zs);
+         }
+         free(w->z);
+     } else if (rc == 0 && chunked) {
+         rc = write_copied(fd, copy, "0\n", 2);
+     }
+     long files = w->files;
+     rc = (rc != 0 || w->failed) ? -1 : 0;
+     free(w);
+     return rc == 0 ? files : -1;
+ }
+ 
+ /**
+  * @brief Copies a chunked stream (as written by tar_write_tree) from a
+  *        storage server, up to and including its "0" terminator.
+  * @param from Reader of the storage server connection
+  * @param outFd Destination, or -1 to just consume the stream
+  * @param framed Nonzero to keep the chunk framing (outFd is a client socket,
+  *        bodies are spliced); zero to write only the archive bytes (outFd is
+  *        a spool file)
+  * @return 0 on success, -1 if the server's stream broke (connection is out of
+  *         sync), -2 if writing failed; the stream has then still been read
+  *         to its end so the server connection can be reused
+  */
+ int copy_chunks(struct line_reader *from, int outFd, int framed) {
+     int outFailed = outFd < 0;
+     char line[32];
+     while (1) {
+         if (reader_getline(from, line, sizeof(line)) < 0) {
+             return -1;
+         }
+         char *end;
+         long len = strtol(line, &end, 16);
+         if (end == line || *end != '\0' || len < 0) {
+             return -1;
+         }
+         if (framed && !outFailed) {
+             char hdr[40];
+             int n = snprintf(hdr, sizeof(hdr), "%s\n", line);
+             if (write_all(outFd, hdr, (size_t)n) != 0) {
+                 outFailed = 1;
+             }
+         }
+         if (len == 0) {
+             return outFailed ? -2 : 0;
+         }
+         if (framed && !outFailed) {
+             int rc = relay_bytes(from, outFd, len);
+             if (rc == -1) return -1;
+             if (rc == -2) outFailed = 1;
+             continue;
+         }
+         char buffer[BUF_SIZE];
+         long remaining = len;
+         while (remaining > 0) {
+             ssize_t n = reader_read(from, buffer, (remaining < BUF_SIZE ? remaining : BUF_SIZE));
+             if (n <= 0) {
+                 return -1;
+             }
+             if (!outFailed && write_all(outFd, buffer, (size_t)n) != 0) {
+                 outFailed = 1;
+             }
+             remaining -= n;
+         }
+     }
+ }
+  
+ // Writes joined archive bytes as copy_chunks_joined() describes (0 or -1).
+ static int joined_write(int outFd, int framed, struct zout *z, const char *buf, size_t len) {
+     if (z) {
+         return zout_write(z, buf, len) != 0 ? -1 : 0;
+     }
+     if (framed) {
+         char hdr[32];
+         int h = snprintf(hdr, sizeof(hdr), "%zx\n", len);
+         if (write_all(outFd, hdr, (size_t)h) != 0) {
+             return -1;
+         }
+     }
+     return write_all(outFd, buf, len);
+ }
+ 
+ // A replicated file is in the archive of every server holding a copy. When
+ // several are joined, each member is kept only from its shard owner: the
+ // first of the file's replicas in ring order whose archive is part of the
+ // download. The members kept are collected in `stage` and written in
+ // chunks of up to TAR_CHUNK_SIZE.
+ struct tar_filter {
+     const struct tar_shard *shard;
+     char block[512];           // Header of the next member, as far as it has arrived
+     size_t have;
+     unsigned long long left;   // Body bytes (with padding) of the current member still to come
+     int keep;                  // The current member goes into the download
+     char *stage;
+     size_t staged;
+ };
+ 
+ // Returns whether the member `name` is the shard's to contribute.
+ static int tar_shard_owns(const struct tar_shard *shard, const char *name) {
+     int nodes[MAX_BACKENDS];
+     int n = route_nodes(name, nodes, replicaCount);
+     for (int i = 0; i < n; i++) {
+         if (nodes[i] < MAX_BACKENDS && shard->up[nodes[i]]) {
+             return nodes[i] == shard->backend;
+         }
+     }
+     return 1;   // None of its replicas holds it yet (the rebalancer moves it)
+ }
+ 
+ // Reads the member header in f->block; -1 if it is not one S2/S3/S4 writes.
+ static int tar_filter_header(struct tar_filter *f) {
+     const unsigned char *b = (const unsigned char *)f->block;
+     unsigned long long size = 0;
+     if (b[124] & 0x80) {
+         for (int i = 125; i < 136; i++) {
+             size = size << 8 | b[i];
+         }
+     } else {
+         char field[13], *end;
+         memcpy(field, f->block + 124, 12);
+         field[12] = '\0';
+         size = strtoull(field, &end, 8);
+         if (end == field) {
+             return -1;
+         }
+     }
+     char name[256 + 8];
+     snprintf(name, sizeof(name), "%.155s%s%.100s", f->block + 345, f->block[345] ? "/" : "", f->block);
+     f->keep = tar_shard_owns(f->shard, name);
+     f->left = (size + 511) / 512 * 512;
+     return 0;
+ }
+ 
+ static int tar_filter_put(struct tar_filter *f, int outFd, int framed, struct zout *z,
+                           const char *buf, size_t len) {
+     while (len > 0) {
+         if (f->staged == TAR_CHUNK_SIZE) {
+             if (joined_write(outFd, framed, z, f->stage, f->staged) != 0) {
+                 return -1;
+             }
+             f->staged = 0;
+         }
+         size_t n = TAR_CHUNK_SIZE - f->staged < len ? TAR_CHUNK_SIZE - f->staged : len;
+         memcpy(f->stage + f->staged, buf, n);
+         f->staged += n;
+         buf += n;
+         len -= n;
+     }
+     return 0;
+ }
+ 
+ /**
+  * @brief Passes archive bytes through the shard filter `f`.
+  * @return 0, or -1 if writing failed
+  */
+ static int tar_filter_write(struct tar_filter *f, int outFd, int framed, struct zout *z,
+                             const char *buf, size_t len) {
+     while (len > 0) {
+         if (f->left == 0) {
+             size_t n = 512 - f->have < len ? 512 - f->have : len;
+             memcpy(f->block + f->have, buf, n);
+             f->have += n;
+             buf += n;
+             len -= n;
+             if (f->have < 512) {
+                 break;
+             }
+             f->have = 0;
+             if (tar_filter_header(f) != 0) {
+                 f->keep = 1;   // Not understood: pass the rest through unfiltered
+                 f->left = ULLONG_MAX;
+             }
+             if (f->keep && tar_filter_put(f, outFd, framed, z, f->block, 512) != 0) {
+                 return -1;
+             }
+             continue;
+         }
+         size_t n = f->left < len ? (size_t)f->left : len;
+         if (f->keep && tar_filter_put(f, outFd, framed, z, buf, n) != 0) {
+             return -1;
+         }
+         f->left -= n;
+         buf += n;
+         len -= n;
+     }
+     return 0;
+ }
+ 
+ /**
+  * @brief Like copy_chunks(), for one of several archives that are joined into
+  *        one: the end-of-archive blocks (the last 1024 bytes of the archive)
+  *        are held back and dropped instead of being copied, and the "0"
+  *        terminator is not copied either. Bodies are copied, not spliced.
+  *        tar_end() finishes the joined archive.
+  * @param z If not NULL, the archive bytes are deflated into it instead of
+  *        being written to `outFd`
+  * @param shard If not NULL, only the members this server is the shard owner
+  *        of are copied (see struct tar_filter)
+  * @return As copy_chunks()
+  */
+ int copy_chunks_joined(struct line_reader *from, int outFd, int framed, struct zout *z,
+                        const struct tar_shard *shard) {
+     char *buf = malloc(TAR_CHUNK_SIZE + 1024 + (shard ? TAR_CHUNK_SIZE : 0));
+     struct tar_filter filter = { shard, { 0 }, 0, 0, 0, buf ? buf + TAR_CHUNK_SIZE + 1024 : NULL, 0 };
+     int outFailed = outFd < 0;
+     size_t held = 0;   // Bytes at the start of buf not yet known not to be the trailer
+     char line[32];
+     int rc = -1;
+     while (buf && reader_getline(from, line, sizeof(line)) >= 0) {
+         char *end;
+         long len = strtol(line, &end, 16);
+         if (end == line || *end != '\0' || len < 0) {
+             break;
+         }
+         if (len == 0) {
+             if (!outFailed && shard && filter.staged > 0) {
+                 outFailed = joined_write(outFd, framed, z, filter.stage, filter.staged) != 0;
+             }
+             rc = outFailed ? -2 : 0;
+             break;
+         }
+         while (len > 0) {
+             size_t want = len < TAR_CHUNK_SIZE ? (size_t)len : TAR_CHUNK_SIZE;
+             ssize_t n = reader_read(from, buf + held, want);
+             if (n <= 0) {
+                 free(buf);
+                 return -1;
+             }
+             len -= n;
+             held += (size_t)n;
+             if (held <= 1024) {
+                 continue;
+             }
+             size_t out = held - 1024;
+             if (!outFailed) {
+                 outFailed = (shard ? tar_filter_write(&filter, outFd, framed, z, buf, out)
+                                    : joined_write(outFd, framed, z, buf, out)) != 0;
+             }
+             memmove(buf, buf + out, 1024);
+             held = 1024;
+         }
+     }
+     free(buf);
+     return rc;
+ }
+ 
+ /**
+  * @brief Ends an archive joined with copy_chunks_joined(): two zero blocks,
+  *        then the "0" terminator if the output is chunked. A deflated stream
+  *        `z` is finished (and its compressor freed) instead.
+  */
+ int tar_end(int fd, int framed, struct zout *z) {
+     char zeros[1024];
+     memset(zeros, 0, sizeof(zeros));
+     if (z) {
+         int rc = zout_write(z, zeros, sizeof(zeros));
+         return zout_finish(z) == 0 ? rc : -1;
+     }
+     if (framed && write_all(fd, "400\n", 4) != 0) {
+         return -1;
+     }
+     if (write_all(fd, zeros, sizeof(zeros)) != 0) {
+         return -1;
+     }
+     return framed ? write_all(fd, "0\n", 2) : 0;
+ }
+
+ /**
+  * @brief Creates an anonymous temp file for an archive whose size has to be
+  *        known before it is sent (clients without chunked support).
+  * @return File descriptor, or -1 on error
+  */
+ int spool_create(void) {
+     char template[] = "/tmp/s1tarXXXXXX";
+     int fd = mkstemp(template);
+     if (fd >= 0) {
+         unlink(template);  // Space is freed when the descriptor is closed
+     }
+     return fd;
+ }
+ 
+ /**
+  * @brief Sends a spooled archive to the client ("<size>\n" + data, sendfile)
+  *        and closes it.
+  */
+ int spool_send(struct client_session *client, int fd, const char *fileType) {
+     struct stat st;
+     if (fstat(fd, &st) != 0) {
+         close(fd);
+         reply_line(client, "ERROR: Tar file not found\n");
+         return -1;
+     }
+     long tarSize = (long)st.st_size;
+     int rc = reply_size(client, tarSize) == 0 ? send_file_fd(client->in.fd, fd, 0, tarSize, NULL) : -1;
+     close(fd);
+     if (rc == 0) {
+         LOG_DEBUG("Sent tar archive for %s files to client (%ld bytes)", fileType, tarSize);
+     }
+     return rc;
+ }
+ 
+ // ----------------------- ARCHIVE CACHE --------------------------------------
+ 
+ // downltar of the local .c files used to walk and read ~/S1 on every call,
+ // although the tree rarely changes between two of them. The last chunked
+ // archives, one per deflate level (plain = 0), are kept exactly as they went
+ // on the wire in ~/S1/.tar-cache/<level>.tar, each with the archive
+ // generation it was built at. Every upload, multipart commit and removal of
+ // a .c file bumps the generation. It lives in a MAP_SHARED mapping, like the
+ // hot-file cache, so forked children and epoll workers agree on it; a robust
+ // mutex guards it. While the generation has not moved, downltar sends the
+ // file with sendfile(). A fresh archive is copied to a temp file in the same
+ // directory as it streams out (struct stream_copy) and renamed into place
+ // only if nothing changed meanwhile. --tar-cache-mb bounds the total; the
+ // least recently used archives go first.
+ //
+ // "downltar <type> chunked since <token>" asks only for what changed after
+ // an earlier answer, whose first line carried the token ("chunked <token>").
+ // For .c files the token is the time of that answer in nanoseconds, and
+ // files whose status changed at or after it are archived; routed types
+ // pass the storage servers' index generations through, comma-joined in route
+ // order. Removed files are not represented; a full archive picks them up.
+ struct tar_cache_slot {
+     uint64_t gen;    // Archive generation it was built at
+     uint64_t used;   // Clock at the last hit, for eviction
+     long len;        // 0 = empty
+ };
+ 
+ struct tar_cache_header {
+     pthread_mutex_t lock;
+     uint64_t generation;
+     uint64_t clock;
+     long budget;
+     struct tar_cache_slot slots[TAR_CACHE_LEVELS];
+ };
+ 
+ static struct tar_cache_header *tarCache;   // NULL when the cache is off
+ 
+ static void tar_cache_lock(void) {
+     if (pthread_mutex_lock(&tarCache->lock) == EOWNERDEAD) {
+         LOG_WARN("Archive cache lock holder died; dropping the cached archives");
+         for (int i = 0; i < TAR_CACHE_LEVELS; i++) {
+             tarCache->slots[i].len = 0;
+         }
+         tarCache->generation++;
+         pthread_mutex_consistent(&tarCache->lock);
+     }
+ }
+ 
+ static void tar_cache_path(char *buf, size_t size, const char *baseDir, int level) {
+     snprintf(buf, size, "%s/%s/%d.tar", baseDir, TAR_CACHE_DIR, level);
+ }
+ 
+ /**
+  * @brief Maps the shared archive cache state. A budget of 0 leaves it off.
+  * @param budget Bytes of archives the cache may keep on disk
+  * @return 0 on success (or when disabled), -1 if the mapping failed
+  */
+ int tar_cache_init(long budget) {
+     if (budget <= 0) {
+         return 0;
+     }
+     void *mem = mmap(NULL, sizeof(struct tar_cache_header), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+     if (mem == MAP_FAILED) {
+         perror("mmap (archive cache)");
+         return -1;
+     }
+     tarCache = mem;
+     tarCache->budget = budget;
+     pthread_mutexattr_t attr;
+     pthread_mutexattr_init(&attr);
+     pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+     pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+     pthread_mutex_init(&tarCache->lock, &attr);
+     pthread_mutexattr_destroy(&attr);
+     return 0;
+ }
+ 
+ void tar_note_change(void) {
+     if (!tarCache) {
+         return;
+     }
+     tar_cache_lock();
+     tarCache->generation++;
+     pthread_mutex_unlock(&tarCache->lock);
+ }
+ 
+ uint64_t tar_cache_generation(void) {
+     if (!tarCache) {
+         return 0;
+     }
+     tar_cache_lock();
+     uint64_t gen = tarCache->generation;
+     pthread_mutex_unlock(&tarCache->lock);
+     return gen;
+ }
+ 
+ /**
+  * @brief Opens the cached archive at `level` if it was built at the current
+  *        generation. The file is opened under the lock, so a newer archive
+  *        renamed over it afterwards does not disturb the sender.
+  * @return The open file with its length in *len, or -1 on a miss
+  */
+ int tar_cache_open(const char *baseDir, int level, long *len) {
+     if (!tarCache) {
+         return -1;
+     }
+     char path[1024];
+     tar_cache_path(path, sizeof(path), baseDir, level);
+     int fd = -1;
+     tar_cache_lock();
+     struct tar_cache_slot *slot = &tarCache->slots[level];
+     if (slot->len > 0 && slot->gen == tarCache->generation) {
+         fd = open(path, O_RDONLY | O_CLOEXEC);
+         if (fd >= 0) {
+             *len = slot->len;
+             slot->used = ++tarCache->clock;
+         } else {
+             slot->len = 0;
+         }
+     }
+     pthread_mutex_unlock(&tarCache->lock);
+     return fd;
+ }
+ 
+ /**
+  * @brief Creates the temp file a new archive is copied into, named in
+  *        `tmpPath` for tar_cache_put().
+  * @return The open file, or -1 if the cache is off or the file cannot be made
+  */
+ int tar_cache_create(const char *baseDir, char *tmpPath, size_t size) {
+     if (!tarCache) {
+         return -1;
+     }
+     snprintf(tmpPath, size, "%s/%s", baseDir, TAR_CACHE_DIR);
+     mkdir(tmpPath, 0700);
+     snprintf(tmpPath, size, "%s/%s/tmp.XXXXXX", baseDir, TAR_CACHE_DIR);
+     int fd = mkostemp(tmpPath, O_CLOEXEC);
+     if (fd < 0) {
+         LOG_DEBUG("Not caching the archive: %s", strerror(errno));
+     }
+     return fd;
+ }
+ 
+ /**
+  * @brief Renames the copy in `tmpPath` (`len` bytes) into place as the
+  *        archive at `level`, evicting the least recently used archives to
+  *        stay within the budget. The copy is removed instead if the files
+  *        changed after generation `gen` or it does not fit at all.
+  */
+ void tar_cache_put(const char *baseDir, const char *tmpPath, int level, uint64_t gen, long len) {
+     char path[1024];
+     tar_cache_lock();
+     struct tar_cache_slot *slots = tarCache->slots;
+     slots[level].len = 0;
+     int keep = gen == tarCache->generation && len > 0 && len <= tarCache->budget;
+     while (keep) {
+         long total = len;
+         int oldest = -1;
+         for (int i = 0; i < TAR_CACHE_LEVELS; i++) {
+             if (slots[i].len == 0) {
+                 continue;
+             }
+             total += slots[i].len;
+             if (oldest < 0 || slots[i].used < slots[oldest].used) {
+                 oldest = i;
+             }
+         }
+         if (total <= tarCache->budget) {
+             break;
+         }
+         tar_cache_path(path, sizeof(path), baseDir, oldest);
+         unlink(path);
+         slots[oldest].len = 0;
+     }
+     tar_cache_path(path, sizeof(path), baseDir, level);
+     if (keep && rename(tmpPath, path) == 0) {
+         slots[level].gen = gen;
+         slots[level].len = len;
+         slots[level].used = ++tarCache->clock;
+     } else {
+         unlink(tmpPath);
+     }
+     pthread_mutex_unlock(&tarCache->lock);
+ }
+ 
+ // ----------------------- ADMISSION CONTROL ----------------------------------
+ 
+ // Without limits one client can take all of S1: a handful of parallel
+ // downltars or uploads from one address fill every storage server
+ // connection while other clients wait behind them. Three limits, all off by
+ // default, bound what a client gets. A transfer (uploadf, uploadp, uploadm,
+ // downlf, downlm, downltar) that would exceed one is refused at once with
+ // "ERROR: BUSY retry-after <seconds> (<reason>)" instead of being queued
+ // without end; a refused upload's body is read and dropped.
+ //
+ //  - --client-rate MB: every client address has a token bucket of bytes,
+ //    refilled at MB per second up to --client-burst MB (default
+ //    ADMIT_BURST_SECS seconds' worth). A transfer is admitted while the
+ //    bucket is not empty and is then charged for the bytes it moved on the
+ //    client connection (at least ADMIT_MIN_COST), so a large one can take
+ //    the bucket below zero; retry-after is the time until it is back above.
+ //  - --client-transfers N: at most N transfers from one address run or wait
+ //    at the same time, however many connections it opens.
+ //  - --backend-slots N: at most N transfers relayed to or from the storage
+ //    servers run at the same time (local .c files do not take a slot). When
+ //    none is free, the transfer waits, up to --slot-wait-ms, and slots are
+ //    handed out by deficit round robin across the waiting connections: each
+ //    round gives every waiter DRR_QUANTUM bytes of credit, and the first
+ //    one, in round-robin order, whose credit covers its cost gets the slot.
+ //    The cost is the upload's size, or for a download what the connection
+ //    moved last time, so large transfers wait more rounds than small ones
+ //    without being starved by them.
+ //
+ // The state is in a MAP_SHARED mapping with a robust mutex and a
+ // process-shared condition variable, like the archive cache, so forked
+ // children and epoll workers share the limits. Every transfer has an entry
+ // with the pid that runs it; entries (and slots) of a process that died are
+ // reclaimed when the table or the slots run out.
+ 
+ enum { ADMIT_FREE, ADMIT_RUNNING, ADMIT_WAITING, ADMIT_SLOT };
+ 
+ struct admit_client {
+     uint32_t addr;       // IPv4 address, network order; 0 = unused
+     double tokens;       // Bytes the client may still move; negative = in debt
+     int64_t refillNs;    // When tokens was last brought up to date
+ };
+ 
+ struct admit_transfer {
+     pid_t pid;
+     int state;           // ADMIT_*; ADMIT_SLOT holds a backend slot
+     uint32_t addr;
+     long cost;           // DRR: bytes the transfer is expected to move
+     long deficit;        // DRR: credit collected while waiting
+ };
+ 
+ struct admit_header {
+     pthread_mutex_t lock;
+     pthread_cond_t granted;   // Broadcast whenever waiters got slots
+     int slotsInUse;
+     int next;                 // DRR: where the next round starts in transfers[]
+     struct admit_client clients[ADMIT_CLIENTS];
+     struct admit_transfer transfers[ADMIT_TRANSFERS];
+ };
+ 
+ static struct admit_header *admit;   // NULL when every limit is off
+ 
+ // The transfer the calling thread was admitted for (index in transfers[])
+ static __thread int admitEntry = -1;
+ 
+ static void admit_lock(void) {
+     if (pthread_mutex_lock(&admit->lock) == EOWNERDEAD) {
+         LOG_WARN("Admission lock holder died; carrying on");
+         pthread_mutex_consistent(&admit->lock);
+     }
+ }
+ 
+ static int64_t admit_now_ns(void) {
+     struct timespec ts;
+     clock_gettime(CLOCK_MONOTONIC, &ts);
+     return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+ }
+ 
+ /**
+  * @brief Maps the shared admission state, unless --client-rate,
+  *        --client-transfers and --backend-slots are all off.
+  * @return 0 on success (or when disabled), -1 if the mapping failed
+  */
+ int admit_init(void) {
+     if (options.clientRateMb <= 0 && options.clientTransfers <= 0 && options.backendSlots <= 0) {
+         return 0;
+     }
+     void *mem = mmap(NULL, sizeof(struct admit_header), PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+     if (mem == MAP_FAILED) {
+         perror("mmap (admission control)");
+         return -1;
+     }
+     admit = mem;
+     pthread_mutexattr_t attr;
+     pthread_mutexattr_init(&attr);
+     pthread_mutexattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+     pthread_mutexattr_setrobust(&attr, PTHREAD_MUTEX_ROBUST);
+     pthread_mutex_init(&admit->lock, &attr);
+     pthread_mutexattr_destroy(&attr);
+     pthread_condattr_t cattr;
+     pthread_condattr_init(&cattr);
+     pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+     pthread_condattr_setclock(&cattr, CLOCK_MONOTONIC);
+     pthread_cond_init(&admit->granted, &cattr);
+     pthread_condattr_destroy(&cattr);
+     return 0;
+ }
+ 
+ /**
+  * @brief The token bucket of `addr`, refilled up to `now`. An address seen
+  *        for the first time takes an unused bucket or else the fullest one,
+  *        that of the client that has been quiet longest. Caller holds the
+  *        lock.
+  */
+ static struct admit_client *admit_bucket(uint32_t addr, int64_t now) {
+     double rate = (double)options.clientRateMb * 1024 * 1024;
+     double burst = (double)(options.clientBurstMb > 0 ? options.clientBurstMb
+                                                       : options.clientRateMb * ADMIT_BURST_SECS) * 1024 * 1024;
+     struct admit_client *c = NULL, *spare = NULL;
+     double spareLevel = 0;
+     for (int i = 0; i < ADMIT_CLIENTS && !c; i++) {
+         struct admit_client *e = &admit->clients[i];
+         double level = e->addr == 0 ? burst + 1 : e->tokens + rate * (double)(now - e->refillNs) / 1e9;
+         if (e->addr == addr && addr != 0) {
+             c = e;
+         } else if (!spare || level > spareLevel) {
+             spare = e;
+             spareLevel = level;
+         }
+     }
+     if (!c) {
+         c = spare;
+         c->addr = addr;
+         c->tokens = burst;
+         c->refillNs = now;
+     }
+     c->tokens += rate * (double)(now - c->refillNs) / 1e9;
+     if (c->tokens > burst) {
+         c->tokens = burst;
+     }
+     c->refillNs = now;
+     return c;
+ }
+ 
+ /**
+  * @brief Frees the entries, and slots, of processes that exited without
+  *        ending their transfers. Caller holds the lock.
+  */
+ static void admit_reclaim(void) {
+     for (int i = 0; i < ADMIT_TRANSFERS; i++) {
+         struct admit_transfer *t = &admit->transfers[i];
+         if (t->state != ADMIT_FREE && kill(t->pid, 0) != 0 && errno == ESRCH) {
+             LOG_WARN("Reclaiming a transfer of exited process %d", (int)t->pid);
+             if (t->state == ADMIT_SLOT) {
+                 admit->slotsInUse--;
+             }
+             t->state = ADMIT_FREE;
+         }
+     }
+ }
+ 
+ /**
+  * @brief Hands free backend slots to waiting transfers by deficit round
+  *        robin. Rounds in which no waiter's credit would reach its cost are
+  *        skipped in one step. Caller holds the lock.
+  */
+ static void admit_schedule(void) {
+     int handed = 0;
+     while (admit->slotsInUse < options.backendSlots) {
+         long rounds = -1;
+         for (int i = 0; i < ADMIT_TRANSFERS; i++) {
+             const struct admit_transfer *t = &admit->transfers[i];
+             if (t->state == ADMIT_WAITING) {
+                 long need = t->cost > t->deficit ? (t->cost - t->deficit + DRR_QUANTUM - 1) / DRR_QUANTUM : 1;
+                 if (rounds < 0 || need < rounds) rounds = need;
+             }
+         }
+         if (rounds < 0) {
+             break;
+         }
+         for (int i = 0; i < ADMIT_TRANSFERS; i++) {
+             if (admit->transfers[i].state == ADMIT_WAITING) {
+                 admit->transfers[i].deficit += (rounds - 1) * DRR_QUANTUM;
+             }
+         }
+         // The last round, from where the previous one stopped
+         for (int k = 0; k < ADMIT_TRANSFERS; k++) {
+             int i = (admit->next + k) % ADMIT_TRANSFERS;
+             struct admit_transfer *t = &admit->transfers[i];
+             if (t->state != ADMIT_WAITING) {
+                 continue;
+             }
+             t->deficit += DRR_QUANTUM;
+             if (t->deficit >= t->cost) {
+                 t->state = ADMIT_SLOT;
+                 admit->slotsInUse++;
+                 admit->next = (i + 1) % ADMIT_TRANSFERS;
+                 handed = 1;
+                 break;
+             }
+         }
+     }
+     if (handed) {
+         pthread_cond_broadcast(&admit->granted);
+     }
+ }
+ 
+ // Unlocks and sends the BUSY refusal.
+ static int admit_refuse(struct client_session *client, long retrySecs, const char *reason) {
+     pthread_mutex_unlock(&admit->lock);
+     char msg[128];
+     snprintf(msg, sizeof(msg), "ERROR: BUSY retry-after %ld (%s)\n", retrySecs > 0 ? retrySecs : 1, reason);
+     LOG_DEBUG("Refused a transfer: %s", reason);
+     reply_line(client, msg);
+     return -1;
+ }
+ 
+ int admit_transfer(struct client_session *client, const char *path, long size) {
+     if (!admit) {
+         return 0;
+     }
+     int backend = path ? route_backend(path) : 0;
+     int needsSlot = options.backendSlots > 0 && backend >= 0 && backend != BACKEND_LOCAL;
+     admit_lock();
+     if (options.clientRateMb > 0) {
+         struct admit_client *c = admit_bucket(client->peer, admit_now_ns());
+         if (c->tokens < 0) {
+             double rate = (double)options.clientRateMb * 1024 * 1024;
+             return admit_refuse(client, (long)(-c->tokens / rate) + 1, "transfer rate limit");
+         }
+     }
+     int mine = 0, entry = -1;
+     for (int pass = 0; pass < 2 && entry < 0; pass++) {
+         if (pass == 1) {
+             admit_reclaim();   // Table full: maybe of entries nobody will end
+         }
+         mine = 0;
+         for (int i = 0; i < ADMIT_TRANSFERS; i++) {
+             const struct admit_transfer *t = &admit->transfers[i];
+             if (t->state == ADMIT_FREE) {
+                 if (entry < 0) entry = i;
+             } else if (t->addr == client->peer) {
+                 mine++;
+             }
+         }
+     }
+     if (options.clientTransfers > 0 && mine >= options.clientTransfers) {
+         return admit_refuse(client, 1, "too many transfers from this address");
+     }
+     if (entry < 0) {
+         return admit_refuse(client, 1, "too many transfers");
+     }
+     struct admit_transfer *t = &admit->transfers[entry];
+     t->pid = getpid();
+     t->addr = client->peer;
+     t->state = ADMIT_RUNNING;
+     t->deficit = 0;
+     t->cost = size >= 0 ? size : client->lastTransfer;
+     if (needsSlot) {
+         t->state = ADMIT_WAITING;
+         if (admit->slotsInUse >= options.backendSlots) {
+             admit_reclaim();
+         }
+         admit_schedule();
+         struct timespec deadline;
+         clock_gettime(CLOCK_MONOTONIC, &deadline);
+         deadline.tv_sec += options.slotWaitMs / 1000;
+         deadline.tv_nsec += (long)(options.slotWaitMs % 1000) * 1000000;
+         if (deadline.tv_nsec >= 1000000000) {
+             deadline.tv_sec++;
+             deadline.tv_nsec -= 1000000000;
+         }
+         while (t->state == ADMIT_WAITING) {
+             int rc = pthread_cond_timedwait(&admit->granted, &admit->lock, &deadline);
+             if (rc == EOWNERDEAD) {
+                 pthread_mutex_consistent(&admit->lock);
+             } else if (rc == ETIMEDOUT) {
+                 break;
+             }
+         }
+         if (t->state == ADMIT_WAITING) {
+             t->state = ADMIT_FREE;
+             return admit_refuse(client, (options.slotWaitMs + 999) / 1000, "no transfer slot free");
+         }
+     }
+     pthread_mutex_unlock(&admit->lock);
+     admitEntry = entry;
+     return 0;
+ }
+ 
+ void admit_release(struct client_session *client) {
+     if (admitEntry < 0) {
+         return;
+     }
+     long moved = req.bytesIn + req.bytesOut;
+     client->lastTransfer = moved;
+     admit_lock();
+     struct admit_transfer *t = &admit->transfers[admitEntry];
+     if (options.clientRateMb > 0) {
+         struct admit_client *c = admit_bucket(t->addr, admit_now_ns());
+         c->tokens -= (double)(moved > ADMIT_MIN_COST ? moved : ADMIT_MIN_COST);
+     }
+     if (t->state == ADMIT_SLOT) {
+         admit->slotsInUse--;
+     }
+     t->state = ADMIT_FREE;
+     admit_schedule();
+     pthread_mutex_unlock(&admit->lock);
+     admitEntry = -1;
+ }
+ 
+ // ----------------------- COMMAND HANDLER DEFINITIONS ------------------------
+ 
+ /**
+  * @brief Handles 'uploadf' command: receives file bytes from client and
+  *        stores them in ~/S1 if .c, else streams them straight through to
+  *        the storage server the file is routed to (by default S2 for pdf,
+  *        S3 for txt, S4 for zip) without staging them on S1's disk.
+  * @return 0 on success, -2 if the file did not match the client's checksum,
+  *         -1 on other errors
+  */
+ int handle_upload(struct client_session *session, const char *filename, const char *destPath,
+                   long fileSize, long zLen) {
+     struct line_reader *client = &session->in;
+     long wireLen = zLen >= 0 ? zLen : fileSize;   // Body bytes on the socket
+     // A protocol 2 client may follow the body with its checksum (see CHECKSUMS)
+     int trailer = session->uploadCrc;
+     session->uploadCrc = 0;
+     long drainLen = wireLen + (trailer ? (long)sizeof(uint32_t) : 0);
+     // Identify file extension
+     const char *ext = strrchr(filename, '.');
+     if (!ext) {
+         // No extension found
+         LOG_WARN("Upload error: file has no extension");
+         // Drain incoming data from socket to keep it in sync
+         drain_socket(client, drainLen);
+         return -1;
+     }
+ 
+     // Build S1 base path: ~/S1
+     char *homeDir = getenv("HOME");
+     if (!homeDir) {
+         drain_socket(client, drainLen);
+         return -1;
+     }
+     char basePath[512];
+     snprintf(basePath, sizeof(basePath), "%s/S1", homeDir);
+ 
+     // Replace "~S1" with basePath
+     char destCopy[512];
+     strncpy(destCopy, destPath, sizeof(destCopy) - 1);
+     destCopy[sizeof(destCopy) - 1] = '\0';
+     // Remove trailing slash if present
+     size_t destLen = strlen(destCopy);
+     if (destLen > 0 && destCopy[destLen - 1] == '/') {
+         destCopy[destLen - 1] = '\0';
+     }
+     const char *subPath = destCopy;
+     if (strncmp(destCopy, "~S1", 3) == 0) {
+         subPath = destCopy + 3;
+         if (*subPath == '/') subPath++;
+     }
+ 
+     // Non-.c files are never written to ~/S1: open the storage server
+     // connection now and pipe the client's bytes to it as they arrive.
+     if (strcmp(ext, ".c") != 0) {
+         // Construct relative path for server (replace ~S1 with their base).
+         // Already have subPath for everything after ~S1
+         char remotePath[512];
+         if (*subPath) {
+             snprintf(remotePath, sizeof(remotePath), "%s/%s", subPath, filename);
+         } else {
+             snprintf(remotePath, sizeof(remotePath), "%s", filename);
+         }
+         int nodes[MAX_BACKENDS];
+         int replicas = route_nodes(remotePath, nodes, replicaCount);
+         if (replicas <= 0) {
+             LOG_WARN("Unsupported file extension: %s", ext);
+             drain_socket(client, drainLen);
+             return -1;
+         }
+ 
+         // The first reachable replica gets the file and passes it down the
+         // chain of the others, so it crosses S1's link only once
+         int head = 0, sfd = -1;
+         while (head < replicas && (sfd = backend_acquire(nodes[head], NULL)) < 0) {
+             head++;
+         }
+         if (sfd < 0) {
+             LOG_WARN("Could not connect to server for file forwarding");
+             drain_socket(client, drainLen);
+             return -1;
+         }
+         int backend = nodes[head];
+ 
+         // Send the store command
+         char header[1600];
+         int headerLen = store_header(header, sizeof(header), remotePath, fileSize, zLen, trailer,
+                                      nodes + head + 1, replicas - head - 1);
+         // Corked so a small body leaves with the header instead of waiting
+         // behind Nagle; the trailer, or the end of the body, uncorks
+         tcp_cork(sfd, 1);
+         if (headerLen < 0 || send_all(sfd, header, (size_t)headerLen) != 0) {
+             LOG_WARN("Error sending STORE command");
+             close(sfd);
+             drain_socket(client, drainLen);
+             return -1;
+         }
+ 
+         // Cut-through: client socket -> storage server socket (a deflated
+         // body stays deflated; the storage server inflates it)
+         int rc = relay_bytes(client, sfd, wireLen);
+         if (!trailer) {
+             tcp_cork(sfd, 0);
+         }
+         // The client's checksum goes on to the storage server, which compares
+         // it with what it received before it keeps the file
+         uint32_t crc;
+         if (rc == 0 && trailer && recv_client_trailer(session, &crc) != 0) {
+             rc = -1;
+         } else if (rc == 0 && trailer && send_backend_trailer(sfd, crc) != 0) {
+             rc = -2;
+         } else if (rc == -2 && trailer) {
+             drain_socket(client, sizeof(uint32_t));
+         }
+         if (rc != 0) {
+             if (rc == -1) {
+                 LOG_WARN("Connection lost while receiving file");
+             } else {
+                 LOG_WARN("Error forwarding file data");
+             }
+             close(sfd);
+             return -1;
+         }
+ 
+         // Wait for server's response
+         char ack[100];
+         struct line_reader reply;
+         reader_init(&reply, sfd);
+         if (reader_getline(&reply, ack, sizeof(ack)) >= 0) {
+             backend_release(backend, sfd);
+         } else {
+             close(sfd);
+         }
+         // Even a failed STORE may have replaced or removed the old file
+         cache_invalidate(remotePath);
+ 
+         int copies = store_copies(ack);
+         if (copies == 0) {
+             LOG_WARN("Server storing file responded with error: %s", ack);
+             return strncmp(ack, "ERROR: Checksum mismatch", 24) == 0 ? -2 : -1;
+         }
+         if (copies < replicas) {
+             LOG_WARN("Stored %d of %d copies of %s; the repair pass adds the others", copies, replicas,
+                 remotePath);
+         }
+         LOG_DEBUG("Streamed file %s (%ld bytes) to storage server", remotePath, fileSize);
+         return 0;
+     }
+ 
+     // Build full directory path inside ~/S1
+     char fullDir[512];
+     if (*subPath) {
+         snprintf(fullDir, sizeof(fullDir), "%s/%s", basePath, subPath);
+     } else {
+         snprintf(fullDir, sizeof(fullDir), "%s", basePath);
+     }
+ 
+     // Make sure the directory exists (but the instructions say user may have
+     // already created them); the file is then handled relative to it
+     int dirFd = dir_open(fullDir);
+     if (dirFd < 0) {
+         LOG_WARN("Directory creation failed for %s", fullDir);
+         // Drain data from socket
+         drain_socket(client, drainLen);
+         return -1;
+     }
+ 
+     // Open a temporary file that replaces the local one once the upload is
+     // complete (see DURABLE WRITES)
+     char fullPath[1024], tmpName[NAME_MAX + 64];
+     snprintf(fullPath, sizeof(fullPath), "%s/%s", fullDir, filename);
+     FILE *fp = durable_open(dirFd, filename, fileSize, tmpName, sizeof(tmpName));
+     if (!fp) {
+         LOG_WARN("Failed to open %s/%s for writing: %s", fullDir, tmpName, strerror(errno));
+         close(dirFd);
+         // Drain incoming data
+         drain_socket(client, drainLen);
+         return -1;
+     }
+ 
+     // Receive file data from client; the checksum is taken in the same pass
+     uint32_t crc = 0;
+     int rc = 0;
+     struct file_writer out;
+     writer_init(&out, fp);
+     if (zLen >= 0) {
+         rc = inflate_to_file(client, &out, zLen, fileSize, &crc);
+     } else {
+         long remaining = fileSize;
+         char buf[BUF_SIZE];
+         while (remaining > 0) {
+             ssize_t r = reader_read(client, buf, (remaining < BUF_SIZE ? remaining : BUF_SIZE));
+             if (r <= 0) {
+                 rc = -1;
+                 break;
+             }
+             if (rc == 0 && writer_write(&out, buf, (size_t)r) != 0) {
+                 rc = -3;   // e.g. disk full; the rest of the body is still read
+             }
+             crc = crc32c(crc, buf, (size_t)r);
+             remaining -= r;
+         }
+     }
+     if (writer_finish(&out) != 0 && rc == 0) {
+         rc = -3;
+     }
+     uint32_t expected = crc;
+     if (rc != -1 && trailer && recv_client_trailer(session, &expected) != 0) {
+         rc = -1;
+     }
+     if (rc == 0 && expected != crc) {
+         rc = -4;
+     }
+     if (rc == 0 && (fflush(fp) != 0 || durable_rename(dirFd, fileno(fp), tmpName, filename) != 0)) {
+         rc = -3;
+     }
+     if (rc == 0) {
+         tar_note_change();
+     }
+     fclose(fp);
+     if (rc != 0) {
+         // The previous version of the file, if any, stays as it was
+         unlinkat(dirFd, tmpName, 0);
+     }
+     close(dirFd);
+     if (rc == -1) {
+         LOG_WARN("Connection lost while receiving file");
+         return -1;
+     }
+     if (rc == -4) {
+         LOG_WARN("Checksum mismatch for %s", fullPath);
+         return -2;
+     }
+     if (rc != 0) {
+         if (rc == -2) {
+             LOG_WARN("Damaged compressed upload of %s", fullPath);
+         } else {
+             LOG_WARN("Failed to write %s: %s", fullPath, strerror(errno));
+         }
+         return -1;
+     }
+     if (zLen >= 0) {
+         LOG_DEBUG("Received file %s (size %ld bytes, %ld deflated)", fullPath, fileSize, zLen);
+     } else {
+         LOG_DEBUG("Received file %s (size %ld bytes)", fullPath, fileSize);
+     }
+     return 0;
+ }
+ 
+ // Multipart uploads. A large file can be uploaded as parts sent over several connections at
+ // once: "uploadp" carries one part, "uploadc" commits the file once every
+ // part has been acknowledged (or aborts it). Parts are written in place with
+ // pwrite into a hidden ".<name>.<id>.part" file next to the destination,
+ // preallocated to the full size; each stored part appends "<offset> <length>"
+ // to ".<name>.<id>.map". Commit renames the part file over the destination
+ // only if the map covers every byte, so readers never see a partial file.
+ // Non-.c files are assembled the same way by their storage server (PART,
+ // COMMIT, ABORT). All state is on disk, so parts may be served by different
+ // S1 processes or workers.
+ 
+ /**
+  * @brief Upload ids are chosen by the client and end up in file names, so
+  *        only short hex strings are accepted.
+  */
+ int valid_upload_id(const char *id) {
+     size_t len = id ? strspn(id, "0123456789abcdefABCDEF") : 0;
+     return len > 0 && len <= MAX_UPLOAD_ID && id[len] == '\0';
+ }
+ 
+ /**
+  * @brief Maps an upload destination to where it is stored.
+  * @param remotePath Receives the path relative to ~S1 ("<dir>/<filename>")
+  * @return As route_backend(), or -1 if the path does not fit
+  */
+ static int upload_route(const char *filename, const char *destPath, char *remotePath, size_t size) {
+     char destCopy[512];
+     snprintf(destCopy, sizeof(destCopy), "%s", destPath);
+     size_t destLen = strlen(destCopy);
+     if (destLen > 0 && destCopy[destLen - 1] == '/') {
+         destCopy[destLen - 1] = '\0';
+     }
+     const char *subPath = destCopy;
+     if (strncmp(destCopy, "~S1", 3) == 0) {
+         subPath = destCopy + 3;
+         if (*subPath == '/') subPath++;
+     }
+     int n = *subPath ? snprintf(remotePath, size, "%s/%s", subPath, filename)
+                      : snprintf(remotePath, size, "%s", filename);
+     return (n >= 0 && (size_t)n < size) ? route_backend(remotePath) : -1;
+ }
+ 
+ /**
+  * @brief Builds the destination, part and map paths in ~/S1 for upload `id`
+  *        of `remotePath`. Each buffer has `size` bytes.
+  * @return 0, or -1 if HOME is unset or the paths do not fit
+  */
+ static int local_upload_paths(const char *remotePath, const char *id, char *fullPath,
+                               char *partPath, char *mapPath, size_t size) {
+     char *homeDir = getenv("HOME");
+     if (!homeDir) {
+         return -1;
+     }
+     const char *name = strrchr(remotePath, '/');
+     int dirLen = name ? (int)(name - remotePath + 1) : 0;
+     name = name ? name + 1 : remotePath;
+     int n = snprintf(partPath, size, "%s/S1/%.*s.%s.%s.part", homeDir, dirLen, remotePath, name, id);
+     if (n < 0 || (size_t)n >= size) {
+         return -1;
+     }
+     snprintf(mapPath, size, "%s/S1/%.*s.%s.%s.map", homeDir, dirLen, remotePath, name, id);
+     snprintf(fullPath, size, "%s/S1/%s", homeDir, remotePath);
+     return 0;
+ }
+ 
+ struct part_range {
+     long offset, length;
+ };
+ 
+ static int part_range_cmp(const void *a, const void *b) {
+     const struct part_range *x = a, *y = b;
+     return (x->offset > y->offset) - (x->offset < y->offset);
+ }
+ 
+ /**
+  * @brief Checks that the parts recorded in a map file cover a whole file.
+  *        Parts may be recorded in any order, overlap, or appear twice after
+  *        a retry.
+  * @return 1 if every byte of the `total`-byte file has been stored
+  */
+ static int parts_cover(const char *mapPath, long total) {
+     FILE *fp = fopen(mapPath, "r");
+     if (!fp) {
+         return total == 0;
+     }
+     struct part_range *ranges = NULL;
+     size_t count = 0, cap = 0;
+     long offset, length;
+     int ok = 1;
+     while (fscanf(fp, "%ld %ld", &offset, &length) == 2) {
+         if (count == cap) {
+             size_t newCap = cap ? cap * 2 : 64;
+             struct part_range *grown = realloc(ranges, newCap * sizeof(*grown));
+             if (!grown) {
+                 ok = 0;
+                 break;
+             }
+             ranges = grown;
+             cap = newCap;
+         }
+         ranges[count].offset = offset;
+         ranges[count].length = length;
+         count++;
      }
      fclose(fp);
+     long reach = 0;
+     if (ok && count > 0) {
+         qsort(ranges, count, sizeof(*ranges), part_range_cmp);
+         for (size_t i = 0; i < count && ranges[i].offset <= reach; i++) {
+             if (ranges[i].offset + ranges[i].length > reach) {
+                 reach = ranges[i].offset + ranges[i].length;
+             }
+         }
+     }
+     free(ranges);
+     return ok && reach >= total;
+ }
  
-     LOG("Received file %s (size %ld bytes)", fullPath, fileSize);
+ /**
+  * @brief Handles 'uploadp': stores `length` bytes at `offset` of a `total`-
+  *        byte file being uploaded in parts. .c parts are written into ~/S1;
+  *        other parts are streamed as a PART command to the first reachable
+  *        replica, which the commit then copies the file from.
+  * @return 0 if the part is stored, -1 otherwise
+  */
+ int handle_upload_part(struct client_session *session, const char *uploadId, const char *filename,
+                        const char *destPath, long total, long offset, long length) {
+     struct line_reader *client = &session->in;
+     char remotePath[512];
+     int backend = upload_route(filename, destPath, remotePath, sizeof(remotePath));
+     if (backend < 0) {
+         LOG_WARN("Unsupported file for multipart upload: %s", filename);
+         drain_socket(client, length);
+         return -1;
+     }
  
-     // If file is .c, keep it in S1
-     if (strcmp(ext, ".c") == 0) {
+     if (backend != BACKEND_LOCAL) {
+         int nodes[MAX_BACKENDS];
+         int replicas = route_nodes(remotePath, nodes, replicaCount);
+         int sfd = -1;
+         for (int i = 0; i < replicas && sfd < 0; i++) {
+             backend = nodes[i];
+             sfd = backend_acquire(backend, NULL);
+         }
+         if (sfd < 0) {
+             LOG_WARN("Could not connect to server for file forwarding");
+             drain_socket(client, length);
+             return -1;
+         }
+         char header[700];
+         snprintf(header, sizeof(header), "PART %s %s %ld %ld %ld\n", uploadId, remotePath,
+                  total, offset, length);
+         tcp_cork(sfd, 1);   // Header and a small part in one segment, as in handle_upload()
+         if (send_all(sfd, header, strlen(header)) != 0) {
+             LOG_WARN("Error sending PART command");
+             close(sfd);
+             drain_socket(client, length);
+             return -1;
+         }
+         int rc = relay_bytes(client, sfd, length);
+         tcp_cork(sfd, 0);
+         if (rc != 0) {
+             if (rc == -1) {
+                 LOG_WARN("Connection lost while receiving part");
+             } else {
+                 LOG_WARN("Error forwarding part data");
+             }
+             close(sfd);
+             return -1;
+         }
+         char ack[100];
+         struct line_reader reply;
+         reader_init(&reply, sfd);
+         if (reader_getline(&reply, ack, sizeof(ack)) < 0) {
+             close(sfd);
+             return -1;
+         }
+         backend_release(backend, sfd);
+         if (strncmp(ack, "SUCCESS", 7) != 0) {
+             LOG_WARN("Server storing part responded with error: %s", ack);
+             return -1;
+         }
          return 0;
      }
  
-     // Otherwise, forward to S2 (.pdf), S3 (.txt), or S4 (.zip). Then remove local copy.
-     const char *serverAddr;
-     int serverPort;
-     if (strcmp(ext, ".pdf") == 0) {
-         serverAddr = S2_ADDR; serverPort = S2_PORT;
-     } else if (strcmp(ext, ".txt") == 0) {
-         serverAddr = S3_ADDR; serverPort = S3_PORT;
-     } else if (strcmp(ext, ".zip") == 0) {
-         serverAddr = S4_ADDR; serverPort = S4_PORT;
-     } else {
-         LOG("Unsupported file extension: %s", ext);
-         remove(fullPath);
+     char fullPath[1024], partPath[1024], mapPath[1024];
+     if (local_upload_paths(remotePath, uploadId, fullPath, partPath, mapPath, sizeof(fullPath)) != 0) {
+         drain_socket(client, length);
+         return -1;
+     }
+     char fullDir[1024];
+     snprintf(fullDir, sizeof(fullDir), "%s", fullPath);
+     *strrchr(fullDir, '/') = '\0';
+     if (ensure_directory_exists(fullDir) != 0) {
+         LOG_WARN("Directory creation failed for %s", fullDir);
+         drain_socket(client, length);
+         return -1;
+     }
+     // The first part to arrive reserves space for the whole file
+     int fd = open(partPath, O_WRONLY | O_CREAT | O_CLOEXEC, 0644);
+     struct stat st;
+     if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size < total &&
+         posix_fallocate(fd, 0, total) != 0 && ftruncate(fd, total) != 0) {
+         close(fd);
+         fd = -1;
+     }
+     if (fd < 0) {
+         LOG_WARN("Failed to open %s for writing: %s", partPath, strerror(errno));
+         drain_socket(client, length);
          return -1;
      }
  
-     // Connect to the target storage server
-     int sfd = socket(AF_INET, SOCK_STREAM, 0);
-     if (sfd < 0) {
-         LOG("Socket creation failed for forwarding");
-         remove(fullPath);
+     long remaining = length;
+     off_t pos = offset;
+     int writeFailed = 0;
+     char buf[BUF_SIZE];
+     while (remaining > 0) {
+         ssize_t r = reader_read(client, buf, (remaining < BUF_SIZE ? remaining : BUF_SIZE));
+         if (r <= 0) {
+             close(fd);
+             LOG_WARN("Connection lost while receiving part");
+             return -1;
+         }
+         if (!writeFailed && pwrite(fd, buf, r, pos) != r) {
+             writeFailed = 1;
+         }
+         pos += r;
+         remaining -= r;
+     }
+     close(fd);
+ 
+     char record[64];
+     int recordLen = snprintf(record, sizeof(record), "%ld %ld\n", offset, length);
+     int mapFd = writeFailed ? -1 : open(mapPath, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+     int rc = (mapFd >= 0 && write(mapFd, record, recordLen) == recordLen) ? 0 : -1;
+     if (mapFd >= 0) {
+         close(mapFd);
+     }
+     if (rc != 0) {
+         LOG_WARN("Failed to store part of %s at %ld", fullPath, offset);
+     }
+     return rc;
+ }
+ 
+ /**
+  * @brief Handles 'uploadc': makes a file uploaded in parts visible at its
+  *        destination, or (`discard`) throws its parts away. The replica that
+  *        got the parts commits the file, which is then copied from it to the
+  *        other replicas in one chained STORE; an abort goes to every replica.
+  * @return 0 on success, -2 if not every part has arrived, -1 on other errors
+  */
+ int handle_upload_commit(const char *uploadId, const char *filename, const char *destPath,
+                          long total, int discard) {
+     char remotePath[512];
+     int backend = upload_route(filename, destPath, remotePath, sizeof(remotePath));
+     if (backend < 0) {
          return -1;
      }
-     struct sockaddr_in serv;
-     memset(&serv, 0, sizeof(serv));
-     serv.sin_family = AF_INET;
-     serv.sin_port = htons(serverPort);
-     if (inet_pton(AF_INET, serverAddr, &serv.sin_addr) <= 0) {
-         LOG("Invalid address for server %s", serverAddr);
-         close(sfd);
-         remove(fullPath);
+ 
+     if (backend != BACKEND_LOCAL) {
+         char cmd[700];
+         if (discard) {
+             snprintf(cmd, sizeof(cmd), "ABORT %s %s\n", uploadId, remotePath);
+         } else {
+             snprintf(cmd, sizeof(cmd), "COMMIT %s %s %ld\n", uploadId, remotePath, total);
+         }
+         // As for the parts, the first replica that answers is the one
+         int nodes[MAX_BACKENDS];
+         int replicas = route_nodes(remotePath, nodes, replicaCount);
+         int head = -1, answered = 0;
+         char ack[100];
+         for (int i = 0; i < replicas && (discard || head < 0); i++) {
+             char line[100];
+             struct line_reader reply;
+             int sfd = backend_command(nodes[i], cmd, &reply, line, sizeof(line));
+             if (sfd < 0) {
+                 continue;
+             }
+             backend_release(nodes[i], sfd);
+             if (!answered++ || strncmp(line, "SUCCESS", 7) == 0) {
+                 snprintf(ack, sizeof(ack), "%s", line);
+             }
+             if (strncmp(line, "SUCCESS", 7) == 0 && head < 0) {
+                 head = i;
+             }
+             if (!discard) {
+                 break;
+             }
+         }
+         if (!discard) {
+             cache_invalidate(remotePath);
+         }
+         if (!answered) {
+             return -1;
+         }
+         if (head < 0) {
+             LOG_WARN("Server could not %s %s: %s", discard ? "abort" : "commit", remotePath, ack);
+             return strstr(ack, "Incomplete") ? -2 : -1;
+         }
+         if (!discard && replicas > 1) {
+             int chain[MAX_BACKENDS], count = 0;
+             for (int i = 0; i < replicas; i++) {
+                 if (i != head) {
+                     chain[count++] = nodes[i];
+                 }
+             }
+             int copied = backend_copy(nodes[head], chain[0], remotePath, chain + 1, count - 1);
+             int copies = 1 + (copied > 0 ? copied : 0);
+             if (copies < replicas) {
+                 LOG_WARN("Stored %d of %d copies of %s; the repair pass adds the others", copies,
+                     replicas, remotePath);
+             }
+         }
+         LOG_DEBUG("%s multipart upload of %s", discard ? "Aborted" : "Committed", remotePath);
+         return 0;
+     }
+ 
+     char fullPath[1024], partPath[1024], mapPath[1024];
+     if (local_upload_paths(remotePath, uploadId, fullPath, partPath, mapPath, sizeof(fullPath)) != 0) {
          return -1;
      }
-     if (connect(sfd, (struct sockaddr*)&serv, sizeof(serv)) < 0) {
-         LOG("Could not connect to server for file forwarding");
-         close(sfd);
-         remove(fullPath);
+     if (discard) {
+         unlink(partPath);
+         unlink(mapPath);
+         LOG_DEBUG("Aborted multipart upload of %s", fullPath);
+         return 0;
+     }
+     struct stat st;
+     if (stat(partPath, &st) != 0 || st.st_size != total || !parts_cover(mapPath, total)) {
+         LOG_WARN("Multipart upload of %s is incomplete", fullPath);
+         return -2;
+     }
+     char fullDir[1024];
+     snprintf(fullDir, sizeof(fullDir), "%s", fullPath);
+     *strrchr(fullDir, '/') = '\0';
+     int dirFd = dir_open(fullDir);
+     int fd = open(partPath, O_RDONLY | O_CLOEXEC);
+     int committed = dirFd >= 0 && fd >= 0 &&
+                     durable_rename(dirFd, fd, strrchr(partPath, '/') + 1, strrchr(fullPath, '/') + 1) == 0;
+     if (fd >= 0) {
+         close(fd);
+     }
+     if (dirFd >= 0) {
+         close(dirFd);
+     }
+     if (!committed) {
+         LOG_WARN("Failed to commit %s: %s", fullPath, strerror(errno));
          return -1;
      }
+     unlink(mapPath);
+     tar_note_change();
+     LOG_DEBUG("Committed multipart upload of %s (%ld bytes)", fullPath, total);
+     return 0;
+ }
  
-     // Construct relative path for server (replace ~S1 with their base).
-     // Already have subPath for everything after ~S1
+ /**
+  * @brief Handles 'uploadh': stores a file the client has only described by
+  *        its size and XXH64 hash. Storage servers running with --dedup are
+  *        asked to LINK the path to contents they already hold, so an
+  *        identical file (say the same zip uploaded to many directories)
+  *        is not sent again. The client uploads the bytes as usual when this
+  *        fails. .c files are kept by S1 itself and are never deduplicated.
+  * @return 0 if at least one replica linked the file, -2 if none holds the
+  *         contents, -1 on other errors
+  */
+ int handle_upload_link(const char *filename, const char *destPath, long fileSize, const char *hash) {
      char remotePath[512];
-     if (*subPath) {
-         snprintf(remotePath, sizeof(remotePath), "%s/%s", subPath, filename);
-     } else {
-         snprintf(remotePath, sizeof(remotePath), "%s", filename);
+     int backend = upload_route(filename, destPath, remotePath, sizeof(remotePath));
+     if (backend < 0) {
+         return -1;
+     }
+     if (backend == BACKEND_LOCAL) {
+         return -2;
+     }
+     int nodes[MAX_BACKENDS];
+     int replicas = route_nodes(remotePath, nodes, replicaCount);
+     char cmd[700];
+     snprintf(cmd, sizeof(cmd), "LINK %s %ld %s\n", remotePath, fileSize, hash);
+     int linked = 0;
+     for (int i = 0; i < replicas; i++) {
+         char ack[100];
+         struct line_reader reply;
+         int sfd = backend_command(nodes[i], cmd, &reply, ack, sizeof(ack));
+         if (sfd < 0) {
+             continue;
+         }
+         backend_release(nodes[i], sfd);
+         if (strncmp(ack, "SUCCESS", 7) == 0) {
+             linked++;
+         }
+     }
+     if (linked == 0) {
+         return -2;
+     }
+     cache_invalidate(remotePath);
+     if (linked < replicas) {
+         LOG_WARN("Linked %d of %d copies of %s; the repair pass adds the others", linked, replicas,
+             remotePath);
+     }
+     LOG_DEBUG("Linked %s (%ld bytes) to stored contents", remotePath, fileSize);
+     return 0;
+ }
+ 
+ // Batch commands. "uploadm", "downlm" and "removem" carry many files in one
+ // request whose body (the v2 payload) holds the entries. Entries for the
+ // same storage server share one connection, and their STORE/GET/DEL
+ // commands are pipelined up to BATCH_WINDOW deep, so a batch costs a few
+ // round trips per server rather than one per file. The outcome for every
+ // entry comes back in the same response, as a "SUCCESS <path>" or
+ // "ERROR <path>: <reason>" line.
+ 
+ struct batch_entry {
+     const char *path;        // as sent by the client ("~S1/...")
+     char subPath[512];       // relative to ~S1
+     int backend;             // see route_backend()
+     int nodes[MAX_BACKENDS]; // all servers of its type, see route_nodes()
+     int nodeCount;
+     int removed;             // removem: deleted from at least one of them
+     const char *error;       // why the entry failed, NULL if it did not
+ };
+ 
+ /**
+  * @brief Reads a manifest of newline-separated "~S1/..." paths (a downlm or
+  *        removem body) and resolves every entry.
+  * @param manifest Receives the manifest, which the entries point into
+  * @param entries Receives the entries; both are freed by the caller
+  * @return Number of entries, or -1 if the manifest could not be read
+  */
+ static long batch_read_manifest(struct line_reader *in, long length, char **manifest,
+                                 struct batch_entry **entries) {
+     *manifest = NULL;
+     *entries = NULL;
+     if (length <= 0 || length > MAX_BATCH_MANIFEST) {
+         drain_socket(in, length);
+         return -1;
+     }
+     char *text = malloc((size_t)length + 1);
+     if (!text) {
+         drain_socket(in, length);
+         return -1;
+     }
+     if (recv_all(in, text, (size_t)length) != 0) {
+         free(text);
+         return -1;
+     }
+     text[length] = '\0';
+     long count = 0;
+     for (long i = 0; i < length; i++) {
+         count += text[i] == '\n';
+     }
+     struct batch_entry *e = calloc((size_t)count + 1, sizeof(*e));
+     if (!e) {
+         free(text);
+         return -1;
+     }
+     long n = 0;
+     char *saveptr;
+     for (char *line = strtok_r(text, "\n", &saveptr); line; line = strtok_r(NULL, "\n", &saveptr)) {
+         struct batch_entry *b = &e[n++];
+         b->path = line;
+         const char *rel = line;
+         if (strncmp(rel, "~S1", 3) == 0) {
+             rel += 3;
+             if (*rel == '/') rel++;
+         }
+         int len = snprintf(b->subPath, sizeof(b->subPath), "%s", rel);
+         b->nodeCount = (len > 0 && (size_t)len < sizeof(b->subPath)) ?
+                        route_nodes(b->subPath, b->nodes, MAX_BACKENDS) : 0;
+         b->backend = b->nodeCount > 0 ? b->nodes[0] : -1;
+         if (b->backend < 0) {
+             b->error = "Unsupported file type";
+         }
+     }
+     *manifest = text;
+     *entries = e;
+     return n;
+ }
+ 
+ // Appends one entry's "SUCCESS <path>" / "ERROR <path>: <reason>" line.
+ static int batch_status(struct text_buf *out, const char *path, const char *error) {
+     char line[700];
+     int n = error ? snprintf(line, sizeof(line), "ERROR %s: %s\n", path, error)
+                   : snprintf(line, sizeof(line), "SUCCESS %s\n", path);
+     return text_append(out, line, n < (int)sizeof(line) ? (size_t)n : sizeof(line) - 1);
+ }
+ 
+ /**
+  * @brief Sends a chunk of the downlm stream: "<hex length>\n" followed by
+  *        `len` bytes of `data` (NULL when the caller sends the bytes itself).
+  */
+ static int batch_chunk(int sock, const char *data, size_t len) {
+     char header[32];
+     snprintf(header, sizeof(header), "%zx\n", len);
+     if (send_all(sock, header, strlen(header)) != 0) {
+         return -1;
+     }
+     return data ? send_all(sock, data, len) : 0;
+ }
+ 
+ /**
+  * @brief Sends one downlm record: "SUCCESS <size> <path>\n" as a chunk,
+  *        then (if size > 0) a chunk header for the body, which the caller
+  *        sends; or "ERROR <path>: <reason>\n".
+  */
+ static int batch_record(int sock, const char *path, long size, const char *error) {
+     char line[700];
+     int n = error ? snprintf(line, sizeof(line), "ERROR %s: %s\n", path, error)
+                   : snprintf(line, sizeof(line), "SUCCESS %ld %s\n", size, path);
+     if (batch_chunk(sock, line, n < (int)sizeof(line) ? (size_t)n : sizeof(line) - 1) != 0) {
+         return -1;
+     }
+     return (!error && size > 0) ? batch_chunk(sock, NULL, (size_t)size) : 0;
+ }
+ 
+ // Returns 1 if `backend` is one of the servers of the entry's type.
+ static int batch_on_node(const struct batch_entry *e, int backend) {
+     for (int i = 0; i < e->nodeCount; i++) {
+         if (e->nodes[i] == backend) {
+             return 1;
+         }
+     }
+     return 0;
+ }
+ 
+ /**
+  * @brief Runs the entries of one storage server over one connection with up
+  *        to BATCH_WINDOW commands in flight: DEL for removem, sent to every
+  *        server of the type since replicas or files not yet rebalanced may
+  *        be on any of them, or GET for downlm (to the file's home server),
+  *        in which case every answer is relayed to the client as a record as
+  *        soon as it arrives.
+  * @return 0, or -1 if the client connection failed mid-stream
+  */
+ static int batch_pipeline(int clientSock, struct batch_entry *entries, long count, int backend,
+                           int download) {
+     long *todo = malloc((size_t)(count > 0 ? count : 1) * sizeof(*todo));
+     long n = 0;
+     for (long i = 0; todo && i < count; i++) {
+         int mine = download ? entries[i].backend == backend : batch_on_node(&entries[i], backend);
+         if (mine && !entries[i].error) {
+             todo[n++] = i;
+         }
+     }
+     if (!todo || n == 0) {
+         free(todo);
+         return 0;
+     }
+     int sfd = backend_acquire(backend, NULL);
+     struct line_reader reply;
+     reader_init(&reply, sfd);
+     long sent = 0, done = 0;
+     int rc = 0;
+     while (sfd >= 0 && done < n) {
+         while (sent < n && sent - done < BATCH_WINDOW) {
+             char cmd[600];
+             snprintf(cmd, sizeof(cmd), "%s %s\n", download ? "GET" : "DEL", entries[todo[sent]].subPath);
+             if (send_all(sfd, cmd, strlen(cmd)) != 0) {
+                 break;
+             }
+             sent++;
+         }
+         struct batch_entry *e = &entries[todo[done]];
+         char line[128];
+         if (done == sent || reader_getline(&reply, line, sizeof(line)) < 0) {
+             close(sfd);
+             sfd = -1;
+             break;
+         }
+         done++;
+         if (!download) {
+             e->removed |= strncmp(line, "SUCCESS", 7) == 0;
+             cache_invalidate(e->subPath);
+             continue;
+         }
+         if (strncmp(line, "ERROR", 5) == 0) {
+             e->error = "File not found";
+             if (batch_record(clientSock, e->path, 0, e->error) != 0) {
+                 rc = -1;
+                 break;
+             }
+             continue;
+         }
+         long size = atol(line);
+         if (batch_record(clientSock, e->path, size, NULL) != 0) {
+             rc = -1;
+             break;
+         }
+         // A body cut short cannot be recovered from (the record promised
+         // it), so the client is disconnected rather than left waiting. The
+         // server's checksum trailer has no place in the record and is dropped.
+         uint32_t crc;
+         int relayed = relay_bytes(&reply, clientSock, size);
+         if (relayed != 0 || read_backend_trailer(&reply, &crc) != 0) {
+             close(sfd);
+             shutdown(clientSock, SHUT_RDWR);
+             free(todo);
+             return -1;
+         }
+     }
+     if (sfd >= 0 && rc == 0) {
+         backend_release(backend, sfd);
+     } else if (sfd >= 0) {
+         close(sfd);
+     }
+     // Whatever is left never got an answer
+     for (long i = done; download && rc == 0 && i < n; i++) {
+         struct batch_entry *e = &entries[todo[i]];
+         e->error = "Storage server unavailable";
+         if (download && batch_record(clientSock, e->path, 0, e->error) != 0) {
+             rc = -1;
+         }
+     }
+     free(todo);
+     return rc;
+ }
+ 
+ /**
+  * @brief Handles 'downlm': sends every file of the manifest as a chunked
+  *        stream of records (see batch_record()), ending with "0\n".
+  */
+ int handle_batch_download(struct client_session *client, long manifestLen) {
+     int clientSock = client->in.fd;
+     char *manifest;
+     struct batch_entry *entries;
+     long count = batch_read_manifest(&client->in, manifestLen, &manifest, &entries);
+     if (count < 0) {
+         reply_line(client, "ERROR: Invalid manifest\n");
+         return -1;
+     }
+     int rc = reply_chunked(client);
+     char *homeDir = getenv("HOME");
+     // .c files from ~/S1 and unsupported entries first, then one server at a time
+     for (long i = 0; rc == 0 && i < count; i++) {
+         struct batch_entry *e = &entries[i];
+         if (e->backend != BACKEND_LOCAL) {
+             if (e->error) {
+                 rc = batch_record(clientSock, e->path, 0, e->error);
+             }
+             continue;
+         }
+         char localPath[1024];
+         snprintf(localPath, sizeof(localPath), "%s/S1/%s", homeDir ? homeDir : "", e->subPath);
+         int fd = homeDir ? open(localPath, O_RDONLY | O_CLOEXEC) : -1;
+         struct stat st;
+         if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+             e->error = "File not found";
+             rc = batch_record(clientSock, e->path, 0, e->error);
+         } else if ((rc = batch_record(clientSock, e->path, (long)st.st_size, NULL)) == 0) {
+             rc = send_file_fd(clientSock, fd, 0, (long)st.st_size, NULL);
+         }
+         if (fd >= 0) {
+             close(fd);
+         }
+     }
+     for (int b = 0; rc == 0 && b < numBackends; b++) {
+         rc = batch_pipeline(clientSock, entries, count, b, 1);
+     }
+     if (rc == 0) {
+         rc = send_all(clientSock, "0\n", 2);
+     }
+     LOG_DEBUG("Batch download of %ld files %s", count, rc == 0 ? "sent" : "failed");
+     free(entries);
+     free(manifest);
+     return rc;
+ }
+ 
+ /**
+  * @brief Handles 'removem': removes every file of the manifest and answers
+  *        with one status line per entry.
+  */
+ int handle_batch_remove(struct client_session *client, long manifestLen) {
+     char *manifest;
+     struct batch_entry *entries;
+     long count = batch_read_manifest(&client->in, manifestLen, &manifest, &entries);
+     if (count < 0) {
+         reply_line(client, "ERROR: Invalid manifest\n");
+         return -1;
+     }
+     for (long i = 0; i < count; i++) {
+         if (entries[i].backend == BACKEND_LOCAL && handle_remove(entries[i].path) != 0) {
+             entries[i].error = "File not found or cannot remove";
+         }
+     }
+     for (int b = 0; b < numBackends; b++) {
+         batch_pipeline(client->in.fd, entries, count, b, 0);
+     }
+     for (long i = 0; i < count; i++) {
+         if (entries[i].backend != BACKEND_LOCAL && !entries[i].error && !entries[i].removed) {
+             entries[i].error = "File not found or cannot remove";
+         }
+     }
+     struct text_buf out = { NULL, 0, 0 };
+     int rc = 0;
+     for (long i = 0; rc == 0 && i < count; i++) {
+         rc = batch_status(&out, entries[i].path, entries[i].error);
+     }
+     if (rc == 0 && reply_size(client, (long)out.len) == 0) {
+         rc = send_all(client->in.fd, out.data, out.len);
+     } else if (rc != 0) {
+         reply_line(client, "ERROR: Out of memory\n");
+     }
+     LOG_DEBUG("Batch remove of %ld files", count);
+     free(out.data);
+     free(entries);
+     free(manifest);
+     return rc;
+ }
+ 
+ // One storage server's connection during an uploadm batch
+ struct batch_store {
+     int sfd;                          // -1 until an entry needs it
+     struct line_reader reply;
+     int head, count;                  // STOREs sent but not acknowledged yet
+     char path[BATCH_WINDOW][600];     // their "~S1/..." paths
+     char key[BATCH_WINDOW][512];      // and cache keys
+ };
+ 
+ /**
+  * @brief Collects the oldest outstanding STORE ack of an uploadm connection
+  *        and records that entry's outcome. If the connection is gone, every
+  *        outstanding entry fails.
+  */
+ static void batch_store_ack(struct batch_store *s, struct text_buf *out) {
+     char ack[100];
+     if (s->sfd >= 0 && reader_getline(&s->reply, ack, sizeof(ack)) >= 0) {
+         cache_invalidate(s->key[s->head]);
+         batch_status(out, s->path[s->head],
+                      strncmp(ack, "SUCCESS", 7) == 0 ? NULL : "Server could not store the file");
+         s->head = (s->head + 1) % BATCH_WINDOW;
+         s->count--;
+         return;
      }
-     // Send the store command
-     char header[600];
-     snprintf(header, sizeof(header), "STORE %s %ld\n", remotePath, fileSize);
-     if (send_all(sfd, header, strlen(header)) != 0) {
-         LOG("Error sending STORE command");
-         close(sfd);
-         remove(fullPath);
-         return -1;
+     if (s->sfd >= 0) {
+         close(s->sfd);
+         s->sfd = -1;
+     }
+     for (; s->count > 0; s->count--, s->head = (s->head + 1) % BATCH_WINDOW) {
+         cache_invalidate(s->key[s->head]);
+         batch_status(out, s->path[s->head], "Storage server connection lost");
      }
+ }
  
-     // Forward file content
-     FILE *fp_in = fopen(fullPath, "rb");
-     if (!fp_in) {
-         LOG("Cannot reopen file for forwarding");
-         close(sfd);
-         remove(fullPath);
+ /**
+  * @brief Handles 'uploadm'. The body is a sequence of entries, each
+  *        "<filename> <dest_path> <size>\n" followed by the file's bytes,
+  *        `bodyLen` bytes in all. Entries are handled as they stream in:
+  *        .c files are written to ~/S1, the others are relayed to their
+  *        server over a connection kept for the whole batch, reading STORE
+  *        acks only once BATCH_WINDOW of them are outstanding. Answers with
+  *        one status line per entry.
+  * @return 0, or -1 if the client connection failed
+  */
+ int handle_batch_upload(struct client_session *client, long bodyLen) {
+     struct line_reader *in = &client->in;
+     struct text_buf out = { NULL, 0, 0 };
+     struct batch_store *stores = calloc(numBackends, sizeof(*stores));
+     if (!stores) {
+         drain_socket(in, bodyLen);
+         reply_line(client, "ERROR: Out of memory\n");
          return -1;
      }
-     char forwardBuf[BUF_SIZE];
-     size_t bytesRead;
-     while ((bytesRead = fread(forwardBuf, 1, BUF_SIZE, fp_in)) > 0) {
-         if (send_all(sfd, forwardBuf, bytesRead) != 0) {
-             LOG("Error forwarding file data");
-             fclose(fp_in);
-             close(sfd);
-             remove(fullPath);
-             return -1;
+     for (int b = 0; b < numBackends; b++) {
+         stores[b].sfd = -1;
+     }
+     long consumed = 0, files = 0;
+     int fatal = 0;
+     while (consumed < bodyLen) {
+         char header[MAX_CMD_LEN];
+         int len = reader_getline(in, header, sizeof(header));
+         if (len < 0) {
+             fatal = 1;
+             break;
+         }
+         consumed += len + 1;
+         char *saveptr;
+         char *filename = strtok_r(header, " ", &saveptr);
+         char *destPath = strtok_r(NULL, " ", &saveptr);
+         char *sizeStr = strtok_r(NULL, " ", &saveptr);
+         long size = sizeStr ? atol(sizeStr) : -1;
+         if (size < 0 || size > bodyLen - consumed) {
+             // Without a size the following entries cannot be found
+             drain_socket(in, bodyLen - consumed);
+             batch_status(&out, "uploadm", "Malformed entry; rest of the batch skipped");
+             break;
+         }
+         consumed += size;
+         files++;
+         char path[600], remotePath[512];
+         snprintf(path, sizeof(path), "%s/%s", destPath, filename);
+         int backend = upload_route(filename, destPath, remotePath, sizeof(remotePath));
+         if (backend < 0) {
+             drain_socket(in, size);
+             batch_status(&out, path, "Unsupported file type");
+             continue;
+         }
+         if (backend == BACKEND_LOCAL) {
+             int res = handle_upload(client, filename, destPath, size, -1);
+             batch_status(&out, path, res == 0 ? NULL : "Upload failed");
+             continue;
+         }
+ 
+         // As for uploadf, the first reachable replica passes the file on to the others
+         int nodes[MAX_BACKENDS];
+         int replicas = route_nodes(remotePath, nodes, replicaCount);
+         int head = 0;
+         struct batch_store *s = NULL;
+         for (; head < replicas; head++) {
+             s = &stores[nodes[head]];
+             if (s->count == BATCH_WINDOW) {
+                 batch_store_ack(s, &out);
+             }
+             if (s->sfd < 0 && (s->sfd = backend_acquire(nodes[head], NULL)) >= 0) {
+                 reader_init(&s->reply, s->sfd);
+             }
+             if (s->sfd >= 0) {
+                 break;
+             }
+         }
+         if (head == replicas) {
+             drain_socket(in, size);
+             batch_status(&out, path, "Storage server unavailable");
+             continue;
+         }
+         char cmd[1600];
+         int cmdLen = store_header(cmd, sizeof(cmd), remotePath, size, -1, 0, nodes + head + 1,
+                                   replicas - head - 1);
+         tcp_cork(s->sfd, 1);   // As in handle_upload()
+         int rc = (cmdLen >= 0 && send_all(s->sfd, cmd, (size_t)cmdLen) == 0) ? relay_bytes(in, s->sfd, size) : -3;
+         tcp_cork(s->sfd, 0);
+         if (rc == -1) {
+             // The client is gone halfway through a body the server still waits for
+             close(s->sfd);
+             s->sfd = -1;
+             batch_store_ack(s, &out);
+             fatal = 1;
+             break;
+         }
+         if (rc != 0) {
+             // The server went away: this entry and all unacknowledged ones fail
+             if (rc == -3) {
+                 drain_socket(in, size);
+             }
+             close(s->sfd);
+             s->sfd = -1;
+             batch_store_ack(s, &out);
+             cache_invalidate(remotePath);
+             batch_status(&out, path, "Storage server connection lost");
+             continue;
          }
+         int slot = (s->head + s->count) % BATCH_WINDOW;
+         snprintf(s->path[slot], sizeof(s->path[slot]), "%s", path);
+         snprintf(s->key[slot], sizeof(s->key[slot]), "%s", remotePath);
+         s->count++;
      }
-     fclose(fp_in);
  
-     // Wait for server's response
-     char ack[100];
-     int ackIdx = 0;
-     char ch;
-     while (ackIdx < (int)sizeof(ack) - 1) {
-         ssize_t n = recv(sfd, &ch, 1, 0);
-         if (n <= 0) break;
-         if (ch == '\n') break;
-         ack[ackIdx++] = ch;
+     for (int b = 0; b < numBackends; b++) {
+         while (stores[b].count > 0) {
+             batch_store_ack(&stores[b], &out);
+         }
+         if (stores[b].sfd >= 0) {
+             backend_release(b, stores[b].sfd);
+         }
+     }
+     free(stores);
+     int rc = -1;
+     if (!fatal && reply_size(client, (long)out.len) == 0) {
+         rc = send_all(in->fd, out.data, out.len);
      }
-     ack[ackIdx] = '\0';
-     close(sfd);
+     LOG_DEBUG("Batch upload of %ld files %s", files, rc == 0 ? "done" : "failed");
+     free(out.data);
+     return rc;
+ }
  
-     if (strncmp(ack, "SUCCESS", 7) != 0) {
-         LOG("Server storing file responded with error: %s", ack);
-         remove(fullPath);
+ /**
+  * @brief Limits a requested range to a file of `total` bytes.
+  * @param length Requested length, or -1 for the rest of the file
+  * @param count Receives the number of bytes to send
+  * @return 0, or -1 if `offset` lies beyond the end of the file
+  */
+ static int range_clamp(long total, long offset, long length, long *count) {
+     if (offset > total) {
          return -1;
      }
+     *count = (length < 0 || length > total - offset) ? total - offset : length;
+     return 0;
+ }
  
-     // Remove the local copy after successful forwarding
-     if (remove(fullPath) != 0) {
-         LOG("Warning: could not remove local file %s (errno: %d)", fullPath, errno);
+ /**
+  * @brief Announces a download: the whole file (offset < 0) or `count` bytes of it.
+  * @param trailer A checksum trailer follows the whole file (see CHECKSUMS)
+  */
+ static int reply_download(struct client_session *client, long offset, long count, long total,
+                           int trailer) {
+     if (trailer) {
+         return reply_size_crc(client, total);
      }
-
-     // Recursively remove empty directories from fullDir upward until basePath
-    char currentDir[512];
-    strncpy(currentDir, fullDir, sizeof(currentDir));
-
-    // Loop: attempt to remove currentDir and then climb one level up
-    while (strcmp(currentDir, basePath) != 0) {
-        if (rmdir(currentDir) == 0) {
-            LOG("Removed empty directory: %s", currentDir);
-            // Find the last slash to move to the parent directory.
-            char *lastSlash = strrchr(currentDir, '/');
-            if (lastSlash != NULL) {
-                *lastSlash = '\0';  // Remove the last directory component.
-            } else {
-                break;
-            }
-        } else {
-            // rmdir failed—either because the directory is not empty or another error occurred.
-            LOG("Directory %s not empty or could not be removed (errno: %d)", currentDir, errno);
-            break;
-        }
-    }
- 
-     LOG("Forwarded file to storage server and removed local copy: %s", filename);
-     return 0;
+     return offset < 0 ? reply_size(client, total) : reply_range(client, count, total);
  }
  
  /**
   * @brief Handles 'downlf' command: obtains a file from S1 (if .c) or from S2/S3/S4 and sends it to the client.
+  * @param offset First byte to send, or -1 for the whole file (plain size reply)
+  * @param length Bytes to send from `offset`, or -1 for the rest of the file
   */
- int handle_download(int clientSock, const char *filePath) {
+ int handle_download(struct client_session *client, const char *filePath, long offset, long length) {
+     int clientSock = client->in.fd;
      // Determine file extension
      const char *ext = strrchr(filePath, '.');
      if (!ext) {
          const char *errMsg = "ERROR: Invalid file path\n";
-         send_all(clientSock, errMsg, strlen(errMsg));
+         reply_line(client, errMsg);
          return -1;
      }
  
@@ -658,7 +7520,7 @@
      char *homeDir = getenv("HOME");
      if (!homeDir) {
          const char *errMsg = "ERROR: Internal error\n";
-         send_all(clientSock, errMsg, strlen(errMsg));
+         reply_line(client, errMsg);
          return -1;
      }
      char basePath[512];
@@ -680,144 +7542,239 @@
      char localPath[1024];
      snprintf(localPath, sizeof(localPath), "%s/%s", basePath, subPath);
  
+     // Whole files of a compressed type go deflated to a client that asked for
+     // it, and whole files carry a checksum trailer if it asked for that
+     int level = (client->deflate && offset < 0) ? compress_level(ext) : 0;
+     int trailer = client->crc && offset < 0;
+     uint32_t crc = 0;
+ 
      // If .c, read from local S1
      if (strcmp(ext, ".c") == 0) {
-         FILE *fp = fopen(localPath, "rb");
-         if (!fp) {
+         int fd = open(localPath, O_RDONLY);
+         struct stat st;
+         if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+             if (fd >= 0) close(fd);
              const char *errMsg = "ERROR: File not found\n";
-             send_all(clientSock, errMsg, strlen(errMsg));
+             reply_line(client, errMsg);
              return -1;
          }
-         // Send file size
-         fseek(fp, 0, SEEK_END);
-         long fileSize = ftell(fp);
-         fseek(fp, 0, SEEK_SET);
-         char sizeStr[64];
-         snprintf(sizeStr, sizeof(sizeStr), "%ld\n", fileSize);
-         if (send_all(clientSock, sizeStr, strlen(sizeStr)) != 0) {
-             fclose(fp);
+         // Send file size (or the range's)
+         long fileSize = (long)st.st_size;
+         long count = fileSize;
+         if (offset >= 0 && range_clamp(fileSize, offset, length, &count) != 0) {
+             close(fd);
+             reply_line(client, "ERROR: Invalid range\n");
              return -1;
          }
-         // Send file content
-         char buffer[BUF_SIZE];
-         size_t bytesRead;
-         while ((bytesRead = fread(buffer, 1, BUF_SIZE, fp)) > 0) {
-             if (send_all(clientSock, buffer, bytesRead) != 0) {
-                 fclose(fp);
-                 return -1;
+         if (level > 0 && fileSize >= COMPRESS_MIN_SIZE) {
+             int rc = send_deflated(client, fd, NULL, fileSize, level, trailer);
+             close(fd);
+             if (rc == 0) {
+                 LOG_DEBUG("Sent local file %s to client (%ld bytes, deflated)", localPath, fileSize);
              }
+             return rc;
+         }
+         if (reply_download(client, offset, count, fileSize, trailer) != 0) {
+             close(fd);
+             return -1;
          }
-         fclose(fp);
-         LOG("Sent local file %s to client (%ld bytes)", localPath, fileSize);
+         // Send file content (zero-copy, unless it is checksummed on the way)
+         if (send_file_fd(clientSock, fd, offset > 0 ? offset : 0, count, trailer ? &crc : NULL) != 0 ||
+             (trailer && send_client_trailer(client, crc) != 0)) {
+             close(fd);
+             return -1;
+         }
+         close(fd);
+         LOG_DEBUG("Sent local file %s to client (%ld bytes)", localPath, count);
          return 0;
      }
  
-     // Otherwise, the file is on S2(.pdf), S3(.txt), or S4(.zip)
-     const char *serverAddr;
-     int serverPort;
-     if (strcmp(ext, ".pdf") == 0) {
-         serverAddr = S2_ADDR; serverPort = S2_PORT;
-     } else if (strcmp(ext, ".txt") == 0) {
-         serverAddr = S3_ADDR; serverPort = S3_PORT;
-     } else {
+     // Otherwise, the file is on the storage servers its type is routed to
+     int nodes[MAX_BACKENDS];
+     int nodeCount = replica_order(subPath, nodes, MAX_BACKENDS);
+     if (nodeCount <= 0) {
          const char *errMsg = "ERROR: Unsupported file type\n";
-         send_all(clientSock, errMsg, strlen(errMsg));
+         reply_line(client, errMsg);
          return -1;
      }
  
-     // Connect to the appropriate server
-     int sfd = socket(AF_INET, SOCK_STREAM, 0);
-     if (sfd < 0) {
-         const char *errMsg = "ERROR: Internal error\n";
-         send_all(clientSock, errMsg, strlen(errMsg));
-         return -1;
-     }
-     struct sockaddr_in serv;
-     memset(&serv, 0, sizeof(serv));
-     serv.sin_family = AF_INET;
-     serv.sin_port = htons(serverPort);
-     if (inet_pton(AF_INET, serverAddr, &serv.sin_addr) <= 0) {
-         const char *errMsg = "ERROR: Internal error\n";
-         send_all(clientSock, errMsg, strlen(errMsg));
-         close(sfd);
-         return -1;
-     }
-     if (connect(sfd, (struct sockaddr*)&serv, sizeof(serv)) < 0) {
-         const char *errMsg = "ERROR: File server unavailable\n";
-         send_all(clientSock, errMsg, strlen(errMsg));
-         close(sfd);
-         return -1;
+     // Repeatedly downloaded small files are served from the cache
+     // (their checksum was verified when they were filled)
+     long cachedSize = 0;
+     char *cached = cache_get(subPath, &cachedSize, &crc);
+     if (cached) {
+         long count = cachedSize;
+         int rc = -1;
+         if (offset >= 0 && range_clamp(cachedSize, offset, length, &count) != 0) {
+             reply_line(client, "ERROR: Invalid range\n");
+         } else if (level > 0 && cachedSize >= COMPRESS_MIN_SIZE) {
+             rc = send_deflated(client, -1, cached, cachedSize, level, trailer);
+         } else if (reply_download(client, offset, count, cachedSize, trailer) == 0 &&
+                    send_all(clientSock, cached + (offset > 0 ? offset : 0), (size_t)count) == 0 &&
+                    (!trailer || send_client_trailer(client, crc) == 0)) {
+             rc = 0;
+         }
+         free(cached);
+         LOG_DEBUG("Sent cached file %s to client (%ld bytes)", filePath, count);
+         return rc;
      }
+     uint64_t generation = cache_generation();
  
-     // Send "GET path" command
+     // Send "GET path" (or "GETR offset length path" for a range) and expect
+     // a response with the size ("<count> <total>" for a range) or ERROR
+     // The storage server deflates the file itself (GETZ), except while the
+     // cache is on: it keeps plain bytes, so S1 deflates what it relays
      char cmd[600];
-     snprintf(cmd, sizeof(cmd), "GET %s\n", subPath);
-     if (send_all(sfd, cmd, strlen(cmd)) != 0) {
-         const char *errMsg = "ERROR: Internal error\n";
-         send_all(clientSock, errMsg, strlen(errMsg));
-         close(sfd);
-         return -1;
+     if (level > 0 && !cache_admits(COMPRESS_MIN_SIZE)) {
+         snprintf(cmd, sizeof(cmd), "GETZ %d %s\n", level, subPath);
+     } else if (offset < 0) {
+         snprintf(cmd, sizeof(cmd), "GET %s\n", subPath);
+     } else if (length < 0) {
+         snprintf(cmd, sizeof(cmd), "GETR %ld - %s\n", offset, subPath);
+     } else {
+         snprintf(cmd, sizeof(cmd), "GETR %ld %ld %s\n", offset, length, subPath);
      }
- 
-     // Expect a response with file size or ERROR
+     // The least busy replica is asked first. If it is down or does not
+     // have the file (it may have missed an upload, or the rebalancer has not
+     // moved the file since a routing change), the other servers of the type
+     // are asked in ring order.
      char line[128];
-     int idx = 0;
-     char ch;
-     while (idx < (int)sizeof(line) - 1) {
-         ssize_t n = recv(sfd, &ch, 1, 0);
-         if (n <= 0) break;
-         if (ch == '\n') break;
-         line[idx++] = ch;
+     struct line_reader reply;
+     int backend = -1, sfd = -1;
+     for (int i = 0; i < nodeCount; i++) {
+         if (sfd >= 0) {
+             backend_release(backend, sfd);
+         }
+         backend = nodes[i];
+         struct timespec asked, answered;
+         clock_gettime(CLOCK_MONOTONIC, &asked);
+         sfd = backend_command(backend, cmd, &reply, line, sizeof(line));
+         if (sfd >= 0) {
+             clock_gettime(CLOCK_MONOTONIC, &answered);
+             backend_latency(backend, (answered.tv_sec - asked.tv_sec) * 1000000L +
+                                      (answered.tv_nsec - asked.tv_nsec) / 1000);
+         }
+         if (sfd >= 0 && strncmp(line, "ERROR: File not found", 21) != 0) {
+             break;
+         }
      }
-     line[idx] = '\0';
- 
-     if (idx == 0) {
+     if (sfd == -1) {
+         const char *errMsg = "ERROR: File server unavailable\n";
+         reply_line(client, errMsg);
+         return -1;
+     }
+     if (sfd < 0 || line[0] == '\0') {
          // No response or connection closed
          const char *errMsg = "ERROR: Failed to retrieve file\n";
-         send_all(clientSock, errMsg, strlen(errMsg));
-         close(sfd);
+         reply_line(client, errMsg);
+         if (sfd >= 0) close(sfd);
          return -1;
      }
      if (strncmp(line, "ERROR", 5) == 0) {
-         // Remote server error
+         // Remote server error; the connection is still in sync
+         backend_release(backend, sfd);
          strcat(line, "\n"); // Ensure newline
-         send_all(clientSock, line, strlen(line));
-         close(sfd);
+         reply_line(client, line);
          return -1;
      }
+     if (strcmp(line, "chunked") == 0) {
+         // GETZ answer: the deflated chunks are passed through as they are,
+         // and so is the server's checksum of the plain file
+         backend_busy(backend, 1);
+         int replied = reply_deflated(client, trailer) == 0;
+         int rc = copy_chunks(&reply, replied ? clientSock : -1, 1);
+         if (rc != -1 && read_backend_trailer(&reply, &crc) != 0) {
+             rc = -1;
+         }
+         if (rc == 0 && replied && trailer && send_client_trailer(client, crc) != 0) {
+             rc = -2;
+         }
+         backend_busy(backend, -1);
+         if (rc == -1) {
+             close(sfd);
+         } else {
+             backend_release(backend, sfd);
+         }
+         if (rc != 0 || !replied) {
+             LOG_WARN("Error relaying file %s", filePath);
+             return -1;
+         }
+         LOG_DEBUG("Downloaded file from server and relayed to client: %s (deflated)", filePath);
+         return 0;
+     }
  
      long fileSize = atol(line);
-     if (fileSize < 0) {
+     long total = fileSize;
+     char *totalStr = strchr(line, ' ');
+     if (offset >= 0 && totalStr) {
+         total = atol(totalStr + 1);
+     }
+     if (fileSize < 0 || total < fileSize) {
          const char *errMsg = "ERROR: Failed to retrieve file\n";
-         send_all(clientSock, errMsg, strlen(errMsg));
+         reply_line(client, errMsg);
          close(sfd);
          return -1;
      }
  
-     // Send size to client
-     char sizeStr[64];
-     snprintf(sizeStr, sizeof(sizeStr), "%ld\n", fileSize);
-     if (send_all(clientSock, sizeStr, strlen(sizeStr)) != 0) {
+     // Relay the file content from server to client (spliced, no user-space copy).
+     // Files small enough for the cache are read into memory once instead, so
+     // they can be kept (and deflated here, if the client wants that). Those
+     // are checked against the server's checksum trailer before anything is
+     // sent or cached; a spliced body and its trailer go on to the client,
+     // which does the checking. Unless the storage server itself failed, the
+     // whole body has been read from it and the connection can go back to the pool.
+     char *body = (offset < 0 && cache_admits(fileSize)) ? malloc(fileSize > 0 ? (size_t)fileSize : 1) : NULL;
+     int deflateBody = body && level > 0 && fileSize >= COMPRESS_MIN_SIZE;
+ 
+     // Send size to client (a body read here is announced once it is checked)
+     if (!body && reply_download(client, offset, fileSize, total, trailer) != 0) {
+         free(body);
          close(sfd);
          return -1;
      }
  
-     // Relay the file content from server to client
-     long remaining = fileSize;
-     char buffer[BUF_SIZE];
-     while (remaining > 0) {
-         ssize_t r = recv(sfd, buffer, (remaining < BUF_SIZE ? remaining : BUF_SIZE), 0);
-         if (r <= 0) break;
-         if (send_all(clientSock, buffer, r) != 0) break;
-         remaining -= r;
+     int rc;
+     backend_busy(backend, 1);
+     if (body) {
+         uint32_t expected;
+         if (recv_all(&reply, body, (size_t)fileSize) != 0 || read_backend_trailer(&reply, &expected) != 0) {
+             rc = -1;
+             reply_line(client, "ERROR: Failed to retrieve file\n");
+         } else if ((crc = crc32c(0, body, (size_t)fileSize)) != expected) {
+             rc = -2;
+             LOG_WARN("Checksum mismatch for %s from server", filePath);
+             reply_line(client, "ERROR: Checksum mismatch\n");
+         } else if (deflateBody) {
+             rc = send_deflated(client, -1, body, fileSize, level, trailer) == 0 ? 0 : -2;
+             cache_put(subPath, body, fileSize, crc, generation);
+         } else {
+             rc = (reply_download(client, offset, fileSize, total, trailer) == 0 &&
+                   send_all(clientSock, body, (size_t)fileSize) == 0 &&
+                   (!trailer || send_client_trailer(client, crc) == 0)) ? 0 : -2;
+             cache_put(subPath, body, fileSize, crc, generation);
+         }
+         free(body);
+     } else {
+         rc = relay_bytes(&reply, clientSock, fileSize);
+         if (rc != -1 && offset < 0 && read_backend_trailer(&reply, &crc) != 0) {
+             rc = -1;
+         }
+         if (rc == 0 && trailer && send_client_trailer(client, crc) != 0) {
+             rc = -2;
+         }
+     }
+     backend_busy(backend, -1);
+     if (rc == -1) {
+         close(sfd);
+     } else {
+         backend_release(backend, sfd);
      }
-     close(sfd);
  
-     if (remaining == 0) {
-         LOG("Downloaded file from server and relayed to client: %s (%ld bytes)", filePath, fileSize);
+     if (rc == 0) {
+         LOG_DEBUG("Downloaded file from server and relayed to client: %s (%ld bytes)", filePath, fileSize);
          return 0;
      } else {
-         LOG("Error relaying file %s", filePath);
+         LOG_WARN("Error relaying file %s", filePath);
          return -1;
      }
  }
@@ -825,7 +7782,7 @@
  /**
   * @brief Handles 'removef' command: deletes a file locally if .c, otherwise instructs S2/S3/S4 to delete it.
   */
- int handle_remove(int clientSock, const char *filePath) {
+ int handle_remove(const char *filePath) {
      const char *ext = strrchr(filePath, '.');
      if (!ext) return -1;
  
@@ -852,10 +7809,10 @@
      /*// If .c, remove locally
      if (strcmp(ext, ".c") == 0) {
          if (unlink(fullPath) == 0) {
-             LOG("Removed local .c file: %s", fullPath);
+             LOG_DEBUG("Removed local .c file: %s", fullPath);
              return 0;
          } else {
-             LOG("Failed to remove local file %s: %s", fullPath, strerror(errno));
+             LOG_WARN("Failed to remove local file %s: %s", fullPath, strerror(errno));
              return -1;
          }
      }*/
@@ -863,7 +7820,8 @@
         // If .c, remove locally and then clean up empty parent directories.
     if (strcmp(ext, ".c") == 0) {
         if (unlink(fullPath) == 0) {
-            LOG("Removed local .c file: %s", fullPath);
+            LOG_DEBUG("Removed local .c file: %s", fullPath);
+            tar_note_change();
             
             // Start cleaning up empty directories.
             // Copy fullPath to a temporary buffer (we already removed the file, so we need its parent directory).
@@ -884,7 +7842,8 @@
             while (strcmp(currentDir, basePath) != 0) {
                 // Try to remove the directory.
                 if (rmdir(currentDir) == 0) {
-                    LOG("Removed empty directory: %s", currentDir);
+                    LOG_DEBUG("Removed empty directory: %s", currentDir);
+                    dir_cache_forget(currentDir);
                     // Remove the last path component to climb one level.
                     lastSlash = strrchr(currentDir, '/');
                     if (lastSlash != NULL) {
@@ -895,103 +7854,89 @@
                     }
                 } else {
                     // If the directory isn't empty (or an error occurs), stop the loop.
-                    LOG("Directory %s not empty or could not be removed (errno: %d), stopping cleanup", currentDir, errno);
+                    LOG_DEBUG("Directory %s not empty or could not be removed (errno: %d), stopping cleanup", currentDir, errno);
                     break;
                 }
             }
             return 0;
         } else {
-            LOG("Failed to remove local file %s: %s", fullPath, strerror(errno));
+            LOG_WARN("Failed to remove local file %s: %s", fullPath, strerror(errno));
             return -1;
         }
     }
     
-     // Otherwise, forward the request to the appropriate server
-     const char *serverAddr;
-     int serverPort;
-     if (strcmp(ext, ".pdf") == 0) {
-         serverAddr = S2_ADDR; serverPort = S2_PORT;
-     } else if (strcmp(ext, ".txt") == 0) {
-         serverAddr = S3_ADDR; serverPort = S3_PORT;
-     } else {
-         return -1;
-     }
- 
-     int sfd = socket(AF_INET, SOCK_STREAM, 0);
-     if (sfd < 0) {
-         return -1;
-     }
-     struct sockaddr_in serv;
-     memset(&serv, 0, sizeof(serv));
-     serv.sin_family = AF_INET;
-     serv.sin_port = htons(serverPort);
-     if (inet_pton(AF_INET, serverAddr, &serv.sin_addr) <= 0) {
-         close(sfd);
-         return -1;
-     }
-     if (connect(sfd, (struct sockaddr*)&serv, sizeof(serv)) < 0) {
-         close(sfd);
+     // Otherwise, forward the request to the servers the file's type is
+     // routed to. Every one of them is asked: while the rebalancer is moving
+     // the file, a copy left on the old server would otherwise come back.
+     int nodes[MAX_BACKENDS];
+     int nodeCount = route_nodes(subPath, nodes, MAX_BACKENDS);
+     if (nodeCount <= 0) {
          return -1;
      }
  
+     // Send DEL and read server ack
      char cmd[600];
      snprintf(cmd, sizeof(cmd), "DEL %s\n", subPath);
-     if (send_all(sfd, cmd, strlen(cmd)) != 0) {
-         close(sfd);
-         return -1;
-     }
- 
-     // Read server ack
-     char ack[64];
-     int idx = 0;
-     char ch;
-     while (idx < (int)sizeof(ack) - 1) {
-         ssize_t n = recv(sfd, &ch, 1, 0);
-         if (n <= 0) break;
-         if (ch == '\n') break;
-         ack[idx++] = ch;
+     int removed = 0;
+     char ack[64] = "";
+     for (int i = 0; i < nodeCount; i++) {
+         char line[64];
+         struct line_reader reply;
+         int sfd = backend_command(nodes[i], cmd, &reply, line, sizeof(line));
+         if (sfd < 0) {
+             continue;
+         }
+         backend_release(nodes[i], sfd);
+         if (strncmp(line, "SUCCESS", 7) == 0) {
+             removed = 1;
+         } else if (i == 0) {
+             snprintf(ack, sizeof(ack), "%s", line);
+         }
      }
-     ack[idx] = '\0';
-     close(sfd);
+     cache_invalidate(subPath);
  
-    if (strncmp(ack, "SUCCESS", 7) == 0) {
-         LOG("Remote server removed file: %s", filePath);
+    if (removed) {
+         LOG_DEBUG("Remote server removed file: %s", filePath);
          return 0;
      } else {
-         LOG("Remote server failed to remove file: %s (%s)", filePath, ack);
+         LOG_WARN("Remote server failed to remove file: %s (%s)", filePath, ack);
          return -1;
      }
  }
  
-// Handles "downltar" command.
-int handle_downltar(int clientSock, const char *fileType) {
+// Handles "downltar" command. Archives are streamed with the chunked framing
+// when the client asked for it ("downltar <type> chunked"); older clients that
+// expect a size up front get the archive spooled to an unlinked temp file.
+// With `since`, only the files changed after that token are archived (see
+// ARCHIVE CACHE) and the answer carries the token for next time.
+int handle_downltar(struct client_session *client, const char *fileType, int chunked,
+                    const char *since) {
+    int clientSock = client->in.fd;
+    // A chunked archive of a compressed type goes deflated to a client that asked for it
+    int level = (chunked && client->deflate) ? compress_level(fileType) : 0;
     // Validate file type.
-    if (strcmp(fileType, ".c") != 0 && strcmp(fileType, ".pdf") != 0 &&
-        strcmp(fileType, ".txt") != 0 && strcmp(fileType, ".zip") != 0) {
-         const char *errMsg = "ERROR: Invalid filetype (supported: .c, .pdf, .txt, .zip)\n";
-         send_all(clientSock, errMsg, strlen(errMsg));
+    const struct route *route = strcmp(fileType, ".c") == 0 ? NULL : route_find(fileType);
+    if (strcmp(fileType, ".c") != 0 && !route) {
+         char types[256], errMsg[300];
+         route_types(types, sizeof(types));
+         snprintf(errMsg, sizeof(errMsg), "ERROR: Invalid filetype (supported: %s)\n", types);
+         reply_line(client, errMsg);
          return -1;
     }
     // Case for .c files: archive files stored in S1 directory
     if (strcmp(fileType, ".c") == 0) {
-         // Get S1 directory path from environment variable, with fallback to current directory
+         // Get S1 directory path from environment variable, with fallback to ~/S1
+         char s1PathBuf[512];
          const char *s1Path = getenv("S1_DIRECTORY");
          if (s1Path == NULL) {
              // If environment variable is not set, try the home directory approach
              const char *homeDir = getenv("HOME");
              if (homeDir == NULL) {
                  const char *errMsg = "ERROR: Could not determine S1 directory location\n";
-                 send_all(clientSock, errMsg, strlen(errMsg));
-                 return -1;
-             }
-             // Allocate space for home directory path + "/S1"
-             char *s1PathBuf = malloc(strlen(homeDir) + 4);
-             if (s1PathBuf == NULL) {
-                 const char *errMsg = "ERROR: Memory allocation failed\n";
-                 send_all(clientSock, errMsg, strlen(errMsg));
+                 reply_line(client, errMsg);
                  return -1;
              }
-             sprintf(s1PathBuf, "%s/S1", homeDir);
+             snprintf(s1PathBuf, sizeof(s1PathBuf), "%s/S1", homeDir);
              s1Path = s1PathBuf;
          }
          
@@ -999,195 +7944,258 @@ int handle_downltar(int clientSock, const char *fileType) {
          struct stat st;
          if (stat(s1Path, &st) != 0 || !S_ISDIR(st.st_mode)) {
               const char *errMsg = "ERROR: S1 directory not found\n";
-              send_all(clientSock, errMsg, strlen(errMsg));
-              if (s1Path != getenv("S1_DIRECTORY")) {
-                  free((void*)s1Path);
-              }
+              reply_line(client, errMsg);
               return -1;
          }
          
-         // Create a unique temporary filename for the tar archive.
-         char template[] = "/tmp/cfilesXXXXXX";
-         int temp_fd = mkstemp(template);
-         if (temp_fd == -1) {
-              const char *errMsg = "ERROR: Unable to create temporary file\n";
-              send_all(clientSock, errMsg, strlen(errMsg));
-              if (s1Path != getenv("S1_DIRECTORY")) {
-                  free((void*)s1Path);
+         if (chunked) {
+              // Stream the archive as it is built, or from the archive cache
+              struct timespec now;
+              clock_gettime(CLOCK_REALTIME_COARSE, &now);
+              char token[32];
+              snprintf(token, sizeof(token), "%llu",
+                       (unsigned long long)now.tv_sec * 1000000000ULL + (unsigned long long)now.tv_nsec);
+              uint64_t gen = tar_cache_generation();
+              if ((since ? reply_chunked_token(client, level > 0, token)
+                         : level > 0 ? reply_deflated(client, 0) : reply_chunked(client)) != 0) {
+                   return -1;
               }
-              return -1;
-         }
-         close(temp_fd); // Close immediately; tar will overwrite it.
-         
-         // Create the tar file - using the configurable path
-         char tarCmd[1024];
-         snprintf(tarCmd, sizeof(tarCmd), 
-                 "cd %s && find . -name \"*.c\" -print0 | tar --null -T - -cf %s 2>/dev/null || echo 'empty'",
-                 s1Path, template);
-         
-         LOG("Executing tar command: %s", tarCmd);
-         int status = system(tarCmd);
-         
-         // Free the allocated path if necessary
-         if (s1Path != getenv("S1_DIRECTORY")) {
-             free((void*)s1Path);
-         }
-         
-         // If tar failed or returned nothing, create an empty tar file
-         struct stat tar_st;
-         if (stat(template, &tar_st) != 0 || tar_st.st_size == 0) {
-             LOG("Creating empty tar file");
-             FILE *emptyTar = fopen(template, "wb");
-             if (!emptyTar) {
-                 const char *errMsg = "ERROR: Failed to create empty tar file\n";
-                 send_all(clientSock, errMsg, strlen(errMsg));
-                 remove(template);
-                 return -1;
-             }
-             fclose(emptyTar);
-         }
-         
-         // Open the tar archive.
-         FILE *fp = fopen(template, "rb");
-         if (!fp) {
-              const char *errMsg = "ERROR: Tar file not found\n";
-              send_all(clientSock, errMsg, strlen(errMsg));
-              remove(template);
-              return -1;
+              long cachedLen;
+              int cached = since ? -1 : tar_cache_open(s1Path, level, &cachedLen);
+              if (cached >= 0) {
+                   int rc = send_file_fd(clientSock, cached, 0, cachedLen, NULL);
+                   close(cached);
+                   if (rc != 0) {
+                        LOG_WARN("Error sending cached tar of .c files to client");
+                        return -1;
+                   }
+                   LOG_DEBUG("Sent cached tar of .c files (%ld bytes) to client", cachedLen);
+                   return 0;
+              }
+              char tmpPath[1024];
+              struct stream_copy copy = { since ? -1 : tar_cache_create(s1Path, tmpPath, sizeof(tmpPath)),
+                                          1, 0, options.tarCacheMb * 1024 * 1024 };
+              long files = tar_write_tree(clientSock, 1, s1Path, ".c", level,
+                                          since ? strtoull(since, NULL, 10) : 0, copy.fd >= 0 ? &copy : NULL);
+              if (copy.fd >= 0) {
+                   close(copy.fd);
+                   if (files >= 0 && copy.ok) {
+                        tar_cache_put(s1Path, tmpPath, level, gen, copy.len);
+                   } else {
+                        unlink(tmpPath);
+                   }
+              }
+              if (files < 0) {
+                   LOG_WARN("Error streaming tar of .c files to client");
+                   return -1;
+              }
+              LOG_DEBUG("Streamed tar of %ld .c files to client%s", files, since ? " (incremental)" : "");
+              return 0;
          }
-         fseek(fp, 0, SEEK_END);
-         long tarSize = ftell(fp);
-         fseek(fp, 0, SEEK_SET);
          
-         // Send tar archive size as a newline-terminated string.
-         char sizeStr[64];
-         snprintf(sizeStr, sizeof(sizeStr), "%ld\n", tarSize);
-         if (send_all(clientSock, sizeStr, strlen(sizeStr)) != 0) {
-              fclose(fp);
-              remove(template);
+         // Size needed up front: build the archive in a temp file first
+         int tmpFd = spool_create();
+         if (tmpFd < 0 || tar_write_tree(tmpFd, 0, s1Path, ".c", 0, 0, NULL) < 0) {
+              const char *errMsg = "ERROR: Failed to create tar file\n";
+              reply_line(client, errMsg);
+              if (tmpFd >= 0) close(tmpFd);
               return -1;
          }
-         
-         // Send tar archive data.
-         char buffer[BUF_SIZE];
-         size_t bytes;
-         while ((bytes = fread(buffer, 1, BUF_SIZE, fp)) > 0) {
-              if (send_all(clientSock, buffer, bytes) != 0) {
-                   fclose(fp);
-                   remove(template);
-                   return -1;
+         return spool_send(client, tmpFd, ".c");
+    }
+    // Other types: forward the request to every server the type is routed to.
+    // Each sends "chunked" and streams its archive; with several servers the
+    // archives are joined into one, taking each replicated file from one
+    // server only (see struct tar_filter). With --replicas, fewer servers than
+    // that may fail to answer: their files all have a copy on one that did.
+    // A single server deflates its archive itself (TARZ); joined archives are
+    // deflated here as they are joined.
+    // The archives are cached by the servers, which see every change to them.
+    // A `since` token holds one index generation per server, in route order;
+    // one that does not match the route asks every server for everything.
+    char gens[MAX_BACKENDS][24];
+    for (int i = 0; i < route->count; i++) {
+         snprintf(gens[i], sizeof(gens[i]), "0");
+    }
+    if (since) {
+         int n = 0;
+         for (const char *p = since; n <= route->count && *p; n++) {
+              size_t len = strcspn(p, ",");
+              if (n < route->count && len < sizeof(gens[n])) {
+                   snprintf(gens[n], sizeof(gens[n]), "%.*s", (int)len, p);
               }
+              p += len + (p[len] == ',');
+         }
+         for (int i = 0; n != route->count && i < route->count; i++) {
+              snprintf(gens[i], sizeof(gens[i]), "0");
          }
-         fclose(fp);
-         remove(template);
-         LOG("Sent tar archive for .c files to client (%ld bytes)", tarSize);
-         return 0;
     }
-    // For .pdf, .txt, and forward the request to the appropriate remote server.
-    else if (strcmp(fileType, ".pdf") == 0 || strcmp(fileType, ".txt") == 0) {
-         const char *serverAddr;
-         int serverPort;
-         if (strcmp(fileType, ".pdf") == 0) {
-              serverAddr = S2_ADDR; serverPort = S2_PORT;
-         } else if (strcmp(fileType, ".txt") == 0) {
-              serverAddr = S3_ADDR; serverPort = S3_PORT;
+    struct line_reader *replies = malloc(sizeof(*replies) * (size_t)route->count);
+    int sfds[MAX_BACKENDS];
+    int started = 0;
+    int replicas = replicaCount < route->count ? replicaCount : route->count;
+    int skipped = 0;
+    char up[MAX_BACKENDS] = { 0 };
+    const char *errMsg = replies ? NULL : "ERROR: Out of memory\n";
+    char line[128];
+    char token[MAX_BACKENDS * 24] = "";
+    for (; !errMsg && started < route->count; started++) {
+         int backend = route->backend[started];
+         // "TARZ <level> <ext> <generation>\n" at its longest
+         char tarCmd[sizeof("TARZ -2147483648  \n") + MAX_EXT_LEN + sizeof(gens[0])];
+         int cmdLen;
+         if (level > 0 && route->count == 1) {
+              cmdLen = snprintf(tarCmd, sizeof(tarCmd), "TARZ %d %s%s%s\n", level, route->ext,
+                                since ? " " : "", since ? gens[started] : "");
          } else {
-              const char *errMsg = "ERROR: Internal error (invalid file type)\n";
-              send_all(clientSock, errMsg, strlen(errMsg));
-              return -1;
-         }
-         int sfd = socket(AF_INET, SOCK_STREAM, 0);
-         if (sfd < 0) {
-              const char *errMsg = "ERROR: Internal error (socket creation failed)\n";
-              send_all(clientSock, errMsg, strlen(errMsg));
-              return -1;
-         }
-         struct sockaddr_in serv;
-         memset(&serv, 0, sizeof(serv));
-         serv.sin_family = AF_INET;
-         serv.sin_port = htons(serverPort);
-         if (inet_pton(AF_INET, serverAddr, &serv.sin_addr) <= 0) {
-              const char *errMsg = "ERROR: Internal error (address conversion failed)\n";
-              send_all(clientSock, errMsg, strlen(errMsg));
-              close(sfd);
-              return -1;
+              cmdLen = snprintf(tarCmd, sizeof(tarCmd), "TAR%s%s%s\n", route->ext, since ? " " : "",
+                                since ? gens[started] : "");
          }
-         if (connect(sfd, (struct sockaddr*)&serv, sizeof(serv)) < 0) {
-              const char *errMsg = "ERROR: File server unavailable\n";
-              send_all(clientSock, errMsg, strlen(errMsg));
-              close(sfd);
-              return -1;
+         if (cmdLen < 0 || (size_t)cmdLen >= sizeof(tarCmd)) {
+              errMsg = "ERROR: Invalid downltar command format\n";
+              continue;
          }
-         // Send "TAR" command with file type.
-         char tarCmd[32];
-         snprintf(tarCmd, sizeof(tarCmd), "TAR%s\n", fileType);
-         if (send_all(sfd, tarCmd, strlen(tarCmd)) != 0) {
-              const char *errMsg = "ERROR: Internal error (failed to send command)\n";
-              send_all(clientSock, errMsg, strlen(errMsg));
-              close(sfd);
-              return -1;
+         sfds[started] = backend_command(backend, tarCmd, &replies[started], line, sizeof(line));
+         // "chunked <generation>": the server's part of the next token
+         const char *gen = NULL;
+         if (sfds[started] >= 0 && strncmp(line, "chunked ", 8) == 0) {
+              gen = line + 8;
+         } else if (sfds[started] >= 0 && strcmp(line, "chunked") == 0) {
+              gen = "0";
          }
-         // Expect tar archive size as a newline-terminated string.
-         char line[128];
-         int idx = 0;
-         char ch;
-         while (idx < (int)sizeof(line) - 1) {
-              ssize_t n = recv(sfd, &ch, 1, 0);
-              if (n <= 0) break;
-              if (ch == '\n') break;
-              line[idx++] = ch;
-         }
-         line[idx] = '\0';
-         if (idx == 0 || strncmp(line, "ERROR", 5) == 0) {
-              if (idx == 0) {
-                   const char *errMsg = "ERROR: Tar failed (no response from server)\n";
-                   send_all(clientSock, errMsg, strlen(errMsg));
+         const char *failed = NULL;
+         if (sfds[started] == -1) {
+              failed = "ERROR: File server unavailable\n";
+         } else if (!gen) {
+              if (sfds[started] < 0 || strncmp(line, "ERROR", 5) != 0) {
+                   failed = "ERROR: Tar failed (no response from server)\n";
+                   if (sfds[started] >= 0) close(sfds[started]);
               } else {
+                   backend_release(backend, sfds[started]);
                    strcat(line, "\n");
-                   send_all(clientSock, line, strlen(line));
+                   failed = line;
+              }
+              sfds[started] = -1;
+         }
+         if (failed && skipped + 1 < replicas) {
+              // The next token asks it again for what this one would have
+              LOG_WARN("downltar %s: %s did not answer; taking its files from the other replicas",
+                  fileType, backendTable[backend].name);
+              skipped++;
+              gen = gens[started];
+              failed = NULL;
+         } else if (!failed) {
+              up[backend] = 1;
+         }
+         errMsg = failed;
+         if (gen) {
+              size_t used = strlen(token);
+              int n = snprintf(token + used, sizeof(token) - used, "%s%s", started ? "," : "", gen);
+              if (n < 0 || (size_t)n >= sizeof(token) - used) {
+                   token[used] = '\0';   // A token short of a server asks all of them for everything
               }
-              close(sfd);
-              return -1;
          }
-         long tarSize = atol(line);
-         char sizeStrOut[64];
-         snprintf(sizeStrOut, sizeof(sizeStrOut), "%ld\n", tarSize);
-         if (send_all(clientSock, sizeStrOut, strlen(sizeStrOut)) != 0) {
-              close(sfd);
+    }
+    if (errMsg) {
+         // The archives already started are not read; drop those connections
+         for (int i = 0; i < started - 1; i++) {
+              if (sfds[i] >= 0) close(sfds[i]);
+         }
+         free(replies);
+         reply_line(client, errMsg);
+         return -1;
+    }
+ 
+    int rc = 0;
+    int tmpFd = -1;
+    int out = clientSock;
+    struct zout *z = NULL;
+    if (chunked) {
+         // Pass the chunks through (bodies are spliced when there is only
+         // one archive); if the client is gone the rest of the streams are
+         // still read from the servers
+         int sent = since ? reply_chunked_token(client, level > 0, token)
+                          : level > 0 ? reply_deflated(client, 0) : reply_chunked(client);
+         out = sent == 0 ? clientSock : -1;
+         if (out >= 0 && level > 0 && route->count > 1) {
+              z = malloc(sizeof(*z));
+              if (!z || zout_init(z, clientSock, level) != 0) {
+                   free(z);
+                   z = NULL;
+                   out = -1;
+              }
+         }
+    } else {
+         tmpFd = spool_create();
+         if (tmpFd < 0) {
+              for (int i = 0; i < route->count; i++) {
+                   if (sfds[i] >= 0) close(sfds[i]);
+              }
+              free(replies);
+              reply_line(client, "ERROR: Unable to create temporary file\n");
               return -1;
          }
-         long remaining = tarSize;
-         char buffer[BUF_SIZE];
-         while (remaining > 0) {
-              ssize_t r = recv(sfd, buffer, (remaining < BUF_SIZE ? remaining : BUF_SIZE), 0);
-              if (r <= 0) break;
-              if (send_all(clientSock, buffer, r) != 0) break;
-              remaining -= r;
+         out = tmpFd;
+    }
+    for (int i = 0; i < route->count; i++) {
+         if (sfds[i] < 0) {
+              continue;   // Left out; its files come from the other replicas
          }
-         close(sfd);
-         if (remaining == 0) {
-              LOG("Relayed tar of type %s (%ld bytes) to client", fileType, tarSize);
-              return 0;
+         struct tar_shard shard = { route->backend[i], up };
+         int r = route->count == 1 ? copy_chunks(&replies[i], out, chunked)
+                                   : copy_chunks_joined(&replies[i], out, chunked, z,
+                                                        replicas > 1 ? &shard : NULL);
+         if (r == -1) {
+              close(sfds[i]);
          } else {
-              LOG("Error relaying tar file of type %s (%ld bytes remaining)", fileType, remaining);
+              backend_release(route->backend[i], sfds[i]);
+         }
+         if (r != 0) {
+              out = -1;   // The output is unusable now; keep draining the rest
+              if (rc == 0) rc = r;
+         }
+    }
+    free(replies);
+    if (rc == 0 && route->count > 1) {
+         if (tar_end(chunked ? clientSock : tmpFd, chunked, z) != 0) {
+              rc = -2;
+         }
+    } else if (z) {
+         deflateEnd(&z->zs);   // tar_end() did not get to finish the stream
+    }
+    free(z);
+    if (tmpFd >= 0) {
+         if (rc != 0) {
+              close(tmpFd);
+              reply_line(client, "ERROR: Tar failed (incomplete archive from server)\n");
               return -1;
          }
+         return spool_send(client, tmpFd, fileType);
+    }
+    if (rc == 0) {
+         LOG_DEBUG("Relayed tar of type %s to client", fileType);
+         return 0;
+    } else {
+         LOG_WARN("Error relaying tar file of type %s", fileType);
+         return -1;
     }
-    // Should not reach here.
-    const char *errMsg = "ERROR: Unsupported filetype\n";
-    send_all(clientSock, errMsg, strlen(errMsg));
-    return -1;
 }
  
  /**
-  * @brief Handles 'dispfnames' command: aggregates filenames from local .c and remote servers for .pdf, .txt, .zip.
+  * @brief Handles 'dispfnames' command: merges the local .c names with the
+  *        names from every storage server into one sorted listing.
+  * @param limit Page size (0 = the whole directory)
+  * @param cursor Hex cursor of the previous page, or NULL for the first
+  * @param filter Listing filter (see find_filter_parse), or NULL for a plain
+  *               listing of the directory
   */
- int handle_dispfnames(int clientSock, const char *dirPath) {
+ int handle_dispfnames(struct client_session *client, const char *dirPath, long limit,
+                       const char *cursor, const char *filter) {
      // Convert ~S1 path to actual local path
      char *homeDir = getenv("HOME");
      if (!homeDir) {
          const char *errMsg = "ERROR: Internal error\n";
-         send_all(clientSock, errMsg, strlen(errMsg));
+         reply_line(client, errMsg);
          return -1;
      }
      char basePath[512];
@@ -1214,174 +8222,121 @@ int handle_downltar(int clientSock, const char *fileType) {
          snprintf(localDir, sizeof(localDir), "%s", basePath);
      }
  
-     // We'll collect .c, .pdf, .txt, and .zip from the different locations
-     // 1) local .c
-     char *cFiles[256];   int cCount   = 0;
-     char *pdfFiles[256]; int pdfCount = 0;
-     char *txtFiles[256]; int txtCount = 0;
-     char *zipFiles[256]; int zipCount = 0;
- 
-     // Initialize counts
-     cCount = pdfCount = txtCount = zipCount = 0;
- 
-     // Read local .c files
-     DIR *dp = opendir(localDir);
-     if (dp) {
-         struct dirent *entry;
-         while ((entry = readdir(dp)) != NULL) {
-             if (entry->d_type == DT_REG) {
-                 const char *name = entry->d_name;
-                 const char *ext = strrchr(name, '.');
-                 if (ext && strcmp(ext, ".c") == 0) {
-                     // Save a copy of the filename
-                     cFiles[cCount++] = strdup(name);
-                     if (cCount >= 256) break;
-                 }
+     char after[1024] = "";
+     if (cursor && hex_decode(cursor, after, sizeof(after)) != 0) {
+         const char *errMsg = "ERROR: Invalid listing cursor\n";
+         reply_line(client, errMsg);
+         return -1;
+     }
+     struct find_filter find;
+     if (filter && find_filter_parse(filter, &find) != 0) {
+         const char *errMsg = "ERROR: Invalid listing filter\n";
+         reply_line(client, errMsg);
+         return -1;
+     }
+ 
+     // Ask S2/S3/S4 for their part first; their replies arrive while the
+     // local directory is read
+     char listCmd[MAX_CMD_LEN + 64];
+     unsigned skip = 0;
+     if (filter) {
+         snprintf(listCmd, sizeof(listCmd), "FIND %ld %s %s %s\n", limit > 0 ? limit + 1 : 0,
+                  cursor ? cursor : "-", filter, *subPath ? subPath : ".");
+         for (int b = 0; b < numBackends; b++) {
+             if (!find_filter_wants(&find, backendTable[b].exts)) {
+                 skip |= 1u << b;
              }
          }
-         closedir(dp);
+     } else if (limit > 0) {
+         snprintf(listCmd, sizeof(listCmd), "LISTP %ld %s %s\n", limit + 1,
+                  cursor ? cursor : "-", *subPath ? subPath : ".");
+     } else {
+         snprintf(listCmd, sizeof(listCmd), "LIST %s\n", *subPath ? subPath : ".");
      }
-     // If dp == NULL, directory might not exist locally, so cCount stays 0.
+     struct list_fanout fanout;
+     list_fanout_start(&fanout, listCmd, skip);
  
-     // We'll define a small helper lambda to connect to S2/S3/S4, issue a "LIST" command, and parse the result
-     // (In C99, we’ll just define a function instead of a lambda).
-     // For clarity, here it is inline:
-     int connect_and_list(const char *addr, int port, char **files, int *count) {
-         int sfd = socket(AF_INET, SOCK_STREAM, 0);
-         if (sfd < 0) return -1;
-         struct sockaddr_in serv;
-         memset(&serv, 0, sizeof(serv));
-         serv.sin_family = AF_INET;
-         serv.sin_port = htons(port);
-         if (inet_pton(AF_INET, addr, &serv.sin_addr) <= 0) {
-             close(sfd);
-             return -1;
-         }
-         if (connect(sfd, (struct sockaddr*)&serv, sizeof(serv)) < 0) {
-             close(sfd);
-             return -1;
-         }
-         // Send "LIST subPath\n" (or .)
-         char cmd[512];
-         if (*subPath) {
-             snprintf(cmd, sizeof(cmd), "LIST %s\n", subPath);
-         } else {
-             snprintf(cmd, sizeof(cmd), "LIST .\n");
-         }
-         if (send_all(sfd, cmd, strlen(cmd)) != 0) {
-             close(sfd);
-             return -1;
-         }
-         // Receive size or "0"
-         char line[128];
-         int idx = 0;
-         char c;
-         while (idx < (int)sizeof(line) - 1) {
-             ssize_t n = recv(sfd, &c, 1, 0);
-             if (n <= 0) {
-                 close(sfd);
-                 return -1;
+     // lists[0] holds the local .c files, lists[1 + b] what backend b sent
+     struct name_list lists[1 + MAX_BACKENDS];
+     for (int i = 0; i < 1 + numBackends; i++) {
+         name_list_init(&lists[i]);
+     }
+     int rc;
+     if (!filter) {
+         rc = list_local_c(localDir, after, &lists[0]);
+     } else if (find_filter_wants(&find, ".c")) {
+         rc = find_local_c(localDir, &find, after, &lists[0]);
+     } else {
+         rc = 0;
+     }
+ 
+     list_fanout_finish(&fanout, options.listTimeoutMs);
+     for (int b = 0; b < numBackends; b++) {
+         if (fanout.fetch[b].buf) {
+             if (rc == 0) {
+                 rc = name_list_parse(&lists[1 + b], fanout.fetch[b].buf);
              }
-             if (c == '\n') break;
-             line[idx++] = c;
-         }
-         line[idx] = '\0';
-         long listSize = atol(line);
-         if (listSize <= 0) {
-             close(sfd);
-             return 0; // no files or error
+             free(fanout.fetch[b].buf);
          }
-         // Now read exactly listSize bytes
-         char *buf = (char*)malloc(listSize + 1);
-         if (!buf) {
-             close(sfd);
-             return -1;
+     }
+ 
+     struct text_buf output = { NULL, 0, 0 };
+     const char *last = NULL;
+     int more = 0;
+     if (rc == 0) {
+         more = merge_listings(lists, 1 + numBackends, (size_t)(limit > 0 ? limit : 0), &output, &last);
+     }
+     char nextCursor[2 * sizeof(after) + 1] = "";
+     if (more == 1) {
+         // The cursor is the name alone, without a filtered line's size and mtime
+         char lastName[sizeof(after)];
+         snprintf(lastName, sizeof(lastName), "%.*s", (int)strcspn(last, "\t"), last);
+         hex_encode(lastName, nextCursor, sizeof(nextCursor));
+     }
+     // Partial result: say which servers' files are missing. With --replicas
+     // a server that did not answer only matters for the types whose other
+     // replicas did not answer either.
+     for (int b = 0; b < numBackends && rc == 0 && more >= 0; b++) {
+         if (fanout.fetch[b].state != LIST_FAILED) {
+             continue;
          }
-         long remaining = listSize;
-         char *p = buf;
-         while (remaining > 0) {
-             ssize_t r = recv(sfd, p, remaining, 0);
-             if (r <= 0) {
-                 free(buf);
-                 close(sfd);
-                 return -1;
+         char exts[sizeof(backendTable[b].exts)] = "";
+         size_t used = 0;
+         for (int r = 0; r < numRoutes; r++) {
+             const struct route *route = &routeTable[r];
+             int serves = 0;
+             for (int i = 0; i < route->count; i++) {
+                 serves |= route->backend[i] == b;
              }
-             p += r;
-             remaining -= r;
-         }
-         buf[listSize] = '\0';
-         close(sfd);
- 
-         // Tokenize by newline to get filenames
-         char *saveptr;
-         char *token = strtok_r(buf, "\n", &saveptr);
-         while (token) {
-             if (*token != '\0') {
-                 files[*count] = strdup(token);
-                 (*count)++;
-                 if (*count >= 256) break;
+             if (serves && !list_route_covered(&fanout, route) && used < sizeof(exts)) {
+                 int n = snprintf(exts + used, sizeof(exts) - used, "%s%s", used ? " " : "", route->ext);
+                 used += n > 0 ? (size_t)n : 0;
              }
-             token = strtok_r(NULL, "\n", &saveptr);
          }
-         free(buf);
-         return 0;
-     };
+         if (used == 0) {
+             continue;   // Every file it holds was listed from another replica
+         }
+         char marker[200];
+         int n = snprintf(marker, sizeof(marker), "WARNING: %s did not respond; its %s files are not listed\n",
+                          backendTable[b].name, exts);
+         more = text_append(&output, marker, (size_t)n) == 0 ? more : -1;
+     }
+     for (int i = 0; i < 1 + numBackends; i++) {
+         name_list_free(&lists[i]);
+     }
  
-     // Retrieve .pdf from S2, .txt from S3, .zip from S4
-     connect_and_list(S2_ADDR, S2_PORT, pdfFiles, &pdfCount);
-     connect_and_list(S3_ADDR, S3_PORT, txtFiles, &txtCount);
-     connect_and_list(S4_ADDR, S4_PORT, zipFiles, &zipCount);
- 
-     // Sort each group alphabetically
-     int cmpfunc(const void *a, const void *b) {
-         const char *fa = *(const char**)a;
-         const char *fb = *(const char**)b;
-         return strcmp(fa, fb);
-     }
-     if (cCount > 0)   qsort(cFiles,   cCount,   sizeof(char*), cmpfunc);
-     if (pdfCount > 0) qsort(pdfFiles, pdfCount, sizeof(char*), cmpfunc);
-     if (txtCount > 0) qsort(txtFiles, txtCount, sizeof(char*), cmpfunc);
-     if (zipCount > 0) qsort(zipFiles, zipCount, sizeof(char*), cmpfunc);
- 
-     // Build consolidated output: .c first, then .pdf, then .txt, then .zip
-     char output[2048];
-     output[0] = '\0';
- 
-     // c
-     for (int i = 0; i < cCount; i++) {
-         strncat(output, cFiles[i], sizeof(output) - strlen(output) - 1);
-         strncat(output, "\n", sizeof(output) - strlen(output) - 1);
-         free(cFiles[i]);
-     }
-     // pdf
-     for (int i = 0; i < pdfCount; i++) {
-         strncat(output, pdfFiles[i], sizeof(output) - strlen(output) - 1);
-         strncat(output, "\n", sizeof(output) - strlen(output) - 1);
-         free(pdfFiles[i]);
-     }
-     // txt
-     for (int i = 0; i < txtCount; i++) {
-         strncat(output, txtFiles[i], sizeof(output) - strlen(output) - 1);
-         strncat(output, "\n", sizeof(output) - strlen(output) - 1);
-         free(txtFiles[i]);
-     }
-     // zip
-     for (int i = 0; i < zipCount; i++) {
-         strncat(output, zipFiles[i], sizeof(output) - strlen(output) - 1);
-         strncat(output, "\n", sizeof(output) - strlen(output) - 1);
-         free(zipFiles[i]);
-     }
- 
-     if (strlen(output) == 0) {
+     int result = 0;
+     if (rc != 0 || more < 0) {
+         const char *errMsg = "ERROR: Out of memory building the listing\n";
+         reply_line(client, errMsg);
+         result = -1;
+     } else if (output.len == 0) {
          const char *msg = "No files found\n";
-         send_all(clientSock, msg, strlen(msg));
-     } else {
-         // We’ll send length first, then the actual list
-         long outLen = strlen(output);
-         char lenStr[64];
-         snprintf(lenStr, sizeof(lenStr), "%ld\n", outLen);
-         send_all(clientSock, lenStr, strlen(lenStr));
-         send_all(clientSock, output, outLen);
+         reply_line(client, msg);
+     } else if (reply_size_cursor(client, (long)output.len, more == 1 ? nextCursor : NULL) != 0 ||
+                send_all(client->in.fd, output.data, output.len) != 0) {
+         result = -1;
      }
-     return 0;
+     free(output.data);
+     return result;
  }
\ No newline at end of file
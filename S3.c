@@ -9,40 +9,134 @@
  *  - Files are physically stored under ~/S3.
  *  - The following commands are recognized (all sent by S1):
  *
- *    1) STORE <path> <size>
+ *    1) STORE <path> <size> [crc32c] [<addr>:<port>...]
  *       - S3 receives <size> bytes from the socket and writes them to
- *         ~/S3/<path>.
- *       - On success, respond "SUCCESS\n"; on failure, "ERROR\n".
+ *         ~/S3/<path>, which is replaced only once the whole file has
+ *         arrived (see "Durable writes").
+ *       - With "<addr>:<port>..." after <size>, the file is also forwarded
+ *         to those replicas as it arrives, and the answer is
+ *         "SUCCESS <copies>\n".
+ *       - With "crc32c" after <size>, the body is followed by the sender's
+ *         checksum, "CRC32C <8 hex digits>\n"; a file that does not match
+ *         it is not kept ("ERROR: Checksum mismatch\n").
+ *       - On success, respond "SUCCESS\n"; on failure, "ERROR\n"
+ *         ("ERROR: No space left\n" if <size> bytes do not fit on the disk).
  *
  *    2) GET <path>
  *       - S3 looks up ~/S3/<path>. If found, sends back:
- *         "<filesize>\n<filedata>"
+ *         "<filesize>\n<filedata>CRC32C <crc>\n"
+ *         where <crc> is the file's CRC-32C, from the index when known.
  *       - Otherwise: "ERROR: File not found\n"
  *
  *    3) DEL <path>
  *       - Removes the file at ~/S3/<path>. On success, "SUCCESS\n"; else
  *         "ERROR\n".
  *
- *    4) TAR
- *       - Creates a tar of all files under ~/S3, named /tmp/text.tar.
- *         Then responds with "<tarsize>\n<tarfile>".
- *       - If anything fails, respond "ERROR\n".
+ *    4) TAR<type> [<since>]   (e.g. "TAR.txt")
+ *       - S3 streams a tar of all .txt files under ~/S3 (member names relative
+ *         to ~/S3), built in-process while walking the tree. Sends
+ *         "chunked\n" and then the archive as "<hex length>\n<bytes>" chunks,
+ *         ending with "0\n". A full archive that was sent before and is
+ *         still current comes from the archive cache instead.
+ *       - With <since>, an index generation from an earlier answer, only the
+ *         files changed after it are archived (all of them if it is not one
+ *         of this run's), and the answer starts "chunked <generation>\n"
+ *         with the generation to ask from next time (see "Archive cache").
+ *       - On a wrong type or setup failure, responds "ERROR: ...\n".
  *
  *    5) LIST <path>
- *       - Lists all regular (non-hidden) files in ~/S3/<path>, returning
- *         "<size>\n<list>" where <list> is newline-separated filenames.
- *       - If directory doesn't exist or empty, can send "0\n".
+ *       - Lists the regular, non-hidden files in ~/S3/<path>, sorted by name,
+ *         as "<size>\n<listdata>" (one name per line). A missing or empty
+ *         directory gives "0\n".
+ *
+ *    6) LISTP <limit> <cursor> <path>
+ *       - One page of the LIST output: at most <limit> names that sort after
+ *         <cursor> (hex-encoded name, "-" to start). Same response format.
+ *
+ *    7) GETR <offset> <length> <path>
+ *       - Like GET for the bytes from <offset> on, at most <length> of them
+ *         ("-" = to the end). Sends "<count> <filesize>\n<count bytes>"
+ *         without a checksum trailer, or
+ *         "ERROR: Invalid range\n" if <offset> is past the end of the file.
+ *
+ *    8) PART <id> <path> <total> <offset> <length>
+ *       - One part of a multipart upload: <length> bytes written at <offset>
+ *         of a <total>-byte file that is kept hidden until it is committed.
+ *
+ *    9) COMMIT <id> <path> <total>
+ *       - Moves the assembled file to ~/S3/<path> once every byte of it has
+ *         arrived; "ERROR: Incomplete upload\n" otherwise.
+ *
+ *   10) ABORT <id> <path>
+ *       - Throws away the parts received so far.
+ *
+ *   11) KEYS
+ *       - Lists every file stored on this server, as paths relative to ~/S3,
+ *         in no particular order ("<size>\n<listdata>", one path per line).
+ *         S1's rebalancer uses it to find files that belong elsewhere.
+ *
+ *   12) REPLICA
+ *       - Sent by another server first on a replication chain connection
+ *         (see STORE); such connections are served by their own thread.
+ *
+ *   13) LINK <path> <size> <hash>
+ *       - With --dedup: makes ~/S3/<path> a copy of already stored contents of
+ *         <size> bytes with XXH64 <hash> (16 hex digits), without the bytes
+ *         being sent again. "SUCCESS\n", or "ERROR: Unknown content\n" if
+ *         no such contents are stored here.
+ *
+ *   14) STOREZ <path> <size> <zlen> [crc32c] [<addr>:<port>...]
+ *       - Like STORE, but the body is <zlen> bytes of one zlib stream that
+ *         inflates to the <size>-byte file. Replicas get the plain file, and
+ *         the checksum trailer is that of the plain file.
+ *
+ *   15) GETZ <level> <path>
+ *       - Like GET, but a file of 4 KB or more is sent deflated at <level>
+ *         (1-9): "chunked\n" and the zlib stream in TAR's chunk framing.
+ *         Smaller files get the plain GET answer. The checksum trailer
+ *         follows the "0\n" terminator.
+ *
+ *   16) TARZ <level> <type> [<since>]
+ *       - Like TAR<type>, with the archive deflated at <level> (1-9) before
+ *         it is cut into chunks.
+ *
+ *   17) STATS
+ *       - Metrics: "<size>\n" and <size> bytes of the per-command counters
+ *         and latency histograms in the Prometheus text format (see
+ *         "Metrics"). --metrics-port serves the same text over HTTP.
+ *
+ *   18) FIND <limit> <cursor> <filter> <path>
+ *       - A filtered listing: the files in ~/S3/<path>, or with "r" in
+ *         <filter> in its whole subtree, that match every predicate of
+ *         <filter>, as "<path>\t<size>\t<mtime>" lines sorted by path (see
+ *         "Filtered listings"). At most <limit> of them (0 = all) after
+ *         <cursor>, as for LISTP, in the same "<size>\n<listdata>" framing.
+ *
+ * Every stored file is also recorded in an in-memory metadata index (size,
+ * mtime, CRC-32C), snapshotted to ~/S3/.index. LIST and "not found" answers
+ * come from the index; --watch also follows changes made to ~/S3 by other
+ * programs (inotify). --dedup keeps identical contents stored under
+ * several paths only once, in ~/S3/.cas (see "Deduplication"). --io uring
+ * moves file bodies through io_uring instead of blocking calls (see "I/O
+ * engine"). Repeated TARs are answered from a cache of the last archives
+ * (--tar-cache-mb, see "Archive cache"). Logging is leveled (--log-level, default info) and done by a
+ * thread of its own (see "Logging").
  *
  * Build (on Linux/Unix):
- *     gcc S3.c -o S3 -lpthread
+ *     gcc S3.c -o S3 -lpthread -lz
  *
  * Usage:
- *     ./S3
+ *     ./S3 [--workers N] [--backlog N] [--queue-limit N] [--watch]
+ *        [--port N] [--dir DIR] [--dedup] [--sync none|each|group]
+ *        [--io blocking|uring] [--metrics-port N] [--tar-cache-mb N]
+ *        [--log-level error|warn|info|debug]
  *
- * By default, it listens on 127.0.0.1:9003. If you want a different address or
- * port, edit the #defines below.
+ * By default, it listens on port 9003 and stores files under ~/S3; --port and
+ * --dir run another instance, e.g. a second node S1's routing file spreads a
+ * file type over.
  *****************************************************************************/
 
+ #define _GNU_SOURCE
  #include <stdio.h>
  #include <stdlib.h>
  #include <string.h>
@@ -51,45 +145,3201 @@
  #include <pthread.h>
  #include <sys/socket.h>
  #include <netinet/in.h>
+ #include <netinet/tcp.h>
  #include <arpa/inet.h>
  #include <sys/stat.h>
  #include <dirent.h>
+ #include <fnmatch.h>
+ #include <fcntl.h>
+ #include <sys/sendfile.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+ #include <sys/epoll.h>
+ #include <signal.h>
+ #include <getopt.h>
+ #include <limits.h>
+ #include <stdarg.h>
+ #include <stddef.h>
+ #include <time.h>
+ #include <stdint.h>
+ #include <endian.h>
+ #include <zlib.h>
+ #include <sys/inotify.h>
+ #include <ftw.h>
+ #if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+ #include <arm_acle.h>
+ #endif
+ 
+ #define S3_PORT 50006
+ #define DEFAULT_BACKLOG 128      // listen() backlog (--backlog)
+ #define DEFAULT_QUEUE_LIMIT 256  // pending commands before answering BUSY (--queue-limit)
+ #define MAX_WORKERS 1024         // largest --workers
+ #define MAX_QUEUE_LIMIT 1000000  // largest --queue-limit
+ #define CONN_IO_TIMEOUT 60       // seconds a worker waits on a stalled S1 mid-command
+ #define MAX_EVENTS 64            // epoll_wait batch size
+ #define BUF_SIZE 4096
+ #define READER_BUF_SIZE 8192      // read-ahead per S1 connection
+ #define TAR_CHUNK_SIZE (64 * 1024)  // TAR output is sent in chunks of this size
+ 
+ // Logging macros, by level; lines get a "S3:" prefix (see "Logging").
+ enum { LOG_LEVEL_ERROR, LOG_LEVEL_WARN, LOG_LEVEL_INFO, LOG_LEVEL_DEBUG };
+ void log_write(int level, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+ #define LOG_ERROR(msg, ...) log_write(LOG_LEVEL_ERROR, "S3: " msg "\n", ##__VA_ARGS__)
+ #define LOG_WARN(msg, ...) log_write(LOG_LEVEL_WARN, "S3: " msg "\n", ##__VA_ARGS__)
+ #define LOG(msg, ...) log_write(LOG_LEVEL_INFO, "S3: " msg "\n", ##__VA_ARGS__)
+ #define LOG_DEBUG(msg, ...) log_write(LOG_LEVEL_DEBUG, "S3: " msg "\n", ##__VA_ARGS__)
+ 
+ /*****************************************************************************
+  * CRC-32C (Castagnoli). Every file that goes through the server is checked
+  * with it in the same loop that moves the bytes, so the checksum costs no
+  * extra read. The CRC32 instruction of SSE4.2 (x86-64) or ARMv8 does eight
+  * bytes at a time; crc32c_init() picks it when the CPU has it and falls back
+  * to the table otherwise. Start with 0 and feed the data in pieces.
+  *****************************************************************************/
+ static uint32_t crc32cTable[256];
+ static uint32_t (*crc32c_update)(uint32_t crc, const unsigned char *p, size_t len);
+ 
+ static uint32_t crc32c_table(uint32_t crc, const unsigned char *p, size_t len) {
+     while (len--) {
+         crc = crc32cTable[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+     }
+     return crc;
+ }
+ 
+ #if defined(__x86_64__)
+ __attribute__((target("sse4.2")))
+ static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+     uint64_t c = crc;
+     for (; len >= 8; p += 8, len -= 8) {
+         uint64_t v;
+         memcpy(&v, p, sizeof(v));
+         c = __builtin_ia32_crc32di(c, v);
+     }
+     crc = (uint32_t)c;
+     while (len--) {
+         crc = __builtin_ia32_crc32qi(crc, *p++);
+     }
+     return crc;
+ }
+ #define CRC32C_HW_AVAILABLE() __builtin_cpu_supports("sse4.2")
+ #elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+ static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+     for (; len >= 8; p += 8, len -= 8) {
+         uint64_t v;
+         memcpy(&v, p, sizeof(v));
+         crc = __crc32cd(crc, v);
+     }
+     while (len--) {
+         crc = __crc32cb(crc, *p++);
+     }
+     return crc;
+ }
+ #define CRC32C_HW_AVAILABLE() 1
+ #endif
+ 
+ static void crc32c_init(void) {
+     for (uint32_t i = 0; i < 256; i++) {
+         uint32_t c = i;
+         for (int k = 0; k < 8; k++) {
+             c = (c >> 1) ^ (0x82F63B78u & (0u - (c & 1)));
+         }
+         crc32cTable[i] = c;
+     }
+     crc32c_update = crc32c_table;
+ #ifdef CRC32C_HW_AVAILABLE
+     if (CRC32C_HW_AVAILABLE()) {
+         crc32c_update = crc32c_hw;
+     }
+ #endif
+ }
+ 
+ uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+     return ~crc32c_update(~crc, buf, len);
+ }
+ 
+ /*****************************************************************************
+  * Checksum trailer. A whole file on the wire (a GET answer, a STORE body
+  * announced with "crc32c") is followed by the sender's checksum of it,
+  *
+  *   CRC32C <8 hex digits>\n
+  *
+  * which the receiver compares with the checksum of what it got.
+  *****************************************************************************/
+ int format_crc_trailer(char *buf, size_t size, uint32_t crc) {
+     return snprintf(buf, size, "CRC32C %08x\n", crc);
+ }
+ 
+ // Returns 0 and sets *crc if `line` (without its newline) is a trailer.
+ int parse_crc_trailer(const char *line, uint32_t *crc) {
+     char *end;
+     if (strncmp(line, "CRC32C ", 7) != 0 || strlen(line + 7) != 8) {
+         return -1;
+     }
+     unsigned long value = strtoul(line + 7, &end, 16);
+     if (*end != '\0') {
+         return -1;
+     }
+     *crc = (uint32_t)value;
+     return 0;
+ }
+ 
+ // Holds back partial segments while a file and its trailer are sent, so the
+ // short trailer does not wait behind Nagle for the peer's delayed ACK.
+ void tcp_cork(int sock, int on) {
+     setsockopt(sock, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+ }
+ 
+ // Sends the trailer and pushes out everything held back by tcp_cork().
+ int send_crc_trailer(int sock, uint32_t crc) {
+     char line[32];
+     int n = format_crc_trailer(line, sizeof(line), crc);
+     int rc = send(sock, line, (size_t)n, MSG_NOSIGNAL) == n ? 0 : -1;
+     tcp_cork(sock, 0);
+     return rc;
+ }
+ 
+ /*****************************************************************************
+  * Logging. LOG() and its siblings format the line in the calling thread and
+  * queue it; a logger thread writes whatever has queued to stderr in one go,
+  * so a worker never waits on the terminal or a pipe. Lines above --log-level
+  * are dropped before they are formatted; per-request lines are LOG_DEBUG,
+  * which keeps them off the hot path at the default level (info). Past
+  * LOG_RATE_LIMIT lines in a second, or with the queue full, lines are
+  * dropped and counted, and the next batch says how many were lost. Until
+  * log_init() has started the logger thread, lines are written at once.
+  *****************************************************************************/
+ #define LOG_QUEUE_SIZE (64 * 1024)   // bytes of lines waiting for the logger
+ #define LOG_RATE_LIMIT 1000          // lines per second
+ 
+ static int logLevel = LOG_LEVEL_INFO;
+ static char logQueue[LOG_QUEUE_SIZE];
+ static size_t logUsed;
+ static unsigned long logDropped;
+ static time_t logSecond;             // second that logInSecond counts
+ static unsigned logInSecond;
+ static int logThreadStarted;
+ static pthread_mutex_t logLock = PTHREAD_MUTEX_INITIALIZER;
+ static pthread_mutex_t logWriteLock = PTHREAD_MUTEX_INITIALIZER;   // held while a batch is written
+ static pthread_cond_t logReady = PTHREAD_COND_INITIALIZER;
+ 
+ // Writes out the queued lines (and the count of dropped ones).
+ static void log_flush(void) {
+     static char batch[LOG_QUEUE_SIZE];
+     pthread_mutex_lock(&logWriteLock);
+     pthread_mutex_lock(&logLock);
+     size_t len = logUsed;
+     unsigned long dropped = logDropped;
+     memcpy(batch, logQueue, len);
+     logUsed = 0;
+     logDropped = 0;
+     pthread_mutex_unlock(&logLock);
+     fwrite(batch, 1, len, stderr);
+     if (dropped > 0) {
+         fprintf(stderr, "S3: %lu log lines dropped\n", dropped);
+     }
+     fflush(stderr);
+     pthread_mutex_unlock(&logWriteLock);
+ }
+ 
+ void log_write(int level, const char *fmt, ...) {
+     if (level > logLevel) {
+         return;
+     }
+     char line[1024];
+     va_list ap;
+     va_start(ap, fmt);
+     int n = vsnprintf(line, sizeof(line), fmt, ap);
+     va_end(ap);
+     if (n < 0) {
+         return;
+     }
+     if ((size_t)n >= sizeof(line)) {
+         n = (int)sizeof(line) - 1;
+         line[n - 1] = '\n';
+     }
+     time_t now = time(NULL);
+     pthread_mutex_lock(&logLock);
+     if (now != logSecond) {
+         logSecond = now;
+         logInSecond = 0;
+     }
+     if (logInSecond >= LOG_RATE_LIMIT || logUsed + (size_t)n > sizeof(logQueue)) {
+         logDropped++;
+     } else {
+         logInSecond++;
+         memcpy(logQueue + logUsed, line, (size_t)n);
+         logUsed += (size_t)n;
+         pthread_cond_signal(&logReady);
+     }
+     pthread_mutex_unlock(&logLock);
+     if (!logThreadStarted) {
+         log_flush();
+     }
+ }
+ 
+ static void *log_main(void *arg) {
+     (void)arg;
+     while (1) {
+         pthread_mutex_lock(&logLock);
+         while (logUsed == 0) {
+             pthread_cond_wait(&logReady, &logLock);
+         }
+         pthread_mutex_unlock(&logLock);
+         log_flush();
+     }
+     return NULL;
+ }
+ 
+ // Sets --log-level and starts the logger thread; what is queued at exit is still written.
+ void log_init(int level) {
+     logLevel = level;
+     pthread_t tid;
+     if (pthread_create(&tid, NULL, log_main, NULL) == 0) {
+         pthread_detach(tid);
+         logThreadStarted = 1;
+         atexit(log_flush);
+     }
+ }
+ 
+ // Parses a --log-level name; -1 if unknown.
+ int log_level_parse(const char *name) {
+     static const char *const names[] = { "error", "warn", "info", "debug" };
+     for (int i = 0; i < (int)(sizeof(names) / sizeof(names[0])); i++) {
+         if (strcmp(name, names[i]) == 0) {
+             return i;
+         }
+     }
+     return -1;
+ }
+ 
+ /*****************************************************************************
+  * Metrics. Every command is counted under its name (STORE includes STOREZ,
+  * GET includes GETR and GETZ, LIST includes LISTP, TAR every TAR<type> and
+  * TARZ), together with its ERROR replies, the bytes it read from and wrote
+  * to its connection, and its latency in a log-linear histogram: 8 buckets
+  * per power of two of microseconds, so a percentile read from it is within
+  * 12.5%. Updates are relaxed atomic adds, without a lock. STATS and
+  * --metrics-port (HTTP "GET /metrics") export them in the Prometheus text
+  * format: the histogram summed into power-of-two buckets, and p50, p90, p99
+  * and p99.9 beside it.
+  *****************************************************************************/
+ #define LAT_SUB_BITS 3
+ #define LAT_MAX_BITS 36                                     // 2^36 us, about 19 hours
+ #define LAT_BUCKETS ((LAT_MAX_BITS - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+ #define LAT_EXPORT_BITS 27                                  // histogram "le" up to 2^26 us
+ 
+ static const char *const metricOps[] = { "STORE", "GET", "DEL", "LIST", "FIND", "TAR", "PART", "COMMIT",
+                                          "ABORT", "LINK", "KEYS", "STATS", "other" };
+ #define METRIC_OPS ((int)(sizeof(metricOps) / sizeof(metricOps[0])))
+ 
+ struct op_metrics {
+     unsigned long count;
+     unsigned long errors;
+     unsigned long bytesIn;
+     unsigned long bytesOut;
+     unsigned long latencySumUs;
+     unsigned long latency[LAT_BUCKETS];
+ };
+ 
+ static struct op_metrics metrics[METRIC_OPS];
+ 
+ // The command the calling thread is running
+ struct request_metrics {
+     int op;              // index in metricOps, -1 between commands
+     int fd;              // its connection; only I/O on it is counted
+     int failed;
+     long bytesIn;
+     long bytesOut;
+     struct timespec start;
+ };
+ static __thread struct request_metrics req = { .op = -1, .fd = -1 };
+ 
+ static int lat_bucket(unsigned long us) {
+     if (us < (1UL << LAT_SUB_BITS)) {
+         return (int)us;
+     }
+     int msb = 63 - __builtin_clzl(us);
+     if (msb >= LAT_MAX_BITS) {
+         return LAT_BUCKETS - 1;
+     }
+     return ((msb - LAT_SUB_BITS + 1) << LAT_SUB_BITS) +
+            (int)((us >> (msb - LAT_SUB_BITS)) & ((1UL << LAT_SUB_BITS) - 1));
+ }
+ 
+ // Smallest latency above bucket `i`, in microseconds.
+ static unsigned long lat_bucket_end(int i) {
+     if (i < (1 << LAT_SUB_BITS)) {
+         return (unsigned long)i + 1;
+     }
+     int shift = (i >> LAT_SUB_BITS) - 1;
+     unsigned long sub = (unsigned long)(i & ((1 << LAT_SUB_BITS) - 1));
+     return (((1UL << LAT_SUB_BITS) + sub + 1) << shift);
+ }
+ 
+ // Called once the command name is known.
+ void metrics_begin(int fd, const char *cmd) {
+     req.op = METRIC_OPS - 1;
+     for (int i = 0; i < METRIC_OPS - 1; i++) {
+         if (strncmp(cmd, metricOps[i], strlen(metricOps[i])) == 0) {
+             req.op = i;
+             break;
+         }
+     }
+     req.fd = fd;
+     req.failed = 0;
+     req.bytesIn = 0;
+     req.bytesOut = 0;
+     clock_gettime(CLOCK_MONOTONIC, &req.start);
+ }
+ 
+ // Counts bytes moved on `fd`, if that is the connection of the current command.
+ static inline void metrics_io(int fd, long in, long out) {
+     if (fd == req.fd) {
+         req.bytesIn += in;
+         req.bytesOut += out;
+     }
+ }
+ 
+ // Records the command begun by metrics_begin(), if any.
+ void metrics_end(void) {
+     if (req.op < 0) {
+         return;
+     }
+     struct timespec now;
+     clock_gettime(CLOCK_MONOTONIC, &now);
+     long us = (now.tv_sec - req.start.tv_sec) * 1000000L + (now.tv_nsec - req.start.tv_nsec) / 1000;
+     struct op_metrics *m = &metrics[req.op];
+     __atomic_add_fetch(&m->count, 1, __ATOMIC_RELAXED);
+     __atomic_add_fetch(&m->errors, (unsigned long)req.failed, __ATOMIC_RELAXED);
+     __atomic_add_fetch(&m->bytesIn, (unsigned long)req.bytesIn, __ATOMIC_RELAXED);
+     __atomic_add_fetch(&m->bytesOut, (unsigned long)req.bytesOut, __ATOMIC_RELAXED);
+     __atomic_add_fetch(&m->latencySumUs, (unsigned long)(us > 0 ? us : 0), __ATOMIC_RELAXED);
+     __atomic_add_fetch(&m->latency[lat_bucket(us > 0 ? (unsigned long)us : 0)], 1, __ATOMIC_RELAXED);
+     req.op = -1;
+     req.fd = -1;
+ }
+ 
+ // Sends an ERROR reply to S1, counting it against the current command.
+ static void send_error(int sock, const char *msg) {
+     req.failed = 1;
+     send(sock, msg, strlen(msg), 0);
+ }
+ 
+ struct text_buf {
+     char *data;
+     size_t len, cap;
+ };
+ 
+ static void text_add(struct text_buf *t, const char *fmt, ...) __attribute__((format(printf, 2, 3)));
+ 
+ static void text_add(struct text_buf *t, const char *fmt, ...) {
+     for (;;) {
+         va_list ap;
+         va_start(ap, fmt);
+         int n = t->data ? vsnprintf(t->data + t->len, t->cap - t->len, fmt, ap) : -1;
+         va_end(ap);
+         if (n >= 0 && t->len + (size_t)n < t->cap) {
+             t->len += (size_t)n;
+             return;
+         }
+         size_t cap = t->cap ? 2 * t->cap : 16384;
+         char *data = realloc(t->data, cap);
+         if (!data) {
+             return;
+         }
+         t->data = data;
+         t->cap = cap;
+     }
+ }
+ 
+ /*****************************************************************************
+  * metrics_text: the metrics in the Prometheus text format, in a malloc()ed
+  * buffer of *len bytes (NULL if out of memory). Commands that never ran are
+  * left out.
+  *****************************************************************************/
+ char *metrics_text(size_t *len) {
+     struct text_buf t = { NULL, 0, 0 };
+     struct op_metrics m[METRIC_OPS];
+     for (int op = 0; op < METRIC_OPS; op++) {
+         unsigned long *from = (unsigned long *)&metrics[op], *to = (unsigned long *)&m[op];
+         for (size_t i = 0; i < sizeof(m[op]) / sizeof(unsigned long); i++) {
+             to[i] = __atomic_load_n(&from[i], __ATOMIC_RELAXED);
+         }
+     }
+     static const struct { const char *name, *help; size_t field; } counters[] = {
+         { "requests_total", "Commands served.", offsetof(struct op_metrics, count) },
+         { "request_errors_total", "Commands answered with an ERROR.",
+           offsetof(struct op_metrics, errors) },
+         { "received_bytes_total", "Bytes read from the connection by commands.",
+           offsetof(struct op_metrics, bytesIn) },
+         { "sent_bytes_total", "Bytes written to the connection by commands.",
+           offsetof(struct op_metrics, bytesOut) },
+     };
+     for (size_t c = 0; c < sizeof(counters) / sizeof(counters[0]); c++) {
+         text_add(&t, "# HELP w25_%s %s\n# TYPE w25_%s counter\n", counters[c].name, counters[c].help,
+                  counters[c].name);
+         for (int op = 0; op < METRIC_OPS; op++) {
+             if (m[op].count > 0) {
+                 text_add(&t, "w25_%s{op=\"%s\"} %lu\n", counters[c].name, metricOps[op],
+                          *(unsigned long *)((char *)&m[op] + counters[c].field));
+             }
+         }
+     }
+     text_add(&t, "# HELP w25_request_duration_seconds Command latency.\n"
+                  "# TYPE w25_request_duration_seconds histogram\n");
+     for (int op = 0; op < METRIC_OPS; op++) {
+         if (m[op].count == 0) {
+             continue;
+         }
+         unsigned long below = 0;
+         int i = 0;
+         for (int bit = 0; bit < LAT_EXPORT_BITS; bit++) {
+             for (; i < LAT_BUCKETS && lat_bucket_end(i) <= (1UL << bit); i++) {
+                 below += m[op].latency[i];
+             }
+             text_add(&t, "w25_request_duration_seconds_bucket{op=\"%s\",le=\"%g\"} %lu\n",
+                      metricOps[op], (double)(1UL << bit) / 1e6, below);
+         }
+         text_add(&t, "w25_request_duration_seconds_bucket{op=\"%s\",le=\"+Inf\"} %lu\n"
+                      "w25_request_duration_seconds_sum{op=\"%s\"} %g\n"
+                      "w25_request_duration_seconds_count{op=\"%s\"} %lu\n",
+                  metricOps[op], m[op].count, metricOps[op], (double)m[op].latencySumUs / 1e6,
+                  metricOps[op], m[op].count);
+     }
+     static const double quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+     text_add(&t, "# HELP w25_request_duration_quantile_seconds Command latency percentiles.\n"
+                  "# TYPE w25_request_duration_quantile_seconds gauge\n");
+     for (int op = 0; op < METRIC_OPS; op++) {
+         unsigned long seen = 0;
+         int i = 0;
+         for (size_t q = 0; m[op].count > 0 && q < sizeof(quantiles) / sizeof(quantiles[0]); q++) {
+             unsigned long rank = (unsigned long)(quantiles[q] * (double)m[op].count);
+             for (; i < LAT_BUCKETS - 1 && seen + m[op].latency[i] <= rank; i++) {
+                 seen += m[op].latency[i];
+             }
+             text_add(&t, "w25_request_duration_quantile_seconds{op=\"%s\",quantile=\"%g\"} %g\n",
+                      metricOps[op], quantiles[q], (double)lat_bucket_end(i) / 1e6);
+         }
+     }
+     *len = t.len;
+     return t.data;
+ }
+ 
+ /*****************************************************************************
+  * I/O engine. With --io uring, file bodies go through an io_uring of the
+  * worker thread instead of blocking pread()/send()/fwrite() calls: a GET
+  * keeps URING_DEPTH reads of the file in flight ahead of the socket, and a
+  * STORE hands each filled buffer to the kernel as a write and goes on
+  * receiving (write-behind), waiting only when every buffer is busy and once
+  * before the file is committed. The buffers are registered with the ring when
+  * it is set up (READ_FIXED/WRITE_FIXED), so they are not mapped again for
+  * every operation. The ring is driven by raw system calls, without liburing.
+  * The blocking engine stays the default, and is what a thread falls back to
+  * when the kernel refuses io_uring (too old, or forbidden by seccomp).
+  *****************************************************************************/
+ enum { IO_BLOCKING, IO_URING };
+ 
+ #define URING_DEPTH 8                 // buffers, and so operations, per ring
+ #define URING_BUF_SIZE (64 * 1024)
+ #define URING_TIMEOUT_TAG ~0ULL       // user_data of a send's link timeout
+ 
+ enum { SLOT_FREE, SLOT_READING, SLOT_READ, SLOT_SENDING, SLOT_WRITING };
+ 
+ struct uring_slot {
+     int state;
+     off_t offset;     // file offset of the buffer's first byte
+     size_t len;       // bytes the operation is for
+     size_t done;      // bytes of them completed so far
+ };
+ 
+ struct uring {
+     int fd;
+     unsigned *sqHead, *sqTail, *sqMask, *sqArray;
+     unsigned *cqHead, *cqTail, *cqMask;
+     struct io_uring_sqe *sqes;
+     struct io_uring_cqe *cqes;
+     unsigned toSubmit;        // queued since the last io_uring_enter()
+     unsigned inFlight;        // submitted, completion not reaped yet
+     char *bufs;               // URING_DEPTH registered buffers
+     struct uring_slot slots[URING_DEPTH];
+ };
+ 
+ static int ioEngine = IO_BLOCKING;
+ static __thread struct uring *threadRing;
+ static __thread int threadRingFailed;
+ 
+ static struct uring *uring_setup(void) {
+     struct io_uring_params p;
+     memset(&p, 0, sizeof(p));
+     int fd = (int)syscall(__NR_io_uring_setup, 2 * URING_DEPTH, &p);
+     if (fd < 0) {
+         return NULL;
+     }
+     struct uring *r = calloc(1, sizeof(*r));
+     size_t sqSize = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+     size_t cqSize = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+     if (p.features & IORING_FEAT_SINGLE_MMAP) {
+         sqSize = cqSize = sqSize > cqSize ? sqSize : cqSize;
+     }
+     char *sq = mmap(NULL, sqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                     IORING_OFF_SQ_RING);
+     char *cq = (p.features & IORING_FEAT_SINGLE_MMAP) ? sq
+                : mmap(NULL, cqSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+                       IORING_OFF_CQ_RING);
+     void *sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+     void *bufs = mmap(NULL, (size_t)URING_DEPTH * URING_BUF_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+     struct iovec iov[URING_DEPTH];
+     for (int i = 0; bufs != MAP_FAILED && i < URING_DEPTH; i++) {
+         iov[i].iov_base = (char *)bufs + (size_t)i * URING_BUF_SIZE;
+         iov[i].iov_len = URING_BUF_SIZE;
+     }
+     if (!r || sq == MAP_FAILED || cq == MAP_FAILED || sqes == MAP_FAILED || bufs == MAP_FAILED ||
+         syscall(__NR_io_uring_register, fd, IORING_REGISTER_BUFFERS, iov, URING_DEPTH) != 0) {
+         // The mappings die with the ring fd; a thread only gets here once
+         close(fd);
+         free(r);
+         return NULL;
+     }
+     r->fd = fd;
+     r->sqHead = (unsigned *)(sq + p.sq_off.head);
+     r->sqTail = (unsigned *)(sq + p.sq_off.tail);
+     r->sqMask = (unsigned *)(sq + p.sq_off.ring_mask);
+     r->sqArray = (unsigned *)(sq + p.sq_off.array);
+     r->cqHead = (unsigned *)(cq + p.cq_off.head);
+     r->cqTail = (unsigned *)(cq + p.cq_off.tail);
+     r->cqMask = (unsigned *)(cq + p.cq_off.ring_mask);
+     r->cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+     r->sqes = sqes;
+     r->bufs = bufs;
+     return r;
+ }
+ 
+ // The calling thread's ring, set up on first use; NULL with the blocking engine.
+ static struct uring *uring_get(void) {
+     if (ioEngine != IO_URING || threadRingFailed) {
+         return NULL;
+     }
+     if (!threadRing) {
+         threadRing = uring_setup();
+         if (!threadRing) {
+             LOG_WARN("io_uring unavailable (%s); this thread uses blocking I/O", strerror(errno));
+             threadRingFailed = 1;
+         }
+     }
+     return threadRing;
+ }
+ 
+ // Queues `op` on buffer `tag` (URING_TIMEOUT_TAG: no buffer); submitted by the next uring_wait().
+ static struct io_uring_sqe *uring_sqe(struct uring *r, int op, int fd, unsigned long long tag) {
+     unsigned tail = *r->sqTail;
+     unsigned idx = tail & *r->sqMask;
+     struct io_uring_sqe *sqe = &r->sqes[idx];
+     memset(sqe, 0, sizeof(*sqe));
+     sqe->opcode = (unsigned char)op;
+     sqe->fd = fd;
+     sqe->user_data = tag;
+     if (tag != URING_TIMEOUT_TAG) {
+         sqe->addr = (unsigned long)(r->bufs + tag * URING_BUF_SIZE + r->slots[tag].done);
+         sqe->len = (unsigned)(r->slots[tag].len - r->slots[tag].done);
+         sqe->off = (unsigned long long)(r->slots[tag].offset + r->slots[tag].done);
+         sqe->buf_index = (unsigned short)tag;
+     }
+     r->sqArray[idx] = idx;
+     __atomic_store_n(r->sqTail, tail + 1, __ATOMIC_RELEASE);
+     r->toSubmit++;
+     r->inFlight++;
+     return sqe;
+ }
+ 
+ // Submits what is queued and takes the next completion. Returns 0, or -1 if the ring failed.
+ static int uring_wait(struct uring *r, struct io_uring_cqe *cqe) {
+     for (;;) {
+         unsigned head = *r->cqHead;
+         if (head != __atomic_load_n(r->cqTail, __ATOMIC_ACQUIRE)) {
+             *cqe = r->cqes[head & *r->cqMask];
+             __atomic_store_n(r->cqHead, head + 1, __ATOMIC_RELEASE);
+             r->inFlight--;
+             return 0;
+         }
+         int n = (int)syscall(__NR_io_uring_enter, r->fd, r->toSubmit, 1, IORING_ENTER_GETEVENTS,
+                              NULL, 0);
+         if (n < 0 && errno != EINTR) {
+             threadRingFailed = 1;   // later transfers of this thread use blocking I/O
+             return -1;
+         }
+         if (n > 0) {
+             r->toSubmit -= (unsigned)n;
+         }
+     }
+ }
+ 
+ // Waits for every operation still in flight (after an error, cancelling them first).
+ static void uring_drain(struct uring *r, int cancel) {
+     if (cancel && r->inFlight > 0) {
+         struct io_uring_sqe *sqe = uring_sqe(r, IORING_OP_ASYNC_CANCEL, -1, URING_TIMEOUT_TAG);
+         sqe->cancel_flags = IORING_ASYNC_CANCEL_ANY;
+     }
+     struct io_uring_cqe cqe;
+     while (r->inFlight > 0 && uring_wait(r, &cqe) == 0) {
+     }
+     for (int i = 0; i < URING_DEPTH; i++) {
+         r->slots[i].state = SLOT_FREE;
+     }
+ }
+ 
+ static void uring_read(struct uring *r, int slot, int fd) {
+     r->slots[slot].state = SLOT_READING;
+     uring_sqe(r, IORING_OP_READ_FIXED, fd, (unsigned long long)slot);
+ }
+ 
+ // A send that may wait on the peer gets the socket's SO_SNDTIMEO as a link timeout.
+ static void uring_send(struct uring *r, int slot, int sock, const struct __kernel_timespec *timeout) {
+     r->slots[slot].state = SLOT_SENDING;
+     struct io_uring_sqe *sqe = uring_sqe(r, IORING_OP_SEND, sock, (unsigned long long)slot);
+     sqe->off = 0;
+     sqe->buf_index = 0;
+     sqe->msg_flags = MSG_NOSIGNAL;
+     if (timeout) {
+         sqe->flags |= IOSQE_IO_LINK;
+         sqe = uring_sqe(r, IORING_OP_LINK_TIMEOUT, -1, URING_TIMEOUT_TAG);
+         sqe->addr = (unsigned long)timeout;
+         sqe->len = 1;
+     }
+ }
+ 
+ /*****************************************************************************
+  * uring_send_file: send_file_fd() for the io_uring engine. The file is read
+  * in URING_BUF_SIZE chunks, chunk k into buffer k % URING_DEPTH, up to
+  * URING_DEPTH chunks ahead; the socket gets one send at a time, in order
+  * (several sends on one stream could complete out of order). Returns 0 on
+  * success, -1 on error.
+  *****************************************************************************/
+ static int uring_send_file(struct uring *r, int sock, int fd, off_t offset, long length,
+                            uint32_t *crc) {
+     struct timeval tv = { 0, 0 };
+     socklen_t tvLen = sizeof(tv);
+     getsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, &tvLen);
+     struct __kernel_timespec timeout = { tv.tv_sec, tv.tv_usec * 1000 };
+     const struct __kernel_timespec *sendTimeout = (tv.tv_sec || tv.tv_usec) ? &timeout : NULL;
+ 
+     long chunks = (length + URING_BUF_SIZE - 1) / URING_BUF_SIZE;
+     long nextRead = 0, nextSend = 0;
+     int sending = 0, rc = 0;
+     for (; nextRead < chunks && nextRead < URING_DEPTH; nextRead++) {
+         struct uring_slot *s = &r->slots[nextRead];
+         s->offset = offset + nextRead * URING_BUF_SIZE;
+         s->len = (size_t)(length - nextRead * URING_BUF_SIZE < URING_BUF_SIZE
+                           ? length - nextRead * URING_BUF_SIZE : URING_BUF_SIZE);
+         s->done = 0;
+         uring_read(r, (int)nextRead, fd);
+     }
+     while (rc == 0 && nextSend < chunks) {
+         int next = (int)(nextSend % URING_DEPTH);
+         if (!sending && r->slots[next].state == SLOT_READ) {
+             if (crc) {
+                 *crc = crc32c(*crc, r->bufs + (size_t)next * URING_BUF_SIZE, r->slots[next].len);
+             }
+             r->slots[next].done = 0;
+             uring_send(r, next, sock, sendTimeout);
+             sending = 1;
+         }
+         struct io_uring_cqe cqe;
+         if (uring_wait(r, &cqe) != 0) {
+             rc = -1;
+             break;
+         }
+         if (cqe.user_data == URING_TIMEOUT_TAG) {
+             continue;   // the send it guarded reports the outcome
+         }
+         int slot = (int)cqe.user_data;
+         struct uring_slot *s = &r->slots[slot];
+         if (cqe.res <= 0) {
+             errno = cqe.res == -ECANCELED ? ETIMEDOUT : cqe.res < 0 ? -cqe.res : EIO;
+             rc = -1;   // error, or file shorter than expected
+         } else if ((s->done += (size_t)cqe.res) < s->len) {
+             if (s->state == SLOT_READING) {
+                 uring_read(r, slot, fd);
+             } else {
+                 uring_send(r, slot, sock, sendTimeout);
+             }
+         } else if (s->state == SLOT_READING) {
+             s->state = SLOT_READ;
+         } else {
+             sending = 0;
+             nextSend++;
+             s->state = SLOT_FREE;
+             if (nextRead < chunks) {
+                 s->offset = offset + nextRead * URING_BUF_SIZE;
+                 s->len = (size_t)(length - nextRead * URING_BUF_SIZE < URING_BUF_SIZE
+                                   ? length - nextRead * URING_BUF_SIZE : URING_BUF_SIZE);
+                 s->done = 0;
+                 uring_read(r, slot, fd);
+                 nextRead++;
+             }
+         }
+     }
+     uring_drain(r, rc != 0);
+     return rc;
+ }
+ 
+ /*****************************************************************************
+  * file_writer: where a STORE body goes. With the blocking engine it is the
+  * stdio stream; with io_uring the bytes are gathered in the ring's buffers
+  * and each full buffer becomes a WRITE_FIXED at its file offset, several of
+  * them in flight at once. writer_finish() must be called before the file is
+  * flushed, renamed or closed, whatever happened to the body.
+  *****************************************************************************/
+ struct file_writer {
+     FILE *fp;
+     struct uring *ring;   // NULL: fwrite() to fp
+     off_t offset;         // file offset of the next byte
+     int slot;             // buffer being filled, -1 if none
+     int failed;
+ };
+ 
+ void writer_init(struct file_writer *w, FILE *fp) {
+     w->fp = fp;
+     w->ring = uring_get();
+     w->offset = 0;
+     w->slot = -1;
+     w->failed = 0;
+ }
+ 
+ // Reaps one completion of the writer's ring, resubmitting the rest of a short write.
+ static void writer_reap(struct file_writer *w) {
+     struct io_uring_cqe cqe;
+     if (uring_wait(w->ring, &cqe) != 0) {
+         w->failed = 1;
+         w->ring->inFlight = 0;   // nothing more will be reaped from it
+         return;
+     }
+     struct uring_slot *s = &w->ring->slots[cqe.user_data];
+     if (cqe.res <= 0) {
+         errno = cqe.res < 0 ? -cqe.res : ENOSPC;
+         w->failed = 1;
+         s->state = SLOT_FREE;
+     } else if ((s->done += (size_t)cqe.res) < s->len) {
+         uring_sqe(w->ring, IORING_OP_WRITE_FIXED, fileno(w->fp), cqe.user_data);
+     } else {
+         s->state = SLOT_FREE;
+     }
+ }
+ 
+ static void writer_submit(struct file_writer *w) {
+     struct uring_slot *s = &w->ring->slots[w->slot];
+     s->state = SLOT_WRITING;
+     s->done = 0;
+     uring_sqe(w->ring, IORING_OP_WRITE_FIXED, fileno(w->fp), (unsigned long long)w->slot);
+     w->slot = -1;
+ }
+ 
+ // Appends `len` bytes to the file. Returns 0, or -1 once a write has failed.
+ int writer_write(struct file_writer *w, const void *data, size_t len) {
+     if (!w->ring) {
+         return fwrite(data, 1, len, w->fp) == len ? 0 : -1;
+     }
+     const char *p = data;
+     while (!w->failed && len > 0) {
+         if (w->slot < 0) {
+             for (int i = 0; i < URING_DEPTH && w->slot < 0; i++) {
+                 if (w->ring->slots[i].state == SLOT_FREE) {
+                     w->slot = i;
+                 }
+             }
+             if (w->slot < 0) {
+                 writer_reap(w);   // every buffer is being written
+                 continue;
+             }
+             w->ring->slots[w->slot].offset = w->offset;
+             w->ring->slots[w->slot].len = 0;
+         }
+         struct uring_slot *s = &w->ring->slots[w->slot];
+         size_t n = URING_BUF_SIZE - s->len < len ? URING_BUF_SIZE - s->len : len;
+         memcpy(w->ring->bufs + (size_t)w->slot * URING_BUF_SIZE + s->len, p, n);
+         s->len += n;
+         w->offset += (off_t)n;
+         p += n;
+         len -= n;
+         if (s->len == URING_BUF_SIZE) {
+             writer_submit(w);
+         }
+     }
+     return w->failed ? -1 : 0;
+ }
+ 
+ // Writes out what is still buffered and waits for every write. Returns 0, or -1 if one failed.
+ int writer_finish(struct file_writer *w) {
+     if (!w->ring) {
+         return 0;
+     }
+     if (w->slot >= 0 && !w->failed) {
+         writer_submit(w);
+     }
+     while (w->ring->inFlight > 0) {
+         writer_reap(w);
+     }
+     uring_drain(w->ring, 0);
+     return w->failed ? -1 : 0;
+ }
+ 
+ // Sets the engine (--io) for the threads' rings, set up on first use.
+ void io_init(int engine) {
+     ioEngine = engine;
+ }
+ 
+ /*****************************************************************************
+  * send_file_fd: sends `length` bytes of an open file, starting at `offset`,
+  * to a socket. Uses sendfile(2) so the data goes from the page cache to the
+  * socket without a user-space copy; falls back to a pread/send loop if the
+  * kernel cannot sendfile from this descriptor. With `crc`, the pread/send
+  * loop is used throughout and *crc is updated with the bytes sent; with
+  * --io uring that loop is uring_send_file(). Returns 0 on success, -1 on
+  * error.
+  *****************************************************************************/
+ int send_file_fd(int sock, int fd, off_t offset, long length, uint32_t *crc) {
+     struct uring *ring = crc ? uring_get() : NULL;
+     if (ring) {
+         int rc = uring_send_file(ring, sock, fd, offset, length, crc);
+         if (rc == 0) {
+             metrics_io(sock, 0, length);
+         }
+         return rc;
+     }
+     long remaining = length;
+     while (!crc && remaining > 0) {
+         size_t chunk = remaining < (1L << 30) ? (size_t)remaining : (1UL << 30);
+         ssize_t n = sendfile(sock, fd, &offset, chunk);
+         if (n < 0 && errno == EINTR) {
+             continue;
+         }
+         if (n < 0 && remaining == length && (errno == EINVAL || errno == ENOSYS)) {
+             break;  // e.g. filesystem without sendfile support
+         }
+         if (n <= 0) {
+             return -1;  // error, or file shorter than expected
+         }
+         remaining -= n;
+     }
+     char buf[BUF_SIZE];
+     while (remaining > 0) {
+         ssize_t r = pread(fd, buf, remaining < BUF_SIZE ? remaining : BUF_SIZE, offset);
+         if (r <= 0) {
+             return -1;
+         }
+         if (crc) {
+             *crc = crc32c(*crc, buf, (size_t)r);
+         }
+         ssize_t sent = 0;
+         while (sent < r) {
+             ssize_t n = send(sock, buf + sent, r - sent, 0);
+             if (n < 0 && errno == EINTR) {
+                 continue;
+             }
+             if (n <= 0) {
+                 return -1;
+             }
+             sent += n;
+         }
+         offset += r;
+         remaining -= r;
+     }
+     metrics_io(sock, 0, length);
+     return 0;
+ }
+ 
+ /*****************************************************************************
+  * Buffered reader for an S1 connection. Instead of one recv() per byte of a
+  * command line, up to READER_BUF_SIZE bytes are read at once and complete
+  * lines are handed out from the buffer. Bytes that follow a line (the start
+  * of a STORE body, or the next command S1 already sent) stay in the buffer,
+  * so every read from the connection must go through the reader. The reader
+  * lives as long as the connection and is what the worker queue carries.
+  *****************************************************************************/
+ struct line_reader {
+     int fd;
+     size_t start;   // first unconsumed byte in buf
+     size_t end;     // one past the last buffered byte
+     char buf[READER_BUF_SIZE];
+ };
+ 
+ void reader_init(struct line_reader *r, int fd) {
+     r->fd = fd;
+     r->start = 0;
+     r->end = 0;
+ }
+ 
+ // Returns 1 if a complete command line is already buffered.
+ int reader_has_line(const struct line_reader *r) {
+     return memchr(r->buf + r->start, '\n', r->end - r->start) != NULL;
+ }
+ 
+ /*****************************************************************************
+  * reader_getline: reads one newline-terminated line into `line` (without the
+  * newline), refilling the buffer with large reads only when it runs dry.
+  * Overlong lines are truncated to size-1 bytes. Returns the line length, or
+  * -1 if the connection was closed or failed first.
+  *****************************************************************************/
+ int reader_getline(struct line_reader *r, char *line, size_t size) {
+     size_t len = 0;
+     while (1) {
+         char *p = r->buf + r->start;
+         size_t avail = r->end - r->start;
+         char *nl = memchr(p, '\n', avail);
+         size_t lineBytes = nl ? (size_t)(nl - p) : avail;
+         size_t copy = lineBytes < size - 1 - len ? lineBytes : size - 1 - len;
+         memcpy(line + len, p, copy);
+         len += copy;
+         line[len] = '\0';
+         r->start += nl ? lineBytes + 1 : lineBytes;
+         if (nl) {
+             return (int)len;
+         }
+         // Buffer is empty: refill it from the start
+         r->start = r->end = 0;
+         ssize_t n;
+         do {
+             n = recv(r->fd, r->buf, sizeof(r->buf), 0);
+         } while (n < 0 && errno == EINTR);
+         if (n <= 0) {
+             return -1;
+         }
+         metrics_io(r->fd, n, 0);
+         r->end = (size_t)n;
+     }
+ }
+ 
+ /*****************************************************************************
+  * reader_read: like recv(), but returns buffered bytes first. Once the buffer
+  * is empty, reads go straight to the socket so large bodies skip the copy.
+  *****************************************************************************/
+ ssize_t reader_read(struct line_reader *r, void *dst, size_t len) {
+     size_t avail = r->end - r->start;
+     if (avail > 0) {
+         size_t n = avail < len ? avail : len;
+         memcpy(dst, r->buf + r->start, n);
+         r->start += n;
+         return (ssize_t)n;
+     }
+     ssize_t n;
+     do {
+         n = recv(r->fd, dst, len, 0);
+     } while (n < 0 && errno == EINTR);
+     if (n > 0) {
+         metrics_io(r->fd, n, 0);
+     }
+     return n;
+ }
+ 
+ /*****************************************************************************
+  * Compression. S1 can ask for a file or an archive to be deflated on its way
+  * out (GETZ, TARZ) and send an upload deflated (STOREZ), so text crosses the
+  * link to S1 compressed. A deflated body is one zlib stream carried in the
+  * chunked framing of TAR ("<hex length>\n<bytes>" ... "0\n"), since its size
+  * is not known until it has been produced. Files are stored uncompressed.
+  *****************************************************************************/
+ #define COMPRESS_MIN_SIZE 4096       // GETZ sends smaller files as they are
+ #define ZCHUNK_SIZE (64 * 1024)      // deflated output is sent in chunks of up to this size
+ 
+ static int write_all(int fd, const char *buf, size_t len) {
+     metrics_io(fd, 0, (long)len);
+     while (len > 0) {
+         ssize_t n = write(fd, buf, len);
+         if (n < 0 && errno == EINTR) continue;
+         if (n <= 0) return -1;
+         buf += n;
+         len -= (size_t)n;
+     }
+     return 0;
+ }
+ 
+ // A copy of an answer taken as it goes out, for the archive cache (see
+ // "Archive cache"). A copy that fails or outgrows `limit` is given up.
+ struct stream_copy {
+     int fd;
+     int ok;                // Every byte so far made it into the copy
+     long len, limit;
+ };
+ 
+ // write_all() to `fd`, and to `copy` as well if there is one.
+ static int write_copied(int fd, struct stream_copy *copy, const char *buf, size_t len) {
+     if (copy && copy->ok) {
+         if (copy->len + (long)len > copy->limit || write_all(copy->fd, buf, len) != 0) {
+             copy->ok = 0;
+         } else {
+             copy->len += (long)len;
+         }
+     }
+     return write_all(fd, buf, len);
+ }
+ 
+ struct zout {
+     int fd;
+     struct stream_copy *copy;  // Also write the stream here; NULL for none
+     int failed;            // A write failed; the rest of the stream is dropped
+     z_stream zs;
+     unsigned char out[ZCHUNK_SIZE];
+ };
+ 
+ // Starts a deflated stream to `fd` at `level` (1-9). Returns 0 on success.
+ int zout_init(struct zout *z, int fd, int level) {
+     memset(&z->zs, 0, sizeof(z->zs));
+     z->fd = fd;
+     z->copy = NULL;
+     z->failed = 0;
+     return deflateInit(&z->zs, level) == Z_OK ? 0 : -1;
+ }
+ 
+ // Feeds `len` bytes to the compressor and sends whatever output it produces.
+ static int zout_run(struct zout *z, const void *data, size_t len, int flush) {
+     z->zs.next_in = (Bytef *)data;
+     z->zs.avail_in = (uInt)len;
+     do {
+         z->zs.next_out = z->out;
+         z->zs.avail_out = sizeof(z->out);
+         if (deflate(&z->zs, flush) == Z_STREAM_ERROR) {
+             z->failed = 1;
+             break;
+         }
+         size_t n = sizeof(z->out) - z->zs.avail_out;
+         if (n > 0 && !z->failed) {
+             char hdr[32];
+             int h = snprintf(hdr, sizeof(hdr), "%zx\n", n);
+             if (write_copied(z->fd, z->copy, hdr, (size_t)h) != 0 ||
+                 write_copied(z->fd, z->copy, (char *)z->out, n) != 0) {
+                 z->failed = 1;
+             }
+         }
+     } while (z->zs.avail_out == 0);
+     return z->failed ? -1 : 0;
+ }
+ 
+ int zout_write(struct zout *z, const void *data, size_t len) {
+     return len > 0 ? zout_run(z, data, len, Z_NO_FLUSH) : (z->failed ? -1 : 0);
+ }
+ 
+ // Ends the stream with the "0" terminator and frees the compressor.
+ int zout_finish(struct zout *z) {
+     int rc = zout_run(z, NULL, 0, Z_FINISH);
+     deflateEnd(&z->zs);
+     return rc == 0 ? write_copied(z->fd, z->copy, "0\n", 2) : -1;
+ }
+ 
+ /*****************************************************************************
+  * zout_send_file: sends the open file `fd` as a deflated stream, adding the
+  * plain bytes to *crc. Returns 0 on success, -1 if S1 went away or the file
+  * could not be read (the stream then ends without its terminator).
+  *****************************************************************************/
+ int zout_send_file(int sock, int fd, int level, uint32_t *crc) {
+     struct zout *z = malloc(sizeof(*z));
+     if (!z || zout_init(z, sock, level) != 0) {
+         free(z);
+         return -1;
+     }
+     char buf[ZCHUNK_SIZE];
+     ssize_t n;
+     int rc = 0;
+     while (rc == 0 && (n = read(fd, buf, sizeof(buf))) != 0) {
+         if (n < 0 && errno == EINTR) {
+             continue;
+         }
+         if (n > 0) {
+             *crc = crc32c(*crc, buf, (size_t)n);
+         }
+         rc = n < 0 ? -1 : zout_write(z, buf, (size_t)n);
+     }
+     if (rc == 0) {
+         rc = zout_finish(z);
+     } else {
+         deflateEnd(&z->zs);
+     }
+     free(z);
+     return rc;
+ }
+ 
+ /*****************************************************************************
+  * Tar archive writer. TAR answers are produced in-process: the tree is walked
+  * with nftw() and ustar headers plus file bodies are written to the socket
+  * as they are read, so S1 starts receiving before the walk is done and no
+  * temp file or external tar process is involved. The output is chunked:
+  *
+  *   <hex length>\n<that many bytes>   repeated, then   0\n
+  *
+  * so neither side needs to know the archive size up front.
+  *****************************************************************************/
+ struct tar_writer {
+     int fd;            // Socket or file the archive goes to
+     int chunked;       // Wrap the output in chunks (see above)
+     int failed;        // A write failed; the walk stops and the output is unusable
+     struct zout *z;    // Deflate the output (see "Compression"); NULL for plain
+     struct stream_copy *copy;  // Copy of the output for the archive cache; NULL for none
+     size_t baseLen;    // Length of the tree root, stripped from member names
+     const char *ext;   // Only regular files ending in this extension are archived
+     unsigned long since;  // Only files changed after this index generation; 0 for all
+     long files;
+     size_t len;        // Bytes waiting in buf
+     char buf[TAR_CHUNK_SIZE];
+ };
+ 
+ // nftw() has no user argument; each thread runs at most one walk at a time.
+ static __thread struct tar_writer *tarActive;
+ 
+ static int tar_flush(struct tar_writer *w) {
+     if (w->failed) return -1;
+     if (w->len == 0) return 0;
+     if (w->z) {
+         if (zout_write(w->z, w->buf, w->len) != 0) {
+             w->failed = 1;
+             return -1;
+         }
+         w->len = 0;
+         return 0;
+     }
+     if (w->chunked) {
+         char hdr[32];
+         int n = snprintf(hdr, sizeof(hdr), "%zx\n", w->len);
+         if (write_copied(w->fd, w->copy, hdr, (size_t)n) != 0) {
+             w->failed = 1;
+             return -1;
+         }
+     }
+     if (write_copied(w->fd, w->chunked ? w->copy : NULL, w->buf, w->len) != 0) {
+         w->failed = 1;
+         return -1;
+     }
+     w->len = 0;
+     return 0;
+ }
+ 
+ // Appends `len` zero bytes (record padding).
+ static int tar_zero(struct tar_writer *w, size_t len) {
+     while (len > 0) {
+         if (w->len == sizeof(w->buf) && tar_flush(w) != 0) return -1;
+         size_t n = sizeof(w->buf) - w->len;
+         if (n > len) n = len;
+         memset(w->buf + w->len, 0, n);
+         w->len += n;
+         len -= n;
+     }
+     return 0;
+ }
+ 
+ // Writes a numeric header field: zero-padded octal, or base-256 when the
+ // value does not fit (GNU extension, needed for files of 8 GiB and more).
+ static void tar_number(char *field, size_t width, unsigned long long value) {
+     if (value < (1ULL << (3 * (width - 1)))) {
+         snprintf(field, width, "%0*llo", (int)width - 1, value);
+         return;
+     }
+     memset(field, 0, width);
+     field[0] = (char)0x80;
+     for (size_t i = width - 1; i > 0 && value; i--, value >>= 8) {
+         field[i] = (char)(value & 0xff);
+     }
+ }
+ 
+ /*****************************************************************************
+  * tar_header: fills in a ustar header block. Names longer than 100 bytes are split
+  * into the prefix field at a '/'.
+  * Returns 0 on success, -1 if the name cannot be represented.
+  *****************************************************************************/
+ static int tar_header(char *block, const char *name, const struct stat *st, long long size) {
+     memset(block, 0, 512);
+     size_t nameLen = strlen(name);
+     if (nameLen <= 100) {
+         memcpy(block, name, nameLen);
+     } else {
+         const char *split = NULL;
+         for (const char *p = name; (p = strchr(p, '/')) != NULL; p++) {
+             if ((size_t)(p - name) <= 155 && nameLen - (size_t)(p - name) - 1 <= 100) {
+                 split = p;
+                 break;
+             }
+         }
+         if (!split || split == name) {
+             return -1;
+         }
+         memcpy(block + 345, name, (size_t)(split - name));
+         memcpy(block, split + 1, nameLen - (size_t)(split - name) - 1);
+     }
+     tar_number(block + 100, 8, st->st_mode & 07777);
+     tar_number(block + 108, 8, st->st_uid);
+     tar_number(block + 116, 8, st->st_gid);
+     tar_number(block + 124, 12, (unsigned long long)size);
+     tar_number(block + 136, 12, st->st_mtime > 0 ? (unsigned long long)st->st_mtime : 0);
+     block[156] = '0';                  // Regular file
+     memcpy(block + 257, "ustar", 6);   // Magic, NUL-terminated
+     memcpy(block + 263, "00", 2);      // Version
+     memset(block + 148, ' ', 8);       // Checksum is computed with spaces here
+     unsigned int sum = 0;
+     for (int i = 0; i < 512; i++) {
+         sum += (unsigned char)block[i];
+     }
+     snprintf(block + 148, 8, "%06o", sum);
+     block[155] = ' ';
+     return 0;
+ }
+ 
+ /*****************************************************************************
+  * tar_add_file: adds one file: header, then the body read straight into the output
+  * buffer. If the file shrinks while being read it is padded with zeros,
+  * as GNU tar does, so the archive stays well-formed.
+  *****************************************************************************/
+ static int tar_add_file(struct tar_writer *w, const char *path, const char *name) {
+     int fd = open(path, O_RDONLY | O_CLOEXEC);
+     struct stat st;
+     if (fd < 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)) {
+         LOG_WARN("tar: skipping %s: %s", path, strerror(errno));
+         if (fd >= 0) close(fd);
+         return 0;
+     }
+     if (w->len + 512 > sizeof(w->buf) && tar_flush(w) != 0) {
+         close(fd);
+         return -1;
+     }
+     if (tar_header(w->buf + w->len, name, &st, (long long)st.st_size) != 0) {
+         LOG_WARN("tar: skipping %s: name too long", path);
+         close(fd);
+         return 0;
+     }
+     w->len += 512;
+ 
+     long long remaining = (long long)st.st_size;
+     while (remaining > 0) {
+         if (w->len == sizeof(w->buf) && tar_flush(w) != 0) {
+             close(fd);
+             return -1;
+         }
+         size_t room = sizeof(w->buf) - w->len;
+         ssize_t n = read(fd, w->buf + w->len, (long long)room < remaining ? room : (size_t)remaining);
+         if (n < 0 && errno == EINTR) continue;
+         if (n <= 0) {
+             LOG_WARN("tar: %s shrank; padding with zeros", path);
+             break;
+         }
+         w->len += (size_t)n;
+         remaining -= n;
+     }
+     close(fd);
+     w->files++;
+     return tar_zero(w, (size_t)remaining + (size_t)((512 - st.st_size % 512) % 512));
+ }
+ 
+ unsigned long index_file_generation(const char *rel);   // see "Metadata index"
+ 
+ static int tar_visit(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+     (void)ftw;
+     struct tar_writer *w = tarActive;
+     if (type != FTW_F || !S_ISREG(st->st_mode)) {
+         return 0;
+     }
+     size_t len = strlen(path), extLen = strlen(w->ext);
+     if (len < extLen || strcmp(path + len - extLen, w->ext) != 0) {
+         return 0;
+     }
+     const char *name = path + w->baseLen;
+     while (*name == '/') name++;
+     if (w->since && index_file_generation(name) <= w->since) {
+         return 0;
+     }
+     return tar_add_file(w, path, name) != 0 ? 1 : 0;
+ }
+ 
+ /*****************************************************************************
+  * tar_write_tree: writes a ustar archive of every regular file under
+  * `baseDir` whose name ends in `ext` to `fd`, chunked if `chunked` is set.
+  * A `level` above 0 deflates the archive at that level, which implies
+  * chunked output. Member names are relative to `baseDir`. A `since` above 0
+  * leaves out the files whose index entry has not changed after that
+  * generation. With `copy`, the chunked output is also written there.
+  * Returns the number of files archived, or -1 if writing failed.
+  *****************************************************************************/
+ long tar_write_tree(int fd, int chunked, const char *baseDir, const char *ext, int level,
+                     unsigned long since, struct stream_copy *copy) {
+     struct tar_writer *w = malloc(sizeof(*w));
+     if (!w) {
+         return -1;
+     }
+     w->z = NULL;
+     if (level > 0) {
+         w->z = malloc(sizeof(*w->z));
+         if (!w->z || zout_init(w->z, fd, level) != 0) {
+             free(w->z);
+             free(w);
+             return -1;
+         }
+         w->z->copy = copy;
+     }
+     w->fd = fd;
+     w->chunked = chunked;
+     w->failed = 0;
+     w->copy = copy;
+     w->baseLen = strlen(baseDir);
+     w->ext = ext;
+     w->since = since;
+     w->files = 0;
+     w->len = 0;
+     tarActive = w;
+     nftw(baseDir, tar_visit, 16, FTW_PHYS);
+     tarActive = NULL;
+ 
+     // End of archive: two zero blocks
+     int rc = tar_zero(w, 1024);
+     if (rc == 0) rc = tar_flush(w);
+     if (w->z) {
+         if (rc == 0) {
+             rc = zout_finish(w->z);
+         } else {
+             deflateEnd(&w->z->zs);
+         }
+         free(w->z);
+     } else if (rc == 0 && chunked) {
+         rc = write_copied(fd, copy, "0\n", 2);
+     }
+     long files = w->files;
+     rc = (rc != 0 || w->failed) ? -1 : 0;
+     free(w);
+     return rc == 0 ? files : -1;
+ }
+ 
+ /*****************************************************************************
+  * Directory listings. A listing is built in one growable block -- names back
+  * to back, NUL-terminated, plus an offset per name -- instead of a fixed
+  * buffer, so large directories are neither truncated nor rebuilt with
+  * repeated strcat. Names are sent sorted (strcmp order) so S1 can merge the
+  * servers' listings without sorting them again.
+  *
+  * LISTP <limit> <cursor> <path> returns one page of the same listing: at
+  * most <limit> names that sort after the cursor (the last name S1 has
+  * already seen, hex-encoded; "-" for the first page).
+  *****************************************************************************/
+ struct name_list {
+     char *data;        // names, each NUL-terminated
+     size_t len, cap;
+     size_t *offsets;   // start of each name in data
+     size_t count, offCap;
+ };
+ 
+ void name_list_init(struct name_list *l) {
+     memset(l, 0, sizeof(*l));
+ }
+ 
+ void name_list_free(struct name_list *l) {
+     free(l->data);
+     free(l->offsets);
+     name_list_init(l);
+ }
+ 
+ static const char *name_list_get(const struct name_list *l, size_t i) {
+     return l->data + l->offsets[i];
+ }
+ 
+ // Appends a name, growing the block geometrically. Returns -1 if out of memory.
+ int name_list_add(struct name_list *l, const char *name) {
+     size_t len = strlen(name);
+     if (l->len + len + 1 > l->cap) {
+         size_t cap = l->cap ? l->cap * 2 : 4096;
+         while (cap < l->len + len + 1) cap *= 2;
+         char *p = realloc(l->data, cap);
+         if (!p) return -1;
+         l->data = p;
+         l->cap = cap;
+     }
+     if (l->count == l->offCap) {
+         size_t cap = l->offCap ? l->offCap * 2 : 256;
+         size_t *p = realloc(l->offsets, cap * sizeof(*p));
+         if (!p) return -1;
+         l->offsets = p;
+         l->offCap = cap;
+     }
+     memcpy(l->data + l->len, name, len + 1);
+     l->offsets[l->count++] = l->len;
+     l->len += len + 1;
+     return 0;
+ }
+ 
+ // Decodes a hex cursor. Returns -1 if it is not valid hex or does not fit.
+ int hex_decode(const char *in, char *out, size_t size) {
+     size_t n = strlen(in);
+     if (n % 2 != 0 || n / 2 >= size) {
+         return -1;
+     }
+     for (size_t i = 0; i < n; i += 2) {
+         int hi, lo;
+         if (sscanf(in + i, "%1x%1x", &hi, &lo) != 2) {
+             return -1;
+         }
+         out[i / 2] = (char)(hi << 4 | lo);
+     }
+     out[n / 2] = '\0';
+     return 0;
+ }
+ 
+ /*****************************************************************************
+  * send_listing: sends "<size>\n" and then the first `limit` names (0 = all),
+  * one per line, batched into BUF_SIZE writes. Returns 0 on success, -1 if
+  * S1 went away.
+  *****************************************************************************/
+ int send_listing(int sock, const struct name_list *l, size_t limit) {
+     size_t count = (limit > 0 && limit < l->count) ? limit : l->count;
+     long total = 0;
+     for (size_t i = 0; i < count; i++) {
+         total += (long)strlen(name_list_get(l, i)) + 1;
+     }
+     char buf[BUF_SIZE];
+     size_t used = (size_t)snprintf(buf, sizeof(buf), "%ld\n", total);
+     for (size_t i = 0; i < count; i++) {
+         const char *name = name_list_get(l, i);
+         size_t n = strlen(name);   // a name or a FIND line: well under BUF_SIZE
+         if (used + n + 1 > sizeof(buf)) {
+             if (write_all(sock, buf, used) != 0) {
+                 return -1;
+             }
+             used = 0;
+         }
+         memcpy(buf + used, name, n);
+         buf[used + n] = '\n';
+         used += n + 1;
+     }
+     return write_all(sock, buf, used);
+ }
+ 
+ /*****************************************************************************
+  * Metadata index. Every stored file is kept in memory as path -> (size,
+  * mtime, CRC-32C), grouped by directory: a hash table maps a directory
+  * (relative to ~/S3, "" for the root) to its files, kept sorted by name.
+  * LIST/LISTP are answered from the sorted arrays without readdir, and GET/DEL
+  * of a file that does not exist are refused without touching the disk.
+  *
+  * At startup the index is loaded from the snapshot ~/S3/.index and then
+  * reconciled with the tree in the background, or, without a snapshot, built
+  * by walking the tree before the server starts listening. STORE and DEL keep
+  * it current. The snapshot is rewritten every INDEX_SYNC_SECS while the index
+  * changes, and on SIGTERM/SIGINT. With --watch, inotify picks up files that
+  * are changed behind the server's back.
+  *****************************************************************************/
+ #define INDEX_SNAPSHOT ".index"
+ #define INDEX_MAGIC "SIDX0001"   // 8 bytes, then one record per file
+ #define INDEX_SYNC_SECS 30
+ #define CAS_DIR ".cas"           // content store of --dedup, kept out of the index
+ 
+ struct file_meta {
+     char *name;
+     long long size;
+     time_t mtime;
+     uint32_t crc;             // CRC-32C of the contents, if crcValid
+     unsigned char crcValid;   // 0 until the server has seen the whole file go by
+     unsigned mark;            // last walk that saw the file (see index_walk)
+     unsigned long gen;        // index generation of its last change (see "Archive cache")
+ };
+ 
+ struct dir_meta {
+     char *path;               // relative to the storage root, "" = root
+     struct file_meta *files;  // sorted by name
+     size_t count, cap;
+     struct dir_meta *next;    // hash chain
+ };
+ 
+ static pthread_rwlock_t indexLock = PTHREAD_RWLOCK_INITIALIZER;
+ static struct dir_meta **indexBuckets;
+ static size_t indexBucketCount, indexDirCount, indexFileCount;
+ static unsigned long indexGeneration;   // bumped on every change
+ static unsigned long indexSavedGeneration;
+ static unsigned long indexBaseGeneration;  // where this run's generations start
+ static unsigned indexWalkId;
+ static char indexRoot[512];
+ static pthread_mutex_t indexWalkLock = PTHREAD_MUTEX_INITIALIZER;  // one walk at a time
+ 
+ // inotify (--watch): watch descriptor -> directory key
+ static int inotifyFd = -1;
+ static char **watchDirs;
+ static int watchCap;
+ static pthread_mutex_t watchLock = PTHREAD_MUTEX_INITIALIZER;
+ 
+ static int is_snapshot_name(const char *name) {
+     return strncmp(name, INDEX_SNAPSHOT, strlen(INDEX_SNAPSHOT)) == 0;
+ }
+ 
+ // STORE's temporary files (see "Durable writes") are not part of the tree either.
+ #define STORE_TMP_SUFFIX ".tmp"
+ 
+ static int is_store_tmp_name(const char *name) {
+     size_t len = strlen(name), suffixLen = strlen(STORE_TMP_SUFFIX);
+     return name[0] == '.' && len > suffixLen && strcmp(name + len - suffixLen, STORE_TMP_SUFFIX) == 0;
+ }
+ 
+ /*****************************************************************************
+  * index_split: normalizes a path relative to the storage root into its
+  * directory ("a/b", "" for the root) and last component, dropping empty and
+  * "." components. Returns -1 for paths that would leave the root ("..") or do
+  * not fit.
+  *****************************************************************************/
+ int index_split(const char *rel, char *dir, size_t dirSize, char *name, size_t nameSize) {
+     size_t dirLen = 0;
+     dir[0] = '\0';
+     name[0] = '\0';
+     while (*rel) {
+         while (*rel == '/') rel++;
+         const char *end = strchrnul(rel, '/');
+         size_t len = (size_t)(end - rel);
+         if (len == 0) {
+             break;
+         }
+         if (len == 1 && rel[0] == '.') {
+             rel = end;
+             continue;
+         }
+         if (len == 2 && rel[0] == '.' && rel[1] == '.') {
+             return -1;
+         }
+         if (dirLen == 0 && !name[0] && len == strlen(CAS_DIR) && memcmp(rel, CAS_DIR, len) == 0) {
+             return -1;   // reserved for the deduplication store
+         }
+         if (name[0]) {
+             // The previous component turned out to be a directory
+             size_t n = strlen(name);
+             if (dirLen + n + 2 > dirSize) return -1;
+             if (dirLen) dir[dirLen++] = '/';
+             memcpy(dir + dirLen, name, n + 1);
+             dirLen += n;
+         }
+         if (len >= nameSize) return -1;
+         memcpy(name, rel, len);
+         name[len] = '\0';
+         rel = end;
+     }
+     return 0;
+ }
+ 
+ // Normalizes a directory path (see index_split) into its index key.
+ int index_dir_key(const char *rel, char *key, size_t size) {
+     char name[NAME_MAX + 1];
+     if (index_split(rel, key, size, name, sizeof(name)) != 0) return -1;
+     if (name[0]) {
+         size_t len = strlen(key);
+         if (len + strlen(name) + 2 > size) return -1;
+         snprintf(key + len, size - len, "%s%s", len ? "/" : "", name);
+     }
+     return 0;
+ }
+ 
+ static size_t index_hash(const char *s) {
+     uint64_t h = 1469598103934665603ULL;   // FNV-1a
+     while (*s) {
+         h = (h ^ (unsigned char)*s++) * 1099511628211ULL;
+     }
+     return (size_t)h;
+ }
+ 
+ // Caller holds indexLock.
+ static struct dir_meta *index_find_dir(const char *dir) {
+     struct dir_meta *d = indexBuckets[index_hash(dir) & (indexBucketCount - 1)];
+     while (d && strcmp(d->path, dir) != 0) {
+         d = d->next;
+     }
+     return d;
+ }
+ 
+ // Finds `dir`, creating it if needed. Caller holds indexLock for writing.
+ static struct dir_meta *index_get_dir(const char *dir) {
+     struct dir_meta *d = index_find_dir(dir);
+     if (d) {
+         return d;
+     }
+     if (indexDirCount >= indexBucketCount) {
+         // Keep chains short: double the table
+         size_t count = indexBucketCount * 2;
+         struct dir_meta **buckets = calloc(count, sizeof(*buckets));
+         if (!buckets) return NULL;
+         for (size_t i = 0; i < indexBucketCount; i++) {
+             while (indexBuckets[i]) {
+                 struct dir_meta *m = indexBuckets[i];
+                 indexBuckets[i] = m->next;
+                 m->next = buckets[index_hash(m->path) & (count - 1)];
+                 buckets[index_hash(m->path) & (count - 1)] = m;
+             }
+         }
+         free(indexBuckets);
+         indexBuckets = buckets;
+         indexBucketCount = count;
+     }
+     d = calloc(1, sizeof(*d));
+     if (!d || !(d->path = strdup(dir))) {
+         free(d);
+         return NULL;
+     }
+     size_t b = index_hash(dir) & (indexBucketCount - 1);
+     d->next = indexBuckets[b];
+     indexBuckets[b] = d;
+     indexDirCount++;
+     return d;
+ }
+ 
+ // Unlinks and frees an empty directory. Caller holds indexLock for writing.
+ static void index_drop_dir(struct dir_meta *d) {
+     struct dir_meta **pp = &indexBuckets[index_hash(d->path) & (indexBucketCount - 1)];
+     while (*pp != d) {
+         pp = &(*pp)->next;
+     }
+     *pp = d->next;
+     free(d->path);
+     free(d->files);
+     free(d);
+     indexDirCount--;
+ }
+ 
+ // Binary search; *pos receives the index of the first name >= `name`.
+ static struct file_meta *dir_find(const struct dir_meta *d, const char *name, size_t *pos) {
+     size_t lo = 0, hi = d->count;
+     while (lo < hi) {
+         size_t mid = lo + (hi - lo) / 2;
+         if (strcmp(d->files[mid].name, name) < 0) {
+             lo = mid + 1;
+         } else {
+             hi = mid;
+         }
+     }
+     if (pos) *pos = lo;
+     return (lo < d->count && strcmp(d->files[lo].name, name) == 0) ? &d->files[lo] : NULL;
+ }
+ 
+ /*****************************************************************************
+  * index_put: records a file. Without a checksum (crcValid == 0) an existing
+  * checksum is kept as long as size and mtime are unchanged, so walks and
+  * inotify events do not throw away what STORE computed.
+  *****************************************************************************/
+ int index_put(const char *dir, const char *name, long long size, time_t mtime,
+               uint32_t crc, int crcValid) {
+     if (!name[0] || is_snapshot_name(name) || is_store_tmp_name(name)) {
+         return 0;
+     }
+     pthread_rwlock_wrlock(&indexLock);
+     struct dir_meta *d = index_get_dir(dir);
+     size_t pos;
+     struct file_meta *f = d ? dir_find(d, name, &pos) : NULL;
+     int added = 0;
+     if (d && !f) {
+         char *copy = strdup(name);
+         if (copy && d->count == d->cap) {
+             size_t cap = d->cap ? d->cap * 2 : 8;
+             struct file_meta *files = realloc(d->files, cap * sizeof(*files));
+             if (files) {
+                 d->files = files;
+                 d->cap = cap;
+             }
+         }
+         if (copy && d->count < d->cap) {
+             memmove(&d->files[pos + 1], &d->files[pos], (d->count - pos) * sizeof(*f));
+             f = &d->files[pos];
+             memset(f, 0, sizeof(*f));
+             f->name = copy;
+             d->count++;
+             indexFileCount++;
+             added = 1;
+         } else {
+             free(copy);
+         }
+     }
+     if (f) {
+         // A walk that finds the file as it was is not a change
+         int changed = added || f->size != size || f->mtime != mtime ||
+                       (crcValid && (!f->crcValid || f->crc != crc));
+         if (crcValid || f->size != size || f->mtime != mtime) {
+             f->crc = crc;
+             f->crcValid = (unsigned char)crcValid;
+         }
+         f->size = size;
+         f->mtime = mtime;
+         f->mark = indexWalkId;
+         if (changed) {
+             f->gen = ++indexGeneration;
+         }
+     }
+     pthread_rwlock_unlock(&indexLock);
+     return f ? 0 : -1;
+ }
+ 
+ // Forgets a file. Returns 1 if it was indexed.
+ int index_remove(const char *dir, const char *name) {
+     pthread_rwlock_wrlock(&indexLock);
+     struct dir_meta *d = index_find_dir(dir);
+     size_t pos;
+     struct file_meta *f = d ? dir_find(d, name, &pos) : NULL;
+     if (f) {
+         free(f->name);
+         memmove(f, f + 1, (d->count - pos - 1) * sizeof(*f));
+         d->count--;
+         indexFileCount--;
+         indexGeneration++;
+         if (d->count == 0) {
+             index_drop_dir(d);
+         }
+     }
+     pthread_rwlock_unlock(&indexLock);
+     return f != NULL;
+ }
+ 
+ // Looks a file up; copies its metadata to *out (if not NULL). Returns 1 if found.
+ int index_lookup(const char *dir, const char *name, struct file_meta *out) {
+     pthread_rwlock_rdlock(&indexLock);
+     struct dir_meta *d = index_find_dir(dir);
+     struct file_meta *f = d ? dir_find(d, name, NULL) : NULL;
+     if (f && out) {
+         *out = *f;
+         out->name = NULL;
+     }
+     pthread_rwlock_unlock(&indexLock);
+     return f != NULL;
+ }
+ 
+ // The index generation of the last change to the file at `rel` (relative to
+ // the storage root); files the index does not know count as just changed.
+ unsigned long index_file_generation(const char *rel) {
+     char dir[1024], name[NAME_MAX + 1];
+     struct file_meta meta;
+     if (index_split(rel, dir, sizeof(dir), name, sizeof(name)) != 0 || !index_lookup(dir, name, &meta)) {
+         return ULONG_MAX;
+     }
+     return meta.gen;
+ }
+ 
+ // The current index generation; it goes up with every change to the index.
+ unsigned long index_generation(void) {
+     pthread_rwlock_rdlock(&indexLock);
+     unsigned long gen = indexGeneration;
+     pthread_rwlock_unlock(&indexLock);
+     return gen;
+ }
+ 
+ /*****************************************************************************
+  * index_list: copies the non-hidden names of `dir` that sort after `after`
+  * into `out`, at most `limit` of them (0 = all), already sorted. Returns -1
+  * if out of memory.
+  *****************************************************************************/
+ int index_list(const char *dir, const char *after, size_t limit, struct name_list *out) {
+     int rc = 0;
+     pthread_rwlock_rdlock(&indexLock);
+     struct dir_meta *d = index_find_dir(dir);
+     if (d) {
+         size_t i;
+         if (dir_find(d, after, &i)) {
+             i++;
+         }
+         for (; i < d->count && rc == 0 && (limit == 0 || out->count < limit); i++) {
+             if (d->files[i].name[0] != '.') {
+                 rc = name_list_add(out, d->files[i].name);
+             }
+         }
+     }
+     pthread_rwlock_unlock(&indexLock);
+     return rc;
+ }
+ 
+ /*****************************************************************************
+  * index_keys: copies the path (relative to the storage root) of every
+  * indexed, non-hidden file into `out`, in no particular order. Returns -1 if
+  * out of memory.
+  *****************************************************************************/
+ int index_keys(struct name_list *out) {
+     int rc = 0;
+     char path[1024];
+     pthread_rwlock_rdlock(&indexLock);
+     for (size_t b = 0; b < indexBucketCount && rc == 0; b++) {
+         for (struct dir_meta *d = indexBuckets[b]; d && rc == 0; d = d->next) {
+             for (size_t i = 0; i < d->count && rc == 0; i++) {
+                 if (d->files[i].name[0] == '.') {
+                     continue;
+                 }
+                 int n = snprintf(path, sizeof(path), "%s%s%s", d->path, d->path[0] ? "/" : "",
+                                  d->files[i].name);
+                 if (n > 0 && (size_t)n < sizeof(path)) {
+                     rc = name_list_add(out, path);
+                 }
+             }
+         }
+     }
+     pthread_rwlock_unlock(&indexLock);
+     return rc;
+ }
+ 
+ /*****************************************************************************
+  * Filtered listings. FIND <limit> <cursor> <filter> <path> answers S1's
+  * searches from the index, so only the matching files cross the network,
+  * each as "<path>\t<size>\t<mtime>". <filter> is "-" or comma-separated
+  * predicates, all of which must hold:
+  *     r                 the whole subtree of <path>, not just the directory
+  *     name=<hex>        the file name matches this fnmatch() pattern
+  *     ext=<.ext>        the name ends in <.ext>; repeated, any one of them
+  *     size=<min>-<max>  size in bytes, inclusive; either end may be left out
+  *     mtime=<from>-<to> modification time in epoch seconds, the same way
+  * Lines are sorted by path, the path relative to <path>, and the cursor is
+  * the last path already seen, as for LISTP.
+  *****************************************************************************/
+ #define FIND_MAX_EXTS 8
+ 
+ struct find_filter {
+     int recursive;
+     char glob[NAME_MAX + 1];        // "" = any name
+     char exts[FIND_MAX_EXTS][16];
+     int extCount;                   // 0 = any extension
+     long long minSize, maxSize;     // -1 = no bound
+     long long minMtime, maxMtime;
+ };
+ 
+ // Parses "<min>-<max>" with either end optional (-1).
+ static int find_range_parse(const char *s, long long *lo, long long *hi) {
+     const char *dash = strchr(s, '-');
+     char *end;
+     *lo = *hi = -1;
+     if (!dash) return -1;
+     if (dash > s) {
+         *lo = strtoll(s, &end, 10);
+         if (end != dash || *lo < 0) return -1;
+     }
+     if (dash[1]) {
+         *hi = strtoll(dash + 1, &end, 10);
+         if (*end || *hi < 0) return -1;
+     }
+     return 0;
+ }
+ 
+ // Parses a FIND filter (see above). Returns -1 if it is malformed.
+ int find_filter_parse(const char *spec, struct find_filter *f) {
+     memset(f, 0, sizeof(*f));
+     f->minSize = f->maxSize = f->minMtime = f->maxMtime = -1;
+     char buf[1024];
+     if (strcmp(spec, "-") == 0) return 0;
+     if (strlen(spec) >= sizeof(buf)) return -1;
+     strcpy(buf, spec);
+     char *save;
+     for (char *p = strtok_r(buf, ",", &save); p; p = strtok_r(NULL, ",", &save)) {
+         char *value = strchr(p, '=');
+         if (value) *value++ = '\0';
+         int rc = -1;
+         if (strcmp(p, "r") == 0 && !value) {
+             f->recursive = 1;
+             rc = 0;
+         } else if (!value) {
+             rc = -1;
+         } else if (strcmp(p, "name") == 0) {
+             rc = hex_decode(value, f->glob, sizeof(f->glob));
+         } else if (strcmp(p, "ext") == 0) {
+             if (f->extCount < FIND_MAX_EXTS && value[0] == '.' && strlen(value) < sizeof(f->exts[0])) {
+                 strcpy(f->exts[f->extCount++], value);
+                 rc = 0;
+             }
+         } else if (strcmp(p, "size") == 0) {
+             rc = find_range_parse(value, &f->minSize, &f->maxSize);
+         } else if (strcmp(p, "mtime") == 0) {
+             rc = find_range_parse(value, &f->minMtime, &f->maxMtime);
+         }
+         if (rc != 0) return -1;
+     }
+     return 0;
+ }
+ 
+ // Whether a file named `name` (last component only) passes every predicate.
+ int find_filter_match(const struct find_filter *f, const char *name, long long size, long long mtime) {
+     if (f->glob[0] && fnmatch(f->glob, name, 0) != 0) return 0;
+     if (f->extCount > 0) {
+         const char *ext = strrchr(name, '.');
+         int i = 0;
+         while (i < f->extCount && !(ext && strcmp(ext, f->exts[i]) == 0)) i++;
+         if (i == f->extCount) return 0;
+     }
+     if ((f->minSize >= 0 && size < f->minSize) || (f->maxSize >= 0 && size > f->maxSize)) return 0;
+     if ((f->minMtime >= 0 && mtime < f->minMtime) || (f->maxMtime >= 0 && mtime > f->maxMtime)) return 0;
+     return 1;
+ }
+ 
+ // Orders FIND lines by their path, the part before the first tab.
+ static int find_line_cmp(const void *a, const void *b, void *data) {
+     const char *x = (const char *)data + *(const size_t *)a;
+     const char *y = (const char *)data + *(const size_t *)b;
+     size_t xl = strcspn(x, "\t"), yl = strcspn(y, "\t");
+     int c = memcmp(x, y, xl < yl ? xl : yl);
+     return c ? c : (xl > yl) - (xl < yl);
+ }
+ 
+ // Adds the FIND line of file `m` of directory `sub` (relative to the listed
+ // one) if it matches and sorts after `after`. Caller holds indexLock.
+ static int find_add(struct name_list *out, const char *sub, const struct file_meta *m,
+                     const struct find_filter *f, const char *after) {
+     if (m->name[0] == '.' || !find_filter_match(f, m->name, m->size, (long long)m->mtime)) {
+         return 0;
+     }
+     char line[1100];
+     int n = snprintf(line, sizeof(line), "%s%s%s", sub, sub[0] ? "/" : "", m->name);
+     if (n <= 0 || (size_t)n >= sizeof(line) - 48 || strcmp(line, after) <= 0) {
+         return 0;
+     }
+     snprintf(line + n, sizeof(line) - (size_t)n, "\t%lld\t%lld", m->size, (long long)m->mtime);
+     return name_list_add(out, line);
+ }
+ 
+ /*****************************************************************************
+  * index_find: copies the FIND lines of the files of `dir` (with f->recursive,
+  * of every directory under it) that match `f` and sort after `after` into
+  * `out`, sorted, at most `limit` of them (0 = all). Returns -1 if out of
+  * memory.
+  *****************************************************************************/
+ int index_find(const char *dir, const struct find_filter *f, const char *after, size_t limit,
+                struct name_list *out) {
+     int rc = 0;
+     size_t dirLen = strlen(dir);
+     pthread_rwlock_rdlock(&indexLock);
+     if (!f->recursive) {
+         // One directory: its files are already in order
+         struct dir_meta *d = index_find_dir(dir);
+         if (d) {
+             size_t i;
+             if (dir_find(d, after, &i)) {
+                 i++;
+             }
+             for (; i < d->count && rc == 0 && (limit == 0 || out->count < limit); i++) {
+                 rc = find_add(out, "", &d->files[i], f, after);
+             }
+         }
+     } else {
+         for (size_t b = 0; b < indexBucketCount && rc == 0; b++) {
+             for (struct dir_meta *d = indexBuckets[b]; d && rc == 0; d = d->next) {
+                 if (dirLen > 0 && (strncmp(d->path, dir, dirLen) != 0 ||
+                                    (d->path[dirLen] != '\0' && d->path[dirLen] != '/'))) {
+                     continue;
+                 }
+                 const char *sub = d->path + dirLen + (dirLen > 0 && d->path[dirLen] == '/');
+                 for (size_t i = 0; i < d->count && rc == 0; i++) {
+                     rc = find_add(out, sub, &d->files[i], f, after);
+                 }
+             }
+         }
+     }
+     pthread_rwlock_unlock(&indexLock);
+     if (rc == 0 && f->recursive && out->count > 1) {
+         qsort_r(out->offsets, out->count, sizeof(size_t), find_line_cmp, out->data);
+     }
+     if (limit > 0 && out->count > limit) {
+         out->count = limit;
+     }
+     return rc;
+ }
+ 
+ // Adds an inotify watch for a directory of the tree (--watch only).
+ static void index_watch_dir(const char *fullPath, const char *dirKey) {
+     int wd = inotify_add_watch(inotifyFd, fullPath, IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+                                                     IN_CREATE | IN_DELETE | IN_ONLYDIR);
+     if (wd < 0) {
+         LOG_WARN("inotify_add_watch(%s): %s", fullPath, strerror(errno));
+         return;
+     }
+     pthread_mutex_lock(&watchLock);
+     if (wd >= watchCap) {
+         int cap = watchCap ? watchCap : 64;
+         while (cap <= wd) cap *= 2;
+         char **dirs = realloc(watchDirs, cap * sizeof(*dirs));
+         if (dirs) {
+             memset(dirs + watchCap, 0, (cap - watchCap) * sizeof(*dirs));
+             watchDirs = dirs;
+             watchCap = cap;
+         }
+     }
+     if (wd < watchCap) {
+         free(watchDirs[wd]);
+         watchDirs[wd] = strdup(dirKey);
+     }
+     pthread_mutex_unlock(&watchLock);
+ }
+ 
+ static int index_visit(const char *path, const struct stat *st, int type, struct FTW *ftw) {
+     (void)ftw;
+     size_t rootLen = strlen(indexRoot);
+     const char *rel = path[rootLen] == '/' ? path + rootLen + 1 : path + rootLen;
+     char dir[1024], name[NAME_MAX + 1];
+     if (index_split(rel, dir, sizeof(dir), name, sizeof(name)) != 0) {
+         return type == FTW_D ? FTW_SKIP_SUBTREE : FTW_CONTINUE;   // e.g. the dedup store
+     }
+     if (type == FTW_D) {
+         if (inotifyFd >= 0) {
+             char key[1024];
+             if (index_dir_key(rel, key, sizeof(key)) == 0) {
+                 index_watch_dir(path, key);
+             }
+         }
+     } else if (type == FTW_F && S_ISREG(st->st_mode)) {
+         index_put(dir, name, (long long)st->st_size, st->st_mtime, 0, 0);
+     }
+     return 0;
+ }
+ 
+ /*****************************************************************************
+  * index_walk: adds every regular file under `top` (the root or a directory
+  * inside it) to the index. A full walk (`sweep`) then drops every entry it
+  * did not see, i.e. files that disappeared behind the server's back.
+  *****************************************************************************/
+ void index_walk(const char *top, int sweep) {
+     pthread_mutex_lock(&indexWalkLock);
+     pthread_rwlock_wrlock(&indexLock);
+     unsigned walk = ++indexWalkId;
+     pthread_rwlock_unlock(&indexLock);
+ 
+     nftw(top, index_visit, 16, FTW_PHYS | FTW_ACTIONRETVAL);
+ 
+     if (sweep) {
+         pthread_rwlock_wrlock(&indexLock);
+         for (size_t b = 0; b < indexBucketCount; b++) {
+             struct dir_meta *d = indexBuckets[b];
+             while (d) {
+                 struct dir_meta *next = d->next;
+                 size_t kept = 0;
+                 for (size_t i = 0; i < d->count; i++) {
+                     if (d->files[i].mark == walk) {
+                         d->files[kept++] = d->files[i];
+                     } else {
+                         free(d->files[i].name);
+                         indexFileCount--;
+                         indexGeneration++;
+                     }
+                 }
+                 d->count = kept;
+                 if (kept == 0) {
+                     index_drop_dir(d);
+                 }
+                 d = next;
+             }
+         }
+         pthread_rwlock_unlock(&indexLock);
+     }
+     pthread_mutex_unlock(&indexWalkLock);
+ }
+ 
+ /*****************************************************************************
+  * index_save: writes the snapshot (to a temp file, then renamed over the old
+  * one). Records are: u16 path length, path, i64 size, i64 mtime, u32 crc,
+  * u8 crcValid, in host byte order. Does nothing if the index has not changed
+  * since the last save. Returns 0 on success.
+  *****************************************************************************/
+ int index_save(void) {
+     pthread_rwlock_rdlock(&indexLock);
+     int dirty = indexGeneration != indexSavedGeneration;
+     pthread_rwlock_unlock(&indexLock);
+     if (!dirty) {
+         return 0;
+     }
+     char path[600], tmp[600];
+     snprintf(path, sizeof(path), "%s/%s", indexRoot, INDEX_SNAPSHOT);
+     snprintf(tmp, sizeof(tmp), "%s/%s.tmp", indexRoot, INDEX_SNAPSHOT);
+     FILE *fp = fopen(tmp, "wb");
+     if (!fp) {
+         LOG_WARN("Cannot write index snapshot %s: %s", tmp, strerror(errno));
+         return -1;
+     }
+     fwrite(INDEX_MAGIC, 1, 8, fp);
+     pthread_rwlock_rdlock(&indexLock);
+     unsigned long generation = indexGeneration;
+     for (size_t b = 0; b < indexBucketCount; b++) {
+         for (struct dir_meta *d = indexBuckets[b]; d; d = d->next) {
+             for (size_t i = 0; i < d->count; i++) {
+                 const struct file_meta *f = &d->files[i];
+                 char key[1400];
+                 int n = snprintf(key, sizeof(key), "%s%s%s", d->path, d->path[0] ? "/" : "", f->name);
+                 uint16_t len = (uint16_t)n;
+                 int64_t size = f->size, mtime = f->mtime;
+                 fwrite(&len, sizeof(len), 1, fp);
+                 fwrite(key, 1, len, fp);
+                 fwrite(&size, sizeof(size), 1, fp);
+                 fwrite(&mtime, sizeof(mtime), 1, fp);
+                 fwrite(&f->crc, sizeof(f->crc), 1, fp);
+                 fwrite(&f->crcValid, 1, 1, fp);
+             }
+         }
+     }
+     pthread_rwlock_unlock(&indexLock);
+     int rc = (fflush(fp) == 0 && fsync(fileno(fp)) == 0) ? 0 : -1;
+     if (fclose(fp) != 0 || rc != 0 || rename(tmp, path) != 0) {
+         LOG_WARN("Cannot write index snapshot %s: %s", path, strerror(errno));
+         unlink(tmp);
+         return -1;
+     }
+     pthread_rwlock_wrlock(&indexLock);
+     indexSavedGeneration = generation;
+     pthread_rwlock_unlock(&indexLock);
+     return 0;
+ }
+ 
+ // Loads the snapshot. Returns 0 if one was found and read completely.
+ static int index_load(void) {
+     char path[600];
+     snprintf(path, sizeof(path), "%s/%s", indexRoot, INDEX_SNAPSHOT);
+     FILE *fp = fopen(path, "rb");
+     if (!fp) {
+         return -1;
+     }
+     char magic[8];
+     int rc = (fread(magic, 1, 8, fp) == 8 && memcmp(magic, INDEX_MAGIC, 8) == 0) ? 0 : -1;
+     uint16_t len;
+     while (rc == 0 && fread(&len, sizeof(len), 1, fp) == 1) {
+         char key[1400], dir[1024], name[NAME_MAX + 1];
+         int64_t size, mtime;
+         uint32_t crc;
+         unsigned char crcValid;
+         if (len >= sizeof(key) || fread(key, 1, len, fp) != len ||
+             fread(&size, sizeof(size), 1, fp) != 1 || fread(&mtime, sizeof(mtime), 1, fp) != 1 ||
+             fread(&crc, sizeof(crc), 1, fp) != 1 || fread(&crcValid, 1, 1, fp) != 1) {
+             rc = -1;
+             break;
+         }
+         key[len] = '\0';
+         if (index_split(key, dir, sizeof(dir), name, sizeof(name)) == 0) {
+             index_put(dir, name, size, (time_t)mtime, crc, crcValid);
+         }
+     }
+     fclose(fp);
+     if (rc != 0) {
+         LOG_WARN("Index snapshot %s is damaged; rebuilding from the tree", path);
+     }
+     return rc;
+ }
+ 
+ // Applies inotify events to the index (--watch).
+ static void *index_watch_main(void *arg) {
+     (void)arg;
+     char buf[64 * 1024] __attribute__((aligned(__alignof__(struct inotify_event))));
+     while (1) {
+         ssize_t n = read(inotifyFd, buf, sizeof(buf));
+         if (n < 0 && errno == EINTR) {
+             continue;
+         }
+         if (n <= 0) {
+             LOG_WARN("inotify read failed: %s", strerror(errno));
+             return NULL;
+         }
+         for (char *p = buf; p < buf + n; ) {
+             struct inotify_event *ev = (struct inotify_event *)p;
+             p += sizeof(*ev) + ev->len;
+             if (ev->mask & IN_Q_OVERFLOW) {
+                 LOG_WARN("inotify queue overflowed; rescanning the tree");
+                 index_walk(indexRoot, 1);
+                 continue;
+             }
+             char dir[1024] = "";
+             int known = 0;
+             pthread_mutex_lock(&watchLock);
+             if (ev->wd >= 0 && ev->wd < watchCap && watchDirs[ev->wd]) {
+                 snprintf(dir, sizeof(dir), "%s", watchDirs[ev->wd]);
+                 known = 1;
+                 if (ev->mask & IN_IGNORED) {
+                     free(watchDirs[ev->wd]);   // directory is gone
+                     watchDirs[ev->wd] = NULL;
+                 }
+             }
+             pthread_mutex_unlock(&watchLock);
+             if (!known || ev->len == 0 || is_snapshot_name(ev->name) || is_store_tmp_name(ev->name)) {
+                 continue;
+             }
+             char full[1600];
+             snprintf(full, sizeof(full), "%s%s%s/%s", indexRoot, dir[0] ? "/" : "", dir, ev->name);
+             if (ev->mask & IN_ISDIR) {
+                 if (ev->mask & (IN_CREATE | IN_MOVED_TO)) {
+                     index_walk(full, 0);           // picks up files created before the watch
+                 } else if (ev->mask & IN_MOVED_FROM) {
+                     index_walk(indexRoot, 1);      // a whole subtree moved away
+                 }
+             } else if (ev->mask & (IN_DELETE | IN_MOVED_FROM)) {
+                 index_remove(dir, ev->name);
+             } else if (ev->mask & (IN_CLOSE_WRITE | IN_MOVED_TO)) {
+                 struct stat st;
+                 if (lstat(full, &st) == 0 && S_ISREG(st.st_mode)) {
+                     index_put(dir, ev->name, (long long)st.st_size, st.st_mtime, 0, 0);
+                 }
+             }
+         }
+     }
+ }
+ 
+ // Reconciles a loaded snapshot with the tree, then saves snapshots as the index changes.
+ static void *index_sync_main(void *arg) {
+     if (arg) {
+         index_walk(indexRoot, 1);
+         LOG("Index reconciled with the tree: %zu files", indexFileCount);
+     }
+     while (1) {
+         sleep(INDEX_SYNC_SECS);
+         index_save();
+     }
+     return NULL;
+ }
+ 
+ /*****************************************************************************
+  * index_init: loads or builds the index for the tree at `root` and starts
+  * the snapshot thread (and, if `watch` is set, the inotify thread).
+  *****************************************************************************/
+ void index_init(const char *root, int watch) {
+     snprintf(indexRoot, sizeof(indexRoot), "%s", root);
+     mkdir(indexRoot, 0755);   // so snapshots can be written into an empty tree
+     crc32c_init();
+     indexBucketCount = 64;
+     indexBuckets = calloc(indexBucketCount, sizeof(*indexBuckets));
+     if (!indexBuckets) {
+         perror("index");
+         exit(EXIT_FAILURE);
+     }
+     if (watch) {
+         inotifyFd = inotify_init1(IN_CLOEXEC);
+         if (inotifyFd < 0) {
+             LOG_WARN("inotify unavailable (%s); not watching for outside changes", strerror(errno));
+         }
+     }
+     int loaded = index_load() == 0;
+     if (!loaded) {
+         index_walk(indexRoot, 1);
+     }
+     // This run's generations start from the clock, above any an earlier run
+     // handed out, so a TAR <since> from before a restart is recognized as
+     // not being one of them.
+     pthread_rwlock_wrlock(&indexLock);
+     indexBaseGeneration = (unsigned long)time(NULL) << 20;
+     if (indexGeneration < indexBaseGeneration) {
+         indexGeneration = indexBaseGeneration;
+     }
+     indexSavedGeneration = loaded ? indexGeneration : indexSavedGeneration;
+     pthread_rwlock_unlock(&indexLock);
+     LOG("Index %s: %zu files in %zu directories", loaded ? "loaded from snapshot" : "built",
+         indexFileCount, indexDirCount);
+ 
+     pthread_t tid;
+     if (pthread_create(&tid, NULL, index_sync_main, loaded ? (void *)1 : NULL) == 0) {
+         pthread_detach(tid);
+     }
+     if (inotifyFd >= 0 && pthread_create(&tid, NULL, index_watch_main, NULL) == 0) {
+         pthread_detach(tid);
+     }
+ }
+ 
+ /*****************************************************************************
+  * Archive cache. S1's downltar asks for the same archive over and over while
+  * the tree hardly changes, and every TAR used to read every .txt file again.
+  * The last full archives sent (one per TARZ level, plain = 0) are kept as
+  * unlinked files in ~/S3, exactly as they went on the wire, each with the
+  * index generation it was built at. While the generation has not moved, a
+  * TAR is answered from the file with sendfile(). A fresh archive is copied
+  * into a new file as it streams out (struct stream_copy) and kept only if
+  * the index did not change during the walk. --tar-cache-mb bounds the total
+  * size; the least recently used archives go first.
+  *
+  * The generations also make incremental archives possible: every index
+  * entry remembers the generation of its last change, and TAR <since> only
+  * archives files changed after <since>. Files removed since then are not
+  * represented; a full archive is the way to pick up deletions.
+  *****************************************************************************/
+ #define TAR_CACHE_SLOTS 4
+ #define DEFAULT_TAR_CACHE_MB 256
+ 
+ struct tar_cache_entry {
+     int fd;                 // unlinked file with the archive, -1 = empty slot
+     int level;              // TARZ level, 0 = plain
+     unsigned long gen;      // index generation the archive was built at
+     long len;
+     unsigned long used;     // tarCacheClock at the last hit
+ };
+ 
+ static struct tar_cache_entry tarCache[TAR_CACHE_SLOTS];
+ static pthread_mutex_t tarCacheLock = PTHREAD_MUTEX_INITIALIZER;
+ static long tarCacheLimit;        // total bytes (--tar-cache-mb), 0 = off
+ static unsigned long tarCacheClock;
+ 
+ void tar_cache_init(long megabytes) {
+     tarCacheLimit = megabytes > 0 ? megabytes * 1024 * 1024 : 0;
+     for (int i = 0; i < TAR_CACHE_SLOTS; i++) {
+         tarCache[i].fd = -1;
+     }
+ }
+ 
+ // Returns a new fd of the cached archive at `level` built at `gen`, with its
+ // length in *len, or -1 if there is none.
+ int tar_cache_get(int level, unsigned long gen, long *len) {
+     int fd = -1;
+     pthread_mutex_lock(&tarCacheLock);
+     for (int i = 0; i < TAR_CACHE_SLOTS; i++) {
+         struct tar_cache_entry *e = &tarCache[i];
+         if (e->fd >= 0 && e->level == level && e->gen == gen) {
+             fd = fcntl(e->fd, F_DUPFD_CLOEXEC, 0);
+             *len = e->len;
+             e->used = ++tarCacheClock;
+             break;
+         }
+     }
+     pthread_mutex_unlock(&tarCacheLock);
+     return fd;
+ }
+ 
+ // Creates the unlinked file a new archive is copied into; -1 if the cache
+ // is off or the file system cannot make one.
+ int tar_cache_create(void) {
+     if (tarCacheLimit == 0) {
+         return -1;
+     }
+     int fd = open(indexRoot, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+     if (fd < 0) {
+         LOG_DEBUG("Not caching the archive: %s", strerror(errno));
+     }
+     return fd;
+ }
+ 
+ // Keeps the `len` bytes in `fd` (from tar_cache_create(), now owned by the
+ // cache) as the archive at `level` for generation `gen`.
+ void tar_cache_put(int fd, int level, unsigned long gen, long len) {
+     pthread_mutex_lock(&tarCacheLock);
+     for (int i = 0; i < TAR_CACHE_SLOTS; i++) {
+         if (tarCache[i].fd >= 0 && tarCache[i].level == level) {
+             close(tarCache[i].fd);
+             tarCache[i].fd = -1;
+         }
+     }
+     while (1) {
+         long total = len;
+         int empty = -1, oldest = -1;
+         for (int i = 0; i < TAR_CACHE_SLOTS; i++) {
+             if (tarCache[i].fd < 0) {
+                 empty = empty < 0 ? i : empty;
+                 continue;
+             }
+             total += tarCache[i].len;
+             if (oldest < 0 || tarCache[i].used < tarCache[oldest].used) {
+                 oldest = i;
+             }
+         }
+         if (empty >= 0 && total <= tarCacheLimit) {
+             struct tar_cache_entry e = { fd, level, gen, len, ++tarCacheClock };
+             tarCache[empty] = e;
+             break;
+         }
+         if (oldest < 0) {
+             close(fd);
+             break;
+         }
+         close(tarCache[oldest].fd);
+         tarCache[oldest].fd = -1;
+     }
+     pthread_mutex_unlock(&tarCacheLock);
+ }
+ 
+ /*****************************************************************************
+  * Deduplication (--dedup). Every stored file is also hard-linked into the
+  * content store ~/S3/.cas under the name "<xxh64>-<size>" of its contents.
+  * When a STORE brings contents that are already there, the new path becomes
+  * one more link to the stored copy and the duplicate is freed, so a zip
+  * uploaded to many directories takes its space once. The link count is the
+  * reference count: DEL only removes the path, and a sweep every
+  * CAS_SWEEP_SECS deletes objects that no path links to any more.
+  *
+  * LINK <path> <size> <hash> puts known contents at a path without sending
+  * them again; S1 uses it when a client offers a file's hash before its
+  * bytes. Paths are plain files either way, so GET, GETR and TAR serve them
+  * as before. Since linked paths share one inode, a path that is still linked
+  * is replaced, never rewritten in place.
+  *****************************************************************************/
+ #define CAS_SWEEP_SECS 300
+ 
+ static int casEnabled;
+ 
+ #define XXH_PRIME1 0x9E3779B185EBCA87ULL
+ #define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+ #define XXH_PRIME3 0x165667B19E3779F9ULL
+ #define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+ #define XXH_PRIME5 0x27D4EB2F165667C5ULL
+ 
+ // Streaming XXH64 (seed 0): init, then feed the data in pieces.
+ struct xxh64_state {
+     uint64_t v[4];
+     uint64_t total;
+     unsigned char buf[32];
+     size_t used;
+ };
+ 
+ static uint64_t xxh_rotl(uint64_t x, int r) {
+     return (x << r) | (x >> (64 - r));
+ }
+ 
+ static uint64_t xxh_read64(const unsigned char *p) {
+     uint64_t v;
+     memcpy(&v, p, sizeof(v));
+     return le64toh(v);
+ }
+ 
+ static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+     return xxh_rotl(acc + input * XXH_PRIME2, 31) * XXH_PRIME1;
+ }
  
- #define S3_PORT 50006
- #define BACKLOG 10
- #define BUF_SIZE 4096
+ static uint64_t xxh_merge(uint64_t acc, uint64_t v) {
+     return (acc ^ xxh_round(0, v)) * XXH_PRIME1 + XXH_PRIME4;
+ }
+ 
+ void xxh64_init(struct xxh64_state *s) {
+     memset(s, 0, sizeof(*s));
+     s->v[0] = XXH_PRIME1 + XXH_PRIME2;
+     s->v[1] = XXH_PRIME2;
+     s->v[3] = 0 - XXH_PRIME1;
+ }
+ 
+ void xxh64_update(struct xxh64_state *s, const void *data, size_t len) {
+     const unsigned char *p = data;
+     s->total += len;
+     if (s->used + len < 32) {
+         memcpy(s->buf + s->used, p, len);
+         s->used += len;
+         return;
+     }
+     if (s->used > 0) {
+         size_t fill = 32 - s->used;
+         memcpy(s->buf + s->used, p, fill);
+         for (int i = 0; i < 4; i++) {
+             s->v[i] = xxh_round(s->v[i], xxh_read64(s->buf + 8 * i));
+         }
+         p += fill;
+         len -= fill;
+         s->used = 0;
+     }
+     for (; len >= 32; p += 32, len -= 32) {
+         for (int i = 0; i < 4; i++) {
+             s->v[i] = xxh_round(s->v[i], xxh_read64(p + 8 * i));
+         }
+     }
+     memcpy(s->buf, p, len);
+     s->used = len;
+ }
+ 
+ uint64_t xxh64_final(const struct xxh64_state *s) {
+     uint64_t h;
+     if (s->total >= 32) {
+         h = xxh_rotl(s->v[0], 1) + xxh_rotl(s->v[1], 7) + xxh_rotl(s->v[2], 12) +
+             xxh_rotl(s->v[3], 18);
+         for (int i = 0; i < 4; i++) {
+             h = xxh_merge(h, s->v[i]);
+         }
+     } else {
+         h = s->v[2] + XXH_PRIME5;
+     }
+     h += s->total;
+     const unsigned char *p = s->buf, *end = s->buf + s->used;
+     for (; p + 8 <= end; p += 8) {
+         h = xxh_rotl(h ^ xxh_round(0, xxh_read64(p)), 27) * XXH_PRIME1 + XXH_PRIME4;
+     }
+     if (p + 4 <= end) {
+         uint32_t w;
+         memcpy(&w, p, sizeof(w));
+         h = xxh_rotl(h ^ (uint64_t)le32toh(w) * XXH_PRIME1, 23) * XXH_PRIME2 + XXH_PRIME3;
+         p += 4;
+     }
+     for (; p < end; p++) {
+         h = xxh_rotl(h ^ *p * XXH_PRIME5, 11) * XXH_PRIME1;
+     }
+     h ^= h >> 33;
+     h *= XXH_PRIME2;
+     h ^= h >> 29;
+     h *= XXH_PRIME3;
+     return h ^ (h >> 32);
+ }
+ 
+ // Path of the stored copy of contents with this hash and size.
+ static void cas_object_path(char *buf, size_t size, uint64_t hash, long long fileSize) {
+     snprintf(buf, size, "%s/%s/%016llx-%lld", indexRoot, CAS_DIR, (unsigned long long)hash,
+              fileSize);
+ }
+ 
+ // Parses the 16 hex digits of a LINK hash. Returns 0 on success.
+ int cas_parse_hash(const char *s, uint64_t *hash) {
+     if (!s || strlen(s) != 16 || strspn(s, "0123456789abcdefABCDEF") != 16) {
+         return -1;
+     }
+     *hash = strtoull(s, NULL, 16);
+     return 0;
+ }
  
- // Simple logging macro for S3 server messages
- #define LOG(msg, ...) fprintf(stderr, "S3: " msg "\n", ##__VA_ARGS__)
+ /*****************************************************************************
+  * cas_place: makes `fullPath` a link to `object`, replacing whatever was
+  * there in one rename so readers never see the path missing. Returns 0 on
+  * success, -1 with errno set otherwise.
+  *****************************************************************************/
+ static int cas_place(const char *object, const char *fullPath) {
+     char tmp[600];
+     snprintf(tmp, sizeof(tmp), "%s/%s/.link-%lx", indexRoot, CAS_DIR, (unsigned long)pthread_self());
+     unlink(tmp);   // left over from a crash
+     if (link(object, tmp) != 0) {
+         return -1;
+     }
+     if (rename(tmp, fullPath) != 0) {
+         int saved = errno;
+         unlink(tmp);
+         errno = saved;
+         return -1;
+     }
+     return 0;
+ }
  
  /*****************************************************************************
-  * Thread function: handles commands from a single S1 connection.
+  * cas_adopt: called once `fullPath` holds a complete file of `fileSize`
+  * bytes with contents hash `hash`. The first copy of some contents is linked
+  * into the store; a later one is replaced by a link to that copy.
   *****************************************************************************/
- void *handle_client(void *arg) {
-     int clientSock = *(int*)arg;
-     free(arg);  // dynamically allocated in the accept loop
-     char buffer[1024];
+ void cas_adopt(const char *fullPath, uint64_t hash, long long fileSize) {
+     char object[600];
+     cas_object_path(object, sizeof(object), hash, fileSize);
+     if (link(fullPath, object) == 0) {
+         return;
+     }
+     if (errno != EEXIST) {
+         LOG_WARN("Cannot add %s to the content store: %s", fullPath, strerror(errno));
+         return;
+     }
+     struct stat obj, st;
+     if (stat(object, &obj) != 0 || stat(fullPath, &st) != 0 || obj.st_ino == st.st_ino ||
+         obj.st_size != st.st_size) {
+         return;
+     }
+     if (cas_place(object, fullPath) == 0) {
+         LOG_DEBUG("Deduplicated %s (%lld bytes, %ld links)", fullPath, fileSize, (long)obj.st_nlink + 1);
+     }
+ }
+ 
+ // Hashes a file for cas_adopt(); also returns its CRC-32C. Returns 0 on success.
+ static int cas_hash_file(const char *fullPath, uint64_t *hash, uint32_t *crc) {
+     int fd = open(fullPath, O_RDONLY);
+     if (fd < 0) {
+         return -1;
+     }
+     struct xxh64_state xs;
+     xxh64_init(&xs);
+     *crc = 0;
+     char buf[BUF_SIZE * 16];
+     ssize_t n;
+     while ((n = read(fd, buf, sizeof(buf))) > 0) {
+         xxh64_update(&xs, buf, (size_t)n);
+         *crc = crc32c(*crc, buf, (size_t)n);
+     }
+     close(fd);
+     *hash = xxh64_final(&xs);
+     return n == 0 ? 0 : -1;
+ }
+ 
+ // Deletes the stored copies no path links to any more.
+ static void cas_sweep(void) {
+     char dirPath[600];
+     snprintf(dirPath, sizeof(dirPath), "%s/%s", indexRoot, CAS_DIR);
+     DIR *d = opendir(dirPath);
+     if (!d) {
+         return;
+     }
+     long freed = 0;
+     struct dirent *e;
+     while ((e = readdir(d)) != NULL) {
+         struct stat st;
+         if (e->d_name[0] == '.' || fstatat(dirfd(d), e->d_name, &st, AT_SYMLINK_NOFOLLOW) != 0) {
+             continue;
+         }
+         if (S_ISREG(st.st_mode) && st.st_nlink == 1 && unlinkat(dirfd(d), e->d_name, 0) == 0) {
+             freed++;
+         }
+     }
+     closedir(d);
+     if (freed > 0) {
+         LOG("Content store: freed %ld unreferenced objects", freed);
+     }
+ }
  
-     // Continuously read commands from S1 until the connection is closed
+ static void *cas_sweep_main(void *arg) {
+     (void)arg;
      while (1) {
-         // Read one line (until newline)
-         int idx = 0;
-         char c;
-         while (1) {
-             ssize_t n = recv(clientSock, &c, 1, 0);
+         cas_sweep();
+         sleep(CAS_SWEEP_SECS);
+     }
+     return NULL;
+ }
+ 
+ // Turns deduplication on (after index_init) and starts the sweep thread.
+ void cas_init(void) {
+     char dirPath[600];
+     snprintf(dirPath, sizeof(dirPath), "%s/%s", indexRoot, CAS_DIR);
+     if (mkdir(dirPath, 0755) != 0 && errno != EEXIST) {
+         LOG_WARN("Cannot create content store %s (%s); deduplication is off", dirPath, strerror(errno));
+         return;
+     }
+     casEnabled = 1;
+     pthread_t tid;
+     if (pthread_create(&tid, NULL, cas_sweep_main, NULL) == 0) {
+         pthread_detach(tid);
+     }
+     LOG("Deduplicating stored files in %s", dirPath);
+ }
+ 
+ /*****************************************************************************
+  * Prometheus endpoint (--metrics-port). A thread of its own answers
+  * "GET /metrics" over HTTP/1.0, one connection at a time, with
+  * metrics_text(); anything else gets a 404.
+  *****************************************************************************/
+ static void *metrics_http_main(void *arg) {
+     int listenSock = (int)(intptr_t)arg;
+     while (1) {
+         int sock = accept(listenSock, NULL, NULL);
+         if (sock < 0) {
+             continue;
+         }
+         struct timeval tv = { 2, 0 };
+         setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+         setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+         char request[1024];
+         size_t used = 0;
+         while (used < sizeof(request) - 1) {
+             ssize_t n = recv(sock, request + used, sizeof(request) - 1 - used, 0);
              if (n <= 0) {
-                 // Connection closed or error
-                 close(clientSock);
-                 return NULL;
+                 break;
              }
-             if (c == '\n') {
-                 break; // end of command
+             used += (size_t)n;
+             request[used] = '\0';
+             if (strstr(request, "\r\n\r\n") || strstr(request, "\n\n")) {
+                 break;
+             }
+         }
+         request[used] = '\0';
+         size_t len = 0;
+         char *body = strncmp(request, "GET /metrics", 12) == 0 ? metrics_text(&len) : NULL;
+         char head[160];
+         int n = body ? snprintf(head, sizeof(head), "HTTP/1.0 200 OK\r\n"
+                                 "Content-Type: text/plain; version=0.0.4\r\n"
+                                 "Content-Length: %zu\r\n\r\n", len)
+                      : snprintf(head, sizeof(head), "HTTP/1.0 404 Not Found\r\nContent-Length: 0\r\n\r\n");
+         if (write_all(sock, head, (size_t)n) == 0 && body) {
+             write_all(sock, body, len);
+         }
+         free(body);
+         close(sock);
+     }
+     return NULL;
+ }
+ 
+ // Starts the endpoint on `port`; returns -1 if it cannot listen there.
+ int metrics_http_start(int port) {
+     int sock = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+     int one = 1;
+     struct sockaddr_in addr;
+     memset(&addr, 0, sizeof(addr));
+     addr.sin_family = AF_INET;
+     addr.sin_addr.s_addr = htonl(INADDR_ANY);
+     addr.sin_port = htons((uint16_t)port);
+     pthread_t tid;
+     if (sock < 0 || setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) != 0 ||
+         bind(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(sock, 16) != 0 ||
+         pthread_create(&tid, NULL, metrics_http_main, (void *)(intptr_t)sock) != 0) {
+         if (sock >= 0) {
+             close(sock);
+         }
+         return -1;
+     }
+     pthread_detach(tid);
+     return 0;
+ }
+ 
+ /*****************************************************************************
+  * Durable writes. STORE writes the body to a hidden temporary file next to
+  * its target, "<dir>/.<name>.<thread>.tmp", preallocated to the declared
+  * size, and renames it over ~/S3/<path> only once the whole body has arrived
+  * and checked out; both names are resolved against the directory's fd (see
+  * "Directory cache"). Readers, and the tree after a crash, see either the old
+  * file or the whole new one; a failed STORE leaves the old file in place.
+  * COMMIT of a multipart upload goes through the same flush. --sync decides
+  * how the data reaches the disk before the rename:
+  *
+  *   group   (default) group commit: one syncfs() of the storage file system
+  *           covers every STORE that finished writing before it started, so
+  *           concurrent uploads share a flush instead of paying one each
+  *   each    fdatasync() of every file, and fsync() of its directory after
+  *           the rename
+  *   none    no flush; the rename still makes the write atomic
+  *****************************************************************************/
+ enum { SYNC_NONE, SYNC_EACH, SYNC_GROUP };
+ 
+ static int syncMode = SYNC_NONE;
+ static int rootFd = -1;                  // the storage root, for syncfs() and dir_open()
+ static pthread_mutex_t syncLock = PTHREAD_MUTEX_INITIALIZER;
+ static pthread_cond_t syncDone = PTHREAD_COND_INITIALIZER;
+ static int syncRunning;                  // a flush is in progress
+ static unsigned long syncCount;          // flushes completed so far
+ static unsigned long syncFailedAt;       // number of the last flush that failed
+  
+ /*****************************************************************************
+  * group_sync: returns once a syncfs() that started after the call has
+  * finished, so everything written before the call is on disk. Whoever finds
+  * no flush running does it for all waiting threads; threads that arrive
+  * during a flush wait for the next one. Returns 0, or -1 if it failed.
+  *****************************************************************************/
+ static int group_sync(void) {
+     pthread_mutex_lock(&syncLock);
+     unsigned long need = syncCount + (syncRunning ? 2 : 1);
+     while (syncCount < need) {
+         if (syncRunning) {
+             pthread_cond_wait(&syncDone, &syncLock);
+             continue;
+         }
+         syncRunning = 1;
+         pthread_mutex_unlock(&syncLock);
+         int rc = syncfs(rootFd);
+         pthread_mutex_lock(&syncLock);
+         syncRunning = 0;
+         syncCount++;
+         if (rc != 0) {
+             syncFailedAt = syncCount;
+         }
+         pthread_cond_broadcast(&syncDone);
+     }
+     int rc = syncFailedAt >= need ? -1 : 0;
+     pthread_mutex_unlock(&syncLock);
+     return rc;
+ }
+ 
+ /*****************************************************************************
+  * store_open: creates the temporary file for a STORE of `fileSize` bytes to
+  * `name` in the directory open as `dirFd`, and puts its name in `tmpName`.
+  * Returns the stream, or NULL with errno set (ENOSPC if the space cannot be
+  * reserved).
+  *****************************************************************************/
+ static FILE *store_open(int dirFd, const char *name, long fileSize, char *tmpName, size_t size) {
+     int n = snprintf(tmpName, size, ".%s.%lx%s", name, (unsigned long)pthread_self(), STORE_TMP_SUFFIX);
+     if (n < 0 || (size_t)n >= size) {
+         errno = ENAMETOOLONG;
+         return NULL;
+     }
+     int fd = openat(dirFd, tmpName, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+     if (fd < 0) {
+         return NULL;
+     }
+     // Reserving the blocks up front lets a full disk fail the STORE before
+     // the body is read and keeps the file in one piece. fallocate() rather
+     // than posix_fallocate(), which writes zeros where it is not supported.
+     FILE *fp = NULL;
+     if (fileSize <= 0 || fallocate(fd, 0, 0, fileSize) == 0 || errno != ENOSPC) {
+         fp = fdopen(fd, "wb");
+     }
+     if (!fp) {
+         int saved = errno;
+         close(fd);
+         unlinkat(dirFd, tmpName, 0);
+         errno = saved;
+     }
+     return fp;
+ }
+ 
+ /*****************************************************************************
+  * durable_rename: flushes the complete file `tmpName` (open as `fd`) as
+  * --sync asks and renames it over `name`, both in the directory open as
+  * `dirFd`. Returns 0 on success, -1 with the target untouched otherwise.
+  * The caller removes `tmpName` on failure.
+  *****************************************************************************/
+ static int durable_rename(int dirFd, int fd, const char *tmpName, const char *name) {
+     int rc = 0;
+     if (syncMode == SYNC_EACH) {
+         rc = fdatasync(fd);
+     } else if (syncMode == SYNC_GROUP) {
+         rc = group_sync();
+     }
+     if (rc != 0 || renameat(dirFd, tmpName, dirFd, name) != 0) {
+         return -1;
+     }
+     // The new name is durable once its directory has been flushed too
+     rc = syncMode == SYNC_EACH ? fsync(dirFd) : syncMode == SYNC_GROUP ? group_sync() : 0;
+     if (rc != 0) {
+         LOG_WARN("Cannot flush the directory of %s: %s", name, strerror(errno));
+     }
+     return 0;
+ }
+ 
+ // Opens the storage root and sets the --sync mode (after index_init).
+ void durable_init(int mode) {
+     syncMode = mode;
+     rootFd = open(indexRoot, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+     if (rootFd < 0) {
+         LOG_WARN("Cannot open %s: %s", indexRoot, strerror(errno));
+         exit(EXIT_FAILURE);
+     }
+ }
+ 
+ /*****************************************************************************
+  * Directory cache. STORE, PART and LINK need the directory of their path.
+  * Directories known to exist are remembered by their index key, so a STORE
+  * into an existing tree costs one openat() of its directory rather than a
+  * mkdir() per path component; only a directory not seen before is walked,
+  * component by component with mkdirat() and openat() from the root. The
+  * directory fd is then used for the file itself (openat, renameat, fsync),
+  * so the path is resolved once per upload. DEL forgets the directories it
+  * removes, and a remembered directory removed behind the server's back is
+  * forgotten and walked again when its openat() fails.
+  *****************************************************************************/
+ #define DIR_CACHE_SLOTS 1024     // direct-mapped: a collision replaces the older entry
+ 
+ static char *dirCache[DIR_CACHE_SLOTS];
+ static pthread_mutex_t dirCacheLock = PTHREAD_MUTEX_INITIALIZER;
+ 
+ static int dir_cache_has(const char *key) {
+     pthread_mutex_lock(&dirCacheLock);
+     const char *slot = dirCache[index_hash(key) % DIR_CACHE_SLOTS];
+     int known = slot && strcmp(slot, key) == 0;
+     pthread_mutex_unlock(&dirCacheLock);
+     return known;
+ }
+ 
+ static void dir_cache_add(const char *key) {
+     char *copy = strdup(key);
+     if (!copy) {
+         return;
+     }
+     pthread_mutex_lock(&dirCacheLock);
+     char **slot = &dirCache[index_hash(key) % DIR_CACHE_SLOTS];
+     free(*slot);
+     *slot = copy;
+     pthread_mutex_unlock(&dirCacheLock);
+ }
+ 
+ // Forgets directory `key` and every directory below it.
+ static void dir_cache_forget(const char *key) {
+     size_t len = strlen(key);
+     pthread_mutex_lock(&dirCacheLock);
+     for (size_t i = 0; i < DIR_CACHE_SLOTS; i++) {
+         const char *slot = dirCache[i];
+         if (slot && strncmp(slot, key, len) == 0 && (slot[len] == '\0' || slot[len] == '/')) {
+             free(dirCache[i]);
+             dirCache[i] = NULL;
+         }
+     }
+     pthread_mutex_unlock(&dirCacheLock);
+ }
+ 
+ /*****************************************************************************
+  * dir_open: returns an fd of the directory with index key `key` ("" for the
+  * root), creating it and its parents if need be, or -1 with errno set.
+  *****************************************************************************/
+ static int dir_open(const char *key) {
+     if (key[0] && dir_cache_has(key)) {
+         int fd = openat(rootFd, key, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+         if (fd >= 0) {
+             return fd;
+         }
+         dir_cache_forget(key);
+     }
+     int fd = openat(rootFd, ".", O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+     for (const char *p = key; fd >= 0 && *p; ) {
+         char component[NAME_MAX + 1];
+         size_t len = strcspn(p, "/");
+         if (len >= sizeof(component)) {
+             close(fd);
+             errno = ENAMETOOLONG;
+             return -1;
+         }
+         memcpy(component, p, len);
+         component[len] = '\0';
+         p += len + (p[len] == '/');
+         int next = -1;
+         if (mkdirat(fd, component, 0755) == 0 || errno == EEXIST) {
+             next = openat(fd, component, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+         }
+         int saved = errno;
+         close(fd);
+         errno = saved;
+         fd = next;
+     }
+     if (fd >= 0 && key[0]) {
+         dir_cache_add(key);
+     }
+     return fd;
+ }
+ 
+ /*****************************************************************************
+  * Replication chain. S1 stores a file on several servers by sending it once,
+  * to the first of them, as
+  *
+  *   STORE <path> <size> <addr>:<port>...
+  *
+  * listing the other replicas. The file is written here and, as it arrives,
+  * forwarded to the first reachable server of the list together with the
+  * servers after it; the answer is then "SUCCESS <copies>" for the whole
+  * chain. A replica that cannot be reached or fails is left out, and S1's
+  * repair pass copies the file there later. Chain connections start with
+  * "REPLICA" so the next server serves them on a thread of their own. Each
+  * server sends the next one its checksum of the file as a trailer
+  * ("crc32c"), so a copy damaged on any hop of the chain is not kept.
+  *****************************************************************************/
+ #define CHAIN_IO_TIMEOUT 30      // seconds to wait on the next server
+ 
+ // The connection to the next server is kept by each worker for its next STORE
+ static __thread int chainSock = -1;
+ static __thread char chainPeer[64];
+ 
+ static void chain_close(void) {
+     if (chainSock >= 0) {
+         close(chainSock);
+     }
+     chainSock = -1;
+ }
+ 
+ // Returns a connection to `peer` ("<addr>:<port>"), or -1.
+ static int chain_connect(const char *peer) {
+     if (chainSock >= 0 && strcmp(chainPeer, peer) == 0) {
+         char c;
+         ssize_t n = recv(chainSock, &c, 1, MSG_PEEK | MSG_DONTWAIT);
+         if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+             return chainSock;   // Idle and still open
+         }
+     }
+     chain_close();
+     char host[64];
+     snprintf(host, sizeof(host), "%s", peer);
+     char *colon = strrchr(host, ':');
+     struct sockaddr_in addr;
+     memset(&addr, 0, sizeof(addr));
+     addr.sin_family = AF_INET;
+     if (!colon) {
+         return -1;
+     }
+     *colon = '\0';
+     addr.sin_port = htons((uint16_t)atoi(colon + 1));
+     if (inet_pton(AF_INET, host, &addr.sin_addr) != 1) {
+         return -1;
+     }
+     int sock = socket(AF_INET, SOCK_STREAM, 0);
+     if (sock < 0) {
+         return -1;
+     }
+     struct timeval tv = { CHAIN_IO_TIMEOUT, 0 };
+     setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+     setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+     if (connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+         close(sock);
+         return -1;
+     }
+     // The server on the other side serves this connection outside its pool
+     if (send(sock, "REPLICA\n", 8, MSG_MORE) != 8) {
+         close(sock);
+         return -1;
+     }
+     chainSock = sock;
+     snprintf(chainPeer, sizeof(chainPeer), "%s", peer);
+     return sock;
+ }
+ 
+ /*****************************************************************************
+  * chain_open: starts the rest of the chain for a STORE. `peers` is the
+  * space-separated list from the command; the first server that accepts the
+  * connection gets the STORE header with the servers after it. Returns the
+  * socket, or -1 if none could be reached.
+  *****************************************************************************/
+ static int chain_open(const char *path, long size, char *peers) {
+     char *saveptr;
+     for (char *peer = strtok_r(peers, " ", &saveptr); peer; peer = strtok_r(NULL, " ", &saveptr)) {
+         const char *rest = saveptr ? saveptr : "";
+         int sock = chain_connect(peer);
+         char header[1600];
+         int n = snprintf(header, sizeof(header), "STORE %s %ld crc32c%s%s\n", path, size,
+                          *rest ? " " : "", rest);
+         if (sock >= 0 && n > 0 && n < (int)sizeof(header) &&
+             send(sock, header, (size_t)n, MSG_MORE) == n) {
+             tcp_cork(sock, 1);   // until the trailer
+             return sock;
+         }
+         LOG_WARN("Replica %s unreachable; left to the repair pass", peer);
+         chain_close();
+     }
+     return -1;
+ }
+ 
+ // Passes the next piece of the file down the chain, dropping the chain if it fails.
+ static void chain_forward(int *sock, const char *buf, size_t len) {
+     if (*sock >= 0 && write_all(*sock, buf, len) != 0) {
+         LOG_WARN("Replica %s failed during a STORE", chainPeer);
+         chain_close();
+         *sock = -1;
+     }
+ }
+ 
+ // Waits for the rest of the chain; returns the copies it made.
+ static int chain_finish(int sock) {
+     if (sock < 0) {
+         return 0;
+     }
+     struct line_reader reply;
+     char line[64];
+     reader_init(&reply, sock);
+     if (reader_getline(&reply, line, sizeof(line)) < 0) {
+         chain_close();
+         return 0;
+     }
+     if (strncmp(line, "SUCCESS", 7) != 0) {
+         return 0;
+     }
+     return line[7] == ' ' ? atoi(line + 8) : 1;
+ }
+ 
+ /*****************************************************************************
+  * Multipart uploads. S1 can send a large file in parts, several of them at
+  * once over different connections:
+  *
+  *   PART <id> <path> <total> <offset> <length>   followed by <length> bytes
+  *   COMMIT <id> <path> <total>
+  *   ABORT <id> <path>
+  *
+  * Parts are written in place with pwrite into "<dir>/.<name>.<id>.part",
+  * which the first part to arrive preallocates to <total> bytes. Once a part
+  * is on disk, "<offset> <length>" is appended to "<dir>/.<name>.<id>.map".
+  * COMMIT renames the part file over ~/S3/<path> only if the recorded parts
+  * cover all <total> bytes, so readers see either the old file or the whole
+  * new one. A part that failed can simply be sent again.
+  *****************************************************************************/
+ #define MAX_UPLOAD_ID 32
+ 
+ struct upload_files {
+     char fullPath[1600];
+     char partPath[1600];
+     char mapPath[1600];
+     char keyDir[1024];
+     char keyName[NAME_MAX + 1];
+ };
+ 
+ /*****************************************************************************
+  * upload_resolve: works out the final path, part file, map file and index
+  * key for upload `id` of `path`. Ids come from the client and end up in file
+  * names, so only short hex strings are accepted. Returns -1 for a bad id or
+  * a path that would leave ~/S3 or is too long.
+  *****************************************************************************/
+ static int upload_resolve(const char *path, const char *id, struct upload_files *u) {
+     size_t idLen = strspn(id, "0123456789abcdefABCDEF");
+     if (idLen == 0 || idLen > MAX_UPLOAD_ID || id[idLen] != '\0') {
+         return -1;
+     }
+     const char *relPath = path;
+     if (strncmp(path, "~S3", 3) == 0) {
+         relPath = path + 3;
+         if (*relPath == '/') {
+             relPath++;
+         }
+     }
+     if (index_split(relPath, u->keyDir, sizeof(u->keyDir), u->keyName, sizeof(u->keyName)) != 0 ||
+         u->keyName[0] == '\0') {
+         return -1;
+     }
+     // A path too long for any of the three names is refused, not cut short
+     const char *sep = u->keyDir[0] ? "/" : "";
+     int part = snprintf(u->partPath, sizeof(u->partPath), "%s/%s%s.%s.%s.part", indexRoot,
+                         u->keyDir, sep, u->keyName, id);
+     int full = snprintf(u->fullPath, sizeof(u->fullPath), "%s/%s%s%s", indexRoot, u->keyDir, sep,
+                         u->keyName);
+     int map = snprintf(u->mapPath, sizeof(u->mapPath), "%s/%s%s.%s.%s.map", indexRoot, u->keyDir,
+                        sep, u->keyName, id);
+     if (part < 0 || full < 0 || map < 0 || (size_t)part >= sizeof(u->partPath) ||
+         (size_t)full >= sizeof(u->fullPath) || (size_t)map >= sizeof(u->mapPath)) {
+         return -1;
+     }
+     return 0;
+ }
+ 
+ // Creates the directory with index key `keyDir` and its parents (see "Directory cache").
+ static void make_dirs(const char *keyDir) {
+     int fd = dir_open(keyDir);
+     if (fd >= 0) {
+         close(fd);
+     }
+ }
+ 
+ // Reads and discards `length` bytes a refused command still carries.
+ static void drain_bytes(struct line_reader *conn, long length) {
+     char discard[512];
+     while (length > 0) {
+         ssize_t r = reader_read(conn, discard,
+                                 (size_t)length < sizeof(discard) ? (size_t)length : sizeof(discard));
+         if (r <= 0) {
+             break;
+         }
+         length -= r;
+     }
+ }
+ 
+ struct part_range {
+     long offset, length;
+ };
+ 
+ static int part_range_cmp(const void *a, const void *b) {
+     const struct part_range *x = a, *y = b;
+     return (x->offset > y->offset) - (x->offset < y->offset);
+ }
+ 
+ /*****************************************************************************
+  * parts_cover: returns 1 if the parts recorded in `mapPath` cover every byte
+  * of a `total`-byte file. Parts may arrive in any order, overlap, or be
+  * recorded twice after a retry.
+  *****************************************************************************/
+ static int parts_cover(const char *mapPath, long total) {
+     FILE *fp = fopen(mapPath, "r");
+     if (!fp) {
+         return total == 0;
+     }
+     struct part_range *ranges = NULL;
+     size_t count = 0, cap = 0;
+     long offset, length;
+     int ok = 1;
+     while (fscanf(fp, "%ld %ld", &offset, &length) == 2) {
+         if (count == cap) {
+             size_t newCap = cap ? cap * 2 : 64;
+             struct part_range *grown = realloc(ranges, newCap * sizeof(*grown));
+             if (!grown) {
+                 ok = 0;
+                 break;
              }
-             if (idx < (int)sizeof(buffer) - 1) {
-                 buffer[idx++] = c;
+             ranges = grown;
+             cap = newCap;
+         }
+         ranges[count].offset = offset;
+         ranges[count].length = length;
+         count++;
+     }
+     fclose(fp);
+     long reach = 0;
+     if (ok && count > 0) {
+         qsort(ranges, count, sizeof(*ranges), part_range_cmp);
+         for (size_t i = 0; i < count && ranges[i].offset <= reach; i++) {
+             if (ranges[i].offset + ranges[i].length > reach) {
+                 reach = ranges[i].offset + ranges[i].length;
              }
          }
-         buffer[idx] = '\0';
+     }
+     free(ranges);
+     return ok && reach >= total;
+ }
+ 
+ /*****************************************************************************
+  * Handles the next command on an S1 connection. Called by a worker thread
+  * whenever the connection becomes readable (or already has a buffered line).
+  * Returns 0 when the command was processed and the connection should wait
+  * for the next one, or -1 when S1 closed the connection. The command is
+  * recorded in the metrics once it is over.
+  *****************************************************************************/
+ static int run_command(struct line_reader *conn);
+ 
+ int handle_command(struct line_reader *conn) {
+     int rc = run_command(conn);
+     metrics_end();
+     return rc;
+ }
+ 
+ static int run_command(struct line_reader *conn) {
+     int clientSock = conn->fd;
+     char buffer[1024];
+ 
+     // Exactly one command per call; "continue" below ends it early.
+     do {
+         // Read one line (until newline)
+         int idx = reader_getline(conn, buffer, sizeof(buffer));
+         if (idx < 0) {
+             // Connection closed or error
+             return -1;
+         }
          if (idx == 0) {
              // Empty command => ignore
              continue;
@@ -100,31 +3350,44 @@
          if (!cmd) {
              continue;
          }
+         metrics_begin(clientSock, cmd);
  
          /*********************************************************************
-          * 1) STORE <path> <size>
+          * 1) STORE <path> <size>   STOREZ <path> <size> <zlen>
           *********************************************************************/
-         if (strcmp(cmd, "STORE") == 0) {
+         if (strcmp(cmd, "STORE") == 0 || strcmp(cmd, "STOREZ") == 0) {
              // Format: STORE <path> <size>
              char *path = strtok(NULL, " ");
              char *sizeStr = strtok(NULL, " ");
              if (!path || !sizeStr) {
                  const char *err = "ERROR: Invalid STORE command\n";
-                 send(clientSock, err, strlen(err), 0);
+                 send_error(clientSock, err);
                  continue;
              }
              long fileSize = atol(sizeStr);
+             // STOREZ: <zlen> deflated bytes follow instead (see "Compression")
+             int deflated = strcmp(cmd, "STOREZ") == 0;
+             char *zlenStr = deflated ? strtok(NULL, " ") : sizeStr;
+             long wireLen = zlenStr ? atol(zlenStr) : -1;
+             if (wireLen < 0) {
+                 // The body length is unknown, so the connection cannot be kept in sync
+                 const char *err = "ERROR: Invalid STORE command\n";
+                 send_error(clientSock, err);
+                 return -1;
+             }
+             // "crc32c": the body is followed by the sender's checksum trailer;
+             // then further replicas to forward the file to (see "Replication chain")
+             char *peers = strtok(NULL, "");
+             int withCrc = 0;
+             if (peers && strncmp(peers, "crc32c", 6) == 0 && (peers[6] == ' ' || peers[6] == '\0')) {
+                 withCrc = 1;
+                 peers = peers[6] ? peers + 7 : NULL;
+             }
  
              // Build full path under ~/S3
-             char *home = getenv("HOME");
-             if (!home) {
-                 const char *err = "ERROR\n";
-                 send(clientSock, err, strlen(err), 0);
-                 continue;
-             }
              // Base directory
              char baseDir[512];
-             snprintf(baseDir, sizeof(baseDir), "%s/S3", home);
+             snprintf(baseDir, sizeof(baseDir), "%s", indexRoot);
  
              // If S1 included ~S3 in the path, remove it
              const char *relPath = path;
@@ -139,99 +3402,220 @@
              char fullPath[1024];
              snprintf(fullPath, sizeof(fullPath), "%s/%s", baseDir, relPath);
  
-             // Ensure subdirectories exist
-             {
-                 char dirPath[1024];
-                 strncpy(dirPath, fullPath, sizeof(dirPath));
-                 dirPath[sizeof(dirPath)-1] = '\0';
-                 char *lastSlash = strrchr(dirPath, '/');
-                 if (lastSlash) {
-                     *lastSlash = '\0';
-                     char tmp[1024];
-                     snprintf(tmp, sizeof(tmp), "%s", dirPath);
-                     for (char *p = tmp + 1; *p; ++p) {
-                         if (*p == '/') {
-                             *p = '\0';
-                             mkdir(tmp, 0755);
-                             *p = '/';
-                         }
-                     }
-                     mkdir(tmp, 0755);
-                 }
-             }
+             // Index key; paths that would leave ~/S3 are refused
+             char keyDir[1024], keyName[NAME_MAX + 1];
+             int validKey = index_split(relPath, keyDir, sizeof(keyDir), keyName, sizeof(keyName)) == 0 &&
+                            keyName[0] != '\0';
+ 
+             // The directory is looked up (and made if need be) once; the file
+             // is opened, renamed and flushed relative to it
+             int dirFd = validKey ? dir_open(keyDir) : -1;
  
-             // Open file for writing
-             FILE *fp = fopen(fullPath, "wb");
+             // The body goes to a temporary file that replaces the path once it
+             // is complete (see "Durable writes"), so a deduplicated path is
+             // never written through to the other paths sharing its contents
+             char tmpName[NAME_MAX + 32];
+             FILE *fp = NULL;
+             if (dirFd >= 0) {
+                 fp = store_open(dirFd, keyName, fileSize, tmpName, sizeof(tmpName));
+             } else if (!validKey) {
+                 errno = EINVAL;
+             }
              if (!fp) {
-                 LOG("Failed to open %s: %s", fullPath, strerror(errno));
-                 const char *err = "ERROR\n";
-                 send(clientSock, err, strlen(err), 0);
+                 LOG_WARN("Failed to open %s: %s", fullPath, strerror(errno));
+                 const char *err = errno == ENOSPC ? "ERROR: No space left\n" : "ERROR\n";
+                 send_error(clientSock, err);
  
                  // Drain incoming data to sync
                  char discard[512];
-                 long remaining = fileSize;
+                 long remaining = wireLen;
                  while (remaining > 0) {
-                     ssize_t r = recv(clientSock, discard,
-                                      remaining < (long)sizeof(discard) ? remaining : sizeof(discard),
-                                      0);
+                     ssize_t r = reader_read(conn, discard,
+                                             (size_t)remaining < sizeof(discard) ? (size_t)remaining
+                                                                                 : sizeof(discard));
                      if (r <= 0) {
                          break;
                      }
                      remaining -= r;
                  }
+                 if (withCrc && remaining == 0) {
+                     reader_getline(conn, discard, sizeof(discard));
+                 }
+                 if (dirFd >= 0) {
+                     close(dirFd);
+                 }
                  continue;
              }
  
              // Read the file content from S1
-             long remaining = fileSize;
+             int nextSock = peers ? chain_open(path, fileSize, peers) : -1;
+             long remaining = wireLen;
              char dataBuf[BUF_SIZE];
+             uint32_t crc = 0;
+             struct xxh64_state xs;
+             xxh64_init(&xs);
+             // A STOREZ body is inflated as it arrives; everything below the
+             // inflate step (disk, replicas, checksums) sees the plain bytes
+             z_stream zs;
+             memset(&zs, 0, sizeof(zs));
+             int zret = deflated ? inflateInit(&zs) : Z_OK;
+             int badBody = zret != Z_OK;
+             long stored = 0;
+             int writeFailed = 0;   // e.g. disk full; the body is still read to the end
+             char plainBuf[ZCHUNK_SIZE];
+             struct file_writer out;
+             writer_init(&out, fp);
              while (remaining > 0) {
-                 ssize_t r = recv(clientSock, dataBuf,
-                                  remaining < (long)sizeof(dataBuf) ? remaining : sizeof(dataBuf),
-                                  0);
+                 ssize_t r = reader_read(conn, dataBuf,
+                                         (size_t)remaining < sizeof(dataBuf) ? (size_t)remaining : sizeof(dataBuf));
                  if (r <= 0) {
                      break;
                  }
-                 fwrite(dataBuf, 1, r, fp);
                  remaining -= r;
+                 zs.next_in = (Bytef *)dataBuf;
+                 zs.avail_in = (uInt)r;
+                 while (!badBody) {
+                     const char *piece = dataBuf;
+                     size_t n = (size_t)r;
+                     if (deflated) {
+                         zs.next_out = (Bytef *)plainBuf;
+                         zs.avail_out = sizeof(plainBuf);
+                         zret = inflate(&zs, Z_NO_FLUSH);
+                         if (zret != Z_OK && zret != Z_STREAM_END && zret != Z_BUF_ERROR) {
+                             badBody = 1;
+                             break;
+                         }
+                         piece = plainBuf;
+                         n = sizeof(plainBuf) - zs.avail_out;
+                     }
+                     if (stored + (long)n > fileSize) {
+                         badBody = 1;
+                         break;
+                     }
+                     if (!writeFailed && writer_write(&out, piece, n) != 0) {
+                         writeFailed = 1;
+                     }
+                     chain_forward(&nextSock, piece, n);
+                     crc = crc32c(crc, piece, n);
+                     if (casEnabled) {
+                         xxh64_update(&xs, piece, n);
+                     }
+                     stored += (long)n;
+                     if (!deflated || zs.avail_out != 0) {
+                         break;
+                     }
+                 }
+             }
+             if (writer_finish(&out) != 0) {
+                 writeFailed = 1;
+             }
+             if (deflated) {
+                 inflateEnd(&zs);
+                 badBody = badBody || zret != Z_STREAM_END;
+             }
+             // Compare with the checksum the sender computed as it sent the file
+             int crcMismatch = 0;
+             if (withCrc && remaining == 0) {
+                 char trailer[64];
+                 uint32_t expected;
+                 crcMismatch = reader_getline(conn, trailer, sizeof(trailer)) < 0 ||
+                               parse_crc_trailer(trailer, &expected) != 0 || expected != crc;
              }
-             fclose(fp);
  
-             if (remaining != 0) {
+             int failed = remaining != 0 || badBody || stored != fileSize || writeFailed || crcMismatch;
+             if (!failed && (fflush(fp) != 0 || durable_rename(dirFd, fileno(fp), tmpName, keyName) != 0)) {
+                 writeFailed = 1;
+                 failed = 1;
+             }
+             fclose(fp);
+             if (failed) {
+                 unlinkat(dirFd, tmpName, 0);
+             }
+             close(dirFd);
+             if (failed) {
                  // Connection lost mid-transfer
-                 LOG("Connection lost during STORE of %s", fullPath);
-                 remove(fullPath);
-                 const char *err = "ERROR\n";
-                 send(clientSock, err, strlen(err), 0);
+                 if (remaining != 0) {
+                     LOG_WARN("Connection lost during STORE of %s", fullPath);
+                 } else if (writeFailed) {
+                     LOG_WARN("Failed to write %s", fullPath);
+                 } else if (crcMismatch) {
+                     LOG_WARN("Checksum mismatch for %s", fullPath);
+                 } else {
+                     LOG_WARN("Damaged compressed body for %s", fullPath);
+                 }
+                 if (nextSock >= 0) {
+                     chain_close();   // The next server sees the body end early too
+                 }
+                 const char *err = crcMismatch ? "ERROR: Checksum mismatch\n"
+                                   : writeFailed ? "ERROR: Write failed\n" : "ERROR\n";
+                 send_error(clientSock, err);
              } else {
-                 LOG("Stored file %s (%ld bytes)", fullPath, fileSize);
-                 const char *succ = "SUCCESS\n";
+                 LOG_DEBUG("Stored file %s (%ld bytes)", fullPath, fileSize);
+                 if (casEnabled) {
+                     cas_adopt(fullPath, xxh64_final(&xs), fileSize);
+                 }
+                 struct stat st;
+                 if (stat(fullPath, &st) == 0) {
+                     index_put(keyDir, keyName, (long long)st.st_size, st.st_mtime, crc, 1);
+                 }
+                 char succ[32];
+                 if (peers) {
+                     char trailer[32];
+                     int n = format_crc_trailer(trailer, sizeof(trailer), crc);
+                     chain_forward(&nextSock, trailer, (size_t)n);
+                     if (nextSock >= 0) {
+                         tcp_cork(nextSock, 0);
+                     }
+                     snprintf(succ, sizeof(succ), "SUCCESS %d\n", 1 + chain_finish(nextSock));
+                 } else {
+                     snprintf(succ, sizeof(succ), "SUCCESS\n");
+                 }
                  send(clientSock, succ, strlen(succ), 0);
              }
  
          /*********************************************************************
           * 2) GET <path>
           *********************************************************************/
-         } else if (strcmp(cmd, "GET") == 0) {
+         } else if (strcmp(cmd, "GET") == 0 || strcmp(cmd, "GETR") == 0 ||
+                    strcmp(cmd, "GETZ") == 0) {
+             // GETR <offset> <length|-> <path>: one byte range of the file
+             // GETZ <level> <path>: the whole file deflated (see "Compression")
+             long offset = -1, length = -1;
+             int level = 0;
+             if (strcmp(cmd, "GETZ") == 0) {
+                 char *levelStr = strtok(NULL, " ");
+                 level = levelStr ? atoi(levelStr) : 0;
+                 if (level < 1 || level > 9) {
+                     const char *err = "ERROR: Invalid GETZ command\n";
+                     send_error(clientSock, err);
+                     continue;
+                 }
+             }
+             if (strcmp(cmd, "GETR") == 0) {
+                 char *offsetStr = strtok(NULL, " ");
+                 char *lengthStr = strtok(NULL, " ");
+                 if (!offsetStr || !lengthStr || atol(offsetStr) < 0 ||
+                     (strcmp(lengthStr, "-") != 0 && atol(lengthStr) < 0)) {
+                     const char *err = "ERROR: Invalid GETR command\n";
+                     send_error(clientSock, err);
+                     continue;
+                 }
+                 offset = atol(offsetStr);
+                 length = strcmp(lengthStr, "-") == 0 ? -1 : atol(lengthStr);
+             }
              char *path = strtok(NULL, "");
              if (!path) {
                  const char *err = "ERROR\n";
-                 send(clientSock, err, strlen(err), 0);
+                 send_error(clientSock, err);
                  continue;
              }
              while (*path == ' ') {
                  path++;
              }
-             char *home = getenv("HOME");
-             if (!home) {
-                 const char *err = "ERROR\n";
-                 send(clientSock, err, strlen(err), 0);
-                 continue;
-             }
  
              // Build full path under ~/S3
              char baseDir[512];
-             snprintf(baseDir, sizeof(baseDir), "%s/S3", home);
+             snprintf(baseDir, sizeof(baseDir), "%s", indexRoot);
              const char *relPath = path;
              if (strncmp(path, "~S3", 3) == 0) {
                  relPath = path + 3;
@@ -243,27 +3627,89 @@
              snprintf(fullPath, sizeof(fullPath), "%s/%s", baseDir,
                       (*relPath ? relPath : "."));
  
-             FILE *fp = fopen(fullPath, "rb");
-             if (!fp) {
+             // Misses are answered from the index without touching the disk
+             char keyDir[1024], keyName[NAME_MAX + 1];
+             struct file_meta meta;
+             if (index_split(relPath, keyDir, sizeof(keyDir), keyName, sizeof(keyName)) != 0 ||
+                 !index_lookup(keyDir, keyName, &meta)) {
+                 const char *err = "ERROR: File not found\n";
+                 send_error(clientSock, err);
+                 continue;
+             }
+             int fd = open(fullPath, O_RDONLY);
+             struct stat fst;
+             if (fd < 0 || fstat(fd, &fst) != 0 || !S_ISREG(fst.st_mode)) {
+                 if (fd < 0 && errno == ENOENT) {
+                     index_remove(keyDir, keyName);   // removed behind our back
+                 }
+                 if (fd >= 0) {
+                     close(fd);
+                 }
                  const char *err = "ERROR: File not found\n";
-                 send(clientSock, err, strlen(err), 0);
+                 send_error(clientSock, err);
                  continue;
              }
+             // The whole file's checksum trailer comes from the index if it has
+             // one for this version of the file; otherwise it is computed while
+             // the file is sent, and recorded for the next time
+             int crcKnown = meta.crcValid && meta.size == (long long)fst.st_size &&
+                            meta.mtime == fst.st_mtime;
+             uint32_t crc = 0;
  
-             fseek(fp, 0, SEEK_END);
-             long fileSize = ftell(fp);
-             fseek(fp, 0, SEEK_SET);
+             // Send file size ("<count> <filesize>" for a range)
+             long fileSize = (long)fst.st_size;
+             if (level > 0 && fileSize >= COMPRESS_MIN_SIZE) {
+                 const char *hdr = "chunked\n";
+                 tcp_cork(clientSock, 1);
+                 int rc = send(clientSock, hdr, strlen(hdr), MSG_NOSIGNAL) == (ssize_t)strlen(hdr)
+                              ? zout_send_file(clientSock, fd, level, &crc) : -1;
+                 close(fd);
+                 if (rc == 0) {
+                     rc = send_crc_trailer(clientSock, crcKnown ? meta.crc : crc);
+                 }
+                 if (rc != 0) {
+                     LOG_WARN("Failed to send %s deflated", fullPath);
+                     return -1;
+                 }
+                 if (!crcKnown) {
+                     index_put(keyDir, keyName, (long long)fst.st_size, fst.st_mtime, crc, 1);
+                 }
+                 LOG_DEBUG("Sent file %s (%ld bytes, deflated)", fullPath, fileSize);
+                 continue;
+             }
+             long count = fileSize;
              char sizeStr[64];
-             snprintf(sizeStr, sizeof(sizeStr), "%ld\n", fileSize);
-             send(clientSock, sizeStr, strlen(sizeStr), 0);
- 
-             char sendBuf[BUF_SIZE];
-             size_t bytes;
-             while ((bytes = fread(sendBuf, 1, sizeof(sendBuf), fp)) > 0) {
-                 send(clientSock, sendBuf, bytes, 0);
+             if (offset >= 0) {
+                 if (offset > fileSize) {
+                     close(fd);
+                     const char *err = "ERROR: Invalid range\n";
+                     send_error(clientSock, err);
+                     continue;
+                 }
+                 count = (length < 0 || length > fileSize - offset) ? fileSize - offset : length;
+                 snprintf(sizeStr, sizeof(sizeStr), "%ld %ld\n", count, fileSize);
+             } else {
+                 snprintf(sizeStr, sizeof(sizeStr), "%ld\n", fileSize);
              }
-             fclose(fp);
-             LOG("Sent file %s (%ld bytes)", fullPath, fileSize);
+             // MSG_MORE lets a small body share the size line's segment
+             // instead of waiting behind Nagle for the peer's delayed ACK
+             if (offset < 0) {
+                 tcp_cork(clientSock, 1);
+             }
+             send(clientSock, sizeStr, strlen(sizeStr), count > 0 ? MSG_MORE : 0);
+
+             // Send file data straight from the page cache
+             if (send_file_fd(clientSock, fd, offset > 0 ? offset : 0, count,
+                              (offset < 0 && !crcKnown) ? &crc : NULL) != 0) {
+                 LOG_WARN("Failed to send %s: %s", fullPath, strerror(errno));
+             } else if (offset < 0) {
+                 send_crc_trailer(clientSock, crcKnown ? meta.crc : crc);
+                 if (!crcKnown) {
+                     index_put(keyDir, keyName, (long long)fst.st_size, fst.st_mtime, crc, 1);
+                 }
+             }
+             close(fd);
+             LOG_DEBUG("Sent file %s (%ld bytes)", fullPath, count);
  
          /*********************************************************************
           * 3) DEL <path>
@@ -272,20 +3718,14 @@
              char *path = strtok(NULL, "");
              if (!path) {
                  const char *err = "ERROR\n";
-                 send(clientSock, err, strlen(err), 0);
+                 send_error(clientSock, err);
                  continue;
              }
              while (*path == ' ') {
                  path++;
              }
-             char *home = getenv("HOME");
-             if (!home) {
-                 const char *err = "ERROR\n";
-                 send(clientSock, err, strlen(err), 0);
-                 continue;
-             }
              char baseDir[512];
-             snprintf(baseDir, sizeof(baseDir), "%s/S3", home);
+             snprintf(baseDir, sizeof(baseDir), "%s", indexRoot);
              const char *relPath = path;
              if (strncmp(path, "~S3", 3) == 0) {
                  relPath = path + 3;
@@ -294,17 +3734,34 @@
                  }
              }
              char fullPath[1024];
-             snprintf(fullPath, sizeof(fullPath), "%s/%s", baseDir,
-                      (*relPath ? relPath : ""));
+             int n = snprintf(fullPath, sizeof(fullPath), "%s/%s", baseDir,
+                              (*relPath ? relPath : ""));
  
+             char keyDir[1024], keyName[NAME_MAX + 1];
+             if (n < 0 || (size_t)n >= sizeof(fullPath)) {
+                 // A cut-short path could name another file
+                 const char *err = "ERROR: path too long\n";
+                 send_error(clientSock, err);
+                 continue;
+             }
+             if (index_split(relPath, keyDir, sizeof(keyDir), keyName, sizeof(keyName)) != 0 ||
+                 !index_lookup(keyDir, keyName, NULL)) {
+                 const char *err = "ERROR\n";
+                 send_error(clientSock, err);
+                 continue;
+             }
              if (unlink(fullPath) == 0) {
-                 LOG("Deleted file %s", fullPath);
+                 LOG_DEBUG("Deleted file %s", fullPath);
+                 index_remove(keyDir, keyName);
                  const char *succ = "SUCCESS\n";
                  send(clientSock, succ, strlen(succ), 0);
              } else {
-                 LOG("Failed to delete %s: %s", fullPath, strerror(errno));
+                 LOG_WARN("Failed to delete %s: %s", fullPath, strerror(errno));
+                 if (errno == ENOENT) {
+                     index_remove(keyDir, keyName);
+                 }
                  const char *err = "ERROR\n";
-                 send(clientSock, err, strlen(err), 0);
+                 send_error(clientSock, err);
              }
 
              // Now remove empty parent directories upward (like what you did for S1)
@@ -316,7 +3773,7 @@
             *lastSlash = '\0';
         } else {
             // Should not happen, but bail out if we can't determine a directory
-            LOG("Failed to determine parent directory for %s", fullPath);
+            LOG_WARN("Failed to determine parent directory for %s", fullPath);
             const char *succ = "SUCCESS\n";
             send(clientSock, succ, strlen(succ), 0);
             continue;
@@ -326,7 +3783,8 @@
         // This will remove empty subdirectories like ~S2/folder1/folder2, etc.
         while (strcmp(currentDir, baseDir) != 0) {
             if (rmdir(currentDir) == 0) {
-                LOG("Removed empty directory: %s", currentDir);
+                LOG_DEBUG("Removed empty directory: %s", currentDir);
+                dir_cache_forget(currentDir + strlen(baseDir) + 1);
                 // Move up one level: strip the last component
                 lastSlash = strrchr(currentDir, '/');
                 if (lastSlash != NULL) {
@@ -336,150 +3794,112 @@
                 }
             } else {
                 // If a directory is not empty or removal fails, stop attempting further removal.
-                LOG("Directory %s not empty or could not be removed (errno: %d)", currentDir, errno);
+                LOG_DEBUG("Directory %s not empty or could not be removed (errno: %d)", currentDir, errno);
                 break;
             }
         }
  
          /*********************************************************************
-          * 4) TAR
+          * 4) TAR <type>
           *********************************************************************/
          }else if (strncmp(cmd, "TAR", 3) == 0) {
-            // Extract file type from the command (we're expecting "TAR .txt")
-            char fileType[10] = {0};
-            
-            // Extract everything after "TAR" and trim whitespace
-            char *typePtr = cmd + 3;
-            while (*typePtr && (*typePtr == ' ' || *typePtr == '\t'))
-                typePtr++;
-                
-            // Copy the file type
-            if (*typePtr) {
-                sscanf(typePtr, "%9s", fileType);
-                LOG("Received TAR command for file type: '%s'", fileType);
-            }
-            
-            // Ensure we're processing the correct file type for S3
-            if (strlen(fileType) == 0 || strcmp(fileType, ".txt") != 0) {
-                const char *err = "ERROR: S3 only handles .txt files\n";
-                send(clientSock, err, strlen(err), 0);
-                continue;
-            }
-
-            // Get HOME directory
-            char *home = getenv("HOME");
-            if (!home) {
-                const char *err = "ERROR: HOME environment variable not set\n";
-                send(clientSock, err, strlen(err), 0);
-                continue;
-            }
-            
-            // Create a temporary file for the tar
-            char tempFile[] = "/tmp/txtXXXXXX";
-            int temp_fd = mkstemp(tempFile);
-            if (temp_fd == -1) {
-                const char *err = "ERROR: Failed to create temporary file\n";
-                send(clientSock, err, strlen(err), 0);
-                continue;
-            }
-            close(temp_fd); // Close the fd; tar will create/overwrite the file
-            
-            // Build the tar command - find all .pdf files in the S2 directory tree
-            char tarCmd[1024];
-            snprintf(tarCmd, sizeof(tarCmd), 
-                    "find %s/S3 -name \"*%s\" -type f | xargs tar -cf %s 2>/dev/null",
-                    home, fileType, tempFile);
-            
-            LOG("Executing tar command: %s", tarCmd);
-            
-            // Attempt to create the tar
-            int status = system(tarCmd);
-            if (status != 0) {
-                LOG("tar command failed with status %d", status);
-                
-                // Check if there are any matching files
-                char checkCmd[512];
-                snprintf(checkCmd, sizeof(checkCmd), 
-                        "find %s/S3 -name \"*%s\" -type f | wc -l", 
-                        home, fileType);
-                
-                FILE *checkP = popen(checkCmd, "r");
-                if (!checkP) {
-                    const char *err = "ERROR: Failed to check for txt files\n";
-                    send(clientSock, err, strlen(err), 0);
-                    remove(tempFile);
-                    continue;
-                }
-                
-                char countStr[32] = {0};
-                fgets(countStr, sizeof(countStr), checkP);
-                pclose(checkP);
-                int count = atoi(countStr);
-                
-                if (count == 0) {
-                    // No files found - create an empty tar
-                    FILE *emptyTar = fopen(tempFile, "wb");
-                    if (!emptyTar) {
-                        const char *err = "ERROR: Failed to create empty tar\n";
-                        send(clientSock, err, strlen(err), 0);
-                        remove(tempFile);
-                        continue;
-                    }
-                    fclose(emptyTar);
-                    LOG("Created empty tar file (no txt files found)");
-                } else {
-                    // Try alternative approach
-                    snprintf(tarCmd, sizeof(tarCmd), 
-                            "tar -cf %s --no-recursion -C $(find %s/S2 -name \"*%s\" -type f -printf \"%%P\\n\") 2>/dev/null", 
-                            tempFile, home, home, fileType);
-                    
-                    LOG("Trying alternative tar command: %s", tarCmd);
-                    status = system(tarCmd);
-                    
-                    if (status != 0) {
-                        const char *err = "ERROR: Failed to create tar file\n";
-                        send(clientSock, err, strlen(err), 0);
-                        remove(tempFile);
-                        continue;
-                    }
-                }
-            }
-            
-            // Send the tar to S1
-            FILE *fp = fopen(tempFile, "rb");
-            if (!fp) {
-                const char *err = "ERROR: Failed to open tar file\n";
-                send(clientSock, err, strlen(err), 0);
-                remove(tempFile);
-                continue;
-            }
-            
-            fseek(fp, 0, SEEK_END);
-            long tarSize = ftell(fp);
-            fseek(fp, 0, SEEK_SET);
-            
-            // First send the size
-            char sizeStr[64];
-            snprintf(sizeStr, sizeof(sizeStr), "%ld\n", tarSize);
-            send(clientSock, sizeStr, strlen(sizeStr), 0);
-            
-            // Then the file itself
-            char buf[BUF_SIZE];
-            size_t bytes;
-            while ((bytes = fread(buf, 1, sizeof(buf), fp)) > 0) {
-                send(clientSock, buf, bytes, 0);
-            }
-            fclose(fp);
-            
-            // Remove the temporary tar file
-            remove(tempFile);
-            LOG("Sent txt.tar (%ld bytes) to S1", tarSize);
-        }
+             // Extract file type from the command (we're expecting "TAR.pdf")
+             // TARZ <level> <type> asks for the archive deflated
+             char fileType[10] = {0};
+             int level = 0;
+             char *typePtr = cmd + 3;
+             if (strcmp(cmd, "TARZ") == 0) {
+                 char *levelStr = strtok(NULL, " ");
+                 level = levelStr ? atoi(levelStr) : 0;
+                 typePtr = strtok(NULL, " ");
+                 if (level < 1 || level > 9 || !typePtr) {
+                     const char *err = "ERROR: Invalid TARZ command\n";
+                     send_error(clientSock, err);
+                     continue;
+                 }
+             }
+             while (*typePtr && (*typePtr == ' ' || *typePtr == '\t'))
+                 typePtr++;
+             if (*typePtr) {
+                 sscanf(typePtr, "%9s", fileType);
+                 LOG_DEBUG("Received TAR command for file type: '%s'", fileType);
+             }
+ 
+             // Ensure we're processing the correct file type for S3
+             if (strlen(fileType) == 0 || strcmp(fileType, ".txt") != 0) {
+                 const char *err = "ERROR: S3 only handles .txt files\n";
+                 send_error(clientSock, err);
+                 continue;
+             }
+ 
+             // An optional <since> asks for the files changed after that generation.
+             // One this run did not hand out gets the full archive.
+             char *sinceStr = strtok(NULL, " ");
+             unsigned long gen = index_generation();
+             unsigned long since = sinceStr ? strtoul(sinceStr, NULL, 10) : 0;
+             if (since < indexBaseGeneration || since > gen) {
+                 since = 0;
+             }
+ 
+             char baseDir[1024];
+             snprintf(baseDir, sizeof(baseDir), "%s", indexRoot);
+ 
+             // Stream the archive; a failed write means S1 is gone
+             char hdr[64];
+             if (sinceStr) {
+                 snprintf(hdr, sizeof(hdr), "chunked %lu\n", gen);
+             } else {
+                 snprintf(hdr, sizeof(hdr), "chunked\n");
+             }
+             if (send(clientSock, hdr, strlen(hdr), MSG_NOSIGNAL) != (ssize_t)strlen(hdr)) {
+                 return -1;
+             }
+             long cachedLen;
+             int cached = since == 0 ? tar_cache_get(level, gen, &cachedLen) : -1;
+             if (cached >= 0) {
+                 int rc = send_file_fd(clientSock, cached, 0, cachedLen, NULL);
+                 close(cached);
+                 if (rc != 0) {
+                     LOG_WARN("Error sending cached tar of %s files to S1", fileType);
+                     return -1;
+                 }
+                 LOG_DEBUG("Sent cached tar of %s files (%ld bytes) to S1", fileType, cachedLen);
+                 continue;
+             }
+             struct stream_copy copy = { since == 0 ? tar_cache_create() : -1, 1, 0, tarCacheLimit };
+             long files = tar_write_tree(clientSock, 1, baseDir, fileType, level, since,
+                                         copy.fd >= 0 ? &copy : NULL);
+             if (files < 0) {
+                 LOG_WARN("Error streaming tar of %s files to S1", fileType);
+                 if (copy.fd >= 0) close(copy.fd);
+                 return -1;
+             }
+             if (copy.fd >= 0 && copy.ok && index_generation() == gen) {
+                 tar_cache_put(copy.fd, level, gen, copy.len);
+             } else if (copy.fd >= 0) {
+                 close(copy.fd);
+             }
+             LOG_DEBUG("Streamed tar of %ld %s files to S1%s", files, fileType, since ? " (incremental)" : "");
+         }
  
          /*********************************************************************
           * 5) LIST <path>
           *********************************************************************/
-         else if (strcmp(cmd, "LIST") == 0) {
+         else if (strcmp(cmd, "LIST") == 0 || strcmp(cmd, "LISTP") == 0) {
+             // LISTP <limit> <cursor> <path>: one page, see "Directory listings"
+             size_t limit = 0;
+             char after[NAME_MAX + 1] = "";
+             if (strcmp(cmd, "LISTP") == 0) {
+                 char *limitStr = strtok(NULL, " ");
+                 char *cursor = strtok(NULL, " ");
+                 if (!limitStr || !cursor || atol(limitStr) <= 0 ||
+                     (strcmp(cursor, "-") != 0 && hex_decode(cursor, after, sizeof(after)) != 0)) {
+                     const char *err = "ERROR: Invalid LISTP command\n";
+                     send_error(clientSock, err);
+                     continue;
+                 }
+                 limit = (size_t)atol(limitStr);
+             }
              char *path = strtok(NULL, "");
              if (path && *path == ' ') {
                  path++;
@@ -487,72 +3907,615 @@
              if (!path || strlen(path) == 0 || strcmp(path, ".") == 0) {
                  path = ".";
              }
-             char *home = getenv("HOME");
-             if (!home) {
+             if (strncmp(path, "~S3", 3) == 0) {
+                 path += 3;
+             }
+             char dirKey[1024];
+             struct name_list names;
+             name_list_init(&names);
+             if (index_dir_key(path, dirKey, sizeof(dirKey)) != 0 ||
+                 index_list(dirKey, after, limit, &names) != 0) {
+                 LOG_WARN("Cannot list %s", path);
+                 name_list_free(&names);
                  const char *err = "0\n";
-                 send(clientSock, err, strlen(err), 0);
+                 send_error(clientSock, err);
                  continue;
              }
-             char dirPath[1024];
-             if (strcmp(path, ".") == 0) {
-                 snprintf(dirPath, sizeof(dirPath), "%s/S3", home);
-             } else {
-                 if (strncmp(path, "~S3", 3) == 0) {
-                     path += 3;
-                     if (*path == '/') {
-                         path++;
-                     }
-                 }
-                 snprintf(dirPath, sizeof(dirPath), "%s/S3/%s", home, path);
+             int rc = send_listing(clientSock, &names, limit);
+             name_list_free(&names);
+             if (rc != 0) {
+                 return -1;
+             }
+ 
+         /*********************************************************************
+          * 18) FIND <limit> <cursor> <filter> <path>
+          *********************************************************************/
+         } else if (strcmp(cmd, "FIND") == 0) {
+             // See "Filtered listings"
+             char *limitStr = strtok(NULL, " ");
+             char *cursor = strtok(NULL, " ");
+             char *spec = strtok(NULL, " ");
+             char after[1024] = "";
+             struct find_filter filter;
+             if (!spec || atol(limitStr) < 0 ||
+                 (strcmp(cursor, "-") != 0 && hex_decode(cursor, after, sizeof(after)) != 0) ||
+                 find_filter_parse(spec, &filter) != 0) {
+                 const char *err = "ERROR: Invalid FIND command\n";
+                 send_error(clientSock, err);
+                 continue;
+             }
+             char *path = strtok(NULL, "");
+             if (path && *path == ' ') {
+                 path++;
+             }
+             if (!path || strlen(path) == 0 || strcmp(path, ".") == 0) {
+                 path = ".";
+             }
+             if (strncmp(path, "~S3", 3) == 0) {
+                 path += 3;
              }
-             DIR *dp = opendir(dirPath);
-             if (!dp) {
+             char dirKey[1024];
+             struct name_list names;
+             name_list_init(&names);
+             if (index_dir_key(path, dirKey, sizeof(dirKey)) != 0 ||
+                 index_find(dirKey, &filter, after, (size_t)atol(limitStr), &names) != 0) {
+                 LOG_WARN("Cannot search %s", path);
+                 name_list_free(&names);
                  const char *err = "0\n";
-                 send(clientSock, err, strlen(err), 0);
+                 send_error(clientSock, err);
+                 continue;
+             }
+             int rc = send_listing(clientSock, &names, 0);
+             name_list_free(&names);
+             if (rc != 0) {
+                 return -1;
+             }
+ 
+         /*********************************************************************
+          * 11) KEYS
+          *********************************************************************/
+         } else if (strcmp(cmd, "KEYS") == 0) {
+             struct name_list keys;
+             name_list_init(&keys);
+             int rc;
+             if (index_keys(&keys) == 0) {
+                 rc = send_listing(clientSock, &keys, 0);
              } else {
-                 char listBuf[2048];
-                 listBuf[0] = '\0';
-                 struct dirent *entry;
-                 while ((entry = readdir(dp)) != NULL) {
-                     if (entry->d_name[0] == '.') {
-                         continue;  // skip hidden files
-                     }
-                     if (entry->d_type == DT_REG) {
-                         strncat(listBuf, entry->d_name,
-                                 sizeof(listBuf) - strlen(listBuf) - 1);
-                         strncat(listBuf, "\n",
-                                 sizeof(listBuf) - strlen(listBuf) - 1);
-                     }
+                 rc = write_all(clientSock, "ERROR: Out of memory\n", 21);
+             }
+             name_list_free(&keys);
+             if (rc != 0) {
+                 return -1;
+             }
+ 
+         /*********************************************************************
+          * 12) REPLICA
+          *********************************************************************/
+         } else if (strcmp(cmd, "REPLICA") == 0) {
+             // Start of a chain connection that reached a pool worker after
+             // all; nothing to answer
+ 
+         /*********************************************************************
+          * 8) PART <id> <path> <total> <offset> <length>
+          *********************************************************************/
+         } else if (strcmp(cmd, "PART") == 0) {
+             char *id = strtok(NULL, " ");
+             char *path = strtok(NULL, " ");
+             char *totalStr = strtok(NULL, " ");
+             char *offsetStr = strtok(NULL, " ");
+             char *lengthStr = strtok(NULL, " ");
+             if (!lengthStr) {
+                 // The body length is unknown, so the connection cannot be kept in sync
+                 const char *err = "ERROR: Invalid PART command\n";
+                 send_error(clientSock, err);
+                 return -1;
+             }
+             long total = atol(totalStr), offset = atol(offsetStr), length = atol(lengthStr);
+             struct upload_files u;
+             if (length < 0 || offset < 0 || total < 0 || offset > total - length ||
+                 upload_resolve(path, id, &u) != 0) {
+                 drain_bytes(conn, length);
+                 const char *err = "ERROR: Invalid PART command\n";
+                 send_error(clientSock, err);
+                 continue;
+             }
+             make_dirs(u.keyDir);
+             int fd = open(u.partPath, O_WRONLY | O_CREAT, 0644);
+             struct stat st;
+             if (fd >= 0 && fstat(fd, &st) == 0 && st.st_size < total &&
+                 posix_fallocate(fd, 0, total) != 0 && ftruncate(fd, total) != 0) {
+                 close(fd);
+                 fd = -1;
+             }
+             if (fd < 0) {
+                 LOG_WARN("Cannot open part file %s: %s", u.partPath, strerror(errno));
+                 drain_bytes(conn, length);
+                 const char *err = "ERROR\n";
+                 send_error(clientSock, err);
+                 continue;
+             }
+ 
+             // Receive the part straight into its place in the file
+             long remaining = length;
+             off_t pos = offset;
+             int writeFailed = 0;
+             char dataBuf[BUF_SIZE];
+             while (remaining > 0) {
+                 ssize_t r = reader_read(conn, dataBuf,
+                                         (size_t)remaining < sizeof(dataBuf) ? (size_t)remaining : sizeof(dataBuf));
+                 if (r <= 0) {
+                     break;
                  }
-                 closedir(dp);
-                 long len = (long)strlen(listBuf);
-                 char lenStr[64];
-                 snprintf(lenStr, sizeof(lenStr), "%ld\n", len);
-                 send(clientSock, lenStr, strlen(lenStr), 0);
-                 if (len > 0) {
-                     send(clientSock, listBuf, len, 0);
+                 if (!writeFailed && pwrite(fd, dataBuf, r, pos) != r) {
+                     writeFailed = 1;
+                 }
+                 pos += r;
+                 remaining -= r;
+             }
+             close(fd);
+             if (remaining != 0) {
+                 LOG_WARN("Connection lost while storing part of %s", u.fullPath);
+                 return -1;
+             }
+ 
+             char record[64];
+             int recordLen = snprintf(record, sizeof(record), "%ld %ld\n", offset, length);
+             int mapFd = writeFailed ? -1 : open(u.mapPath, O_WRONLY | O_CREAT | O_APPEND, 0644);
+             if (mapFd < 0 || write(mapFd, record, recordLen) != recordLen) {
+                 LOG_WARN("Failed to store part of %s at %ld", u.fullPath, offset);
+                 const char *err = "ERROR\n";
+                 send_error(clientSock, err);
+             } else {
+                 const char *succ = "SUCCESS\n";
+                 send(clientSock, succ, strlen(succ), 0);
+             }
+             if (mapFd >= 0) {
+                 close(mapFd);
+             }
+ 
+         /*********************************************************************
+          * 9) COMMIT <id> <path> <total>   10) ABORT <id> <path>
+          *********************************************************************/
+         } else if (strcmp(cmd, "COMMIT") == 0 || strcmp(cmd, "ABORT") == 0) {
+             int commit = strcmp(cmd, "COMMIT") == 0;
+             char *id = strtok(NULL, " ");
+             char *path = strtok(NULL, " ");
+             char *totalStr = strtok(NULL, " ");
+             struct upload_files u;
+             if (!path || (commit && !totalStr) || upload_resolve(path, id, &u) != 0) {
+                 const char *err = "ERROR: Invalid multipart command\n";
+                 send_error(clientSock, err);
+                 continue;
+             }
+             if (!commit) {
+                 unlink(u.partPath);
+                 unlink(u.mapPath);
+                 LOG_DEBUG("Aborted upload %s of %s", id, u.fullPath);
+                 const char *succ = "SUCCESS\n";
+                 send(clientSock, succ, strlen(succ), 0);
+                 continue;
+             }
+             long total = atol(totalStr);
+             struct stat st;
+             if (stat(u.partPath, &st) != 0 || st.st_size != total || !parts_cover(u.mapPath, total)) {
+                 LOG_WARN("Upload %s of %s is incomplete", id, u.fullPath);
+                 const char *err = "ERROR: Incomplete upload\n";
+                 send_error(clientSock, err);
+                 continue;
+             }
+             int dirFd = dir_open(u.keyDir);
+             int partFd = open(u.partPath, O_RDONLY | O_CLOEXEC);
+             int committed = dirFd >= 0 && partFd >= 0 &&
+                             durable_rename(dirFd, partFd, strrchr(u.partPath, '/') + 1, u.keyName) == 0;
+             if (partFd >= 0) {
+                 close(partFd);
+             }
+             if (dirFd >= 0) {
+                 close(dirFd);
+             }
+             if (!committed) {
+                 LOG_WARN("Failed to commit %s: %s", u.fullPath, strerror(errno));
+                 const char *err = "ERROR\n";
+                 send_error(clientSock, err);
+                 continue;
+             }
+             unlink(u.mapPath);
+             // Parts arrive out of order, so the contents are hashed here
+             uint64_t hash;
+             uint32_t crc = 0;
+             int hashed = casEnabled && cas_hash_file(u.fullPath, &hash, &crc) == 0;
+             if (hashed) {
+                 cas_adopt(u.fullPath, hash, total);
+                 stat(u.fullPath, &st);
+             }
+             index_put(u.keyDir, u.keyName, (long long)st.st_size, st.st_mtime, crc, hashed);
+             LOG_DEBUG("Committed multipart upload of %s (%ld bytes)", u.fullPath, total);
+             const char *succ = "SUCCESS\n";
+             send(clientSock, succ, strlen(succ), 0);
+ 
+         /*********************************************************************
+          * 13) LINK <path> <size> <hash>
+          *********************************************************************/
+         } else if (strcmp(cmd, "LINK") == 0) {
+             char *path = strtok(NULL, " ");
+             char *sizeStr = strtok(NULL, " ");
+             char *hashStr = strtok(NULL, " ");
+             const char *relPath = path;
+             if (relPath && strncmp(relPath, "~S3", 3) == 0) {
+                 relPath += 3;
+                 if (*relPath == '/') {
+                     relPath++;
                  }
              }
+             uint64_t hash;
+             char keyDir[1024], keyName[NAME_MAX + 1];
+             if (!hashStr || atoll(sizeStr) < 0 || cas_parse_hash(hashStr, &hash) != 0 ||
+                 index_split(relPath, keyDir, sizeof(keyDir), keyName, sizeof(keyName)) != 0 ||
+                 keyName[0] == '\0') {
+                 const char *err = "ERROR: Invalid LINK command\n";
+                 send_error(clientSock, err);
+                 continue;
+             }
+             if (!casEnabled) {
+                 const char *err = "ERROR: Deduplication is off\n";
+                 send_error(clientSock, err);
+                 continue;
+             }
+             char object[600], fullPath[1600];
+             cas_object_path(object, sizeof(object), hash, atoll(sizeStr));
+             int n = snprintf(fullPath, sizeof(fullPath), "%s/%s%s%s", indexRoot, keyDir,
+                              keyDir[0] ? "/" : "", keyName);
+             if (n < 0 || (size_t)n >= sizeof(fullPath)) {
+                 // A cut-short path would link the contents under another name
+                 const char *err = "ERROR: path too long\n";
+                 send_error(clientSock, err);
+                 continue;
+             }
+             struct stat st;
+             if (stat(object, &st) != 0 || !S_ISREG(st.st_mode)) {
+                 const char *err = "ERROR: Unknown content\n";
+                 send_error(clientSock, err);
+                 continue;
+             }
+             make_dirs(keyDir);
+             if (cas_place(object, fullPath) != 0 || stat(fullPath, &st) != 0) {
+                 LOG_WARN("Failed to link %s: %s", fullPath, strerror(errno));
+                 const char *err = "ERROR\n";
+                 send_error(clientSock, err);
+                 continue;
+             }
+             index_put(keyDir, keyName, (long long)st.st_size, st.st_mtime, 0, 0);
+             LOG_DEBUG("Linked %s to stored contents (%lld bytes)", fullPath, (long long)st.st_size);
+             const char *succ = "SUCCESS\n";
+             send(clientSock, succ, strlen(succ), 0);
+ 
+         /*********************************************************************
+          * 17) STATS
+          *********************************************************************/
+         } else if (strcmp(cmd, "STATS") == 0) {
+             size_t len = 0;
+             char *text = metrics_text(&len);
+             char sizeStr[32];
+             snprintf(sizeStr, sizeof(sizeStr), "%zu\n", len);
+             int rc = write_all(clientSock, sizeStr, strlen(sizeStr));
+             if (rc == 0 && len > 0) {
+                 rc = write_all(clientSock, text, len);
+             }
+             free(text);
+             if (rc != 0) {
+                 return -1;
+             }
  
          /*********************************************************************
           * Unknown command
           *********************************************************************/
          } else {
              const char *err = "ERROR: Unknown command\n";
-             send(clientSock, err, strlen(err), 0);
+             send_error(clientSock, err);
          }
+     } while (0);
+ 
+     return 0;
+ }
+ 
+ /*****************************************************************************
+  * Worker pool.
+  *
+  * A fixed set of worker threads serves every S1 connection. The main thread
+  * waits in epoll until a connection has a command to read and then queues it;
+  * a worker runs exactly one command with handle_command() (plus any further
+  * commands already sitting in the connection's read buffer, which epoll
+  * cannot see) and hands the connection back to epoll (EPOLLONESHOT), so
+  * long-lived pooled connections from S1 do not each pin a thread. The queue is bounded: when it is full the
+  * connection is answered with "ERROR: BUSY" and closed straight away instead
+  * of letting latency grow without bound.
+  *****************************************************************************/
+ struct server_options {
+     int workers;     // worker threads (--workers, 0 = one per core)
+     int backlog;     // listen() backlog (--backlog)
+     int queueLimit;  // max pending commands (--queue-limit)
+     int watch;       // follow outside changes with inotify (--watch)
+     int port;        // listening port (--port)
+     const char *dir; // storage directory (--dir, default ~/S3)
+     int dedup;       // store identical contents once (--dedup)
+     int sync;        // how stored files are flushed to disk (--sync)
+     int io;          // I/O engine for file bodies (--io)
+     int metricsPort; // Prometheus endpoint port (--metrics-port, 0 = off)
+     int logLevel;    // most verbose level logged (--log-level)
+     long tarCacheMb; // archive cache size (--tar-cache-mb, 0 = off)
+ };
+ static struct server_options options = { 0, DEFAULT_BACKLOG, DEFAULT_QUEUE_LIMIT, 0, S3_PORT, NULL, 0, SYNC_GROUP,
+                                           IO_BLOCKING, 0, LOG_LEVEL_INFO, DEFAULT_TAR_CACHE_MB };
+ 
+ static struct line_reader **workQueue;   // ring buffer of connections with a command waiting
+ static int workHead, workCount;
+ static pthread_mutex_t workLock = PTHREAD_MUTEX_INITIALIZER;
+ static pthread_cond_t workReady = PTHREAD_COND_INITIALIZER;
+ static int epollFd = -1;
+ 
+ // Queues a ready connection; returns -1 if the queue is full.
+ int work_push(struct line_reader *conn) {
+     pthread_mutex_lock(&workLock);
+     if (workCount >= options.queueLimit) {
+         pthread_mutex_unlock(&workLock);
+         return -1;
+     }
+     workQueue[(workHead + workCount) % options.queueLimit] = conn;
+     workCount++;
+     pthread_cond_signal(&workReady);
+     pthread_mutex_unlock(&workLock);
+     return 0;
+ }
+ 
+ struct line_reader *work_pop(void) {
+     pthread_mutex_lock(&workLock);
+     while (workCount == 0) {
+         pthread_cond_wait(&workReady, &workLock);
+     }
+     struct line_reader *conn = workQueue[workHead];
+     workHead = (workHead + 1) % options.queueLimit;
+     workCount--;
+     pthread_mutex_unlock(&workLock);
+     return conn;
+ }
+ 
+ // Fast rejection when the server is overloaded.
+ void reject_busy(struct line_reader *conn) {
+     const char *busy = "ERROR: BUSY\n";
+     send(conn->fd, busy, strlen(busy), MSG_DONTWAIT | MSG_NOSIGNAL);
+     close(conn->fd);
+     free(conn);
+ }
+ 
+ // Serves a connection from another server's replication chain until it closes.
+ static void *replica_main(void *arg) {
+     struct line_reader *conn = arg;
+     while (handle_command(conn) == 0) {
+     }
+     close(conn->fd);
+     free(conn);
+     return NULL;
+ }
+ 
+ /*****************************************************************************
+  * replica_claim: connections that another server opened with "REPLICA" (see
+  * "Replication chain") get a thread of their own instead of a pool worker.
+  * Two servers replicating to each other could otherwise fill both pools with
+  * STOREs that each wait for a worker on the other side. Called by the event
+  * loop on a readable connection; returns 1 if the connection was taken.
+  *****************************************************************************/
+ int replica_claim(struct line_reader *conn) {
+     char hello[8];
+     if (conn->start != conn->end ||
+         recv(conn->fd, hello, sizeof(hello), MSG_PEEK | MSG_DONTWAIT) != (ssize_t)sizeof(hello) ||
+         memcmp(hello, "REPLICA\n", sizeof(hello)) != 0) {
+         return 0;
+     }
+     recv(conn->fd, hello, sizeof(hello), 0);
+     epoll_ctl(epollFd, EPOLL_CTL_DEL, conn->fd, NULL);
+     pthread_t tid;
+     if (pthread_create(&tid, NULL, replica_main, conn) != 0) {
+         close(conn->fd);
+         free(conn);
+         return 1;
      }
+     pthread_detach(tid);
+     return 1;
+ }
  
-     close(clientSock);
+ void *worker_main(void *arg) {
+     (void)arg;
+     while (1) {
+         struct line_reader *conn = work_pop();
+         int rc;
+         do {
+             rc = handle_command(conn);
+         } while (rc == 0 && reader_has_line(conn));
+         if (rc < 0) {
+             close(conn->fd);  // also removes it from epoll
+             free(conn);
+             continue;
+         }
+         struct epoll_event ev;
+         ev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+         ev.data.ptr = conn;
+         if (epoll_ctl(epollFd, EPOLL_CTL_MOD, conn->fd, &ev) < 0) {
+             close(conn->fd);
+             free(conn);
+         }
+     }
      return NULL;
  }
  
  /*****************************************************************************
-  * main: Sets up a listening socket on port 9003. For each connection from S1,
-  * we spawn a new thread to handle commands. Typically, S1 uses S3 for .txt
-  * files (upload, download, remove, tar, list).
+  * usage / option_number: the command-line help, and the parser for the
+  * numeric options. A value that is not a whole number from `min` to `max`
+  * is reported with the option's name, followed by the help.
+  *****************************************************************************/
+ static void usage(const char *prog, int status) {
+     fprintf(stderr, "Usage: %s [--workers N] [--backlog N] [--queue-limit N] [--watch]\n"
+                     "          [--port N] [--dir DIR] [--dedup] [--sync none|each|group]\n"
+                     "          [--io blocking|uring] [--metrics-port N] [--tar-cache-mb N]\n"
+                     "          [--log-level error|warn|info|debug]\n", prog);
+     exit(status);
+ }
+ 
+ static long option_number(const char *prog, const char *name, const char *arg, long min, long max) {
+     char *end;
+     errno = 0;
+     long value = strtol(arg, &end, 10);
+     if (end == arg || *end != '\0' || errno != 0 || value < min || value > max) {
+         fprintf(stderr, "Error: invalid --%s '%s' (use %ld to %ld)\n", name, arg, min, max);
+         usage(prog, EXIT_FAILURE);
+     }
+     return value;
+ }
+ 
+ void parse_options(int argc, char *argv[]) {
+     static const struct option longOpts[] = {
+         { "workers",     required_argument, NULL, 'w' },
+         { "backlog",     required_argument, NULL, 'b' },
+         { "queue-limit", required_argument, NULL, 'q' },
+         { "watch",       no_argument,       NULL, 'W' },
+         { "port",        required_argument, NULL, 'p' },
+         { "dir",         required_argument, NULL, 'd' },
+         { "dedup",       no_argument,       NULL, 'D' },
+         { "sync",        required_argument, NULL, 's' },
+         { "io",          required_argument, NULL, 'i' },
+         { "metrics-port", required_argument, NULL, 'M' },
+         { "log-level",   required_argument, NULL, 'L' },
+         { "tar-cache-mb", required_argument, NULL, 'T' },
+         { "help",        no_argument,       NULL, 'h' },
+         { NULL, 0, NULL, 0 }
+     };
+     int opt;
+     while ((opt = getopt_long(argc, argv, "w:b:q:Wp:d:Ds:i:M:L:T:h", longOpts, NULL)) != -1) {
+         switch (opt) {
+         case 'w':
+             options.workers = (int)option_number(argv[0], "workers", optarg, 0, MAX_WORKERS);
+             break;
+         case 'b':
+             options.backlog = (int)option_number(argv[0], "backlog", optarg, 1, 65535);
+             break;
+         case 'q':
+             options.queueLimit = (int)option_number(argv[0], "queue-limit", optarg, 1, MAX_QUEUE_LIMIT);
+             break;
+         case 'W':
+             options.watch = 1;
+             break;
+         case 'p':
+             options.port = (int)option_number(argv[0], "port", optarg, 1, 65535);
+             break;
+         case 'd':
+             options.dir = optarg;
+             break;
+         case 'D':
+             options.dedup = 1;
+             break;
+         case 'M':
+             options.metricsPort = (int)option_number(argv[0], "metrics-port", optarg, 0, 65535);
+             break;
+         case 'T':
+             options.tarCacheMb = option_number(argv[0], "tar-cache-mb", optarg, 0, 1024L * 1024);
+             break;
+         case 's':
+             if (strcmp(optarg, "none") == 0) {
+                 options.sync = SYNC_NONE;
+             } else if (strcmp(optarg, "each") == 0) {
+                 options.sync = SYNC_EACH;
+             } else if (strcmp(optarg, "group") == 0) {
+                 options.sync = SYNC_GROUP;
+             } else {
+                 fprintf(stderr, "Error: unknown sync mode '%s' (use none, each or group)\n", optarg);
+                 usage(argv[0], EXIT_FAILURE);
+             }
+             break;
+         case 'i':
+             if (strcmp(optarg, "blocking") == 0) {
+                 options.io = IO_BLOCKING;
+             } else if (strcmp(optarg, "uring") == 0) {
+                 options.io = IO_URING;
+             } else {
+                 fprintf(stderr, "Error: unknown I/O engine '%s' (use blocking or uring)\n", optarg);
+                 usage(argv[0], EXIT_FAILURE);
+             }
+             break;
+         case 'L':
+             options.logLevel = log_level_parse(optarg);
+             if (options.logLevel < 0) {
+                 fprintf(stderr, "Error: unknown log level '%s' (use error, warn, info or debug)\n", optarg);
+                 usage(argv[0], EXIT_FAILURE);
+             }
+             break;
+         case 'h':
+             usage(argv[0], EXIT_SUCCESS);
+             break;
+         default:
+             usage(argv[0], EXIT_FAILURE);
+         }
+     }
+     if (options.workers == 0) {
+         long cores = sysconf(_SC_NPROCESSORS_ONLN);
+         options.workers = cores > 0 ? (int)cores : 1;
+     }
+ }
+ 
+ static volatile sig_atomic_t stopRequested;
+ 
+ static void on_stop_signal(int sig) {
+     (void)sig;
+     stopRequested = 1;
+ }
+ 
+ /*****************************************************************************
+  * main: Sets up a listening socket on port 9003 and serves S1 connections from
+  * the worker pool above. S1 is expected to connect on this port to store and
+  * retrieve .txt files.
   *****************************************************************************/
- int main() {
+ int main(int argc, char *argv[]) {
+     parse_options(argc, argv);
+     log_init(options.logLevel);
+ 
+     // S1 going away mid-transfer must not kill the whole server
+     signal(SIGPIPE, SIG_IGN);
+ 
+     // SIGTERM/SIGINT end the event loop so the index snapshot gets saved. They
+     // stay blocked everywhere except inside epoll_pwait() below.
+     struct sigaction sa;
+     memset(&sa, 0, sizeof(sa));
+     sa.sa_handler = on_stop_signal;
+     sigaction(SIGTERM, &sa, NULL);
+     sigaction(SIGINT, &sa, NULL);
+     sigset_t stopSignals, waitMask;
+     sigemptyset(&stopSignals);
+     sigaddset(&stopSignals, SIGTERM);
+     sigaddset(&stopSignals, SIGINT);
+     pthread_sigmask(SIG_BLOCK, &stopSignals, &waitMask);
+ 
+     // Load or build the metadata index before accepting S1 connections
+     char rootDir[512];
+     if (options.dir) {
+         snprintf(rootDir, sizeof(rootDir), "%s", options.dir);
+     } else {
+         char *home = getenv("HOME");
+         if (!home) {
+             fprintf(stderr, "HOME environment variable not set\n");
+             exit(EXIT_FAILURE);
+         }
+         snprintf(rootDir, sizeof(rootDir), "%s/S3", home);
+     }
+     index_init(rootDir, options.watch);
+     durable_init(options.sync);
+     io_init(options.io);
+     tar_cache_init(options.tarCacheMb);
+     if (options.metricsPort > 0 && metrics_http_start(options.metricsPort) != 0) {
+         LOG_ERROR("Cannot serve metrics on port %d: %s", options.metricsPort, strerror(errno));
+         exit(EXIT_FAILURE);
+     }
+     if (options.dedup) {
+         cas_init();
+     }
+ 
      // Create a socket
      int servSock = socket(AF_INET, SOCK_STREAM, 0);
      if (servSock < 0) {
@@ -569,7 +4532,7 @@
      memset(&servaddr, 0, sizeof(servaddr));
      servaddr.sin_family      = AF_INET;
      servaddr.sin_addr.s_addr = htonl(INADDR_ANY);
-     servaddr.sin_port        = htons(S3_PORT);
+     servaddr.sin_port        = htons(options.port);
  
      if (bind(servSock, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0) {
          perror("bind");
@@ -578,42 +4541,102 @@
      }
  
      // Listen
-     if (listen(servSock, BACKLOG) < 0) {
+     if (listen(servSock, options.backlog) < 0) {
          perror("listen");
          close(servSock);
          exit(EXIT_FAILURE);
      }
-     LOG("Server listening on port %d", S3_PORT);
+     LOG("Server listening on port %d", options.port);
+ 
+     // Start the worker pool
+     workQueue = malloc(sizeof(*workQueue) * options.queueLimit);
+     epollFd = epoll_create1(EPOLL_CLOEXEC);
+     if (!workQueue || epollFd < 0) {
+         perror("worker pool setup");
+         exit(EXIT_FAILURE);
+     }
+     for (int i = 0; i < options.workers; i++) {
+         pthread_t tid;
+         if (pthread_create(&tid, NULL, worker_main, NULL) != 0) {
+             perror("pthread_create");
+             exit(EXIT_FAILURE);
+         }
+         pthread_detach(tid);
+     }
+     LOG("%d workers, backlog %d, queue limit %d", options.workers, options.backlog,
+         options.queueLimit);
+ 
+     fcntl(servSock, F_SETFL, fcntl(servSock, F_GETFL, 0) | O_NONBLOCK);
+     struct epoll_event ev;
+     ev.events = EPOLLIN;
+     ev.data.ptr = NULL;  // NULL marks the listening socket
+     if (epoll_ctl(epollFd, EPOLL_CTL_ADD, servSock, &ev) < 0) {
+         perror("epoll_ctl");
+         exit(EXIT_FAILURE);
+     }
  
-     // Accept loop: spawn a thread for each connection
+     // Event loop: accept S1 connections and queue the ones with a command ready
+     struct epoll_event events[MAX_EVENTS];
+     struct timeval tv = { CONN_IO_TIMEOUT, 0 };
      while (1) {
-         struct sockaddr_in cliaddr;
-         socklen_t clilen = sizeof(cliaddr);
-         int *clientSock = malloc(sizeof(int)); // Freed by the thread
-         if (!clientSock) {
-             continue; // out of memory?
-         }
-         *clientSock = accept(servSock, (struct sockaddr*)&cliaddr, &clilen);
-         if (*clientSock < 0) {
-             free(clientSock);
+         int n = epoll_pwait(epollFd, events, MAX_EVENTS, -1, &waitMask);
+         if (n < 0) {
              if (errno == EINTR) {
+                 if (stopRequested) {
+                     break;
+                 }
                  continue;
              }
-             perror("accept");
+             perror("epoll_wait");
              break;
          }
- 
-         pthread_t tid;
-         if (pthread_create(&tid, NULL, handle_client, clientSock) != 0) {
-             perror("pthread_create");
-             close(*clientSock);
-             free(clientSock);
-         } else {
-             pthread_detach(tid); // automatically reclaim resources
+         for (int i = 0; i < n; i++) {
+             struct line_reader *ready = events[i].data.ptr;
+             if (ready != NULL) {
+                 if (replica_claim(ready)) {
+                     continue;
+                 }
+                 if (work_push(ready) != 0) {
+                     LOG_WARN("Work queue full (%d pending); rejecting connection", options.queueLimit);
+                     reject_busy(ready);
+                 }
+                 continue;
+             }
+             while (1) {
+                 struct sockaddr_in cliaddr;
+                 socklen_t clilen = sizeof(cliaddr);
+                 int clientSock = accept4(servSock, (struct sockaddr*)&cliaddr, &clilen,
+                                          SOCK_CLOEXEC);
+                 if (clientSock < 0) {
+                     if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+                         perror("accept");
+                     }
+                     break;
+                 }
+                 // Workers use blocking I/O; the timeouts stop a stalled S1
+                 // from holding a worker forever.
+                 setsockopt(clientSock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+                 setsockopt(clientSock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+                 struct line_reader *conn = malloc(sizeof(*conn));
+                 if (!conn) {
+                     close(clientSock);
+                     continue;
+                 }
+                 reader_init(conn, clientSock);
+                 struct epoll_event cev;
+                 cev.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+                 cev.data.ptr = conn;
+                 if (epoll_ctl(epollFd, EPOLL_CTL_ADD, clientSock, &cev) < 0) {
+                     close(clientSock);
+                     free(conn);
+                 }
+             }
          }
      }
  
      close(servSock);
+     LOG("Shutting down; saving the index");
+     index_save();
      return 0;
  }
  
\ No newline at end of file
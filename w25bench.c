@@ -0,0 +1,767 @@
+/*****************************************************************************
+ * w25bench.c
+ *
+ * Load generator for the S1-S4 pipeline. It runs N simulated clients, each
+ * a thread with its own connection to S1 speaking the same protocol as
+ * w25clients (through w25lib), and has them issue a weighted mix of uploadf, downlf,
+ * removef, dispfnames and downltar requests on files of configurable types
+ * and sizes. At the end it prints, per command and in total, the requests
+ * completed, the errors, the throughput and the p50/p99/p99.9/max latency.
+ *
+ * By default every client is closed-loop: it sends the next request as soon
+ * as the previous one has been answered. With -r the clients are open-loop:
+ * requests are scheduled at a fixed total arrival rate, and latency is
+ * measured from the time a request was due, not from when it could be sent,
+ * so a stalled server shows up in the percentiles instead of hiding behind
+ * the requests that were never issued (coordinated omission).
+ *
+ * Each client works in its own directory, <prefix>/c<N>, on a pool of files
+ * f<slot><type>. It uploads -f of them before the clock starts; downlf and
+ * removef pick one of its files that exists (or turn into an uploadf when
+ * there is none), and what is left is removed at the end unless -k is given.
+ * Upload bodies are pseudo-random bytes.
+ *
+ * Build example (on Linux/Unix):
+ *     gcc w25bench.c w25lib.c -o w25bench -lpthread -lz
+ * Usage:
+ *     ./w25bench [-c clients] [-d seconds] [-n requests] [-r rate]
+ *                [-m mix] [-s sizes] [-t types] [-f files] [-P prefix]
+ *                [-T] [-z] [-k] [S1_IP] [S1_port]
+ *
+ *   -c N       simulated clients (default 4)
+ *   -d S       run for S seconds (default 10)
+ *   -n N       stop after N requests instead
+ *   -r R       open loop at R requests/s in total (default: closed loop)
+ *   -m MIX     command weights, default
+ *              "uploadf:30,downlf:50,removef:5,dispfnames:10,downltar:5"
+ *   -s SIZES   upload sizes and weights, e.g. "4k:60,64k:30,1m:10" (k/m/g)
+ *   -t TYPES   file types, e.g. ".c,.txt,.pdf,.zip" (the default)
+ *   -f N       files each client uploads before the run (default 8)
+ *   -P PREFIX  where the clients' directories go (default ~S1/bench)
+ *   -T         text protocol instead of protocol 2
+ *   -z         ask S1 for compression and checksums, like w25clients; the
+ *              responses are then deflated and carry checksum trailers
+ *   -k         leave the files in place at the end
+ *
+ *****************************************************************************/
+
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <unistd.h>
+ #include <arpa/inet.h>
+ #include <errno.h>
+ #include <sys/socket.h>
+ #include <netinet/in.h>
+ #include <netinet/tcp.h>
+ #include <stdint.h>
+ #include <pthread.h>
+ #include <signal.h>
+ #include <time.h>
+ #include "w25lib.h"
+ 
+ // Default connection settings for S1 (can be overridden via argv)
+ #define DEFAULT_S1_PORT 50004
+ #define DEFAULT_S1_ADDR "127.0.0.1"
+ 
+ #define MAX_CLIENTS 1024
+ #define MAX_TYPES 16
+ #define MAX_SIZES 16
+ #define POOL_FILES 64           // Files a client cycles through
+ 
+ /*****************************************************************************
+  * exchange: sends one request, with `bodyLen` bytes of `body` as its
+  * payload (-1 for none), and reads S1's answer. The benchmark has one
+  * request in flight per connection, so the answer is always to the request
+  * just sent. Returns 0, or -1 if the connection failed or is out of sync.
+  *****************************************************************************/
+ static int exchange(struct s1_conn *c, int opcode, const char *command, const char *args,
+                     const char *body, long bodyLen, int expectData, struct response *resp) {
+     struct pending_request req = { opcode, 0, "" };
+     if (send_request(c, opcode, command, args, bodyLen, &req.reqId) != 0 ||
+         (bodyLen > 0 && send_all(c->in.fd, body, (size_t)bodyLen) != 0)) {
+         return -1;
+     }
+     return read_response(c, &req, expectData, resp);
+ }
+ 
+ // S1 answered with an error
+ static int failed(const struct response *resp) {
+     return strncmp(resp->msg, "ERROR", 5) == 0;
+ }
+ 
+ /*****************************************************************************
+  * drain_response: reads and drops the data of a response: `payloadLen`
+  * bytes, or a chunked stream up to its "0\n", and the checksum trailer if
+  * there is one. Returns the number of data bytes, or -1 if the connection
+  * failed or the stream was malformed.
+  *****************************************************************************/
+ long drain_response(struct s1_conn *c, const struct response *resp) {
+     long total = 0;
+     if (!resp->chunked) {
+         total = resp->payloadLen;
+         if (recv_discard(&c->in, total) != 0) {
+             return -1;
+         }
+     } else {
+         while (1) {
+             char line[32];
+             if (recv_line(&c->in, line, sizeof(line)) <= 0) {
+                 return -1;
+             }
+             char *end;
+             long length = strtol(line, &end, 16);
+             if (end == line || *end != '\n' || length < 0) {
+                 return -1;
+             }
+             if (length == 0) {
+                 break;
+             }
+             if (recv_discard(&c->in, length) != 0) {
+                 return -1;
+             }
+             total += length;
+         }
+     }
+     if (resp->crc && recv_discard(&c->in, 4) != 0) {
+         return -1;
+     }
+     return total;
+ }
+ 
+ /*****************************************************************************
+  * Latency histograms. Log-linear like S1's metrics, but finer: 32 buckets
+  * per power of two of microseconds, so a percentile is within about 3%.
+  * Every client has its own and they are added up at the end, so recording
+  * needs no lock.
+  *****************************************************************************/
+ #define LAT_SUB_BITS 5
+ #define LAT_MAX_BITS 36                                     // 2^36 us, about 19 hours
+ #define LAT_BUCKETS ((LAT_MAX_BITS - LAT_SUB_BITS + 1) << LAT_SUB_BITS)
+ 
+ struct histogram {
+     unsigned long count;
+     unsigned long maxUs;
+     unsigned long buckets[LAT_BUCKETS];
+ };
+ 
+ static int lat_bucket(unsigned long us) {
+     if (us < (1UL << LAT_SUB_BITS)) {
+         return (int)us;
+     }
+     int msb = 63 - __builtin_clzl(us);
+     if (msb >= LAT_MAX_BITS) {
+         return LAT_BUCKETS - 1;
+     }
+     return ((msb - LAT_SUB_BITS + 1) << LAT_SUB_BITS) +
+            (int)((us >> (msb - LAT_SUB_BITS)) & ((1UL << LAT_SUB_BITS) - 1));
+ }
+ 
+ // Smallest latency above bucket `i`, in microseconds.
+ static unsigned long lat_bucket_end(int i) {
+     if (i < (1 << LAT_SUB_BITS)) {
+         return (unsigned long)i + 1;
+     }
+     int shift = (i >> LAT_SUB_BITS) - 1;
+     unsigned long sub = (unsigned long)(i & ((1 << LAT_SUB_BITS) - 1));
+     return (((1UL << LAT_SUB_BITS) + sub + 1) << shift);
+ }
+ 
+ void histogram_add(struct histogram *h, unsigned long us) {
+     h->count++;
+     h->buckets[lat_bucket(us)]++;
+     if (us > h->maxUs) {
+         h->maxUs = us;
+     }
+ }
+ 
+ void histogram_merge(struct histogram *to, const struct histogram *from) {
+     to->count += from->count;
+     for (int i = 0; i < LAT_BUCKETS; i++) {
+         to->buckets[i] += from->buckets[i];
+     }
+     if (from->maxUs > to->maxUs) {
+         to->maxUs = from->maxUs;
+     }
+ }
+ 
+ // Latency at quantile `q` (0.5 for the median), in microseconds.
+ unsigned long histogram_quantile(const struct histogram *h, double q) {
+     if (h->count == 0) {
+         return 0;
+     }
+     unsigned long rank = (unsigned long)(q * (double)h->count), seen = 0;
+     for (int i = 0; i < LAT_BUCKETS; i++) {
+         seen += h->buckets[i];
+         if (seen > rank) {
+             unsigned long end = lat_bucket_end(i);
+             return end < h->maxUs ? end : h->maxUs;
+         }
+     }
+     return h->maxUs;
+ }
+ 
+ /*****************************************************************************
+  * Workload. The command mix and the upload sizes are weighted lists parsed
+  * from -m and -s ("name:weight,..."); each request draws from them with the
+  * client's own random number generator.
+  *****************************************************************************/
+ enum { OP_UPLOADF, OP_DOWNLF, OP_REMOVEF, OP_DISPFNAMES, OP_DOWNLTAR, NUM_OPS };
+ 
+ static const char *const opNames[NUM_OPS] = { "uploadf", "downlf", "removef", "dispfnames", "downltar" };
+ 
+ struct bench_config {
+     int clients;
+     int seconds;
+     long requests;         // 0 = run for `seconds`
+     double rate;           // requests/s in total, 0 = closed loop
+     int opWeights[NUM_OPS];
+     long sizes[MAX_SIZES];
+     int sizeWeights[MAX_SIZES];
+     int numSizes;
+     char types[MAX_TYPES][16];
+     int numTypes;
+     int preload;           // files uploaded by each client before the run
+     const char *prefix;
+     int text;              // -T
+     int extras;            // -z
+     int keep;              // -k
+     struct sockaddr_in addr;
+ };
+ 
+ static struct bench_config config = {
+     4, 10, 0, 0, { 30, 50, 5, 10, 5 }, { 4096, 65536, 1048576 }, { 60, 30, 10 }, 3,
+     { ".c", ".txt", ".pdf", ".zip" }, 4, 8, "~S1/bench", 0, 0, 0, { 0 }
+ };
+ 
+ static char *payload;          // Upload bodies: the first <size> bytes of this
+ static long maxSize;
+ static long requestsIssued;    // With -n, requests handed out so far
+ static struct timespec runStart, runEnd;
+ 
+ // Parses a size such as "64k" or "1m"; -1 if it is not one.
+ long parse_size(const char *s) {
+     char *end;
+     double v = strtod(s, &end);
+     long mult = 1;
+     if (*end == 'k' || *end == 'K') {
+         mult = 1024;
+     } else if (*end == 'm' || *end == 'M') {
+         mult = 1024 * 1024;
+     } else if (*end == 'g' || *end == 'G') {
+         mult = 1024L * 1024 * 1024;
+     }
+     if (end == s || (mult > 1 ? end[1] : end[0]) != '\0' || v < 0) {
+         return -1;
+     }
+     return (long)(v * (double)mult);
+ }
+ 
+ // -m: "uploadf:30,downlf:50,..."; commands left out get weight 0.
+ int parse_mix(char *list) {
+     memset(config.opWeights, 0, sizeof(config.opWeights));
+     int total = 0;
+     for (char *save, *item = strtok_r(list, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+         char *colon = strchr(item, ':');
+         int weight = colon ? atoi(colon + 1) : 1;
+         if (colon) {
+             *colon = '\0';
+         }
+         int op = 0;
+         while (op < NUM_OPS && strcmp(item, opNames[op]) != 0) {
+             op++;
+         }
+         if (op == NUM_OPS || weight < 0) {
+             fprintf(stderr, "Bad mix entry '%s' (commands: uploadf, downlf, removef, dispfnames, downltar)\n",
+                     item);
+             return -1;
+         }
+         config.opWeights[op] = weight;
+         total += weight;
+     }
+     return total > 0 ? 0 : -1;
+ }
+ 
+ // -s: "4k:60,64k:30,1m:10".
+ int parse_sizes(char *list) {
+     config.numSizes = 0;
+     for (char *save, *item = strtok_r(list, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+         char *colon = strchr(item, ':');
+         int weight = colon ? atoi(colon + 1) : 1;
+         if (colon) {
+             *colon = '\0';
+         }
+         long size = parse_size(item);
+         if (size < 0 || weight < 0 || config.numSizes == MAX_SIZES) {
+             fprintf(stderr, "Bad size entry '%s'\n", item);
+             return -1;
+         }
+         config.sizes[config.numSizes] = size;
+         config.sizeWeights[config.numSizes++] = weight;
+     }
+     return config.numSizes > 0 ? 0 : -1;
+ }
+ 
+ // -t: ".c,.txt,.pdf,.zip".
+ int parse_types(char *list) {
+     config.numTypes = 0;
+     for (char *save, *item = strtok_r(list, ",", &save); item; item = strtok_r(NULL, ",", &save)) {
+         if (item[0] != '.' || strlen(item) >= sizeof(config.types[0]) || config.numTypes == MAX_TYPES) {
+             fprintf(stderr, "Bad file type '%s'\n", item);
+             return -1;
+         }
+         strcpy(config.types[config.numTypes++], item);
+     }
+     return config.numTypes > 0 ? 0 : -1;
+ }
+ 
+ // xorshift64*: a per-client generator, so clients never share state.
+ static uint64_t next_random(uint64_t *state) {
+     uint64_t x = *state;
+     x ^= x >> 12;
+     x ^= x << 25;
+     x ^= x >> 27;
+     *state = x;
+     return x * 0x2545F4914F6CDD1DULL;
+ }
+ 
+ // Index drawn from `weights` (n entries, not all 0).
+ static int pick_weighted(uint64_t *rng, const int *weights, int n) {
+     int total = 0;
+     for (int i = 0; i < n; i++) {
+         total += weights[i];
+     }
+     int r = (int)(next_random(rng) % (uint64_t)total);
+     for (int i = 0; i < n; i++) {
+         if (r < weights[i]) {
+             return i;
+         }
+         r -= weights[i];
+     }
+     return n - 1;
+ }
+ 
+ static long elapsed_us(const struct timespec *from, const struct timespec *to) {
+     return (to->tv_sec - from->tv_sec) * 1000000L + (to->tv_nsec - from->tv_nsec) / 1000;
+ }
+ 
+ /*****************************************************************************
+  * Simulated clients
+  *****************************************************************************/
+ struct op_stats {
+     unsigned long errors;
+     unsigned long bytes;       // Uploaded or downloaded payload bytes
+     struct histogram latency;
+ };
+ 
+ struct bench_client {
+     int id;
+     pthread_t thread;
+     struct s1_conn conn;
+     int connected;
+     uint64_t rng;
+     long fileSize[POOL_FILES]; // Size of each pool file on S1, -1 if it has none
+     int fileCount;
+     unsigned long reconnects;
+     unsigned long late;        // Open loop: requests sent after they were due
+     struct op_stats ops[NUM_OPS];
+ };
+ 
+ static struct bench_client *clients;
+ 
+ int client_connect(struct bench_client *c) {
+     int sock = socket(AF_INET, SOCK_STREAM, 0);
+     if (sock < 0) {
+         return -1;
+     }
+     int one = 1;
+     setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+     if (connect(sock, (struct sockaddr *)&config.addr, sizeof(config.addr)) < 0) {
+         close(sock);
+         return -1;
+     }
+     reader_init(&c->conn.in, sock);
+     c->conn.proto = 1;
+     c->conn.nextReqId = 1;
+     c->conn.compress[0] = '\0';
+     c->conn.crc = 0;
+     if (!config.text) {
+         negotiate_protocol_extras(&c->conn, config.extras);
+     }
+     c->connected = 1;
+     return 0;
+ }
+ 
+ void client_disconnect(struct bench_client *c) {
+     if (c->connected) {
+         close(c->conn.in.fd);
+         c->connected = 0;
+     }
+ }
+ 
+ // Name and directory of pool file `slot` of client `c`.
+ static void file_name(const struct bench_client *c, int slot, char *name, size_t nameSize,
+                       char *dir, size_t dirSize) {
+     snprintf(name, nameSize, "f%d%s", slot, config.types[slot % config.numTypes]);
+     snprintf(dir, dirSize, "%s/c%d", config.prefix, c->id);
+ }
+ 
+ // A pool file that exists on S1 (or -1 if there is none).
+ static int pick_file(struct bench_client *c) {
+     if (c->fileCount == 0) {
+         return -1;
+     }
+     int slot = (int)(next_random(&c->rng) % POOL_FILES);
+     while (c->fileSize[slot] < 0) {
+         slot = (slot + 1) % POOL_FILES;
+     }
+     return slot;
+ }
+ 
+ /*****************************************************************************
+  * run_request: issues one request of kind `op` on client `c` and reads the
+  * whole answer. *opDone is set to the command actually run (downlf/removef
+  * without any file become uploadf). Returns 0 if S1 answered successfully,
+  * 1 if it answered with an error, -1 if the connection failed.
+  *****************************************************************************/
+ int run_request(struct bench_client *c, int op, int *opDone, long *bytes) {
+     char name[64], dir[512], args[1024], path[600];
+     struct response resp;
+     int slot = op == OP_UPLOADF ? -1 : pick_file(c);
+     if ((op == OP_DOWNLF || op == OP_REMOVEF) && slot < 0) {
+         op = OP_UPLOADF;
+     }
+     *opDone = op;
+     *bytes = 0;
+     if (slot >= 0) {
+         file_name(c, slot, name, sizeof(name), dir, sizeof(dir));
+         snprintf(path, sizeof(path), "%s/%s", dir, name);
+     }
+     switch (op) {
+     case OP_UPLOADF: {
+         slot = (int)(next_random(&c->rng) % POOL_FILES);
+         long size = config.sizes[pick_weighted(&c->rng, config.sizeWeights, config.numSizes)];
+         file_name(c, slot, name, sizeof(name), dir, sizeof(dir));
+         snprintf(args, sizeof(args), "%s %s", name, dir);
+         if (exchange(&c->conn, V2_OP_UPLOADF, "uploadf", args, payload, size, 0, &resp) != 0) {
+             return -1;
+         }
+         *bytes = size;
+         if (!failed(&resp)) {
+             c->fileCount += c->fileSize[slot] < 0;
+             c->fileSize[slot] = size;
+         }
+         return failed(&resp);
+     }
+     case OP_DOWNLF:
+     case OP_DISPFNAMES:
+     case OP_DOWNLTAR: {
+         int opcode;
+         const char *command;
+         if (op == OP_DOWNLF) {
+             opcode = V2_OP_DOWNLF;
+             command = "downlf";
+             snprintf(args, sizeof(args), "%s", path);
+         } else if (op == OP_DISPFNAMES) {
+             opcode = V2_OP_DISPFNAMES;
+             command = "dispfnames";
+             snprintf(args, sizeof(args), "-n %d %s/c%d", LIST_PAGE_SIZE, config.prefix, c->id);
+         } else {
+             opcode = V2_OP_DOWNLTAR;
+             command = "downltar";
+             snprintf(args, sizeof(args), "%s chunked",
+                      config.types[next_random(&c->rng) % (uint64_t)config.numTypes]);
+         }
+         if (exchange(&c->conn, opcode, command, args, NULL, -1, 1, &resp) != 0) {
+             return -1;
+         }
+         if (resp.payloadLen >= 0 && (*bytes = drain_response(&c->conn, &resp)) < 0) {
+             return -1;
+         }
+         return failed(&resp);
+     }
+     case OP_REMOVEF:
+         if (exchange(&c->conn, V2_OP_REMOVEF, "removef", path, NULL, -1, 0, &resp) != 0) {
+             return -1;
+         }
+         if (!failed(&resp)) {
+             c->fileSize[slot] = -1;
+             c->fileCount--;
+         }
+         return failed(&resp);
+     }
+     return -1;
+ }
+ 
+ // Claims the next of the -n requests; 0 once all have been handed out.
+ static int claim_request(void) {
+     return __atomic_fetch_add(&requestsIssued, 1, __ATOMIC_RELAXED) < config.requests;
+ }
+ 
+ /*****************************************************************************
+  * client_main: the loop of one simulated client. Closed loop, a request
+  * starts when the previous one ends. Open loop, request k of the client is
+  * due at runStart + k * interval (interval = clients / rate), staggered
+  * between clients; the client sleeps until then, or sends at once if it is
+  * behind, and the latency recorded is from the due time.
+  *****************************************************************************/
+ void *client_main(void *arg) {
+     struct bench_client *c = arg;
+     double interval = config.rate > 0 ? (double)config.clients / config.rate : 0;
+     long stagger = interval > 0 ? (long)(interval * 1e9 * c->id / config.clients) : 0;
+     for (long k = 0;; k++) {
+         struct timespec due, now;
+         clock_gettime(CLOCK_MONOTONIC, &now);
+         if (config.requests > 0 ? !claim_request() : elapsed_us(&runStart, &now) >= config.seconds * 1000000L) {
+             break;
+         }
+         if (interval > 0) {
+             long ns = (long)(interval * 1e9 * (double)k) + stagger;
+             due.tv_sec = runStart.tv_sec + ns / 1000000000L;
+             due.tv_nsec = runStart.tv_nsec + ns % 1000000000L;
+             if (due.tv_nsec >= 1000000000L) {
+                 due.tv_sec++;
+                 due.tv_nsec -= 1000000000L;
+             }
+             if (elapsed_us(&now, &due) > 0) {
+                 while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL) == EINTR) {
+                 }
+             } else if (elapsed_us(&due, &now) > 1000) {
+                 c->late++;
+             }
+             if (config.requests == 0 && elapsed_us(&runStart, &due) >= config.seconds * 1000000L) {
+                 break;
+             }
+         } else {
+             due = now;
+         }
+         if (!c->connected && client_connect(c) != 0) {
+             c->reconnects++;
+             c->ops[OP_UPLOADF].errors++;
+             usleep(100000);
+             continue;
+         }
+         int opDone;
+         long bytes;
+         int rc = run_request(c, pick_weighted(&c->rng, config.opWeights, NUM_OPS), &opDone, &bytes);
+         clock_gettime(CLOCK_MONOTONIC, &now);
+         struct op_stats *s = &c->ops[opDone];
+         histogram_add(&s->latency, (unsigned long)elapsed_us(&due, &now));
+         s->bytes += (unsigned long)bytes;
+         if (rc != 0) {
+             s->errors++;
+         }
+         if (rc < 0) {
+             client_disconnect(c);
+             c->reconnects++;
+         }
+     }
+     return NULL;
+ }
+ 
+ // Uploads the client's first -f files before the clock starts.
+ void *client_preload(void *arg) {
+     struct bench_client *c = arg;
+     if (client_connect(c) != 0) {
+         return NULL;
+     }
+     for (int i = 0; i < config.preload && i < POOL_FILES; i++) {
+         char name[64], dir[512], args[1024];
+         struct response resp;
+         long size = config.sizes[pick_weighted(&c->rng, config.sizeWeights, config.numSizes)];
+         file_name(c, i, name, sizeof(name), dir, sizeof(dir));
+         snprintf(args, sizeof(args), "%s %s", name, dir);
+         if (exchange(&c->conn, V2_OP_UPLOADF, "uploadf", args, payload, size, 0, &resp) != 0) {
+             client_disconnect(c);
+             return NULL;
+         }
+         if (!failed(&resp)) {
+             c->fileSize[i] = size;
+             c->fileCount++;
+         }
+     }
+     return NULL;
+ }
+ 
+ // Removes what is left of the client's files after the run.
+ void *client_cleanup(void *arg) {
+     struct bench_client *c = arg;
+     if (!c->connected && client_connect(c) != 0) {
+         return NULL;
+     }
+     for (int slot = 0; slot < POOL_FILES; slot++) {
+         if (c->fileSize[slot] < 0) {
+             continue;
+         }
+         char name[64], dir[512], path[600];
+         struct response resp;
+         file_name(c, slot, name, sizeof(name), dir, sizeof(dir));
+         snprintf(path, sizeof(path), "%s/%s", dir, name);
+         if (exchange(&c->conn, V2_OP_REMOVEF, "removef", path, NULL, -1, 0, &resp) != 0) {
+             break;
+         }
+         c->fileSize[slot] = -1;
+     }
+     client_disconnect(c);
+     return NULL;
+ }
+ 
+ // Runs `fn` on every client in parallel and waits for all of them.
+ void run_clients(void *(*fn)(void *)) {
+     for (int i = 0; i < config.clients; i++) {
+         if (pthread_create(&clients[i].thread, NULL, fn, &clients[i]) != 0) {
+             perror("pthread_create");
+             exit(EXIT_FAILURE);
+         }
+     }
+     for (int i = 0; i < config.clients; i++) {
+         pthread_join(clients[i].thread, NULL);
+     }
+ }
+ 
+ /*****************************************************************************
+  * Report: one line per command that ran and a total, with latencies in ms.
+  *****************************************************************************/
+ static void report_line(const char *name, const struct op_stats *s, double secs) {
+     const struct histogram *h = &s->latency;
+     printf("%-11s %9lu %7lu %10.1f %9.2f %9.3f %9.3f %9.3f %9.3f\n", name, h->count, s->errors,
+            (double)h->count / secs, (double)s->bytes / secs / (1024 * 1024),
+            histogram_quantile(h, 0.5) / 1000.0, histogram_quantile(h, 0.99) / 1000.0,
+            histogram_quantile(h, 0.999) / 1000.0, h->maxUs / 1000.0);
+ }
+ 
+ void report(void) {
+     static struct op_stats ops[NUM_OPS], total;
+     unsigned long reconnects = 0, late = 0;
+     for (int i = 0; i < config.clients; i++) {
+         for (int op = 0; op < NUM_OPS; op++) {
+             ops[op].errors += clients[i].ops[op].errors;
+             ops[op].bytes += clients[i].ops[op].bytes;
+             histogram_merge(&ops[op].latency, &clients[i].ops[op].latency);
+         }
+         reconnects += clients[i].reconnects;
+         late += clients[i].late;
+     }
+     double secs = elapsed_us(&runStart, &runEnd) / 1e6;
+     if (secs <= 0) {
+         secs = 1e-6;
+     }
+     printf("%-11s %9s %7s %10s %9s %9s %9s %9s %9s\n", "command", "requests", "errors", "req/s",
+            "MB/s", "p50 ms", "p99 ms", "p99.9 ms", "max ms");
+     for (int op = 0; op < NUM_OPS; op++) {
+         if (ops[op].latency.count > 0) {
+             report_line(opNames[op], &ops[op], secs);
+         }
+         total.errors += ops[op].errors;
+         total.bytes += ops[op].bytes;
+         histogram_merge(&total.latency, &ops[op].latency);
+     }
+     report_line("total", &total, secs);
+     printf("%.2f s, %lu reconnects", secs, reconnects);
+     if (config.rate > 0) {
+         printf(", %lu requests sent more than 1 ms late", late);
+     }
+     printf("\n");
+ }
+ 
+ int main(int argc, char *argv[]) {
+     const char *usage = "Usage: %s [-c clients] [-d seconds] [-n requests] [-r rate] [-m mix]\n"
+                         "          [-s sizes] [-t types] [-f files] [-P prefix] [-T] [-z] [-k]\n"
+                         "          [S1_IP] [S1_port]\n";
+     int opt;
+     while ((opt = getopt(argc, argv, "c:d:n:r:m:s:t:f:P:Tzkh")) != -1) {
+         switch (opt) {
+         case 'c': config.clients = atoi(optarg); break;
+         case 'd': config.seconds = atoi(optarg); break;
+         case 'n': config.requests = atol(optarg); break;
+         case 'r': config.rate = atof(optarg); break;
+         case 'f': config.preload = atoi(optarg); break;
+         case 'P': config.prefix = optarg; break;
+         case 'T': config.text = 1; break;
+         case 'z': config.extras = 1; break;
+         case 'k': config.keep = 1; break;
+         case 'm':
+             if (parse_mix(optarg) != 0) {
+                 return EXIT_FAILURE;
+             }
+             break;
+         case 's':
+             if (parse_sizes(optarg) != 0) {
+                 return EXIT_FAILURE;
+             }
+             break;
+         case 't':
+             if (parse_types(optarg) != 0) {
+                 return EXIT_FAILURE;
+             }
+             break;
+         default:
+             fprintf(stderr, usage, argv[0]);
+             return opt == 'h' ? EXIT_SUCCESS : EXIT_FAILURE;
+         }
+     }
+     if (config.clients <= 0 || config.clients > MAX_CLIENTS || config.seconds <= 0 ||
+         config.requests < 0 || config.rate < 0 || config.preload < 0) {
+         fprintf(stderr, usage, argv[0]);
+         return EXIT_FAILURE;
+     }
+     const char *serverIP = optind < argc ? argv[optind] : DEFAULT_S1_ADDR;
+     int serverPort = optind + 1 < argc ? atoi(argv[optind + 1]) : DEFAULT_S1_PORT;
+     config.addr.sin_family = AF_INET;
+     config.addr.sin_port = htons(serverPort);
+     if (inet_pton(AF_INET, serverIP, &config.addr.sin_addr) <= 0) {
+         fprintf(stderr, "Invalid server address %s\n", serverIP);
+         return EXIT_FAILURE;
+     }
+     signal(SIGPIPE, SIG_IGN);
+ 
+     // One buffer of pseudo-random bytes serves every upload
+     maxSize = 0;
+     for (int i = 0; i < config.numSizes; i++) {
+         if (config.sizes[i] > maxSize) {
+             maxSize = config.sizes[i];
+         }
+     }
+     payload = malloc(maxSize > 0 ? (size_t)maxSize : 1);
+     clients = calloc((size_t)config.clients, sizeof(*clients));
+     if (!payload || !clients) {
+         fprintf(stderr, "Out of memory\n");
+         return EXIT_FAILURE;
+     }
+     uint64_t seed = (uint64_t)time(NULL) | 1;
+     for (long i = 0; i < maxSize; i += 8) {
+         uint64_t v = next_random(&seed);
+         memcpy(payload + i, &v, maxSize - i < 8 ? (size_t)(maxSize - i) : 8);
+     }
+     for (int i = 0; i < config.clients; i++) {
+         clients[i].id = i;
+         clients[i].rng = seed ^ (0x9E3779B97F4A7C15ULL * (uint64_t)(i + 1));
+         for (int slot = 0; slot < POOL_FILES; slot++) {
+             clients[i].fileSize[slot] = -1;
+         }
+     }
+ 
+     run_clients(client_preload);
+     if (!clients[0].connected) {
+         fprintf(stderr, "Cannot connect to S1 at %s:%d\n", serverIP, serverPort);
+         return EXIT_FAILURE;
+     }
+     printf("%d clients, %s, %s loop", config.clients, clients[0].conn.proto == 2 ? "protocol 2" : "text protocol",
+            config.rate > 0 ? "open" : "closed");
+     if (config.rate > 0) {
+         printf(" at %.0f requests/s", config.rate);
+     }
+     if (config.requests > 0) {
+         printf(", %ld requests\n", config.requests);
+     } else {
+         printf(", %d s\n", config.seconds);
+     }
+     clock_gettime(CLOCK_MONOTONIC, &runStart);
+     run_clients(client_main);
+     clock_gettime(CLOCK_MONOTONIC, &runEnd);
+     report();
+     if (!config.keep) {
+         run_clients(client_cleanup);
+     }
+     return EXIT_SUCCESS;
+ }
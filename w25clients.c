@@ -3,11 +3,34 @@
  *
  * Client program that connects to the S1 server. The user can type:
  *
- *   1. uploadf <filename> <destination_path>
- *   2. downlf <file_path_in_S1>
+ *   1. uploadf [-k] [-j N] <filename> <destination_path>
+ *        (-j: send a large file as parts over N connections in parallel;
+ *        it appears at the destination once every part has arrived;
+ *        -k: send the file's hash first and skip the upload if a storage
+ *        server already holds the same contents)
+ *   2. downlf [-o offset] [-l length] [-r] [-j N] <file_path_in_S1>
+ *        (-o/-l: part of the file, written in place; -r: resume a partial
+ *        download; -j: fetch N ranges over N connections in parallel)
  *   3. removef <file_path_in_S1>
- *   4. downltar <filetype>
- *   5. dispfnames <directory_path_in_S1>
+ *   4. downltar [-s <token>] <filetype>
+ *        (-s: only the files changed since the archive that printed
+ *        <token>; every archive fetched with -s prints the next one, and
+ *        "-s 0" fetches everything)
+ *   5. dispfnames [-r] [-g <glob>] [-e <.ext,...>] [-s <min>:<max>]
+ *                 [-m <from>:<to>] <directory_path_in_S1>
+ *        (a search, done by the servers that hold the files: -r the whole
+ *        subtree, -g names matching a shell pattern, -e these types, -s a
+ *        size range such as 1k:10m, -m a modification time range in epoch
+ *        seconds or ages such as 7d:; each match is printed as
+ *        "<path>\t<size>\t<mtime>")
+ *   6. cachestats   (hit/miss counters of S1's hot-file cache)
+ *      stats        (S1's per-command counters and latencies, Prometheus text)
+ *   7. uploadm <destination_path> <file|glob>...  /  uploadm -f <manifest>
+ *      downlm <file_path_in_S1>...  /  downlm -f <manifest>
+ *      removem <file_path_in_S1>...  /  removem -f <manifest>
+ *        (many files in one request; an uploadm manifest has one
+ *        "<filename> <destination_path>" per line, the others one path per
+ *        line; the result of every file is reported)
  *
  * where <file_path_in_S1> or <directory_path_in_S1> typically starts with ~S1.
  *
@@ -15,12 +38,25 @@
  * For file transfers (upload/download/tar), it also handles sending/receiving
  * file contents.
  *
- * Build example (on Linux/Unix):
- *     gcc w25clients.c -o w25clients
+ * Build example (on Linux/Unix), with the client library (w25lib.h):
+ *     gcc w25clients.c w25lib.c -o w25clients -lpthread -lz
  * Usage:
  *     ./w25clients
  *   or to specify a custom server IP/port:
- *     ./w25clients [S1_IP] [S1_port]
+ *     ./w25clients [-t] [S1_IP] [S1_port]
+ *   or to run commands without the prompt, for scripts:
+ *     ./w25clients [-t] [-e command]... [-f command_file] [-j N] [S1_IP] [S1_port]
+ *
+ * In batch mode (-e, -f) uploadf, downlf, removef, dispfnames and downltar
+ * are run N at a time over a pool of N connections (-j, default 1), and
+ * every command reports one tab-separated result line; see run_batch().
+ *
+ * The client asks S1 for the binary framed protocol (see S1.c) and falls back
+ * to the text protocol if S1 does not offer it; -t always uses text. With the
+ * framed protocol, files of the types S1 names (by default .txt and .c) are
+ * uploaded, downloaded and archived deflated, and uploads and whole-file
+ * downloads carry a CRC-32C checksum that is checked at the other end (a
+ * download that does not match it is removed).
  *
  *****************************************************************************/
 
@@ -33,97 +69,1106 @@
  #include <sys/socket.h>
  #include <netinet/in.h>
  #include <sys/stat.h>
+ #include <stdint.h>
+ #include <endian.h>
+ #include <fcntl.h>
+ #include <pthread.h>
+ #include <sys/sendfile.h>
+ #include <time.h>
+ #include <glob.h>
+ #include <zlib.h>
+ #include "w25lib.h"
  
  // Default connection settings for S1 (can be overridden via argv)
  #define DEFAULT_S1_PORT 50004
  #define DEFAULT_S1_ADDR "127.0.0.1"
  
- // Buffer size for file transfer
- #define BUF_SIZE 4096
+ /*****************************************************************************
+  * With protocol 2 (see w25lib.h) requests are pipelined when commands come
+  * from a file or pipe: up to PIPELINE_DEPTH requests are sent before the
+  * first response is read.
+  *****************************************************************************/
+ #define PIPELINE_DEPTH 16
+ #define MAX_RANGE_JOBS 16     // Connections for one downlf -j / uploadf -j transfer
+ #define RANGE_RETRIES 3       // Retries per range or part after a failure
+ #define UPLOAD_PART_SIZE (8L * 1024 * 1024)  // Part size of an uploadf -j upload
  
  /*****************************************************************************
-  * send_all: ensures we send the entire buffer over a socket, even if 'send()'
-  * writes only part of it. Returns 0 on success, -1 on error.
+  * complete_request: reads and reports the response to one pending request.
+  * Returns 0 to carry on, -1 if the connection to S1 is gone.
   *****************************************************************************/
- int send_all(int sock, const void *buf, size_t len) {
-     size_t sent = 0;
-     const char *ptr = (const char*)buf;
-     while (sent < len) {
-         ssize_t n = send(sock, ptr + sent, len - sent, 0);
-         if (n < 0) {
-             return -1;  // error
+ int complete_request(struct s1_conn *c, const struct pending_request *req) {
+     struct response resp;
+     int expectData = (req->opcode == V2_OP_DOWNLF || req->opcode == V2_OP_DOWNLTAR ||
+                       req->opcode == V2_OP_DISPFNAMES || req->opcode == V2_OP_STATS);
+     if (read_response(c, req, expectData, &resp) != 0) {
+         fprintf(stderr, "Connection closed by server\n");
+         return -1;
+     }
+     if (resp.payloadLen < 0) {
+         // Status or error message: print it as is
+         printf("%s", resp.msg);
+         return 0;
+     }
+     long size = resp.payloadLen;
+ 
+     if (req->opcode == V2_OP_DOWNLF) {
+         int rc = receive_download(c, &resp, req->name, &size);
+         if (rc == 2) {
+             printf("ERROR: Checksum mismatch, %s removed\n", req->name);
+         } else if (rc == 0) {
+             printf("File %s downloaded (%ld bytes)\n", req->name, size);
+         } else if (rc < 0) {
+             printf("ERROR: Incomplete download\n");
+             return -1;
+         }
+     } else if (req->opcode == V2_OP_DOWNLTAR) {
+         int rc = resp.chunked ? receive_chunks_to_file(c, req->name, &size, resp.deflate, NULL)
+                               : receive_to_file(c, req->name, size, NULL);
+         if (rc == 0 && resp.cursor) {
+             printf("Tar file saved as %s (token %s)\n", req->name, resp.cursor);
+         } else if (rc == 0) {
+             printf("Tar file saved as %s \n", req->name);
+         } else if (rc < 0) {
+             printf("ERROR: Incomplete tar download\n");
+             return -1;
+         }
+     } else if (req->opcode == V2_OP_DISPFNAMES) {
+         if (size == 0) {
+             printf("No files found\n");
+             return 0;
+         }
+         // Allocate buffer for list
+         char *listBuf = (char*)malloc(size + 1);
+         if (!listBuf) {
+             fprintf(stderr, "Memory allocation error\n");
+             return -1;
+         }
+         if (recv_all(&c->in, listBuf, size) != 0) {
+             fprintf(stderr, "Failed to receive file list\n");
+             free(listBuf);
+             return -1;
          }
-         sent += n;
+         listBuf[size] = '\0';
+         // Print the file list
+         printf("%s", listBuf);
+         free(listBuf);
+     } else if (req->opcode == V2_OP_STATS) {
+         char *text = malloc(size + 1);
+         if (!text || recv_all(&c->in, text, size) != 0) {
+             fprintf(stderr, "Failed to receive the metrics\n");
+             free(text);
+             return -1;
+         }
+         text[size] = '\0';
+         printf("%s", text);
+         free(text);
      }
      return 0;
  }
  
  /*****************************************************************************
-  * recv_line: reads data from the socket one character at a time until we hit
-  * a newline or we've read maxlen-1 chars. Puts a '\0' terminator at the end.
-  *
-  * Returns:
-  *   - number of bytes read if successful (including '\n'),
-  *   - 0 if the server has closed the connection,
-  *   - -1 on error.
+  * list_pages: runs dispfnames for `path` one page at a time, printing each
+  * page as it arrives and asking for the next one with the cursor S1 returned,
+  * so even a huge directory needs only one page of memory on either side.
+  * `filter` (see w25_filter_add) is "" for the plain listing. Must be called
+  * with no other request outstanding. Returns 0 to carry on, -1 if the
+  * connection to S1 is gone.
   *****************************************************************************/
- int recv_line(int sock, char *buf, size_t maxlen) {
-     size_t i = 0;
-     char ch;
-     while (i < maxlen - 1) {
-         ssize_t n = recv(sock, &ch, 1, 0);
-         if (n <= 0) {
-             // 0 => connection closed, -1 => error
-             return (n == 0) ? 0 : -1;
+ int list_pages(struct s1_conn *c, const char *path, const char *filter) {
+     char cursor[1024] = "";
+     int page = 0;
+     while (1) {
+         char args[2700];
+         int n = snprintf(args, sizeof(args), "-n %d ", LIST_PAGE_SIZE);
+         if (cursor[0]) {
+             n += snprintf(args + n, sizeof(args) - n, "-c %s ", cursor);
+         }
+         if (filter[0]) {
+             n += snprintf(args + n, sizeof(args) - n, "-f %s ", filter);
+         }
+         snprintf(args + n, sizeof(args) - n, "%s", path);
+         struct pending_request req;
+         req.opcode = V2_OP_DISPFNAMES;
+         req.name[0] = '\0';
+         if (send_request(c, V2_OP_DISPFNAMES, "dispfnames", args, -1, &req.reqId) != 0) {
+             fprintf(stderr, "Failed to send 'dispfnames' command\n");
+             return -1;
+         }
+         struct response resp;
+         if (read_response(c, &req, 1, &resp) != 0) {
+             fprintf(stderr, "Connection closed by server\n");
+             return -1;
+         }
+         if (resp.payloadLen < 0) {
+             // "No files found" only makes sense for the first page
+             if (page == 0 || strncmp(resp.msg, "No files found", 14) != 0) {
+                 printf("%s", resp.msg);
+             }
+             return 0;
+         }
+         char *listBuf = (char*)malloc(resp.payloadLen + 1);
+         if (!listBuf) {
+             fprintf(stderr, "Memory allocation error\n");
+             return -1;
+         }
+         if (recv_all(&c->in, listBuf, resp.payloadLen) != 0) {
+             fprintf(stderr, "Failed to receive file list\n");
+             free(listBuf);
+             return -1;
+         }
+         listBuf[resp.payloadLen] = '\0';
+         printf("%s", listBuf);
+         free(listBuf);
+         if (!resp.cursor) {
+             return 0;
          }
-         buf[i++] = ch;
-         if (ch == '\n') {
-             // we include the newline in our buffer, but we can break
+         snprintf(cursor, sizeof(cursor), "%s", resp.cursor);
+         page++;
+     }
+ }
+ 
+ /*****************************************************************************
+  * Batch commands: uploadm, downlm and removem move many files in one request
+  * (see S1.c). The request body lists the entries; S1 answers with one
+  * "SUCCESS <path>" / "ERROR <path>: <reason>" line per entry or, for downlm,
+  * a chunked stream of such lines, each successful one ("SUCCESS <size>
+  * <path>") followed by a chunk holding the file.
+  *****************************************************************************/
+ struct batch_list {
+     char **items;         // uploadm: "<filename> <destination_path>"; else "~S1/..." paths
+     size_t count, cap;
+ };
+ 
+ int batch_add(struct batch_list *l, const char *item) {
+     if (l->count == l->cap) {
+         size_t cap = l->cap ? l->cap * 2 : 64;
+         char **items = realloc(l->items, cap * sizeof(*items));
+         if (!items) {
+             return -1;
+         }
+         l->items = items;
+         l->cap = cap;
+     }
+     if (!(l->items[l->count] = strdup(item))) {
+         return -1;
+     }
+     l->count++;
+     return 0;
+ }
+ 
+ void batch_free(struct batch_list *l) {
+     for (size_t i = 0; i < l->count; i++) {
+         free(l->items[i]);
+     }
+     free(l->items);
+     l->items = NULL;
+     l->count = l->cap = 0;
+ }
+ 
+ /*****************************************************************************
+  * batch_load: adds the non-empty lines of a manifest file to the list.
+  * Returns 0 on success, -1 if the file cannot be read.
+  *****************************************************************************/
+ int batch_load(struct batch_list *l, const char *file) {
+     FILE *fp = fopen(file, "r");
+     if (!fp) {
+         perror(file);
+         return -1;
+     }
+     char line[1100];
+     int rc = 0;
+     while (rc == 0 && fgets(line, sizeof(line), fp)) {
+         line[strcspn(line, "\r\n")] = '\0';
+         if (line[0]) {
+             rc = batch_add(l, line);
+         }
+     }
+     fclose(fp);
+     return rc;
+ }
+ 
+ /*****************************************************************************
+  * batch_finish: reads the per-entry status lines that answer uploadm and
+  * removem and prints them. Returns 0 to carry on, -1 if the connection to S1
+  * is gone.
+  *****************************************************************************/
+ static int batch_finish(struct s1_conn *c, const struct pending_request *req) {
+     struct response resp;
+     if (read_response(c, req, 1, &resp) != 0) {
+         fprintf(stderr, "Connection closed by server\n");
+         return -1;
+     }
+     if (resp.payloadLen < 0) {
+         printf("%s", resp.msg);
+         return 0;
+     }
+     char *status = malloc((size_t)resp.payloadLen + 1);
+     if (!status || recv_all(&c->in, status, resp.payloadLen) != 0) {
+         fprintf(stderr, "Failed to receive batch results\n");
+         free(status);
+         return -1;
+     }
+     status[resp.payloadLen] = '\0';
+     printf("%s", status);
+     free(status);
+     return 0;
+ }
+ 
+ /*****************************************************************************
+  * batch_send_manifest: sends downlm/removem with the list as its body, one
+  * path per line.
+  *****************************************************************************/
+ static int batch_send_manifest(struct s1_conn *c, int opcode, const char *command,
+                                const struct batch_list *l, struct pending_request *req) {
+     long length = 0;
+     for (size_t i = 0; i < l->count; i++) {
+         length += (long)strlen(l->items[i]) + 1;
+     }
+     req->opcode = opcode;
+     req->name[0] = '\0';
+     if (send_request(c, opcode, command, "", length, &req->reqId) != 0) {
+         return -1;
+     }
+     for (size_t i = 0; i < l->count; i++) {
+         if (send_all(c->in.fd, l->items[i], strlen(l->items[i])) != 0 ||
+             send_all(c->in.fd, "\n", 1) != 0) {
+             return -1;
+         }
+     }
+     return 0;
+ }
+ 
+ /*****************************************************************************
+  * batch_upload: uploadm. Each entry is sent as "<filename> <destination>
+  * <size>\n" followed by the file. Entries that fail the local checks are
+  * reported and left out. Must be called with no other request outstanding.
+  * Returns 0 to carry on, -1 if the connection to S1 is gone.
+  *****************************************************************************/
+ int batch_upload(struct s1_conn *c, const struct batch_list *l) {
+     long *sizes = calloc(l->count + 1, sizeof(*sizes));
+     if (!sizes) {
+         fprintf(stderr, "Memory allocation error\n");
+         return 0;
+     }
+     long body = 0, files = 0;
+     for (size_t i = 0; i < l->count; i++) {
+         char filename[1100], destPath[1100];
+         struct stat st;
+         const char *ext;
+         sizes[i] = -1;
+         if (sscanf(l->items[i], "%1099s %1099s", filename, destPath) != 2) {
+             fprintf(stderr, "Error: bad entry '%s' (expected <filename> <destination_path>)\n",
+                     l->items[i]);
+         } else if (stat(filename, &st) != 0 || !S_ISREG(st.st_mode)) {
+             fprintf(stderr, "Error: %s: file not found\n", filename);
+         } else if (!(ext = strrchr(filename, '.')) ||
+                    !(strcmp(ext, ".c") == 0 || strcmp(ext, ".pdf") == 0 ||
+                      strcmp(ext, ".txt") == 0 || strcmp(ext, ".zip") == 0)) {
+             fprintf(stderr, "Error: %s: uploadm supports only .c, .pdf, .txt, .zip\n", filename);
+         } else if (strncmp(destPath, "~S1", 3) != 0) {
+             fprintf(stderr, "Error: %s: destination_path must begin with ~S1\n", filename);
+         } else {
+             sizes[i] = (long)st.st_size;
+             body += (long)strlen(l->items[i]) + snprintf(NULL, 0, " %ld\n", sizes[i]) + sizes[i];
+             files++;
+         }
+     }
+     if (files == 0) {
+         free(sizes);
+         return 0;
+     }
+ 
+     struct pending_request req;
+     req.opcode = V2_OP_UPLOADM;
+     req.name[0] = '\0';
+     int rc = send_request(c, V2_OP_UPLOADM, "uploadm", "", body, &req.reqId);
+     for (size_t i = 0; rc == 0 && i < l->count; i++) {
+         if (sizes[i] < 0) {
+             continue;
+         }
+         char filename[1100];
+         sscanf(l->items[i], "%1099s", filename);
+         char header[1200];
+         snprintf(header, sizeof(header), "%s %ld\n", l->items[i], sizes[i]);
+         int fd = open(filename, O_RDONLY);
+         rc = (fd >= 0 && send_all(c->in.fd, header, strlen(header)) == 0) ? 0 : -1;
+         off_t pos = 0;
+         while (rc == 0 && pos < sizes[i]) {
+             ssize_t n = sendfile(c->in.fd, fd, &pos, (size_t)(sizes[i] - pos));
+             if (n < 0 && errno == EINTR) {
+                 continue;
+             }
+             if (n <= 0) {
+                 // The file shrank or the connection failed: the batch is out of sync
+                 fprintf(stderr, "Error sending %s\n", filename);
+                 rc = -1;
+             }
+         }
+         if (fd >= 0) {
+             close(fd);
+         }
+     }
+     free(sizes);
+     if (rc != 0) {
+         fprintf(stderr, "Failed to send 'uploadm' batch\n");
+         return -1;
+     }
+     return batch_finish(c, &req);
+ }
+ 
+ /*****************************************************************************
+  * batch_download: downlm. Saves every file S1 sends under its base name and
+  * prints a line per entry. Must be called with no other request
+  * outstanding. Returns 0 to carry on, -1 if the connection to S1 is gone.
+  *****************************************************************************/
+ int batch_download(struct s1_conn *c, const struct batch_list *l) {
+     struct pending_request req;
+     if (batch_send_manifest(c, V2_OP_DOWNLM, "downlm", l, &req) != 0) {
+         fprintf(stderr, "Failed to send 'downlm' command\n");
+         return -1;
+     }
+     struct response resp;
+     if (read_response(c, &req, 1, &resp) != 0) {
+         fprintf(stderr, "Connection closed by server\n");
+         return -1;
+     }
+     if (resp.payloadLen < 0 || !resp.chunked) {
+         printf("%s", resp.payloadLen < 0 ? resp.msg : "ERROR: Unexpected response to downlm\n");
+         return resp.payloadLen < 0 ? 0 : -1;
+     }
+     while (1) {
+         char line[32], record[1200];
+         if (recv_line(&c->in, line, sizeof(line)) <= 0) {
              break;
          }
+         long length = strtol(line, NULL, 16);
+         if (length == 0) {
+             return 0;
+         }
+         if (length < 0 || length >= (long)sizeof(record) ||
+             recv_all(&c->in, record, (size_t)length) != 0) {
+             break;
+         }
+         record[length] = '\0';
+         long size;
+         int pathAt;
+         if (sscanf(record, "SUCCESS %ld %n", &size, &pathAt) != 1 || size < 0) {
+             printf("%s", record);   // an entry's error
+             continue;
+         }
+         record[strcspn(record, "\n")] = '\0';
+         const char *name = strrchr(record + pathAt, '/');
+         name = name ? name + 1 : record + pathAt;
+         if (size > 0 && (recv_line(&c->in, line, sizeof(line)) <= 0 || strtol(line, NULL, 16) != size)) {
+             break;
+         }
+         int rc = receive_to_file(c, name, size, NULL);
+         if (rc < 0) {
+             break;
+         }
+         if (rc == 0) {
+             printf("File %s downloaded (%ld bytes)\n", name, size);
+         }
+     }
+     printf("ERROR: Incomplete batch download\n");
+     return -1;
+ }
+ 
+ /*****************************************************************************
+  * batch_remove: removem. Must be called with no other request outstanding.
+  * Returns 0 to carry on, -1 if the connection to S1 is gone.
+  *****************************************************************************/
+ int batch_remove(struct s1_conn *c, const struct batch_list *l) {
+     struct pending_request req;
+     if (batch_send_manifest(c, V2_OP_REMOVEM, "removem", l, &req) != 0) {
+         fprintf(stderr, "Failed to send 'removem' command\n");
+         return -1;
+     }
+     return batch_finish(c, &req);
+ }
+ 
+ /*****************************************************************************
+  * fetch_range: downloads up to `length` bytes of `path` starting at `offset`
+  * (length -1 = to the end of the file) and writes them into `fd` at the same
+  * position, so a range lands in place in the local copy. *total receives the
+  * size of the whole file and *got the number of bytes written, which is
+  * also valid after a failure (the part that did arrive is kept). Must be
+  * called with no other request outstanding. Returns 0 on success, 1 if S1
+  * refused or the file could not be written, -1 if the connection failed.
+  *****************************************************************************/
+ int fetch_range(struct s1_conn *c, const char *path, long offset, long length, int fd,
+                 long *total, long *got) {
+     char args[1100];
+     if (length >= 0) {
+         snprintf(args, sizeof(args), "-o %ld -l %ld %s", offset, length, path);
+     } else {
+         snprintf(args, sizeof(args), "-o %ld %s", offset, path);
+     }
+     struct pending_request req;
+     req.opcode = V2_OP_DOWNLF;
+     req.name[0] = '\0';
+     *got = 0;
+     if (send_request(c, V2_OP_DOWNLF, "downlf", args, -1, &req.reqId) != 0) {
+         return -1;
+     }
+     struct response resp;
+     if (read_response(c, &req, 1, &resp) != 0) {
+         return -1;
+     }
+     if (resp.payloadLen < 0) {
+         printf("%s", resp.msg);
+         return 1;
+     }
+     *total = resp.cursor ? atol(resp.cursor) : resp.payloadLen;
+     long remaining = resp.payloadLen;
+     off_t pos = offset;
+     int writeFailed = 0;
+     while (remaining > 0) {
+         char dataBuf[BUF_SIZE];
+         ssize_t n = reader_read(&c->in, dataBuf, (remaining < BUF_SIZE ? remaining : BUF_SIZE));
+         if (n <= 0) {
+             return -1;
+         }
+         // After a write error the rest is still read, to stay in sync
+         if (!writeFailed && pwrite(fd, dataBuf, n, pos) != n) {
+             perror("pwrite");
+             writeFailed = 1;
+         }
+         if (!writeFailed) {
+             *got += n;
+         }
+         pos += n;
+         remaining -= n;
+     }
+     return writeFailed ? 1 : 0;
+ }
+ 
+ // One of the ranges of a parallel download (downlf -j)
+ struct range_job {
+     const struct sockaddr_in *addr;
+     int forceText;
+     const char *path;
+     long offset, length;
+     int fd;
+     int rc;               // fetch_range() result of the last attempt
+ };
+ 
+ /*****************************************************************************
+  * range_worker: fetches one range over its own connection to S1. A dropped
+  * connection is retried (up to RANGE_RETRIES times) from the first byte that
+  * did not arrive, so a failure costs only the rest of that one range.
+  *****************************************************************************/
+ static void *range_worker(void *arg) {
+     struct range_job *job = arg;
+     job->rc = -1;
+     for (int attempt = 0; attempt <= RANGE_RETRIES && job->rc < 0; attempt++) {
+         int sock = connect_to_s1(job->addr);
+         if (sock < 0) {
+             continue;
+         }
+         struct s1_conn c;
+         reader_init(&c.in, sock);
+         c.proto = 1;
+         c.nextReqId = 1;
+         if (!job->forceText) {
+             negotiate_protocol(&c);
+         }
+         long total, got = 0;
+         job->rc = fetch_range(&c, job->path, job->offset, job->length, job->fd, &total, &got);
+         job->offset += got;
+         job->length -= got;
+         close(sock);
+     }
+     return NULL;
+ }
+ 
+ /*****************************************************************************
+  * ranged_download: downlf with options. -o/-l fetch part of the file into the
+  * same place in the local copy; -r resumes after the bytes the local file
+  * already has; -j N splits what is left into N ranges that are fetched over
+  * N connections in parallel. The local file is never truncated except to
+  * drop stale bytes after the end when the download ran to the end. Must be
+  * called with no other request outstanding. Returns 0 to carry on, -1 if the
+  * connection to S1 is gone.
+  *****************************************************************************/
+ int ranged_download(struct s1_conn *c, const struct sockaddr_in *addr, int forceText,
+                     const char *path, const char *name, long offset, long length,
+                     int resume, int jobs) {
+     int fd = open(name, O_WRONLY | O_CREAT, 0644);
+     if (fd < 0) {
+         perror("open");
+         return 0;
+     }
+     struct stat st;
+     if (resume && fstat(fd, &st) == 0) {
+         offset = (long)st.st_size;
+     }
+     long total = 0, got = 0;
+     int rc;
+     if (jobs <= 1) {
+         rc = fetch_range(c, path, offset, length, fd, &total, &got);
+     } else {
+         // An empty range first, to learn the file size
+         rc = fetch_range(c, path, offset, 0, fd, &total, &got);
+         long end = (length >= 0 && offset + length < total) ? offset + length : total;
+         long span = end > offset ? end - offset : 0;
+         long part = (span + jobs - 1) / jobs;
+         struct range_job job[MAX_RANGE_JOBS];
+         pthread_t tid[MAX_RANGE_JOBS];
+         int started = 0;
+         for (int i = 0; rc == 0 && i < jobs && (long)i * part < span; i++) {
+             job[i].addr = addr;
+             job[i].forceText = forceText;
+             job[i].path = path;
+             job[i].offset = offset + (long)i * part;
+             job[i].length = (i + 1) * part < span ? part : span - (long)i * part;
+             job[i].fd = fd;
+             if (pthread_create(&tid[i], NULL, range_worker, &job[i]) != 0) {
+                 range_worker(&job[i]);   // run this one on the calling thread instead
+                 tid[i] = 0;
+             }
+             started++;
+         }
+         for (int i = 0; i < started; i++) {
+             if (tid[i]) {
+                 pthread_join(tid[i], NULL);
+             }
+             if (job[i].rc != 0) {
+                 printf("ERROR: Range %d (%ld bytes from offset %ld) failed\n", i,
+                        job[i].length, job[i].offset);
+                 rc = 1;
+             }
+         }
+         got = span;
+     }
+     if (rc == 0 && length < 0 && ftruncate(fd, offset + got) != 0) {
+         perror("ftruncate");
      }
-     buf[i] = '\0';  // null-terminate
-     return (int)i;
+     close(fd);
+     if (rc == 0) {
+         printf("File %s: %ld bytes from offset %ld downloaded (file size %ld)\n", name, got,
+                offset, total);
+     } else if (rc < 0) {
+         printf("ERROR: Download interrupted after %ld bytes; resume with downlf -r\n", got);
+         return -1;
+     }
+     return 0;
  }
  
  /*****************************************************************************
-  * recv_all: reads exactly 'length' bytes from the socket, handling short reads.
-  * Returns 0 on success, or -1 on error/disconnection.
+  * send_part: uploads `length` bytes of the open file `fd`, starting at
+  * `offset`, as one part of multipart upload `id` of a `total`-byte file. The
+  * body goes out with sendfile. Must be called with no other request
+  * outstanding. Returns 0 if S1 stored the part, 1 if it refused it, -1 if
+  * the connection failed.
   *****************************************************************************/
- int recv_all(int sock, void *buffer, size_t length) {
-     size_t total = 0;
-     char *buf = (char*)buffer;
-     while (total < length) {
-         ssize_t n = recv(sock, buf + total, length - total, 0);
+ int send_part(struct s1_conn *c, const char *id, const char *filename, const char *destPath,
+               int fd, long offset, long length, long total) {
+     char args[1100];
+     snprintf(args, sizeof(args), "%s %ld %ld %s %s", id, offset, total, filename, destPath);
+     struct pending_request req;
+     req.opcode = V2_OP_UPLOADP;
+     req.name[0] = '\0';
+     if (send_request(c, V2_OP_UPLOADP, "uploadp", args, length, &req.reqId) != 0) {
+         return -1;
+     }
+     off_t pos = offset;
+     long remaining = length;
+     while (remaining > 0) {
+         ssize_t n = sendfile(c->in.fd, fd, &pos, (size_t)remaining);
+         if (n < 0 && errno == EINTR) {
+             continue;
+         }
          if (n <= 0) {
-             return -1; // error or connection closed
+             return -1;
+         }
+         remaining -= n;
+     }
+     struct response resp;
+     if (read_response(c, &req, 0, &resp) != 0) {
+         return -1;
+     }
+     return strncmp(resp.msg, "SUCCESS", 7) == 0 ? 0 : 1;
+ }
+ 
+ // The parts of one multipart upload (uploadf -j), shared by its workers
+ struct upload_job {
+     const struct sockaddr_in *addr;
+     int forceText;
+     const char *id, *filename, *destPath;
+     int fd;
+     long total, parts;
+     long nextPart;        // next part to hand out
+     long failed;          // parts that could not be stored
+     pthread_mutex_t lock;
+ };
+ 
+ /*****************************************************************************
+  * upload_worker: sends parts over its own connection to S1 until none are
+  * left. A part that fails is sent again (up to RANGE_RETRIES times, on a new
+  * connection if the old one dropped), so a failure costs only that part.
+  *****************************************************************************/
+ static void *upload_worker(void *arg) {
+     struct upload_job *job = arg;
+     struct s1_conn c;
+     int sock = -1;
+     while (1) {
+         pthread_mutex_lock(&job->lock);
+         long part = job->nextPart < job->parts ? job->nextPart++ : -1;
+         pthread_mutex_unlock(&job->lock);
+         if (part < 0) {
+             break;
+         }
+         long offset = part * UPLOAD_PART_SIZE;
+         long length = job->total - offset < UPLOAD_PART_SIZE ? job->total - offset : UPLOAD_PART_SIZE;
+         int rc = -1;
+         for (int attempt = 0; attempt <= RANGE_RETRIES && rc != 0; attempt++) {
+             if (sock < 0) {
+                 sock = connect_to_s1(job->addr);
+                 if (sock < 0) {
+                     continue;
+                 }
+                 reader_init(&c.in, sock);
+                 c.proto = 1;
+                 c.nextReqId = 1;
+                 if (!job->forceText) {
+                     negotiate_protocol(&c);
+                 }
+             }
+             rc = send_part(&c, job->id, job->filename, job->destPath, job->fd, offset, length,
+                            job->total);
+             if (rc < 0) {
+                 close(sock);
+                 sock = -1;
+             }
+         }
+         if (rc != 0) {
+             pthread_mutex_lock(&job->lock);
+             job->failed++;
+             pthread_mutex_unlock(&job->lock);
+         }
+     }
+     if (sock >= 0) {
+         close(sock);
+     }
+     return NULL;
+ }
+ 
+ /*****************************************************************************
+  * multipart_upload: uploadf -j. Splits the file into UPLOAD_PART_SIZE parts
+  * and sends them over up to `jobs` connections in parallel; once every part
+  * is stored, asks S1 (on the main connection `c`) to commit the file, which
+  * makes it appear at its destination all at once. If a part keeps failing
+  * the upload is aborted instead. Must be called with no other request
+  * outstanding. Returns 0 to carry on, -1 if the connection to S1 is gone.
+  *****************************************************************************/
+ int multipart_upload(struct s1_conn *c, const struct sockaddr_in *addr, int forceText,
+                      const char *filename, const char *destPath, int fd, long total, int jobs) {
+     // A random id keeps concurrent uploads of the same file apart
+     unsigned long long rnd = 0;
+     int rndFd = open("/dev/urandom", O_RDONLY);
+     if (rndFd < 0 || read(rndFd, &rnd, sizeof(rnd)) != (ssize_t)sizeof(rnd)) {
+         rnd = ((unsigned long long)time(NULL) << 20) ^ (unsigned long long)getpid();
+     }
+     if (rndFd >= 0) {
+         close(rndFd);
+     }
+     char id[32];
+     snprintf(id, sizeof(id), "%016llx", rnd);
+ 
+     struct upload_job job;
+     job.addr = addr;
+     job.forceText = forceText;
+     job.id = id;
+     job.filename = filename;
+     job.destPath = destPath;
+     job.fd = fd;
+     job.total = total;
+     job.parts = (total + UPLOAD_PART_SIZE - 1) / UPLOAD_PART_SIZE;
+     job.nextPart = 0;
+     job.failed = 0;
+     pthread_mutex_init(&job.lock, NULL);
+     if (jobs > job.parts) {
+         jobs = (int)job.parts;
+     }
+     pthread_t tid[MAX_RANGE_JOBS];
+     int started = 0;
+     for (int i = 0; i < jobs; i++) {
+         if (pthread_create(&tid[started], NULL, upload_worker, &job) == 0) {
+             started++;
          }
-         total += n;
+     }
+     if (started == 0) {
+         upload_worker(&job);   // no threads: send every part from here
+     }
+     for (int i = 0; i < started; i++) {
+         pthread_join(tid[i], NULL);
+     }
+     pthread_mutex_destroy(&job.lock);
+ 
+     char args[1100];
+     if (job.failed == 0) {
+         snprintf(args, sizeof(args), "%s %ld %s %s", id, total, filename, destPath);
+     } else {
+         printf("ERROR: %ld of %ld parts could not be uploaded\n", job.failed, job.parts);
+         snprintf(args, sizeof(args), "-a %s %s %s", id, filename, destPath);
+     }
+     struct pending_request req;
+     req.opcode = V2_OP_UPLOADC;
+     req.name[0] = '\0';
+     struct response resp;
+     if (send_request(c, V2_OP_UPLOADC, "uploadc", args, -1, &req.reqId) != 0 ||
+         read_response(c, &req, 0, &resp) != 0) {
+         fprintf(stderr, "Connection closed by server\n");
+         return -1;
+     }
+     if (job.failed == 0) {
+         printf("%s", resp.msg);
      }
      return 0;
  }
  
+ /*****************************************************************************
+  * XXH64 (seed 0) of a whole file, the contents hash the storage servers'
+  * deduplication store is keyed by (see "Deduplication" in S2.c).
+  *****************************************************************************/
+ #define XXH_PRIME1 0x9E3779B185EBCA87ULL
+ #define XXH_PRIME2 0xC2B2AE3D27D4EB4FULL
+ #define XXH_PRIME3 0x165667B19E3779F9ULL
+ #define XXH_PRIME4 0x85EBCA77C2B2AE63ULL
+ #define XXH_PRIME5 0x27D4EB2F165667C5ULL
+ 
+ // Streaming XXH64 (seed 0): init, then feed the data in pieces.
+ struct xxh64_state {
+     uint64_t v[4];
+     uint64_t total;
+     unsigned char buf[32];
+     size_t used;
+ };
+ 
+ static uint64_t xxh_rotl(uint64_t x, int r) {
+     return (x << r) | (x >> (64 - r));
+ }
+ 
+ static uint64_t xxh_read64(const unsigned char *p) {
+     uint64_t v;
+     memcpy(&v, p, sizeof(v));
+     return le64toh(v);
+ }
+ 
+ static uint64_t xxh_round(uint64_t acc, uint64_t input) {
+     return xxh_rotl(acc + input * XXH_PRIME2, 31) * XXH_PRIME1;
+ }
+ 
+ static uint64_t xxh_merge(uint64_t acc, uint64_t v) {
+     return (acc ^ xxh_round(0, v)) * XXH_PRIME1 + XXH_PRIME4;
+ }
+ 
+ void xxh64_init(struct xxh64_state *s) {
+     memset(s, 0, sizeof(*s));
+     s->v[0] = XXH_PRIME1 + XXH_PRIME2;
+     s->v[1] = XXH_PRIME2;
+     s->v[3] = 0 - XXH_PRIME1;
+ }
+ 
+ void xxh64_update(struct xxh64_state *s, const void *data, size_t len) {
+     const unsigned char *p = data;
+     s->total += len;
+     if (s->used + len < 32) {
+         memcpy(s->buf + s->used, p, len);
+         s->used += len;
+         return;
+     }
+     if (s->used > 0) {
+         size_t fill = 32 - s->used;
+         memcpy(s->buf + s->used, p, fill);
+         for (int i = 0; i < 4; i++) {
+             s->v[i] = xxh_round(s->v[i], xxh_read64(s->buf + 8 * i));
+         }
+         p += fill;
+         len -= fill;
+         s->used = 0;
+     }
+     for (; len >= 32; p += 32, len -= 32) {
+         for (int i = 0; i < 4; i++) {
+             s->v[i] = xxh_round(s->v[i], xxh_read64(p + 8 * i));
+         }
+     }
+     memcpy(s->buf, p, len);
+     s->used = len;
+ }
+ 
+ uint64_t xxh64_final(const struct xxh64_state *s) {
+     uint64_t h;
+     if (s->total >= 32) {
+         h = xxh_rotl(s->v[0], 1) + xxh_rotl(s->v[1], 7) + xxh_rotl(s->v[2], 12) +
+             xxh_rotl(s->v[3], 18);
+         for (int i = 0; i < 4; i++) {
+             h = xxh_merge(h, s->v[i]);
+         }
+     } else {
+         h = s->v[2] + XXH_PRIME5;
+     }
+     h += s->total;
+     const unsigned char *p = s->buf, *end = s->buf + s->used;
+     for (; p + 8 <= end; p += 8) {
+         h = xxh_rotl(h ^ xxh_round(0, xxh_read64(p)), 27) * XXH_PRIME1 + XXH_PRIME4;
+     }
+     if (p + 4 <= end) {
+         uint32_t w;
+         memcpy(&w, p, sizeof(w));
+         h = xxh_rotl(h ^ (uint64_t)le32toh(w) * XXH_PRIME1, 23) * XXH_PRIME2 + XXH_PRIME3;
+         p += 4;
+     }
+     for (; p < end; p++) {
+         h = xxh_rotl(h ^ *p * XXH_PRIME5, 11) * XXH_PRIME1;
+     }
+     h ^= h >> 33;
+     h *= XXH_PRIME2;
+     h ^= h >> 29;
+     h *= XXH_PRIME3;
+     return h ^ (h >> 32);
+ }
+ 
+ // Hashes the file open as `fd` from its start. Returns 0 on success.
+ int hash_file(int fd, uint64_t *hash) {
+     struct xxh64_state xs;
+     xxh64_init(&xs);
+     char buf[BUF_SIZE * 16];
+     off_t pos = 0;
+     ssize_t n;
+     while ((n = pread(fd, buf, sizeof(buf), pos)) > 0) {
+         xxh64_update(&xs, buf, (size_t)n);
+         pos += n;
+     }
+     *hash = xxh64_final(&xs);
+     return n == 0 ? 0 : -1;
+ }
+ 
+ /*****************************************************************************
+  * upload_by_hash: uploadf -k. Sends only the file's size and hash; if a
+  * storage server already holds identical contents, S1 links them to the
+  * destination and nothing else needs to be sent. Must be called with no
+  * other request outstanding. Returns 1 if the file was stored that way, 0 if
+  * it has to be uploaded normally, -1 if the connection to S1 is gone.
+  *****************************************************************************/
+ int upload_by_hash(struct s1_conn *c, const char *filename, const char *destPath, long fileSize) {
+     int fd = open(filename, O_RDONLY);
+     uint64_t hash;
+     int hashed = fd >= 0 && hash_file(fd, &hash) == 0;
+     if (fd >= 0) {
+         close(fd);
+     }
+     if (!hashed) {
+         return 0;
+     }
+     char args[1100];
+     snprintf(args, sizeof(args), "%s %s %ld %016llx", filename, destPath, fileSize,
+              (unsigned long long)hash);
+     struct pending_request req;
+     req.opcode = V2_OP_UPLOADH;
+     req.name[0] = '\0';
+     struct response resp;
+     if (send_request(c, V2_OP_UPLOADH, "uploadh", args, -1, &req.reqId) != 0 ||
+         read_response(c, &req, 0, &resp) != 0) {
+         fprintf(stderr, "Connection closed by server\n");
+         return -1;
+     }
+     if (strncmp(resp.msg, "SUCCESS", 7) != 0) {
+         return 0;   // Contents not stored yet, or an S1 without uploadh
+     }
+     printf("%s", resp.msg);
+     return 1;
+ }
+ 
+ /*****************************************************************************
+  * Batch mode (-e / -f): instead of the prompt loop, the commands are parsed
+  * into w25_ops and run through the connection pool of w25lib.c, -j at a
+  * time over as many connections, so they must not depend on each other.
+  * Once all are done, each reports one tab-separated line, in the order
+  * given:
+  *     <n> <ok|partial|failed|disconnected> <bytes> <message>
+  * and dispfnames one "<n> name <name>" line per file after it (stats: one
+  * "<n> metric <line>" line per metric), then one
+  * "<n> warning <message>" line per storage server S1 could not list (the
+  * status is then "partial"). The exit status is 0 if every command
+  * succeeded, 1 if S1 refused one, 2 if the connection to S1 failed, and 3
+  * if the only trouble was a partial listing.
+  *****************************************************************************/
+ #define MAX_POOL_CONNECTIONS 64
+ 
+ // Local file downltar saves the archive of `filetype` (".c") in
+ static const char *tar_name(const char *filetype) {
+     if (strcmp(filetype, ".c") == 0) {
+         return "cfiles.tar";
+     } else if (strcmp(filetype, ".pdf") == 0) {
+         return "pdf.tar";
+     } else if (strcmp(filetype, ".txt") == 0) {
+         return "text.tar";
+     }
+     return "output.tar";
+ }
+ 
+ /*****************************************************************************
+  * parse_command: turns one batch command into `op`. Supported are
+  *     uploadf <filename> <destination_path>
+  *     downlf <file_path_in_S1> [<local_file>]
+  *     removef <file_path_in_S1>
+  *     dispfnames [-r] [-g <glob>] [-e <exts>] [-s <min>:<max>] [-m <from>:<to>]
+  *                <directory_path_in_S1>
+  *     downltar [-s <token>] <filetype> [<local_file>]
+  *     cachestats
+  *     stats
+  * anything else becomes an op that is not sent, with a usage error. The
+  * options that open connections of their own (uploadf -j, downlf -j) or
+  * keep state between commands (uploadf -k, downlf -o/-l/-r) and the
+  * uploadm/downlm/removem batches are refused by name: batch mode already
+  * runs its commands in parallel over the pool.
+  *****************************************************************************/
+ static void parse_command(const char *line, struct w25_op *op) {
+     char buf[1100];
+     char *save = NULL;
+     snprintf(buf, sizeof(buf), "%s", line);
+     char *cmd = strtok_r(buf, " ", &save);
+     char *a = cmd ? strtok_r(NULL, " ", &save) : NULL;
+     const char *since = "";
+     int badFilter = 0;
+     op->filter[0] = '\0';
+     op->opcode = 0;
+     op->since[0] = '\0';
+     const char *unsupported = NULL, *hint = "";
+     if (cmd && (strcmp(cmd, "uploadm") == 0 || strcmp(cmd, "downlm") == 0 || strcmp(cmd, "removem") == 0)) {
+         unsupported = cmd;
+         hint = "; give one uploadf/downlf/removef per file and -j N to run them in parallel";
+     } else if (cmd && (strcmp(cmd, "uploadf") == 0 || strcmp(cmd, "downlf") == 0) && a && a[0] == '-' &&
+                a[1] && !a[2] && strchr(cmd[0] == 'u' ? "jk" : "olrj", a[1])) {
+         unsupported = a;
+         hint = a[1] == 'j' ? "; -j N before the commands runs N of them at a time" : "";
+     }
+     if (unsupported) {
+         w25_result_set(&op->res, W25_FAILED, "ERROR: %s%s%s is not supported in batch mode%s", cmd,
+                        unsupported == cmd ? "" : " ", unsupported == cmd ? "" : unsupported, hint);
+         return;
+     }
+     if (cmd && !a && (strcmp(cmd, "stats") == 0 || strcmp(cmd, "cachestats") == 0)) {
+         op->opcode = cmd[0] == 's' ? V2_OP_STATS : V2_OP_CACHESTATS;
+         return;
+     }
+     if (cmd && strcmp(cmd, "downltar") == 0 && a && strcmp(a, "-s") == 0) {
+         since = strtok_r(NULL, " ", &save);
+         a = since ? strtok_r(NULL, " ", &save) : NULL;
+     }
+     while (cmd && strcmp(cmd, "dispfnames") == 0 && a && a[0] == '-' && a[1] && !a[2] &&
+            strchr("rgesm", a[1]) && !badFilter) {
+         char *value = a[1] == 'r' ? NULL : strtok_r(NULL, " ", &save);
+         badFilter = w25_filter_add(op->filter, sizeof(op->filter), a[1], value) != 0;
+         a = strtok_r(NULL, " ", &save);
+     }
+     char *b = a ? strtok_r(NULL, " ", &save) : NULL;
+     int extra = b && strtok_r(NULL, " ", &save) != NULL;
+     if (!cmd || !a || extra || badFilter) {
+         // Wrong number of arguments for any command
+     } else if (strcmp(cmd, "uploadf") == 0 && b) {
+         op->opcode = V2_OP_UPLOADF;
+         snprintf(op->dest, sizeof(op->dest), "%s", b);
+     } else if (strcmp(cmd, "downlf") == 0) {
+         const char *name = strrchr(a, '/');
+         op->opcode = V2_OP_DOWNLF;
+         snprintf(op->dest, sizeof(op->dest), "%s", b ? b : name ? name + 1 : a);
+     } else if (strcmp(cmd, "removef") == 0 && !b) {
+         op->opcode = V2_OP_REMOVEF;
+     } else if (strcmp(cmd, "dispfnames") == 0 && !b) {
+         op->opcode = V2_OP_DISPFNAMES;
+     } else if (strcmp(cmd, "downltar") == 0) {
+         op->opcode = V2_OP_DOWNLTAR;
+         snprintf(op->arg, sizeof(op->arg), "%s%s", a[0] == '.' ? "" : ".", a);
+         snprintf(op->dest, sizeof(op->dest), "%s", b ? b : tar_name(op->arg));
+         snprintf(op->since, sizeof(op->since), "%s", since);
+         return;
+     }
+     if (op->opcode == 0) {
+         w25_result_set(&op->res, W25_FAILED, "ERROR: Usage: uploadf <filename> <destination_path> | "
+                        "downlf <file_path_in_S1> [<local_file>] | removef <file_path_in_S1> | "
+                        "dispfnames [-r] [-g <glob>] [-e <exts>] [-s <min>:<max>] [-m <from>:<to>] "
+                        "<directory_path_in_S1> | downltar [-s <token>] <filetype> [<local_file>] | "
+                        "cachestats | stats");
+         return;
+     }
+     snprintf(op->arg, sizeof(op->arg), "%s", a);
+ }
+ 
+ /*****************************************************************************
+  * run_batch: runs the commands and prints their results. Returns the exit
+  * status.
+  *****************************************************************************/
+ static int run_batch(const struct sockaddr_in *addr, int forceText,
+                      const struct batch_list *commands, int parallel) {
+     static const char *statusNames[] = { "ok", "partial", "failed", "disconnected" };
+     static const int exitStatus[] = { 0, 3, 1, 2 };
+     struct w25_op *ops = calloc(commands->count ? commands->count : 1, sizeof(*ops));
+     if (!ops) {
+         fprintf(stderr, "Memory allocation error\n");
+         return exitStatus[W25_DISCONNECTED];
+     }
+     for (size_t i = 0; i < commands->count; i++) {
+         parse_command(commands->items[i], &ops[i]);
+     }
+     int worst = w25_run(addr, forceText, ops, commands->count, parallel);
+     for (size_t i = 0; i < commands->count; i++) {
+         const struct w25_result *res = &ops[i].res;
+         printf("%zu\t%s\t%ld\t%s\n", i + 1, statusNames[res->status], res->bytes, res->msg);
+         const char *label = ops[i].opcode == V2_OP_STATS ? "metric" : "name";
+         for (char *name = res->names; name && *name; ) {
+             size_t len = strcspn(name, "\n");
+             printf("%zu\t%s\t%.*s\n", i + 1, label, (int)len, name);
+             name += len + (name[len] == '\n');
+         }
+         for (char *warning = res->warnings; warning && *warning; ) {
+             size_t len = strcspn(warning, "\n");
+             printf("%zu\twarning\t%.*s\n", i + 1, (int)len, warning);
+             warning += len + (warning[len] == '\n');
+         }
+         free(res->names);
+         free(res->warnings);
+     }
+     free(ops);
+     return exitStatus[worst];
+ }
+ 
  /*****************************************************************************
   * main: Connects to S1 and continuously prompts the user for commands. Sends
   * commands to S1 and processes the responses (including file transmissions).
   *****************************************************************************/
  int main(int argc, char *argv[]) {
-     // Parse optional command-line arguments (server IP, port)
+     // Parse options (-t forces the text protocol; -e and -f give commands to
+     // run in batch mode, -j of them at a time) and optional server IP, port
+     int forceText = 0, batch = 0, parallel = 1;
+     struct batch_list commands = { NULL, 0, 0 };
+     int opt;
+     while ((opt = getopt(argc, argv, "te:f:j:")) != -1) {
+         if (opt == 't') {
+             forceText = 1;
+         } else if (opt == 'e' && batch_add(&commands, optarg) == 0) {
+             batch = 1;
+         } else if (opt == 'f' && batch_load(&commands, optarg) == 0) {
+             batch = 1;
+         } else if (opt == 'j' && atoi(optarg) >= 1 && atoi(optarg) <= MAX_POOL_CONNECTIONS) {
+             parallel = atoi(optarg);
+         } else {
+             fprintf(stderr, "Usage: %s [-t] [-e command]... [-f command_file] [-j 1-%d] "
+                             "[S1_IP] [S1_port]\n", argv[0], MAX_POOL_CONNECTIONS);
+             return EXIT_FAILURE;
+         }
+     }
      const char *serverIP = DEFAULT_S1_ADDR;
      int serverPort = DEFAULT_S1_PORT;
  
-     if (argc >= 2) {
-         serverIP = argv[1];       // custom IP
+     if (optind < argc) {
+         serverIP = argv[optind];       // custom IP
      }
-     if (argc >= 3) {
-         serverPort = atoi(argv[2]);  // custom port
-     }
- 
-     // Create a socket
-     int sock = socket(AF_INET, SOCK_STREAM, 0);
-     if (sock < 0) {
-         perror("socket");
-         return EXIT_FAILURE;
+     if (optind + 1 < argc) {
+         serverPort = atoi(argv[optind + 1]);  // custom port
      }
  
      // Prepare address structure
@@ -134,22 +1179,47 @@
  
      if (inet_pton(AF_INET, serverIP, &servaddr.sin_addr) <= 0) {
          fprintf(stderr, "Invalid server address %s\n", serverIP);
-         close(sock);
          return EXIT_FAILURE;
      }
  
+     crc32c_init();
+     if (batch) {
+         int rc = run_batch(&servaddr, forceText, &commands, parallel);
+         batch_free(&commands);
+         return rc;
+     }
+ 
      // Connect to S1
-     if (connect(sock, (struct sockaddr*)&servaddr, sizeof(servaddr)) < 0) {
-         perror("connect");
-         close(sock);
+     struct s1_conn s1;
+     if (w25_connect(&s1, &servaddr, forceText) != 0) {
          return EXIT_FAILURE;
      }
- 
+     int sock = s1.in.fd;
      printf("Connected to S1 at %s:%d\n", serverIP, serverPort);
  
+     // Pipeline requests only when commands are not typed interactively and
+     // the framed protocol is in use; otherwise wait for each response.
+     int depth = (s1.proto == 2 && !isatty(STDIN_FILENO)) ? PIPELINE_DEPTH : 1;
+     struct pending_request pending[PIPELINE_DEPTH];
+     int pendingHead = 0, pendingCount = 0;
+     int connected = 1;
+ 
      // Main command loop
      char input[1024];
-     while (1) {
+     while (connected) {
+         // Collect responses until there is room for another request
+         while (pendingCount >= depth) {
+             if (complete_request(&s1, &pending[pendingHead]) != 0) {
+                 connected = 0;
+                 break;
+             }
+             pendingHead = (pendingHead + 1) % PIPELINE_DEPTH;
+             pendingCount--;
+         }
+         if (!connected) {
+             break;
+         }
+ 
          printf("w25clients$ ");
          fflush(stdout);
  
@@ -179,12 +1249,27 @@
              continue;
          }
  
+         struct pending_request *req = &pending[(pendingHead + pendingCount) % PIPELINE_DEPTH];
+         req->name[0] = '\0';
+ 
          // --------------- uploadf ---------------
          if (strcmp(cmd, "uploadf") == 0) {
+             // uploadf [-k] [-j connections] <filename> <destination_path>
+             int jobs = 1, byHash = 0;
              char *filename = strtok(NULL, " ");
+             while (filename && (strcmp(filename, "-j") == 0 || strcmp(filename, "-k") == 0)) {
+                 if (filename[1] == 'j') {
+                     char *value = strtok(NULL, " ");
+                     jobs = value ? atoi(value) : 0;
+                 } else {
+                     byHash = 1;
+                 }
+                 filename = strtok(NULL, " ");
+             }
              char *destPath = strtok(NULL, "");
-             if (!filename || !destPath) {
-                 fprintf(stderr, "Usage: uploadf <filename> <destination_path>\n");
+             if (!filename || !destPath || jobs < 1 || jobs > MAX_RANGE_JOBS) {
+                 fprintf(stderr, "Usage: uploadf [-k] [-j 1-%d] <filename> <destination_path>\n",
+                         MAX_RANGE_JOBS);
                  continue;
              }
              // Trim leading spaces from destPath
@@ -211,54 +1296,109 @@
                  fprintf(stderr, "Error: destination_path must begin with ~S1\n");
                  continue;
              }
- 
-             // Send the command line to S1, including file size
-             char header[1024];
-             snprintf(header, sizeof(header), "uploadf %s %s %ld\n", filename, destPath, fileSize);
-             if (send_all(sock, header, strlen(header)) != 0) {
-                 fprintf(stderr, "Failed to send 'uploadf' command\n");
+             // -k: try to store the file by its hash alone (.c files stay on S1
+             // and are never deduplicated)
+             if (byHash && strcmp(ext, ".c") != 0) {
+                 while (pendingCount > 0) {
+                     if (complete_request(&s1, &pending[pendingHead]) != 0) {
+                         connected = 0;
+                         break;
+                     }
+                     pendingHead = (pendingHead + 1) % PIPELINE_DEPTH;
+                     pendingCount--;
+                 }
+                 int rc = connected ? upload_by_hash(&s1, filename, destPath, fileSize) : -1;
+                 if (rc != 0) {
+                     connected = rc > 0;
+                     continue;
+                 }
+             }
+             // Files bigger than one part go up in parallel parts with -j
+             if (jobs > 1 && fileSize > UPLOAD_PART_SIZE) {
+                 int fd = open(filename, O_RDONLY);
+                 if (fd < 0) {
+                     perror("open");
+                     continue;
+                 }
+                 while (pendingCount > 0) {
+                     if (complete_request(&s1, &pending[pendingHead]) != 0) {
+                         connected = 0;
+                         break;
+                     }
+                     pendingHead = (pendingHead + 1) % PIPELINE_DEPTH;
+                     pendingCount--;
+                 }
+                 if (!connected || multipart_upload(&s1, &servaddr, forceText, filename, destPath,
+                                                    fd, fileSize, jobs) != 0) {
+                     connected = 0;
+                 }
+                 close(fd);
                  continue;
              }
- 
-             // Now send the file data
              FILE *fp = fopen(filename, "rb");
              if (!fp) {
                  perror("fopen");
                  continue;
              }
-             char buf[BUF_SIZE];
-             size_t bytesRead;
-             while ((bytesRead = fread(buf, 1, BUF_SIZE, fp)) > 0) {
-                 if (send_all(sock, buf, bytesRead) != 0) {
-                     fprintf(stderr, "Error sending file data\n");
+ 
+             // A body must not be pushed while S1 may be blocked sending us a
+             // download we are not reading yet, so finish those first.
+             int downloadsPending = 0;
+             for (int i = 0; i < pendingCount; i++) {
+                 if (pending[(pendingHead + i) % PIPELINE_DEPTH].opcode != V2_OP_UPLOADF &&
+                     pending[(pendingHead + i) % PIPELINE_DEPTH].opcode != V2_OP_REMOVEF) {
+                     downloadsPending = 1;
+                 }
+             }
+             while (downloadsPending && pendingCount > 0) {
+                 if (complete_request(&s1, &pending[pendingHead]) != 0) {
+                     connected = 0;
                      break;
                  }
+                 pendingHead = (pendingHead + 1) % PIPELINE_DEPTH;
+                 pendingCount--;
              }
-             fclose(fp);
- 
-             // Receive server response
-             char resp[256];
-             int r = recv_line(sock, resp, sizeof(resp));
-             if (r <= 0) {
-                 fprintf(stderr, "Connection closed by server\n");
+             if (!connected) {
+                 fclose(fp);
                  break;
              }
-             // Print the response from S1
-             printf("%s", resp);
+ 
+             req->opcode = V2_OP_UPLOADF;
+             if (send_upload(&s1, fp, filename, destPath, fileSize, &req->reqId) != 0) {
+                 fprintf(stderr, "Failed to send 'uploadf' command\n");
+                 connected = 0;
+                 continue;
+             }
  
          // --------------- downlf ---------------
          } else if (strcmp(cmd, "downlf") == 0) {
-             char *path = strtok(NULL, "");
-             if (!path) {
-                 fprintf(stderr, "Usage: downlf <file_path_in_S1>\n");
-                 continue;
+             // downlf [-o offset] [-l length] [-r] [-j connections] <file_path_in_S1>
+             long offset = -1, length = -1;
+             int resume = 0, jobs = 1, badOption = 0;
+             char *path;
+             while ((path = strtok(NULL, " ")) != NULL && path[0] == '-' && path[1] && !path[2]) {
+                 char opt = path[1];
+                 if (opt == 'r') {
+                     resume = 1;
+                     continue;
+                 }
+                 char *value = strtok(NULL, " ");
+                 if (!value || atol(value) < 0 || (opt != 'o' && opt != 'l' && opt != 'j')) {
+                     badOption = 1;
+                     break;
+                 }
+                 if (opt == 'o') offset = atol(value);
+                 if (opt == 'l') length = atol(value);
+                 if (opt == 'j') jobs = atoi(value);
              }
-             // Trim spaces
-             while (*path == ' ') {
-                 path++;
+             if (path) {
+                 // The path is the rest of the line
+                 char *rest = strtok(NULL, "");
+                 if (rest) rest[-1] = ' ';
              }
-             if (strlen(path) == 0) {
-                 fprintf(stderr, "Usage: downlf <file_path_in_S1>\n");
+             if (badOption || !path || strlen(path) == 0 || jobs < 1 || jobs > MAX_RANGE_JOBS) {
+                 fprintf(stderr, "Usage: downlf [-o offset] [-l length] [-r] [-j 1-%d] <file_path_in_S1>\n",
+                         MAX_RANGE_JOBS);
                  continue;
              }
              const char *ext = strrchr(path, '.');
@@ -272,64 +1412,35 @@
                  fprintf(stderr, "Error: file path must begin with ~S1\n");
                  continue;
              }
-             // Send the downlf command
-             char msg[1024];
-             snprintf(msg, sizeof(msg), "downlf %s\n", path);
-             if (send_all(sock, msg, strlen(msg)) != 0) {
-                 fprintf(stderr, "Failed to send 'downlf' command\n");
-                 continue;
-             }
-             // Expect file size or error
-             char line[128];
-             int r = recv_line(sock, line, sizeof(line));
-             if (r <= 0) {
-                 fprintf(stderr, "Connection closed by server\n");
-                 break;
-             }
-             if (strncmp(line, "ERROR", 5) == 0) {
-                 // If server says ERROR, just print it out
-                 printf("%s", line);
-                 continue;
-             }
-             long size = atol(line);
-             if (size < 0) {
-                 printf("ERROR: Download failed\n");
-                 continue;
-             }
              // The file name to save locally is everything after the last slash in path
              char *name = strrchr(path, '/');
              name = (name ? name + 1 : path);  // if slash found, skip it; else use path directly
+             snprintf(req->name, sizeof(req->name), "%s", name);
  
-             // Create local file
-             FILE *fp = fopen(name, "wb");
-             if (!fp) {
-                 perror("fopen");
-                 // If we can't open the file to write, we need to drain the data from the socket
-                 long remaining = size;
-                 while (remaining > 0) {
-                     char discard[512];
-                     ssize_t n = recv(sock, discard, (remaining < (long)sizeof(discard) ? remaining : sizeof(discard)), 0);
-                     if (n <= 0) break;
-                     remaining -= n;
+             // Ranges, resumes and parallel downloads run one at a time, after
+             // everything sent before
+             if (offset >= 0 || length >= 0 || resume || jobs > 1) {
+                 while (pendingCount > 0) {
+                     if (complete_request(&s1, &pending[pendingHead]) != 0) {
+                         connected = 0;
+                         break;
+                     }
+                     pendingHead = (pendingHead + 1) % PIPELINE_DEPTH;
+                     pendingCount--;
                  }
-                 continue;
-             }
-             // Receive file content
-             long remaining = size;
-             while (remaining > 0) {
-                 char dataBuf[BUF_SIZE];
-                 ssize_t n = recv(sock, dataBuf, (remaining < BUF_SIZE ? remaining : BUF_SIZE), 0);
-                 if (n <= 0) {
-                     break;
+                 if (!connected || ranged_download(&s1, &servaddr, forceText, path, req->name,
+                                                   offset < 0 ? 0 : offset, length, resume,
+                                                   jobs) != 0) {
+                     connected = 0;
                  }
-                 fwrite(dataBuf, 1, n, fp);
-                 remaining -= n;
+                 continue;
              }
-             fclose(fp);
-             if (remaining == 0) {
-                 printf("File %s downloaded (%ld bytes)\n", name, size);
-             } else {
-                 printf("ERROR: Incomplete download\n");
+ 
+             // Send the downlf command; the response is the file size or an error
+             req->opcode = V2_OP_DOWNLF;
+             if (send_request(&s1, V2_OP_DOWNLF, "downlf", path, -1, &req->reqId) != 0) {
+                 fprintf(stderr, "Failed to send 'downlf' command\n");
+                 continue;
              }
  
          // --------------- removef ---------------
@@ -356,34 +1467,23 @@
                  fprintf(stderr, "Error: file path must begin with ~S1\n");
                  continue;
              }
-             char msg[1024];
-             snprintf(msg, sizeof(msg), "removef %s\n", path);
-             if (send_all(sock, msg, strlen(msg)) != 0) {
+             req->opcode = V2_OP_REMOVEF;
+             if (send_request(&s1, V2_OP_REMOVEF, "removef", path, -1, &req->reqId) != 0) {
                  fprintf(stderr, "Failed to send 'removef' command\n");
                  continue;
              }
-             // Receive response
-             char resp[256];
-             int r = recv_line(sock, resp, sizeof(resp));
-             if (r <= 0) {
-                 fprintf(stderr, "Connection closed by server\n");
-                 break;
-             }
-             printf("%s", resp);
  
          // --------------- downltar ---------------
          } else if (strcmp(cmd, "downltar") == 0) {
-             char *filetype = strtok(NULL, "");
-             if (!filetype) {
-                 fprintf(stderr, "Usage: downltar <filetype>\n");
-                 continue;
-             }
-             // Trim spaces
-             while (*filetype == ' ') {
-                 filetype++;
+             // -s <token>: only what changed since the archive that printed <token>
+             char *filetype = strtok(NULL, " ");
+             char *since = NULL;
+             if (filetype && strcmp(filetype, "-s") == 0) {
+                 since = strtok(NULL, " ");
+                 filetype = since ? strtok(NULL, " ") : NULL;
              }
-             if (strlen(filetype) == 0) {
-                 fprintf(stderr, "Usage: downltar <filetype>\n");
+             if (!filetype || strlen(filetype) == 0) {
+                 fprintf(stderr, "Usage: downltar [-s <token>] <filetype>\n");
                  continue;
              }
              // Ensure it starts with a '.' if not provided
@@ -397,84 +1497,54 @@
                  fprintf(stderr, "Error: filetype must be .c, .pdf, or .txt\n");
                  continue;
              }
-             // Send command
-             char msg[32];
-             snprintf(msg, sizeof(msg), "downltar %s\n", filetype);
-             if (send_all(sock, msg, strlen(msg)) != 0) {
-                 fprintf(stderr, "Failed to send 'downltar' command\n");
-                 continue;
-             }
-             // Receive tar size or error
-             char line[128];
-             int r = recv_line(sock, line, sizeof(line));
-             if (r <= 0) {
-                 fprintf(stderr, "Connection closed by server\n");
-                 break;
-             }
-             if (strncmp(line, "ERROR", 5) == 0) {
-                 printf("%s", line);
-                 continue;
-             }
-             long tarSize = atol(line);
-             if (tarSize < 0) {
-                 printf("ERROR: Tar creation failed\n");
-                 continue;
-             }
              // Determine local filename to save the tar
-             char outName[32];
-             if (strcmp(filetype, ".c") == 0) {
-                 strcpy(outName, "cfiles.tar");
-             } else if (strcmp(filetype, ".pdf") == 0) {
-                 strcpy(outName, "pdf.tar");
-             } else if (strcmp(filetype, ".txt") == 0) {
-                 strcpy(outName, "text.tar");
+             strcpy(req->name, tar_name(filetype));
+             // Send command; the archive is streamed in chunks (or, from an
+             // older S1, preceded by its size), or an error comes back
+             char tarArgs[300];
+             if (since) {
+                 snprintf(tarArgs, sizeof(tarArgs), "%s chunked since %s", filetype, since);
              } else {
-                 // fallback name
-                 strcpy(outName, "output.tar");
+                 snprintf(tarArgs, sizeof(tarArgs), "%s chunked", filetype);
              }
-             FILE *fp = fopen(outName, "wb");
-             if (!fp) {
-                 perror("fopen");
-                 // If we can't write locally, we still need to drain the data
-                 long rem = tarSize;
-                 while (rem > 0) {
-                     char discard[512];
-                     ssize_t n = recv(sock, discard, (rem < (long)sizeof(discard) ? rem : sizeof(discard)), 0);
-                     if (n <= 0) break;
-                     rem -= n;
-                 }
+             req->opcode = V2_OP_DOWNLTAR;
+             if (send_request(&s1, V2_OP_DOWNLTAR, "downltar", tarArgs, -1, &req->reqId) != 0) {
+                 fprintf(stderr, "Failed to send 'downltar' command\n");
                  continue;
              }
-             // Receive the tar file
-             long remaining = tarSize;
-             while (remaining > 0) {
-                 char dataBuf[BUF_SIZE];
-                 ssize_t n = recv(sock, dataBuf, (remaining < BUF_SIZE ? remaining : BUF_SIZE), 0);
-                 if (n <= 0) {
-                     break;
-                 }
-                 fwrite(dataBuf, 1, n, fp);
-                 remaining -= n;
-             }
-             fclose(fp);
-             if (remaining == 0) {
-                 printf("Tar file saved as %s \n", outName);
-             } else {
-                 printf("ERROR: Incomplete tar download\n");
-             }
  
          // --------------- dispfnames ---------------
          } else if (strcmp(cmd, "dispfnames") == 0) {
+             static const char *usage = "Usage: dispfnames [-r] [-g <glob>] [-e <.ext,...>] "
+                                        "[-s <min>:<max>] [-m <from>:<to>] <directory_path_in_S1>\n";
              char *path = strtok(NULL, "");
-             if (!path) {
-                 fprintf(stderr, "Usage: dispfnames <directory_path_in_S1>\n");
-                 continue;
-             }
-             while (*path == ' ') {
-                 path++;
+             char filter[512] = "";
+             int bad = (path == NULL);
+             while (!bad) {
+                 while (*path == ' ') {
+                     path++;
+                 }
+                 if (path[0] != '-' || !path[1] || !strchr("rgesm", path[1]) || path[2] != ' ') {
+                     break;
+                 }
+                 // Search options, see w25_filter_add()
+                 char opt = path[1];
+                 char *value = NULL;
+                 path += 3;
+                 if (opt != 'r') {
+                     while (*path == ' ') {
+                         path++;
+                     }
+                     value = path;
+                     path += strcspn(path, " ");
+                     if (*path) {
+                         *path++ = '\0';
+                     }
+                 }
+                 bad = w25_filter_add(filter, sizeof(filter), opt, value) != 0;
              }
-             if (strlen(path) == 0) {
-                 fprintf(stderr, "Usage: dispfnames <directory_path_in_S1>\n");
+             if (bad || strlen(path) == 0) {
+                 fprintf(stderr, "%s", usage);
                  continue;
              }
              // We expect a directory, not a file with extension
@@ -491,67 +1561,127 @@
                  fprintf(stderr, "Error: directory path must begin with ~S1\n");
                  continue;
              }
-             // Send dispfnames command
-             char msg[1024];
-             snprintf(msg, sizeof(msg), "dispfnames %s\n", path);
-             if (send_all(sock, msg, strlen(msg)) != 0) {
-                 fprintf(stderr, "Failed to send 'dispfnames' command\n");
-                 continue;
+             // Pages are requested one after another, so answer everything
+             // sent before first
+             while (pendingCount > 0) {
+                 if (complete_request(&s1, &pending[pendingHead]) != 0) {
+                     connected = 0;
+                     break;
+                 }
+                 pendingHead = (pendingHead + 1) % PIPELINE_DEPTH;
+                 pendingCount--;
              }
-             // Possible responses:
+             // Possible responses per page:
              //   1) "No files found\n"
              //   2) "ERROR: ...
-             //   3) A line with a numeric length, then that many bytes of filenames
-             char line[128];
-             int r = recv_line(sock, line, sizeof(line));
-             if (r <= 0) {
-                 fprintf(stderr, "Connection closed by server\n");
-                 break;
+             //   3) A numeric length (plus the next page's cursor), then that
+             //      many bytes of filenames
+             if (!connected || list_pages(&s1, path, filter) != 0) {
+                 connected = 0;
              }
-             if (strncmp(line, "ERROR", 5) == 0 || strncmp(line, "No files found", 14) == 0) {
-                 // Just print the line as is
-                 printf("%s", line);
-                 continue;
+             continue;
+ 
+         // --------------- uploadm / downlm / removem ---------------
+         } else if (strcmp(cmd, "uploadm") == 0 || strcmp(cmd, "downlm") == 0 ||
+                    strcmp(cmd, "removem") == 0) {
+             // uploadm <destination_path> <file|glob>...   or   uploadm -f <manifest>
+             // downlm|removem <file_path_in_S1>...         or   -f <manifest>
+             struct batch_list list = { NULL, 0, 0 };
+             int upload = (cmd[0] == 'u');
+             char *arg = strtok(NULL, " ");
+             int bad = (arg == NULL);
+             if (arg && strcmp(arg, "-f") == 0) {
+                 char *file = strtok(NULL, " ");
+                 bad = !file || batch_load(&list, file) != 0;
+             } else if (arg && upload) {
+                 const char *destPath = arg;
+                 char *pattern;
+                 while ((pattern = strtok(NULL, " ")) != NULL) {
+                     glob_t g;
+                     if (glob(pattern, 0, NULL, &g) != 0) {
+                         fprintf(stderr, "Error: no files match %s\n", pattern);
+                         continue;
+                     }
+                     for (size_t i = 0; i < g.gl_pathc; i++) {
+                         char item[1100];
+                         if (strchr(g.gl_pathv[i], ' ')) {
+                             fprintf(stderr, "Error: %s: file names with spaces are not supported\n",
+                                     g.gl_pathv[i]);
+                             continue;
+                         }
+                         snprintf(item, sizeof(item), "%s %s", g.gl_pathv[i], destPath);
+                         batch_add(&list, item);
+                     }
+                     globfree(&g);
+                 }
+             } else {
+                 for (; arg; arg = strtok(NULL, " ")) {
+                     batch_add(&list, arg);
+                 }
              }
-             // Otherwise, line should be a length
-             long listSize = atol(line);
-             if (listSize < 0) {
-                 printf("ERROR: Failed to retrieve file list\n");
+             if (bad || list.count == 0) {
+                 if (upload) {
+                     fprintf(stderr, "Usage: uploadm <destination_path> <file|glob>... | uploadm -f <manifest>\n");
+                 } else {
+                     fprintf(stderr, "Usage: %s <file_path_in_S1>... | %s -f <manifest>\n", cmd, cmd);
+                 }
+                 batch_free(&list);
                  continue;
              }
-             if (listSize == 0) {
-                 printf("No files found\n");
-                 continue;
+             // A batch is one request with its own body; answer everything before it first
+             while (pendingCount > 0) {
+                 if (complete_request(&s1, &pending[pendingHead]) != 0) {
+                     connected = 0;
+                     break;
+                 }
+                 pendingHead = (pendingHead + 1) % PIPELINE_DEPTH;
+                 pendingCount--;
              }
-             // Allocate buffer for list
-             char *listBuf = (char*)malloc(listSize + 1);
-             if (!listBuf) {
-                 fprintf(stderr, "Memory allocation error\n");
-                 // Drain data from the socket
-                 long rem = listSize;
-                 while (rem > 0) {
-                     char discard[256];
-                     ssize_t n = recv(sock, discard, (rem < (long)sizeof(discard) ? rem : sizeof(discard)), 0);
-                     if (n <= 0) break;
-                     rem -= n;
+             if (connected) {
+                 int rc = upload ? batch_upload(&s1, &list)
+                          : (cmd[0] == 'd') ? batch_download(&s1, &list) : batch_remove(&s1, &list);
+                 if (rc != 0) {
+                     connected = 0;
                  }
+             }
+             batch_free(&list);
+             continue;
+ 
+         // --------------- cachestats ---------------
+         } else if (strcmp(cmd, "cachestats") == 0) {
+             // S1's hot-file cache counters, answered with a status line
+             req->opcode = V2_OP_CACHESTATS;
+             if (send_request(&s1, V2_OP_CACHESTATS, "cachestats", "", -1, &req->reqId) != 0) {
+                 fprintf(stderr, "Failed to send 'cachestats' command\n");
                  continue;
              }
-             if (recv_all(sock, listBuf, listSize) != 0) {
-                 fprintf(stderr, "Failed to receive file list\n");
-                 free(listBuf);
+ 
+         // --------------- stats ---------------
+         } else if (strcmp(cmd, "stats") == 0) {
+             // S1's metrics, answered with "<size>\n" and that much text
+             req->opcode = V2_OP_STATS;
+             if (send_request(&s1, V2_OP_STATS, "stats", "", -1, &req->reqId) != 0) {
+                 fprintf(stderr, "Failed to send 'stats' command\n");
                  continue;
              }
-             listBuf[listSize] = '\0';
-             // Print the file list
-             printf("%s", listBuf);
-             free(listBuf);
  
          // --------------- unknown command ---------------
          } else {
              fprintf(stderr, "Unknown command: %s\n", cmd);
-             fprintf(stderr, "Commands: uploadf, downlf, removef, downltar, dispfnames, quit\n");
+             fprintf(stderr, "Commands: uploadf, downlf, removef, downltar, dispfnames, cachestats,\n"
+                             "          stats, uploadm, downlm, removem, quit\n");
+             continue;
+         }
+         pendingCount++;
+     }
+ 
+     // Collect the responses still outstanding
+     while (connected && pendingCount > 0) {
+         if (complete_request(&s1, &pending[pendingHead]) != 0) {
+             break;
          }
+         pendingHead = (pendingHead + 1) % PIPELINE_DEPTH;
+         pendingCount--;
      }
  
      // End of loop, close socket
@@ -559,4 +1689,3 @@
      printf("Client disconnected.\n");
      return 0;
  }
- 
\ No newline at end of file
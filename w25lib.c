@@ -0,0 +1,1138 @@
+/*****************************************************************************
+ * w25lib.c
+ *
+ * The client library declared in w25lib.h: transport and framing helpers
+ * moved here from w25clients.c, the one-shot command functions and the
+ * connection pool behind w25_run().
+ *
+ *****************************************************************************/
+ 
+ #include <stdio.h>
+ #include <stdlib.h>
+ #include <string.h>
+ #include <unistd.h>
+ #include <arpa/inet.h>
+ #include <errno.h>
+ #include <sys/socket.h>
+ #include <netinet/in.h>
+ #include <netinet/tcp.h>
+ #include <sys/stat.h>
+ #include <stdint.h>
+ #include <stdarg.h>
+ #include <time.h>
+ #include <limits.h>
+ #include <endian.h>
+ #include <pthread.h>
+ #include <zlib.h>
+ #if defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+ #include <arm_acle.h>
+ #endif
+ #include "w25lib.h"
+ 
+ void reader_init(struct line_reader *r, int fd) {
+     r->fd = fd;
+     r->start = 0;
+     r->end = 0;
+ }
+ 
+ /*****************************************************************************
+  * reader_read: like recv(), but hands out buffered bytes first. Once the
+  * buffer is empty, reads go straight to the socket so large bodies skip the
+  * extra copy.
+  *****************************************************************************/
+ ssize_t reader_read(struct line_reader *r, void *dst, size_t len) {
+     size_t avail = r->end - r->start;
+     if (avail > 0) {
+         size_t n = avail < len ? avail : len;
+         memcpy(dst, r->buf + r->start, n);
+         r->start += n;
+         return (ssize_t)n;
+     }
+     ssize_t n;
+     do {
+         n = recv(r->fd, dst, len, 0);
+     } while (n < 0 && errno == EINTR);
+     return n;
+ }
+ 
+ /*****************************************************************************
+  * send_all: ensures we send the entire buffer over a socket, even if 'send()'
+  * writes only part of it. Returns 0 on success, -1 on error.
+  *****************************************************************************/
+ int send_all(int sock, const void *buf, size_t len) {
+     size_t sent = 0;
+     const char *ptr = (const char*)buf;
+     while (sent < len) {
+         ssize_t n = send(sock, ptr + sent, len - sent, 0);
+         if (n < 0) {
+             return -1;  // error
+         }
+         sent += n;
+     }
+     return 0;
+ }
+ 
+ /*****************************************************************************
+  * recv_line: copies data from the reader until we hit a newline or we've
+  * copied maxlen-1 chars, refilling the buffer from the socket only when it
+  * runs dry. Puts a '\0' terminator at the end.
+  *
+  * Returns:
+  *   - number of bytes read if successful (including '\n'),
+  *   - 0 if the server has closed the connection,
+  *   - -1 on error.
+  *****************************************************************************/
+ int recv_line(struct line_reader *r, char *buf, size_t maxlen) {
+     size_t i = 0;
+     while (i < maxlen - 1) {
+         if (r->start == r->end) {
+             ssize_t n;
+             do {
+                 n = recv(r->fd, r->buf, sizeof(r->buf), 0);
+             } while (n < 0 && errno == EINTR);
+             if (n <= 0) {
+                 // 0 => connection closed, -1 => error
+                 return (n == 0) ? 0 : -1;
+             }
+             r->start = 0;
+             r->end = (size_t)n;
+         }
+         char ch = r->buf[r->start++];
+         buf[i++] = ch;
+         if (ch == '\n') {
+             // we include the newline in our buffer, but we can break
+             break;
+         }
+     }
+     buf[i] = '\0';  // null-terminate
+     return (int)i;
+ }
+ 
+ /*****************************************************************************
+  * recv_all: reads exactly 'length' bytes from the socket, handling short reads.
+  * Returns 0 on success, or -1 on error/disconnection.
+  *****************************************************************************/
+ int recv_all(struct line_reader *r, void *buffer, size_t length) {
+     size_t total = 0;
+     char *buf = (char*)buffer;
+     while (total < length) {
+         ssize_t n = reader_read(r, buf + total, length - total);
+         if (n <= 0) {
+             return -1; // error or connection closed
+         }
+         total += n;
+     }
+     return 0;
+ }
+ 
+ /*****************************************************************************
+  * recv_discard: reads and drops exactly `length` bytes. Returns 0 on
+  * success, -1 if the connection failed first.
+  *****************************************************************************/
+ int recv_discard(struct line_reader *r, long length) {
+     char buf[BUF_SIZE * 4];
+     while (length > 0) {
+         ssize_t n = reader_read(r, buf, (size_t)length < sizeof(buf) ? (size_t)length : sizeof(buf));
+         if (n <= 0) {
+             return -1;
+         }
+         length -= n;
+     }
+     return 0;
+ }
+ 
+ /*****************************************************************************
+  * CRC-32C (Castagnoli), the checksum S1 offers for uploads and whole-file
+  * downloads ("HELLO 2 ... crc32c"). It is taken in the loops that send or
+  * write the data, with the CRC32 instruction of SSE4.2 (x86-64) or ARMv8
+  * when the CPU has it. Start with 0 and feed the data in pieces.
+  *****************************************************************************/
+ static uint32_t crc32cTable[256];
+ static uint32_t (*crc32c_update)(uint32_t crc, const unsigned char *p, size_t len);
+ 
+ static uint32_t crc32c_table(uint32_t crc, const unsigned char *p, size_t len) {
+     while (len--) {
+         crc = crc32cTable[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+     }
+     return crc;
+ }
+ 
+ #if defined(__x86_64__)
+ __attribute__((target("sse4.2")))
+ static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+     uint64_t c = crc;
+     for (; len >= 8; p += 8, len -= 8) {
+         uint64_t v;
+         memcpy(&v, p, sizeof(v));
+         c = __builtin_ia32_crc32di(c, v);
+     }
+     crc = (uint32_t)c;
+     while (len--) {
+         crc = __builtin_ia32_crc32qi(crc, *p++);
+     }
+     return crc;
+ }
+ #define CRC32C_HW_AVAILABLE() __builtin_cpu_supports("sse4.2")
+ #elif defined(__aarch64__) && defined(__ARM_FEATURE_CRC32)
+ static uint32_t crc32c_hw(uint32_t crc, const unsigned char *p, size_t len) {
+     for (; len >= 8; p += 8, len -= 8) {
+         uint64_t v;
+         memcpy(&v, p, sizeof(v));
+         crc = __crc32cd(crc, v);
+     }
+     while (len--) {
+         crc = __crc32cb(crc, *p++);
+     }
+     return crc;
+ }
+ #define CRC32C_HW_AVAILABLE() 1
+ #endif
+ 
+ void crc32c_init(void) {
+     for (uint32_t i = 0; i < 256; i++) {
+         uint32_t c = i;
+         for (int k = 0; k < 8; k++) {
+             c = (c >> 1) ^ (0x82F63B78u & (0u - (c & 1)));
+         }
+         crc32cTable[i] = c;
+     }
+     crc32c_update = crc32c_table;
+ #ifdef CRC32C_HW_AVAILABLE
+     if (CRC32C_HW_AVAILABLE()) {
+         crc32c_update = crc32c_hw;
+     }
+ #endif
+ }
+ 
+ uint32_t crc32c(uint32_t crc, const void *buf, size_t len) {
+     return ~crc32c_update(~crc, buf, len);
+ }
+ 
+ /*****************************************************************************
+  * negotiate_protocol: asks S1 for protocol 2 with compression and checksums
+  * (negotiate_protocol_extras without `extras`: plain protocol 2).
+  * An S1 without framing support answers with an error line, and the
+  * connection stays on the text protocol; one without compression or
+  * checksums leaves those words out of its "HELLO 2" answer.
+  *****************************************************************************/
+ void negotiate_protocol_extras(struct s1_conn *c, int extras) {
+     const char *hello = extras ? "HELLO 2 deflate crc32c\n" : "HELLO 2\n";
+     char line[512];
+     c->proto = 1;
+     c->compress[0] = '\0';
+     c->crc = 0;
+     if (send_all(c->in.fd, hello, strlen(hello)) == 0 &&
+         recv_line(&c->in, line, sizeof(line)) > 0 &&
+         strncmp(line, "HELLO 2", 7) == 0) {
+         c->proto = 2;
+         line[strcspn(line, "\n")] = '\0';
+         size_t len = strlen(line);
+         if (len >= 7 + 7 && strcmp(line + len - 7, " crc32c") == 0) {
+             c->crc = 1;
+             line[len - 7] = '\0';
+         }
+         if (strncmp(line + 7, " deflate", 8) == 0) {
+             snprintf(c->compress, sizeof(c->compress), "%s", line + 15);
+         }
+     }
+ }
+ 
+ void negotiate_protocol(struct s1_conn *c) {
+     negotiate_protocol_extras(c, 1);
+ }
+ 
+ /*****************************************************************************
+  * compress_level: the zlib level S1 asked for files of type `ext` (".txt"),
+  * or 0 if they are sent as they are.
+  *****************************************************************************/
+ int compress_level(const struct s1_conn *c, const char *ext) {
+     char entry[32];
+     int n = snprintf(entry, sizeof(entry), " %s:", ext);
+     if (n <= 0 || (size_t)n >= sizeof(entry)) {
+         return 0;
+     }
+     const char *p = strstr(c->compress, entry);
+     return p ? atoi(p + n) : 0;
+ }
+ 
+ /*****************************************************************************
+  * send_request: sends one command. In text mode this is the line
+  * "<command> <args>[ <payloadLen>]"; in protocol 2 it is a frame carrying
+  * `args`, with `payloadLen` (upload size, -1 for none) in the header. The
+  * payload itself is sent by the caller right after.
+  *****************************************************************************/
+ int send_request_flags(struct s1_conn *c, int opcode, int flags, const char *command,
+                        const char *args, long payloadLen, uint32_t *reqId) {
+     *reqId = c->nextReqId++;
+     if (c->proto != 2) {
+         char line[1100];
+         if (payloadLen >= 0) {
+             snprintf(line, sizeof(line), "%s %s %ld\n", command, args, payloadLen);
+         } else {
+             snprintf(line, sizeof(line), "%s %s\n", command, args);
+         }
+         return send_all(c->in.fd, line, strlen(line));
+     }
+     // Header and arguments go out in one send: as two small writes the
+     // second would wait for S1's delayed ACK (Nagle)
+     size_t argLen = strlen(args);
+     unsigned char h[V2_HEADER_LEN + 1024];
+     uint32_t id = htonl(*reqId);
+     uint64_t len64 = htobe64(payloadLen > 0 ? (uint64_t)payloadLen : 0);
+     h[0] = (unsigned char)opcode;
+     h[1] = (unsigned char)flags;
+     h[2] = (unsigned char)(argLen >> 8);
+     h[3] = (unsigned char)argLen;
+     memcpy(h + 4, &id, sizeof(id));
+     memcpy(h + 8, &len64, sizeof(len64));
+     unsigned char *frame = argLen <= sizeof(h) - V2_HEADER_LEN ? h : malloc(V2_HEADER_LEN + argLen);
+     if (!frame) {
+         return -1;
+     }
+     if (frame != h) {
+         memcpy(frame, h, V2_HEADER_LEN);
+     }
+     memcpy(frame + V2_HEADER_LEN, args, argLen);
+     int rc = send_all(c->in.fd, frame, V2_HEADER_LEN + argLen);
+     if (frame != h) {
+         free(frame);
+     }
+     return rc;
+ }
+ 
+ int send_request(struct s1_conn *c, int opcode, const char *command, const char *args,
+                  long payloadLen, uint32_t *reqId) {
+     return send_request_flags(c, opcode, 0, command, args, payloadLen, reqId);
+ }
+ 
+ /*****************************************************************************
+  * read_response: reads S1's answer to the oldest pending request. With the
+  * text protocol, commands that return data (`expectData`) answer with a size
+  * line unless something went wrong; in protocol 2 the frame says which it is.
+  * Returns 0 on success, -1 if the connection was closed or is out of sync.
+  *****************************************************************************/
+ int read_response(struct s1_conn *c, const struct pending_request *req, int expectData,
+                   struct response *resp) {
+     resp->payloadLen = -1;
+     resp->chunked = 0;
+     resp->deflate = 0;
+     resp->crc = 0;
+     resp->cursor = NULL;
+     resp->msg[0] = '\0';
+     if (c->proto != 2) {
+         if (recv_line(&c->in, resp->msg, sizeof(resp->msg)) <= 0) {
+             return -1;
+         }
+         if (expectData && (strcmp(resp->msg, "chunked\n") == 0 || strncmp(resp->msg, "chunked ", 8) == 0)) {
+             resp->payloadLen = 0;
+             resp->chunked = 1;
+             if (resp->msg[7] == ' ') {
+                 // "chunked <token>\n" of a downltar that asked for changes
+                 resp->msg[strcspn(resp->msg, "\n")] = '\0';
+                 resp->cursor = resp->msg + 8;
+             }
+         } else if (expectData && strncmp(resp->msg, "ERROR", 5) != 0 &&
+             strncmp(resp->msg, "No files found", 14) != 0) {
+             resp->payloadLen = atol(resp->msg);
+             // "<size> <cursor>\n" on a listing page that has a successor,
+             // "<count> <total>\n" on a ranged download
+             char *cursor = strchr(resp->msg, ' ');
+             if (cursor) {
+                 cursor[strcspn(cursor, "\n")] = '\0';
+                 resp->cursor = cursor + 1;
+             }
+         }
+         return 0;
+     }
+     unsigned char h[V2_HEADER_LEN];
+     if (recv_all(&c->in, h, sizeof(h)) != 0) {
+         return -1;
+     }
+     size_t argLen = ((size_t)h[2] << 8) | h[3];
+     uint32_t id;
+     uint64_t len64;
+     memcpy(&id, h + 4, sizeof(id));
+     memcpy(&len64, h + 8, sizeof(len64));
+     if (ntohl(id) != req->reqId || argLen > sizeof(resp->msg) - 2) {
+         fprintf(stderr, "Protocol error: unexpected response from S1\n");
+         return -1;
+     }
+     if (recv_all(&c->in, resp->msg, argLen) != 0) {
+         return -1;
+     }
+     if (argLen > 0) {
+         resp->msg[argLen++] = '\n';
+     }
+     resp->msg[argLen] = '\0';
+     if (h[0] == V2_OP_OK && (argLen == 0 || len64 > 0 || (h[1] & V2_FLAG_DATA))) {
+         resp->payloadLen = (long)be64toh(len64);
+         resp->chunked = (h[1] & V2_FLAG_CHUNKED) != 0;
+         resp->deflate = resp->chunked && (h[1] & V2_FLAG_DEFLATE) != 0;
+         resp->crc = (h[1] & V2_FLAG_CRC) != 0;
+         if (argLen > 0) {
+             resp->msg[argLen - 1] = '\0';   // Arguments of a data response: cursor, total or token
+             resp->cursor = resp->msg;
+         }
+     }
+     return 0;
+ }
+ 
+ /*****************************************************************************
+  * receive_to_file: stores the next `size` bytes from S1 in `name`. If the
+  * file cannot be created the data is still drained to keep the stream in
+  * sync. Returns 0 if the file is complete, 1 if it could not be written,
+  * -1 if the connection failed. With `crc`, the checksum of the data is
+  * taken on the way.
+  *****************************************************************************/
+ int receive_to_file(struct s1_conn *c, const char *name, long size, uint32_t *crc) {
+     FILE *fp = fopen(name, "wb");
+     if (!fp) {
+         perror("fopen");
+         // If we can't open the file to write, we need to drain the data from the socket
+         long remaining = size;
+         while (remaining > 0) {
+             char discard[512];
+             ssize_t n = reader_read(&c->in, discard, ((size_t)remaining < sizeof(discard) ? (size_t)remaining : sizeof(discard)));
+             if (n <= 0) return -1;
+             if (crc) *crc = crc32c(*crc, discard, (size_t)n);
+             remaining -= n;
+         }
+         return 1;
+     }
+     long remaining = size;
+     int writeFailed = 0;
+     while (remaining > 0) {
+         char dataBuf[BUF_SIZE];
+         ssize_t n = reader_read(&c->in, dataBuf, (remaining < BUF_SIZE ? remaining : BUF_SIZE));
+         if (n <= 0) {
+             break;
+         }
+         if (crc) *crc = crc32c(*crc, dataBuf, (size_t)n);
+         if (!writeFailed && fwrite(dataBuf, 1, n, fp) != (size_t)n) {
+             perror("fwrite");
+             writeFailed = 1;
+         }
+         remaining -= n;
+     }
+     if (fclose(fp) != 0) {
+         writeFailed = 1;
+     }
+     return remaining != 0 ? -1 : writeFailed ? 1 : 0;
+ }
+ 
+ /*****************************************************************************
+  * receive_chunks_to_file: stores a chunked stream from S1 in `name` and adds
+  * its length to *size. With `deflated`, the chunks are one zlib stream that
+  * is inflated on the way to the file, and *size counts the inflated bytes.
+  * As with receive_to_file, the stream is read to its end even if the file
+  * cannot be written (or the zlib stream is damaged). Same return values;
+  * `crc` is as for receive_to_file, over the inflated bytes.
+  *****************************************************************************/
+ int receive_chunks_to_file(struct s1_conn *c, const char *name, long *size, int deflated,
+                            uint32_t *crc) {
+     FILE *fp = fopen(name, "wb");
+     if (!fp) {
+         perror("fopen");
+     }
+     int writeFailed = (fp == NULL);
+     z_stream zs;
+     memset(&zs, 0, sizeof(zs));
+     int zret = Z_OK;
+     if (deflated && inflateInit(&zs) != Z_OK) {
+         writeFailed = 1;
+         deflated = 0;    // Nothing to inflate with; just drain the stream
+     }
+     unsigned char plain[BUF_SIZE * 4];
+     *size = 0;
+     while (1) {
+         char line[32];
+         if (recv_line(&c->in, line, sizeof(line)) <= 0) {
+             break;
+         }
+         char *end;
+         long remaining = strtol(line, &end, 16);
+         if (end == line || *end != '\n' || remaining < 0) {
+             break;
+         }
+         if (remaining == 0) {
+             if (fp) fclose(fp);
+             if (deflated) {
+                 inflateEnd(&zs);
+                 if (zret != Z_STREAM_END) {
+                     fprintf(stderr, "Damaged compressed data from S1\n");
+                     writeFailed = 1;
+                 }
+             }
+             return writeFailed ? 1 : 0;
+         }
+         if (!deflated) {
+             *size += remaining;
+         }
+         while (remaining > 0) {
+             char dataBuf[BUF_SIZE];
+             ssize_t n = reader_read(&c->in, dataBuf, (remaining < BUF_SIZE ? remaining : BUF_SIZE));
+             if (n <= 0) {
+                 if (fp) fclose(fp);
+                 if (deflated) inflateEnd(&zs);
+                 return -1;
+             }
+             remaining -= n;
+             if (!deflated) {
+                 if (crc) *crc = crc32c(*crc, dataBuf, (size_t)n);
+                 if (fp && fwrite(dataBuf, 1, n, fp) != (size_t)n) {
+                     writeFailed = 1;
+                 }
+                 continue;
+             }
+             zs.next_in = (Bytef *)dataBuf;
+             zs.avail_in = (uInt)n;
+             do {
+                 zs.next_out = plain;
+                 zs.avail_out = sizeof(plain);
+                 zret = inflate(&zs, Z_NO_FLUSH);
+                 if (zret != Z_OK && zret != Z_STREAM_END && zret != Z_BUF_ERROR) {
+                     break;
+                 }
+                 size_t got = sizeof(plain) - zs.avail_out;
+                 *size += (long)got;
+                 if (crc) *crc = crc32c(*crc, plain, got);
+                 if (fp && fwrite(plain, 1, got, fp) != got) {
+                     writeFailed = 1;
+                 }
+             } while (zs.avail_out == 0);
+         }
+     }
+     if (fp) fclose(fp);
+     if (deflated) inflateEnd(&zs);
+     return -1;
+ }
+ 
+ /*****************************************************************************
+  * connect_to_s1: opens a TCP connection to S1. Returns the socket or -1.
+  *****************************************************************************/
+ int connect_to_s1(const struct sockaddr_in *addr) {
+     int sock = socket(AF_INET, SOCK_STREAM, 0);
+     if (sock < 0) {
+         perror("socket");
+         return -1;
+     }
+     if (connect(sock, (const struct sockaddr *)addr, sizeof(*addr)) < 0) {
+         perror("connect");
+         close(sock);
+         return -1;
+     }
+     return sock;
+ }
+ 
+ /*****************************************************************************
+  * deflate_to_tmpfile: compresses the `fileSize` bytes of `in` at `level`
+  * into an anonymous temp file, rewound for reading, and sets *zLen to its
+  * length, and *crc to the checksum of the plain bytes. Returns NULL (with
+  * `in` read partway) if that fails or would not make the file smaller, e.g.
+  * for contents that are already compressed.
+  *****************************************************************************/
+ FILE *deflate_to_tmpfile(FILE *in, int level, long fileSize, long *zLen, uint32_t *crc) {
+     FILE *out = tmpfile();
+     z_stream zs;
+     memset(&zs, 0, sizeof(zs));
+     if (!out || deflateInit(&zs, level) != Z_OK) {
+         if (out) fclose(out);
+         return NULL;
+     }
+     unsigned char inBuf[BUF_SIZE * 4], outBuf[BUF_SIZE * 4];
+     long written = 0;
+     int flush, ok = 1;
+     do {
+         size_t n = fread(inBuf, 1, sizeof(inBuf), in);
+         *crc = crc32c(*crc, inBuf, n);
+         flush = n < sizeof(inBuf) ? Z_FINISH : Z_NO_FLUSH;
+         zs.next_in = inBuf;
+         zs.avail_in = (uInt)n;
+         do {
+             zs.next_out = outBuf;
+             zs.avail_out = sizeof(outBuf);
+             deflate(&zs, flush);
+             size_t got = sizeof(outBuf) - zs.avail_out;
+             written += (long)got;
+             if (written >= fileSize || fwrite(outBuf, 1, got, out) != got) {
+                 ok = 0;
+             }
+         } while (ok && zs.avail_out == 0);
+     } while (ok && flush != Z_FINISH);
+     deflateEnd(&zs);
+     if (!ok || ferror(in) || fflush(out) != 0) {
+         fclose(out);
+         return NULL;
+     }
+     rewind(out);
+     *zLen = written;
+     return out;
+ }
+ 
+ /*****************************************************************************
+  * w25_connect: opens a connection to S1 and negotiates the protocol (the
+  * text protocol only with `forceText`). Returns 0 or -1.
+  *****************************************************************************/
+ int w25_connect(struct s1_conn *c, const struct sockaddr_in *addr, int forceText) {
+     int sock = connect_to_s1(addr);
+     if (sock < 0) {
+         return -1;
+     }
+     reader_init(&c->in, sock);
+     c->proto = 1;
+     c->nextReqId = 1;
+     c->compress[0] = '\0';
+     c->crc = 0;
+     if (!forceText) {
+         negotiate_protocol(c);
+     }
+     return 0;
+ }
+ 
+ /*****************************************************************************
+  * send_upload: sends an uploadf of `fileSize` bytes from `fp`, the local
+  * file `filename`, to `destPath`, and closes `fp`. Files of a type S1
+  * compresses go deflated, if that makes them smaller; the checksum is over
+  * the plain bytes either way. The response is left to the caller.
+  * Returns 0 once the request and its body are sent, -1 if sending failed.
+  *****************************************************************************/
+ int send_upload(struct s1_conn *c, FILE *fp, const char *filename, const char *destPath,
+                 long fileSize, uint32_t *reqId) {
+     const char *ext = strrchr(filename, '.');
+     long zLen = -1;
+     uint32_t crc = 0;
+     int level = (c->proto == 2 && ext) ? compress_level(c, ext) : 0;
+     FILE *zfp = (level > 0 && fileSize >= COMPRESS_MIN_SIZE)
+                     ? deflate_to_tmpfile(fp, level, fileSize, &zLen, &crc) : NULL;
+     if (zfp) {
+         fclose(fp);
+         fp = zfp;
+     } else {
+         crc = 0;
+         rewind(fp);
+     }
+ 
+     // Send the command to S1, including file size (and the inflated size
+     // of a deflated body). The socket is corked until the checksum is out,
+     // so the frame, a small body and the trailer share segments instead of
+     // each waiting behind Nagle for an ACK.
+     int on = 1, off = 0;
+     setsockopt(c->in.fd, IPPROTO_TCP, TCP_CORK, &on, sizeof(on));
+     char args[1024];
+     int sent;
+     int crcFlag = c->crc ? V2_FLAG_CRC : 0;
+     if (zfp) {
+         snprintf(args, sizeof(args), "%s %s %ld", filename, destPath, fileSize);
+         sent = send_request_flags(c, V2_OP_UPLOADF, V2_FLAG_DEFLATE | crcFlag, "uploadz", args,
+                                   zLen, reqId);
+     } else {
+         snprintf(args, sizeof(args), "%s %s", filename, destPath);
+         sent = send_request_flags(c, V2_OP_UPLOADF, crcFlag, "uploadf", args, fileSize, reqId);
+     }
+     // Now send the file data, and its checksum after it
+     char buf[BUF_SIZE];
+     size_t bytesRead;
+     while (sent == 0 && (bytesRead = fread(buf, 1, BUF_SIZE, fp)) > 0) {
+         if (!zfp) {
+             crc = crc32c(crc, buf, bytesRead);
+         }
+         sent = send_all(c->in.fd, buf, bytesRead);
+     }
+     fclose(fp);
+     uint32_t be = htonl(crc);
+     if (sent == 0 && crcFlag) {
+         sent = send_all(c->in.fd, &be, sizeof(be));
+     }
+     setsockopt(c->in.fd, IPPROTO_TCP, TCP_CORK, &off, sizeof(off));
+     return sent;
+ }
+ 
+ /*****************************************************************************
+  * receive_download: stores the file of a downlf data response in `name` and
+  * sets *size to its length. A whole file comes with S1's checksum of it, if
+  * we asked for that, and a copy that does not match it is removed. Returns
+  * 0 if the file is complete, 1 if it could not be written, 2 if it did not
+  * match its checksum, -1 if the connection failed.
+  *****************************************************************************/
+ int receive_download(struct s1_conn *c, const struct response *resp, const char *name,
+                      long *size) {
+     uint32_t crc = 0, expected = 0;
+     *size = resp->payloadLen;
+     int rc = resp->chunked ? receive_chunks_to_file(c, name, size, resp->deflate,
+                                                     resp->crc ? &crc : NULL)
+                            : receive_to_file(c, name, *size, resp->crc ? &crc : NULL);
+     if (rc >= 0 && resp->crc && recv_all(&c->in, &expected, sizeof(expected)) != 0) {
+         rc = -1;
+     }
+     if (rc == 0 && resp->crc && ntohl(expected) != crc) {
+         remove(name);
+         rc = 2;
+     }
+     return rc;
+ }
+ 
+ /*****************************************************************************
+  * Commands
+  *****************************************************************************/
+ 
+ // Fills in `res`; returns what a command returns with that status
+ int w25_result_set(struct w25_result *res, int status, const char *fmt, ...) {
+     va_list ap;
+     va_start(ap, fmt);
+     vsnprintf(res->msg, sizeof(res->msg), fmt, ap);
+     va_end(ap);
+     res->msg[strcspn(res->msg, "\n")] = '\0';
+     res->status = status;
+     return status == W25_DISCONNECTED ? -1 : 0;
+ }
+ 
+ // A status message from S1: "SUCCESS: ..." or an error
+ static int result_from_reply(struct w25_result *res, const char *msg) {
+     return w25_result_set(res, strncmp(msg, "SUCCESS", 7) == 0 ? W25_OK : W25_FAILED, "%s", msg);
+ }
+ 
+ static int lost(struct w25_result *res) {
+     return w25_result_set(res, W25_DISCONNECTED, "ERROR: Connection to S1 lost");
+ }
+ 
+ static void result_init(struct w25_result *res) {
+     res->status = W25_OK;
+     res->bytes = 0;
+     res->msg[0] = '\0';
+     res->names = NULL;
+     res->warnings = NULL;
+ }
+ 
+ int w25_upload(struct s1_conn *c, const char *filename, const char *destPath,
+                struct w25_result *res) {
+     result_init(res);
+     FILE *fp = fopen(filename, "rb");
+     struct stat st;
+     if (!fp || fstat(fileno(fp), &st) != 0) {
+         if (fp) fclose(fp);
+         return w25_result_set(res, W25_FAILED, "ERROR: %s: %s", filename, strerror(errno));
+     }
+     struct pending_request req;
+     req.opcode = V2_OP_UPLOADF;
+     req.name[0] = '\0';
+     struct response resp;
+     if (send_upload(c, fp, filename, destPath, st.st_size, &req.reqId) != 0 ||
+         read_response(c, &req, 0, &resp) != 0) {
+         return lost(res);
+     }
+     res->bytes = st.st_size;
+     return result_from_reply(res, resp.msg);
+ }
+ 
+ int w25_download(struct s1_conn *c, const char *path, const char *localName,
+                  struct w25_result *res) {
+     result_init(res);
+     struct pending_request req;
+     req.opcode = V2_OP_DOWNLF;
+     req.name[0] = '\0';
+     struct response resp;
+     if (send_request(c, V2_OP_DOWNLF, "downlf", path, -1, &req.reqId) != 0 ||
+         read_response(c, &req, 1, &resp) != 0) {
+         return lost(res);
+     }
+     if (resp.payloadLen < 0) {
+         return result_from_reply(res, resp.msg);
+     }
+     long size;
+     int rc = receive_download(c, &resp, localName, &size);
+     if (rc < 0) {
+         return lost(res);
+     }
+     if (rc == 2) {
+         return w25_result_set(res, W25_FAILED, "ERROR: Checksum mismatch, %s removed", localName);
+     }
+     if (rc == 1) {
+         return w25_result_set(res, W25_FAILED, "ERROR: Cannot write %s", localName);
+     }
+     res->bytes = size;
+     return w25_result_set(res, W25_OK, "SUCCESS: File %s downloaded", localName);
+ }
+ 
+ int w25_remove(struct s1_conn *c, const char *path, struct w25_result *res) {
+     result_init(res);
+     struct pending_request req;
+     req.opcode = V2_OP_REMOVEF;
+     req.name[0] = '\0';
+     struct response resp;
+     if (send_request(c, V2_OP_REMOVEF, "removef", path, -1, &req.reqId) != 0 ||
+         read_response(c, &req, 0, &resp) != 0) {
+         return lost(res);
+     }
+     return result_from_reply(res, resp.msg);
+ }
+ 
+ int w25_tar(struct s1_conn *c, const char *filetype, const char *since, const char *localName,
+             struct w25_result *res) {
+     result_init(res);
+     char args[300];
+     if (since && since[0]) {
+         snprintf(args, sizeof(args), "%s chunked since %s", filetype, since);
+     } else {
+         snprintf(args, sizeof(args), "%s chunked", filetype);
+     }
+     struct pending_request req;
+     req.opcode = V2_OP_DOWNLTAR;
+     req.name[0] = '\0';
+     struct response resp;
+     if (send_request(c, V2_OP_DOWNLTAR, "downltar", args, -1, &req.reqId) != 0 ||
+         read_response(c, &req, 1, &resp) != 0) {
+         return lost(res);
+     }
+     if (resp.payloadLen < 0) {
+         return result_from_reply(res, resp.msg);
+     }
+     long size = resp.payloadLen;
+     int rc = resp.chunked ? receive_chunks_to_file(c, localName, &size, resp.deflate, NULL)
+                           : receive_to_file(c, localName, size, NULL);
+     if (rc < 0) {
+         return lost(res);
+     }
+     if (rc != 0) {
+         return w25_result_set(res, W25_FAILED, "ERROR: Cannot write %s", localName);
+     }
+     res->bytes = size;
+     if (resp.cursor) {
+         return w25_result_set(res, W25_OK, "SUCCESS: Tar file saved as %s (token %s)", localName,
+                               resp.cursor);
+     }
+     return w25_result_set(res, W25_OK, "SUCCESS: Tar file saved as %s", localName);
+ }
+ 
+ // One end of a -s or -m range: "" = open, else a number with an optional
+ // suffix (size: k, m, g; mtime: s, m, h, d, w for an age instead of a time).
+ static int filter_bound(const char *s, size_t len, char opt, long long *out) {
+     char buf[32];
+     *out = -1;
+     if (len == 0) {
+         return 0;
+     }
+     if (len >= sizeof(buf)) {
+         return -1;
+     }
+     memcpy(buf, s, len);
+     buf[len] = '\0';
+     char *end;
+     long long v = strtoll(buf, &end, 10);
+     if (end == buf || v < 0 || (end[0] && end[1])) {
+         return -1;
+     }
+     const char *suffixes = opt == 's' ? "kmg" : "smhdw";
+     static const long long sizeUnits[] = { 1024, 1024 * 1024, 1024 * 1024 * 1024 };
+     static const long long ageUnits[] = { 1, 60, 3600, 86400, 7 * 86400 };
+     if (!end[0]) {
+         *out = v;
+         return 0;
+     }
+     const char *unit = strchr(suffixes, end[0]);
+     if (!unit) {
+         return -1;
+     }
+     if (opt == 's') {
+         *out = v * sizeUnits[unit - suffixes];
+     } else {
+         *out = (long long)time(NULL) - v * ageUnits[unit - suffixes];
+         if (*out < 0) *out = 0;
+     }
+     return 0;
+ }
+ 
+ /*****************************************************************************
+  * w25_filter_add: adds a dispfnames search option to `filter`, the listing
+  * filter S1 pushes down to the storage servers:
+  *     -r              the whole subtree, not just the directory
+  *     -g <glob>       file names matching the shell pattern
+  *     -e <.a,.b,...>  files with one of these extensions
+  *     -s <min>:<max>  size in bytes (k, m, g suffixes allowed)
+  *     -m <from>:<to>  modification time, in epoch seconds or as an age
+  *                     (30m, 12h, 7d, ...): "-m 7d:" is the last week
+  * Either end of a range may be left out. `opt` is the option letter and
+  * `value` its argument (NULL for -r). Returns -1 for a bad value or if
+  * `filter` is full.
+  *****************************************************************************/
+ int w25_filter_add(char *filter, size_t size, char opt, const char *value) {
+     char pred[600];
+     size_t n = 0;
+     if (opt == 'r') {
+         n = (size_t)snprintf(pred, sizeof(pred), "r");
+     } else if (!value || !value[0]) {
+         return -1;
+     } else if (opt == 'g') {
+         static const char digits[] = "0123456789abcdef";
+         if (strlen(value) > NAME_MAX || strlen(value) * 2 + 6 > sizeof(pred)) {
+             return -1;
+         }
+         n = (size_t)snprintf(pred, sizeof(pred), "name=");
+         for (const char *p = value; *p; p++) {
+             pred[n++] = digits[(unsigned char)*p >> 4];
+             pred[n++] = digits[(unsigned char)*p & 0xf];
+         }
+         pred[n] = '\0';
+     } else if (opt == 'e') {
+         const char *p = value;
+         while (*p) {
+             size_t len = strcspn(p, ",");
+             if (len == 0 || len > 12 || n + len + 8 > sizeof(pred)) {
+                 return -1;
+             }
+             n += (size_t)snprintf(pred + n, sizeof(pred) - n, "%sext=%s%.*s", n ? "," : "",
+                                   p[0] == '.' ? "" : ".", (int)len, p);
+             p += len + (p[len] == ',');
+         }
+     } else if (opt == 's' || opt == 'm') {
+         const char *colon = strchr(value, ':');
+         long long lo, hi;
+         if (!colon || filter_bound(value, (size_t)(colon - value), opt, &lo) != 0 ||
+             filter_bound(colon + 1, strlen(colon + 1), opt, &hi) != 0) {
+             return -1;
+         }
+         n = (size_t)snprintf(pred, sizeof(pred), "%s=", opt == 's' ? "size" : "mtime");
+         if (lo >= 0) n += (size_t)snprintf(pred + n, sizeof(pred) - n, "%lld", lo);
+         n += (size_t)snprintf(pred + n, sizeof(pred) - n, "-");
+         if (hi >= 0) n += (size_t)snprintf(pred + n, sizeof(pred) - n, "%lld", hi);
+     } else {
+         return -1;
+     }
+     size_t used = strlen(filter);
+     if (used + (used ? 1 : 0) + n + 1 > size) {
+         return -1;
+     }
+     snprintf(filter + used, size - used, "%s%s", used ? "," : "", pred);
+     return 0;
+ }
+ 
+ /*****************************************************************************
+  * list_take_page: moves the names of a page received at res->names + len
+  * into place and the "WARNING: <server> did not respond ..." lines S1 adds
+  * for servers missing from the listing into res->warnings, each only once
+  * (every page repeats them). Returns the new length of res->names, or -1 if
+  * out of memory.
+  *****************************************************************************/
+ static long list_take_page(struct w25_result *res, size_t len, size_t pageLen) {
+     char *page = res->names + len;
+     page[pageLen] = '\0';
+     size_t kept = 0;
+     for (char *line = page; *line; ) {
+         size_t lineLen = strcspn(line, "\n");
+         size_t step = lineLen + (line[lineLen] == '\n');
+         if (strncmp(line, "WARNING: ", 9) != 0) {
+             memmove(page + kept, line, step);
+             kept += step;
+             res->bytes += line[lineLen] == '\n';
+         } else {
+             size_t have = res->warnings ? strlen(res->warnings) : 0;
+             line[lineLen] = '\0';
+             char *seen = res->warnings ? strstr(res->warnings, line) : NULL;
+             if (!seen || (seen[lineLen] != '\n' && seen[lineLen] != '\0')) {
+                 char *grown = realloc(res->warnings, have + lineLen + 2);
+                 if (!grown) {
+                     return -1;
+                 }
+                 res->warnings = grown;
+                 snprintf(grown + have, lineLen + 2, "%s\n", line);
+             }
+         }
+         line += step;
+     }
+     page[kept] = '\0';
+     return (long)(len + kept);
+ }
+ 
+ // The result of a listing that is complete, apart from its warnings
+ static int list_done(struct w25_result *res) {
+     long missing = 0;
+     for (const char *w = res->warnings; w && *w; w++) {
+         missing += *w == '\n';
+     }
+     if (missing > 0) {
+         return w25_result_set(res, W25_PARTIAL, "WARNING: %ld files; %ld storage server%s did not respond",
+                               res->bytes, missing, missing == 1 ? "" : "s");
+     }
+     return w25_result_set(res, W25_OK, "SUCCESS: %ld files", res->bytes);
+ }
+ 
+ /*****************************************************************************
+  * w25_list: collects all pages of the listing of `path` in res->names, and
+  * their number in res->bytes. An empty directory is a success with no names.
+  * With a filter, each name is a "<path>\t<size>\t<mtime>" line. Servers S1
+  * could not list are reported in res->warnings, and the status is then
+  * W25_PARTIAL.
+  *****************************************************************************/
+ int w25_list(struct s1_conn *c, const char *path, const char *filter, struct w25_result *res) {
+     result_init(res);
+     char cursor[1024] = "";
+     size_t len = 0;
+     while (1) {
+         char args[2700];
+         int n = snprintf(args, sizeof(args), "-n %d ", LIST_PAGE_SIZE);
+         if (cursor[0]) {
+             n += snprintf(args + n, sizeof(args) - n, "-c %s ", cursor);
+         }
+         if (filter && filter[0]) {
+             n += snprintf(args + n, sizeof(args) - n, "-f %s ", filter);
+         }
+         snprintf(args + n, sizeof(args) - n, "%s", path);
+         struct pending_request req;
+         req.opcode = V2_OP_DISPFNAMES;
+         req.name[0] = '\0';
+         struct response resp;
+         if (send_request(c, V2_OP_DISPFNAMES, "dispfnames", args, -1, &req.reqId) != 0 ||
+             read_response(c, &req, 1, &resp) != 0) {
+             return lost(res);
+         }
+         if (resp.payloadLen < 0) {
+             // "No files found" ends the listing, on the first page or after the last
+             if (strncmp(resp.msg, "No files found", 14) == 0) {
+                 return list_done(res);
+             }
+             return result_from_reply(res, resp.msg);
+         }
+         char *names = realloc(res->names, len + resp.payloadLen + 1);
+         if (!names) {
+             return w25_result_set(res, W25_FAILED, "ERROR: Out of memory");
+         }
+         res->names = names;
+         if (recv_all(&c->in, names + len, resp.payloadLen) != 0) {
+             return lost(res);
+         }
+         long kept = list_take_page(res, len, (size_t)resp.payloadLen);
+         if (kept < 0) {
+             return w25_result_set(res, W25_FAILED, "ERROR: Out of memory");
+         }
+         len = (size_t)kept;
+         if (!resp.cursor) {
+             return list_done(res);
+         }
+         snprintf(cursor, sizeof(cursor), "%s", resp.cursor);
+     }
+ }
+ 
+ int w25_stats(struct s1_conn *c, int opcode, struct w25_result *res) {
+     result_init(res);
+     int stats = opcode == V2_OP_STATS;
+     struct pending_request req;
+     req.opcode = opcode;
+     req.name[0] = '\0';
+     struct response resp;
+     if (send_request(c, opcode, stats ? "stats" : "cachestats", "", -1, &req.reqId) != 0 ||
+         read_response(c, &req, stats, &resp) != 0) {
+         return lost(res);
+     }
+     if (resp.payloadLen < 0) {
+         // cachestats answers with its counters, anything else here is an error
+         return w25_result_set(res, !stats && strncmp(resp.msg, "ERROR", 5) != 0 ? W25_OK : W25_FAILED,
+                               "%s", resp.msg);
+     }
+     res->names = malloc((size_t)resp.payloadLen + 1);
+     if (!res->names) {
+         return w25_result_set(res, W25_FAILED, "ERROR: Out of memory");
+     }
+     if (recv_all(&c->in, res->names, resp.payloadLen) != 0) {
+         return lost(res);
+     }
+     res->names[resp.payloadLen] = '\0';
+     for (long i = 0; i < resp.payloadLen; i++) {
+         res->bytes += res->names[i] == '\n';
+     }
+     return w25_result_set(res, W25_OK, "SUCCESS: %ld metrics", res->bytes);
+ }
+ 
+ /*****************************************************************************
+  * w25_run_op: runs one w25_op on `c`. Same return values as the commands.
+  *****************************************************************************/
+ int w25_run_op(struct s1_conn *c, struct w25_op *op) {
+     switch (op->opcode) {
+     case V2_OP_UPLOADF:
+         return w25_upload(c, op->arg, op->dest, &op->res);
+     case V2_OP_DOWNLF:
+         return w25_download(c, op->arg, op->dest, &op->res);
+     case V2_OP_REMOVEF:
+         return w25_remove(c, op->arg, &op->res);
+     case V2_OP_DOWNLTAR:
+         return w25_tar(c, op->arg, op->since, op->dest, &op->res);
+     case V2_OP_DISPFNAMES:
+         return w25_list(c, op->arg, op->filter, &op->res);
+     case V2_OP_CACHESTATS:
+     case V2_OP_STATS:
+         return w25_stats(c, op->opcode, &op->res);
+     default:
+         return 0;
+     }
+ }
+ 
+ /*****************************************************************************
+  * Connection pool: w25_run() runs `count` independent ops over up to
+  * `parallel` connections to S1, each served by its own thread (the calling
+  * thread is one of them). Every thread takes the next op that nobody has
+  * taken yet, so a slow transfer does not hold up the ops behind it, and the
+  * ops may run in any order. A connection that fails is reopened for the
+  * next op; the op it failed on is not retried. Returns the worst status of
+  * all ops (W25_OK if every one succeeded).
+  *****************************************************************************/
+ struct w25_pool {
+     const struct sockaddr_in *addr;
+     int forceText;
+     struct w25_op *ops;
+     size_t count;
+     size_t next;          // Next op to take (atomic)
+ };
+ 
+ static void *pool_worker(void *arg) {
+     struct w25_pool *p = arg;
+     struct s1_conn c;
+     int open = 0;
+     size_t i;
+     while ((i = __atomic_fetch_add(&p->next, 1, __ATOMIC_RELAXED)) < p->count) {
+         struct w25_op *op = &p->ops[i];
+         if (op->opcode == 0) {
+             continue;
+         }
+         if (!open && w25_connect(&c, p->addr, p->forceText) != 0) {
+             result_init(&op->res);
+             w25_result_set(&op->res, W25_DISCONNECTED, "ERROR: Cannot connect to S1");
+             continue;
+         }
+         open = 1;
+         if (w25_run_op(&c, op) != 0) {
+             close(c.in.fd);
+             open = 0;
+         }
+     }
+     if (open) {
+         close(c.in.fd);
+     }
+     return NULL;
+ }
+ 
+ int w25_run(const struct sockaddr_in *addr, int forceText, struct w25_op *ops, size_t count,
+             int parallel) {
+     struct w25_pool pool = { addr, forceText, ops, count, 0 };
+     if (parallel < 1) {
+         parallel = 1;
+     }
+     if ((size_t)parallel > count) {
+         parallel = count > 0 ? (int)count : 1;
+     }
+     pthread_t *threads = calloc(parallel, sizeof(*threads));
+     int started = 0;
+     while (threads && started < parallel - 1 &&
+            pthread_create(&threads[started], NULL, pool_worker, &pool) == 0) {
+         started++;
+     }
+     pool_worker(&pool);
+     for (int t = 0; t < started; t++) {
+         pthread_join(threads[t], NULL);
+     }
+     free(threads);
+     int worst = W25_OK;
+     for (size_t i = 0; i < count; i++) {
+         if (ops[i].res.status > worst) {
+             worst = ops[i].res.status;
+         }
+     }
+     return worst;
+ }
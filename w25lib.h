@@ -0,0 +1,195 @@
+/*****************************************************************************
+ * w25lib.h
+ *
+ * Client library for S1, shared by w25clients and w25bench: the connection
+ * to S1 (line reader, send/receive helpers, protocol negotiation, request
+ * and response framing), CRC-32C, and one function per command that runs it
+ * to the end and reports the outcome as a w25_result. w25_run() spreads
+ * independent commands over a pool of parallel connections.
+ *
+ * Build it together with the program that uses it:
+ *     gcc w25clients.c w25lib.c -o w25clients -lpthread -lz
+ *     gcc w25bench.c w25lib.c -o w25bench -lpthread -lz
+ *
+ *****************************************************************************/
+
+ #ifndef W25LIB_H
+ #define W25LIB_H
+ 
+ #include <stdio.h>
+ #include <stdint.h>
+ #include <sys/types.h>
+ #include <netinet/in.h>
+ 
+ // Buffer size for file transfer
+ #define BUF_SIZE 4096
+ 
+ // Read-ahead for S1's response lines
+ #define READER_BUF_SIZE 8192
+ 
+ /*****************************************************************************
+  * line_reader: buffers what S1 sends so response lines (sizes, status
+  * messages) are read with a few large recv() calls instead of one per byte.
+  * Bytes after a line -- the start of a file body -- stay buffered, so every
+  * read of the S1 socket, including file data, goes through the reader.
+  *****************************************************************************/
+ struct line_reader {
+     int fd;
+     size_t start;   // first unconsumed byte in buf
+     size_t end;     // one past the last buffered byte
+     char buf[READER_BUF_SIZE];
+ };
+ 
+ /*****************************************************************************
+  * Protocol 2 (see S1.c): after "HELLO 2" is acknowledged, requests and
+  * responses are frames with a 16-byte big-endian header -- opcode, flags,
+  * argument length, request id, payload length -- followed by the text
+  * arguments and the payload. Requests may be pipelined; responses arrive
+  * in request order.
+  *****************************************************************************/
+ #define V2_HEADER_LEN 16
+ #define V2_FLAG_CHUNKED 0x01  // Response data is a chunked stream of unknown size
+ #define V2_FLAG_DATA 0x02     // Data response with arguments (cursor, total size)
+ #define V2_FLAG_DEFLATE 0x04  // Chunked data / upload payload is one zlib stream
+ #define V2_FLAG_CRC 0x08      // Payload is followed by its CRC-32C (4 bytes, big-endian)
+ #define LIST_PAGE_SIZE 1000   // Names per dispfnames page
+ #define COMPRESS_MIN_SIZE 4096  // Smaller uploads are never deflated
+ 
+ enum {
+     V2_OP_UPLOADF = 1,
+     V2_OP_DOWNLF,
+     V2_OP_REMOVEF,
+     V2_OP_DOWNLTAR,
+     V2_OP_DISPFNAMES,
+     V2_OP_CACHESTATS,
+     V2_OP_UPLOADP,
+     V2_OP_UPLOADC,
+     V2_OP_UPLOADM,
+     V2_OP_DOWNLM,
+     V2_OP_REMOVEM,
+     V2_OP_UPLOADH,
+     V2_OP_STATS,
+     V2_OP_OK = 0x80,
+     V2_OP_ERROR = 0x81
+ };
+ 
+ // The connection to S1
+ struct s1_conn {
+     struct line_reader in;
+     int proto;            // 1 = text lines, 2 = binary frames
+     uint32_t nextReqId;
+     char compress[512];   // " <type>:<level>..." S1 deflates, empty if none
+     int crc;              // S1 checks and sends checksum trailers
+ };
+ 
+ // A request that has been sent and whose response has not been read yet
+ struct pending_request {
+     int opcode;
+     uint32_t reqId;
+     char name[256];       // Local file: downloaded file name / tar output name
+ };
+ 
+ // What S1 answered: either a message line or the size of the data that follows
+ struct response {
+     long payloadLen;      // -1 if the response is just `msg`
+     int chunked;          // Data follows as "<hex length>\n<bytes>" chunks ending "0\n"
+     int deflate;          // The chunks carry a zlib stream
+     int crc;              // The data is followed by its checksum
+     char msg[1100];       // Message including its trailing newline
+     const char *cursor;   // Listing page: where the next page starts (NULL if last);
+                           // ranged download: the file's total size; downltar
+                           // with "since": the token to ask from next time
+ };
+ 
+ // Connection
+ void reader_init(struct line_reader *r, int fd);
+ ssize_t reader_read(struct line_reader *r, void *dst, size_t len);
+ int send_all(int sock, const void *buf, size_t len);
+ int recv_line(struct line_reader *r, char *buf, size_t maxlen);
+ int recv_all(struct line_reader *r, void *buffer, size_t length);
+ int recv_discard(struct line_reader *r, long length);
+ int connect_to_s1(const struct sockaddr_in *addr);
+ int w25_connect(struct s1_conn *c, const struct sockaddr_in *addr, int forceText);
+ 
+ // CRC-32C; crc32c_init() must run once before the first checksum
+ void crc32c_init(void);
+ uint32_t crc32c(uint32_t crc, const void *buf, size_t len);
+ 
+ // Requests and responses
+ void negotiate_protocol(struct s1_conn *c);
+ void negotiate_protocol_extras(struct s1_conn *c, int extras);
+ int compress_level(const struct s1_conn *c, const char *ext);
+ int send_request_flags(struct s1_conn *c, int opcode, int flags, const char *command,
+                        const char *args, long payloadLen, uint32_t *reqId);
+ int send_request(struct s1_conn *c, int opcode, const char *command, const char *args,
+                  long payloadLen, uint32_t *reqId);
+ int read_response(struct s1_conn *c, const struct pending_request *req, int expectData,
+                   struct response *resp);
+ FILE *deflate_to_tmpfile(FILE *in, int level, long fileSize, long *zLen, uint32_t *crc);
+ int send_upload(struct s1_conn *c, FILE *fp, const char *filename, const char *destPath,
+                 long fileSize, uint32_t *reqId);
+ int receive_to_file(struct s1_conn *c, const char *name, long size, uint32_t *crc);
+ int receive_chunks_to_file(struct s1_conn *c, const char *name, long *size, int deflated,
+                            uint32_t *crc);
+ int receive_download(struct s1_conn *c, const struct response *resp, const char *name,
+                      long *size);
+ 
+ /*****************************************************************************
+  * Commands: each runs one command on an idle connection, waiting for its
+  * response, and fills in a w25_result. They return 0 if the connection can
+  * be used for the next command, -1 if it is gone (status W25_DISCONNECTED).
+  *****************************************************************************/
+ enum {
+     W25_OK,               // S1 answered with success
+     W25_PARTIAL,          // dispfnames: listed, but some storage servers did not answer
+     W25_FAILED,           // S1 refused the command, or a local file could not be used
+     W25_DISCONNECTED      // The connection to S1 failed
+ };
+ 
+ struct w25_result {
+     int status;
+     long bytes;           // Bytes uploaded or downloaded; dispfnames: number of names
+     char msg[1100];       // S1's answer or the local error, without the newline
+     char *names;          // dispfnames: the names; stats: the metrics (one per line, malloc'd, or NULL)
+     char *warnings;       // dispfnames: S1's "WARNING: ..." lines, one per line (malloc'd, or NULL)
+ };
+ 
+ int w25_upload(struct s1_conn *c, const char *filename, const char *destPath,
+                struct w25_result *res);
+ int w25_download(struct s1_conn *c, const char *path, const char *localName,
+                  struct w25_result *res);
+ int w25_remove(struct s1_conn *c, const char *path, struct w25_result *res);
+ // `since` is the token of an earlier archive (or NULL/"" for a full one); the
+ // token of this one is in the result message.
+ int w25_tar(struct s1_conn *c, const char *filetype, const char *since, const char *localName,
+             struct w25_result *res);
+ // `filter` is a listing filter built with w25_filter_add(), or NULL/"" for
+ // the plain listing of the directory.
+ int w25_list(struct s1_conn *c, const char *path, const char *filter, struct w25_result *res);
+ int w25_filter_add(char *filter, size_t size, char opt, const char *value);
+ // `opcode` is V2_OP_CACHESTATS (S1's one-line answer is the message) or
+ // V2_OP_STATS (S1's metrics go into res->names).
+ int w25_stats(struct s1_conn *c, int opcode, struct w25_result *res);
+ int w25_result_set(struct w25_result *res, int status, const char *fmt, ...)
+     __attribute__((format(printf, 3, 4)));
+ 
+ /*****************************************************************************
+  * w25_op: one command for w25_run(). `opcode` selects the w25_* function;
+  * an op with opcode 0 is skipped and keeps the result it already has (e.g.
+  * a command line that did not parse).
+  *****************************************************************************/
+ struct w25_op {
+     int opcode;           // V2_OP_UPLOADF, _DOWNLF, _REMOVEF, _DOWNLTAR, _DISPFNAMES,
+                           // _CACHESTATS or _STATS
+     char arg[1024];       // Local file (uploadf), S1 path or directory, file type (downltar)
+     char dest[1024];      // uploadf: destination path; downlf/downltar: local file name
+     char since[256];      // downltar: token of an earlier archive, "" for a full one
+     char filter[512];     // dispfnames: listing filter (w25_filter_add), "" for none
+     struct w25_result res;
+ };
+ 
+ int w25_run_op(struct s1_conn *c, struct w25_op *op);
+ int w25_run(const struct sockaddr_in *addr, int forceText, struct w25_op *ops, size_t count,
+             int parallel);
+ 
+ #endif